@@ -0,0 +1,154 @@
+#include "utils.h"
+#include "accounts.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static uint8_t *map;
+static size_t map_len;
+static const struct accounts_file_hdr *hdr;
+static const uint32_t *slots;
+static struct account *records;
+
+/* Lookups that found no account, and reservations refused for lack of credit */
+static atomic_uint_fast64_t unknown;
+static atomic_uint_fast64_t exhausted;
+
+int accounts_load(const char *path)
+{
+    struct stat st;
+    uint64_t start = now_ns();
+    int fd, ret;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        ret = errno;
+        fd_log_error("Unable to open account file %s: %s\n", path, strerror(ret));
+        return ret;
+    }
+    if (fstat(fd, &st) < 0) {
+        ret = errno;
+        close(fd);
+        return ret;
+    }
+    /* Private and writable: balances change in memory only */
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        return errno;
+    }
+    map_len = st.st_size;
+    hdr = (const struct accounts_file_hdr *)map;
+
+    if (map_len < sizeof(*hdr) || memcmp(hdr->magic, ACCOUNTS_MAGIC, sizeof(hdr->magic))
+        || hdr->version != ACCOUNTS_VERSION || hdr->record_size != sizeof(struct account)
+        || !hdr->nslots || (hdr->nslots & (hdr->nslots - 1)) || hdr->count >= hdr->nslots
+        || hdr->index_offset + hdr->nslots * sizeof(uint32_t) > map_len
+        || hdr->records_offset % 64 || hdr->records_offset + hdr->count * sizeof(struct account) > map_len) {
+        fd_log_error("%s is not a valid account file\n", path);
+        accounts_unload();
+        return EINVAL;
+    }
+    slots = (const uint32_t *)(map + hdr->index_offset);
+    records = (struct account *)(map + hdr->records_offset);
+
+    fd_log_notice("Loaded %llu accounts from %s in %.1f ms\n",
+                  (unsigned long long)hdr->count, path, (double)(now_ns() - start) / 1e6);
+    return 0;
+}
+
+void accounts_unload(void)
+{
+    if (map)
+        munmap(map, map_len);
+    map = NULL;
+    hdr = NULL;
+    slots = NULL;
+    records = NULL;
+}
+
+int accounts_loaded(void)
+{
+    return records != NULL;
+}
+
+struct account *accounts_find(const uint8_t *id, size_t len)
+{
+    uint64_t mask, i;
+
+    if (!records || !len || len > ACCOUNT_ID_MAX)
+        goto unknown;
+
+    mask = hdr->nslots - 1;
+    for (i = accounts_home_slot(hdr, id, len); slots[i]; i = (i + 1) & mask) {
+        struct account *a = &records[slots[i] - 1];
+        if (a->id_len == len && !memcmp(a->id, id, len))
+            return a;
+    }
+
+unknown:
+    atomic_fetch_add_explicit(&unknown, 1, memory_order_relaxed);
+    return NULL;
+}
+
+uint64_t accounts_reserve(struct account *a, uint64_t requested)
+{
+    uint_fast64_t avail = atomic_load_explicit(&a->available, memory_order_relaxed);
+    uint64_t grant;
+
+    /* On failure the CAS reloads avail, and the grant is recomputed from it */
+    do {
+        grant = requested < avail ? requested : avail;
+        if (!grant) {
+            atomic_fetch_add_explicit(&exhausted, 1, memory_order_relaxed);
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&a->available, &avail, avail - grant,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    atomic_fetch_add_explicit(&a->reserved, grant, memory_order_relaxed);
+    return grant;
+}
+
+void accounts_settle(struct account *a, uint64_t reservation, uint64_t used)
+{
+    uint_fast64_t avail, charge;
+
+    if (reservation)
+        atomic_fetch_sub_explicit(&a->reserved, reservation, memory_order_relaxed);
+    if (used)
+        atomic_fetch_add_explicit(&a->consumed, used, memory_order_relaxed);
+
+    /* Unused part of the reservation goes back to the balance */
+    if (used <= reservation) {
+        if (reservation > used)
+            atomic_fetch_add_explicit(&a->available, reservation - used, memory_order_relaxed);
+        return;
+    }
+
+    /* Usage beyond the grant: charge what is left */
+    avail = atomic_load_explicit(&a->available, memory_order_relaxed);
+    do {
+        charge = used - reservation < avail ? used - reservation : avail;
+        if (!charge)
+            return;
+    } while (!atomic_compare_exchange_weak_explicit(&a->available, &avail, avail - charge,
+                                                    memory_order_relaxed, memory_order_relaxed));
+}
+
+void accounts_log_stats(void)
+{
+    uint64_t i, available = 0, reserved = 0, consumed = 0;
+
+    if (!records)
+        return;
+    for (i = 0; i < hdr->count; i++) {
+        available += atomic_load_explicit(&records[i].available, memory_order_relaxed);
+        reserved += atomic_load_explicit(&records[i].reserved, memory_order_relaxed);
+        consumed += atomic_load_explicit(&records[i].consumed, memory_order_relaxed);
+    }
+    fd_log_notice("Accounts: %llu loaded, available=%llu reserved=%llu consumed=%llu octets, unknown subscribers=%lu, exhausted=%lu\n",
+                  (unsigned long long)hdr->count, (unsigned long long)available, (unsigned long long)reserved,
+                  (unsigned long long)consumed, (unsigned long)atomic_load(&unknown), (unsigned long)atomic_load(&exhausted));
+}
@@ -0,0 +1,73 @@
+#ifndef GY_ACCOUNTS_H
+#define GY_ACCOUNTS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "hash.h"
+
+/*
+ * Subscriber balances, keyed by Subscription-Id-Data (e.g. the MSISDN).
+ *
+ * The store is a binary file, built offline by acctgen, that is mapped into
+ * memory as is: a header, an open-addressing index (linear probing on
+ * gy_hash of the identity) and fixed-size 64-byte account records. Loading
+ * millions of accounts therefore costs one mmap; pages are faulted in as
+ * subscribers show up. The mapping is private: balances start from the file
+ * content at every load and changes are not written back.
+ *
+ * Every account has its own cache line. Sessions of the same subscriber
+ * reserve and settle credit with atomic compare-and-swap on it, without
+ * any lock.
+ */
+
+#define ACCOUNTS_MAGIC    "GYACCT01"
+#define ACCOUNTS_VERSION  1
+#define ACCOUNT_ID_MAX    39
+
+struct accounts_file_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;         /* sizeof(struct account) */
+    uint64_t count;               /* number of accounts */
+    uint64_t nslots;              /* index slots, a power of two */
+    uint64_t index_offset;        /* uint32_t slots: record number + 1, 0 = empty */
+    uint64_t records_offset;      /* 64-byte aligned */
+    uint64_t reserved[2];
+};
+
+struct account {
+    atomic_uint_fast64_t available;  /* balance not reserved by any session */
+    atomic_uint_fast64_t reserved;   /* granted to sessions, not yet reported */
+    atomic_uint_fast64_t consumed;   /* usage reported so far */
+    uint8_t id_len;
+    char id[ACCOUNT_ID_MAX];         /* not NUL terminated */
+};
+
+_Static_assert(sizeof(struct account) == 64, "account records must fill one cache line");
+
+/* First index slot to probe for an identity */
+static inline uint64_t accounts_home_slot(const struct accounts_file_hdr *hdr, const uint8_t *id, size_t len)
+{
+    return gy_hash(id, len) & (hdr->nslots - 1);
+}
+
+/* Map the account file; the store stays empty (accounts_loaded() == 0) when not called */
+int  accounts_load(const char *path);
+void accounts_unload(void);
+int  accounts_loaded(void);
+
+/* Account of a subscriber, or NULL if unknown */
+struct account *accounts_find(const uint8_t *id, size_t len);
+
+/* Reserve up to requested octets; returns what was granted, 0 when the balance is exhausted */
+uint64_t accounts_reserve(struct account *a, uint64_t requested);
+
+/* Release a session's reservation and charge its reported usage (an overrun is charged up to the balance) */
+void accounts_settle(struct account *a, uint64_t reservation, uint64_t used);
+
+/* Log the totals of all accounts */
+void accounts_log_stats(void);
+
+#endif /* GY_ACCOUNTS_H */
@@ -0,0 +1,87 @@
+/* Build a subscriber account file for the Gy server (see accounts.h) */
+#include "accounts.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+int main(int argc, char *argv[])
+{
+    struct accounts_file_hdr hdr;
+    struct account rec;
+    uint64_t count, balance, first = 46700000000ULL, nslots = 2, i;
+    uint32_t *index;
+    FILE *f;
+
+    if (argc < 4 || argc > 5) {
+        fprintf(stderr, "usage: %s <file> <accounts> <balance in octets> [first MSISDN, default %" PRIu64 "]\n",
+                argv[0], first);
+        return 2;
+    }
+    count = strtoull(argv[2], NULL, 10);
+    balance = strtoull(argv[3], NULL, 10);
+    if (argc == 5)
+        first = strtoull(argv[4], NULL, 10);
+    if (!count || count >= UINT32_MAX) {
+        fprintf(stderr, "%s: invalid number of accounts\n", argv[2]);
+        return 2;
+    }
+
+    /* Load factor at most 50%, so that probe sequences stay short */
+    while (nslots < 2 * count)
+        nslots <<= 1;
+    if ((index = calloc(nslots, sizeof(*index))) == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, ACCOUNTS_MAGIC, sizeof(hdr.magic));
+    hdr.version = ACCOUNTS_VERSION;
+    hdr.record_size = sizeof(struct account);
+    hdr.count = count;
+    hdr.nslots = nslots;
+    hdr.index_offset = sizeof(hdr);
+    hdr.records_offset = (hdr.index_offset + nslots * sizeof(*index) + 63) & ~(uint64_t)63;
+
+    if ((f = fopen(argv[1], "wb")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (fseek(f, hdr.records_offset, SEEK_SET) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    /* Records in MSISDN order, the index is filled on the way */
+    for (i = 0; i < count; i++) {
+        uint64_t slot;
+
+        memset(&rec, 0, sizeof(rec));
+        atomic_init(&rec.available, balance);
+        atomic_init(&rec.reserved, 0);
+        atomic_init(&rec.consumed, 0);
+        rec.id_len = snprintf(rec.id, sizeof(rec.id), "%" PRIu64, first + i);
+
+        for (slot = accounts_home_slot(&hdr, (uint8_t *)rec.id, rec.id_len); index[slot]; slot = (slot + 1) & (nslots - 1))
+            ;
+        index[slot] = (uint32_t)(i + 1);
+
+        if (fwrite(&rec, sizeof(rec), 1, f) != 1) {
+            perror(argv[1]);
+            return 1;
+        }
+    }
+
+    if (fseek(f, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, f) != 1
+        || fwrite(index, sizeof(*index), nslots, f) != nslots || fclose(f) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    printf("%s: %" PRIu64 " accounts (MSISDN %" PRIu64 "..%" PRIu64 ") of %" PRIu64 " octets\n",
+           argv[1], count, first, first + count - 1, balance);
+    free(index);
+    return 0;
+}
@@ -0,0 +1,190 @@
+#include "utils.h"
+#include "balance.h"
+
+#include <stdatomic.h>
+#include <limits.h>
+#include <math.h>
+
+#define BALANCE_PEERS_MAX  64
+#define BALANCE_FLOOR_NS   1000.0   /* cost floor: without latency, the least loaded peer wins */
+
+struct balance_peer {
+    DiamId_t id;
+    size_t idlen;
+    atomic_uint in_flight;
+    pthread_mutex_t lock;           /* ewma_ns and stamp_ns */
+    double ewma_ns;
+    uint64_t stamp_ns;              /* time of the last observation */
+    atomic_uint_fast64_t routed;
+    atomic_uint_fast64_t answered;
+    atomic_uint_fast64_t expired;
+} __attribute__((aligned(64)));
+
+static struct balance_peer peers[BALANCE_PEERS_MAX];
+static atomic_uint npeers;          /* entries below are complete and never change identity */
+static pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
+static double decay_ns;
+
+static atomic_uint_fast64_t sessions_moved;   /* pinned peer gone, session routed elsewhere */
+static atomic_uint_fast64_t table_full;       /* candidates left out, the table being full */
+
+/* Index of a candidate peer, added on first sight; BALANCE_NONE when the table is full */
+static int peer_index(DiamId_t id, size_t idlen)
+{
+    unsigned i, n = atomic_load_explicit(&npeers, memory_order_acquire);
+    int ret = BALANCE_NONE;
+
+    for (i = 0; i < n; i++)
+        if (peers[i].idlen == idlen && !memcmp(peers[i].id, id, idlen))
+            return i;
+
+    pthread_mutex_lock(&peers_lock);
+    n = atomic_load(&npeers);
+    for (i = 0; i < n; i++)
+        if (peers[i].idlen == idlen && !memcmp(peers[i].id, id, idlen))
+            break;
+    if (i < n) {
+        ret = i;
+    } else if (n < BALANCE_PEERS_MAX && (peers[n].id = strndup(id, idlen)) != NULL) {
+        peers[n].idlen = idlen;
+        peers[n].stamp_ns = now_ns();
+        pthread_mutex_init(&peers[n].lock, NULL);
+        atomic_store_explicit(&npeers, n + 1, memory_order_release);
+        fd_log_notice("OCS peer %s added to the balancing\n", peers[n].id);
+        ret = n;
+    } else {
+        atomic_fetch_add_explicit(&table_full, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&peers_lock);
+    return ret;
+}
+
+/* Latency of the peer now: the last peak or average, faded since it was observed */
+static double peer_latency(struct balance_peer *p, uint64_t now)
+{
+    double l;
+
+    pthread_mutex_lock(&p->lock);
+    l = p->ewma_ns * exp(-(double)(now - p->stamp_ns) / decay_ns);
+    pthread_mutex_unlock(&p->lock);
+    return l;
+}
+
+static double peer_cost(struct balance_peer *p, uint64_t now)
+{
+    return (peer_latency(p, now) + BALANCE_FLOOR_NS)
+           * (atomic_load_explicit(&p->in_flight, memory_order_relaxed) + 1);
+}
+
+/* Peak EWMA: a slower sample replaces the average, a faster one is blended in over time */
+static void peer_observe(struct balance_peer *p, uint64_t rtt_ns)
+{
+    uint64_t now = now_ns();
+    double w;
+
+    pthread_mutex_lock(&p->lock);
+    if (rtt_ns > p->ewma_ns) {
+        p->ewma_ns = rtt_ns;
+    } else {
+        w = exp(-(double)(now - p->stamp_ns) / decay_ns);
+        p->ewma_ns = p->ewma_ns * w + rtt_ns * (1 - w);
+    }
+    p->stamp_ns = now;
+    pthread_mutex_unlock(&p->lock);
+}
+
+int balance_route(struct fd_list *candidates, int pinned)
+{
+    struct rtd_candidate *c, *best = NULL, *stay = NULL;
+    struct fd_list *li;
+    uint64_t now = now_ns();
+    int top = INT_MIN, best_idx = BALANCE_NONE, idx;
+    double best_cost = 0, cost;
+
+    /* Only balance among the peers the routing rates equally good, e.g. those of the realm */
+    for (li = candidates->next; li != candidates; li = li->next) {
+        c = (struct rtd_candidate *)li;
+        if (c->score > top)
+            top = c->score;
+    }
+    if (top <= 0)
+        return BALANCE_NONE;
+
+    for (li = candidates->next; li != candidates; li = li->next) {
+        c = (struct rtd_candidate *)li;
+        if (c->score != top || (idx = peer_index(c->diamid, c->diamidlen)) == BALANCE_NONE)
+            continue;
+        if (idx == pinned) {
+            stay = c;
+            break;
+        }
+        cost = peer_cost(&peers[idx], now);
+        if (!best || cost < best_cost) {
+            best = c;
+            best_idx = idx;
+            best_cost = cost;
+        }
+    }
+
+    if (stay) {
+        best = stay;
+        best_idx = pinned;
+    } else if (!best) {
+        return BALANCE_NONE;
+    } else if (pinned != BALANCE_NONE) {
+        atomic_fetch_add_explicit(&sessions_moved, 1, memory_order_relaxed);
+    }
+
+    best->score += FD_SCORE_LOAD_BALANCE;
+    atomic_fetch_add_explicit(&peers[best_idx].in_flight, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&peers[best_idx].routed, 1, memory_order_relaxed);
+    return best_idx;
+}
+
+void balance_answered(int peer, uint64_t rtt_ns)
+{
+    struct balance_peer *p;
+
+    if (peer < 0 || peer >= BALANCE_PEERS_MAX)
+        return;
+    p = &peers[peer];
+    atomic_fetch_sub_explicit(&p->in_flight, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&p->answered, 1, memory_order_relaxed);
+    peer_observe(p, rtt_ns);
+}
+
+/* A timeout counts as an answer as late as the wait: the peer is penalized like a slow one */
+void balance_expired(int peer, uint64_t waited_ns)
+{
+    struct balance_peer *p;
+
+    if (peer < 0 || peer >= BALANCE_PEERS_MAX)
+        return;
+    p = &peers[peer];
+    atomic_fetch_sub_explicit(&p->in_flight, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&p->expired, 1, memory_order_relaxed);
+    peer_observe(p, waited_ns);
+}
+
+void balance_log_stats(void)
+{
+    unsigned i, n = atomic_load(&npeers);
+    uint64_t now = now_ns();
+
+    for (i = 0; i < n; i++) {
+        struct balance_peer *p = &peers[i];
+        fd_log_notice("Gy client OCS %s: %lu CCRs routed, %lu answered, %lu timed out, %u in flight, latency %.2f ms\n",
+                      p->id, (unsigned long)atomic_load(&p->routed), (unsigned long)atomic_load(&p->answered),
+                      (unsigned long)atomic_load(&p->expired), atomic_load(&p->in_flight), peer_latency(p, now) / 1e6);
+    }
+    if (n)
+        fd_log_notice("Gy client balancing: %lu sessions moved off an unavailable OCS, %lu candidates ignored (over %d peers)\n",
+                      (unsigned long)atomic_load(&sessions_moved), (unsigned long)atomic_load(&table_full), BALANCE_PEERS_MAX);
+}
+
+int balance_init(double decay_s)
+{
+    CHECK_PARAMS(decay_s > 0);
+    decay_ns = decay_s * NS_PER_SEC;
+    return 0;
+}
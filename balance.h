@@ -0,0 +1,41 @@
+#ifndef GY_BALANCE_H
+#define GY_BALANCE_H
+
+#include <stdint.h>
+
+/*
+ * Latency-aware choice among the OCS peers of the realm (client side).
+ *
+ * Every peer the routing offers gets a cost: its CCA latency, as a peak
+ * EWMA, times the number of its CCRs in flight plus one. A new session
+ * goes to the cheapest peer and stays there: the later CCRs of the session
+ * are routed to the same peer for as long as it is a candidate, since only
+ * that OCS holds the session. A slow answer raises the peer's latency at
+ * once; it then fades over decay seconds, so that an idle peer is tried
+ * again.
+ *
+ * Peers are small indexes, BALANCE_NONE when unknown.
+ */
+
+#define BALANCE_NONE  (-1)
+
+struct fd_list;
+
+/* decay_s: seconds for a latency peak to fade by a factor e */
+int  balance_init(double decay_s);
+
+/*
+ * Routing-out step of one CCR: among the best-scored candidates, raise the
+ * score of the pinned peer, or of the cheapest one when the pinned peer is
+ * not available. Returns the chosen peer, now counted in flight.
+ */
+int  balance_route(struct fd_list *candidates, int pinned);
+
+/* The CCR routed to peer was answered after rtt_ns, or given up after waited_ns */
+void balance_answered(int peer, uint64_t rtt_ns);
+void balance_expired(int peer, uint64_t waited_ns);
+
+/* One line per peer: CCRs, timeouts, latency and sessions moved */
+void balance_log_stats(void);
+
+#endif /* GY_BALANCE_H */
@@ -0,0 +1,315 @@
+/*
+ * Offline benchmark of the Gy message path: builds CCRs and CCAs the way
+ * the extensions do, and round-trips them through the freeDiameter encoder
+ * and parser. No peer and no network are needed; the configuration file
+ * only provides the local identity and loads the DCCA dictionaries.
+ *
+ * usage: bench [config file] [iterations]
+ */
+#include "utils.h"
+#include "codec.h"
+#include "build.h"
+
+#include <stdio.h>
+
+#define BATCH 1024    /* messages prepared at a time, outside the timed section */
+
+/*
+ * Allocation counter. The executable's malloc interposes the one of the C
+ * library for the freeDiameter libraries as well. Only the main thread runs
+ * (the daemon is never started), so a plain counter will do.
+ */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static uint64_t allocs;
+
+void *malloc(size_t n)
+{
+    allocs++;
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t sz)
+{
+    allocs++;
+    return __libc_calloc(n, sz);
+}
+
+void *realloc(void *p, size_t n)
+{
+    allocs++;
+    return __libc_realloc(p, n);
+}
+
+/* A message shape: what send_ccr or ccr_handle would produce */
+struct shape {
+    const char *name;
+    uint32_t cc_request_type;
+    unsigned mscc;              /* rating groups, 0 = top-level service units */
+    int answer;                 /* measure the CCA instead of the CCR */
+};
+
+static const struct shape shapes[] = {
+    { "CCR-I",         1, 0,  0 },
+    { "CCR-U",         2, 0,  0 },
+    { "CCR-T",         3, 0,  0 },
+    { "CCR-U 4 MSCC",  2, 4,  0 },
+    { "CCR-U 16 MSCC", 2, 16, 0 },
+    { "CCA-I",         1, 0,  1 },
+    { "CCA-U",         2, 0,  1 },
+    { "CCA-U 4 MSCC",  2, 4,  1 },
+    { "CCA-U 16 MSCC", 2, 16, 1 },
+};
+
+struct bench {
+    const struct shape *shape;
+    struct gy_ccr_fields ccr;
+    struct gy_ccr_mscc ccr_mscc[GY_MSCC_MAX];
+    struct gy_cca_fields cca;
+    struct gy_cca_mscc cca_mscc[GY_MSCC_MAX];
+    uint8_t *req_wire;          /* the encoded CCR */
+    size_t req_len;
+    uint8_t *wire;              /* the encoded message of the shape (CCR or CCA) */
+    size_t len;
+    struct msg *msgs[BATCH];
+    uint8_t *bufs[BATCH];
+    size_t lens[BATCH];
+};
+
+static const char session_id[] = "smfplayground.dpc.mnc005.mcc226.3gppnetwork.org;1700000000;1;gy-demo";
+static const char msisdn[] = "46700000042";
+
+/* Fill the fields as send_ccr and ccr_handle do for this shape */
+static void bench_fields(struct bench *b)
+{
+    const struct shape *s = b->shape;
+    uint32_t type = s->cc_request_type;
+    unsigned g;
+
+    memset(&b->ccr, 0, sizeof(b->ccr));
+    b->ccr.session_id = (const uint8_t *)session_id;
+    b->ccr.session_id_len = strlen(session_id);
+    b->ccr.cc_request_type = type;
+    b->ccr.cc_request_number = type == 1 ? 0 : 1;
+    b->ccr.msisdn = (const uint8_t *)msisdn;
+    b->ccr.msisdn_len = strlen(msisdn);
+
+    memset(&b->cca, 0, sizeof(b->cca));
+    b->cca.result_code = 2001;
+    b->cca.cc_request_type = type;
+    b->cca.cc_request_number = b->ccr.cc_request_number;
+
+    if (!s->mscc) {
+        b->ccr.has_rsu = (type == 1 || type == 2);
+        b->ccr.rsu_octets = 1024ULL * 1024 * 1024;
+        b->ccr.has_usu = (type == 2 || type == 3);
+        b->ccr.usu_octets = 800ULL * 1024 * 1024;
+        b->cca.has_gsu = b->ccr.has_rsu;
+        b->cca.gsu_octets = b->ccr.rsu_octets;
+        return;
+    }
+
+    memset(b->ccr_mscc, 0, sizeof(b->ccr_mscc));
+    memset(b->cca_mscc, 0, sizeof(b->cca_mscc));
+    for (g = 0; g < s->mscc; g++) {
+        b->ccr_mscc[g].rating_group = g + 1;
+        b->ccr_mscc[g].has_rsu = 1;
+        b->ccr_mscc[g].rsu_octets = 1024ULL * 1024 * 1024 / s->mscc;
+        b->ccr_mscc[g].has_usu = (type == 2);
+        b->ccr_mscc[g].usu_octets = 800ULL * 1024 * 1024 / s->mscc;
+        b->cca_mscc[g].rating_group = g + 1;
+        b->cca_mscc[g].result_code = 2001;
+        b->cca_mscc[g].has_gsu = 1;
+        b->cca_mscc[g].gsu_octets = b->ccr_mscc[g].rsu_octets;
+    }
+    b->ccr.mscc_count = b->cca.mscc_count = s->mscc;
+    b->ccr.mscc = b->ccr_mscc;
+    b->cca.mscc = b->cca_mscc;
+}
+
+/* What the receiving side does with a buffer: parse it and resolve its AVPs */
+static int parse(const uint8_t *wire, size_t len, struct msg **out)
+{
+    uint8_t *buf;
+
+    CHECK_MALLOC(buf = malloc(len));
+    memcpy(buf, wire, len);
+    /* On success, the message owns the buffer */
+    CHECK_FCT_DO(fd_msg_parse_buffer(&buf, len, out), { free(buf); return EINVAL; });
+    CHECK_FCT(fd_msg_parse_dict(*out, fd_g_config->cnf_dict, NULL));
+    return 0;
+}
+
+/* One measured operation: setup and teardown run outside of the timed section */
+struct op {
+    const char *name;
+    int  (*setup)(struct bench *b, unsigned i);
+    int  (*run)(struct bench *b, unsigned i);
+    void (*teardown)(struct bench *b, unsigned i);
+};
+
+static int setup_none(struct bench *b, unsigned i)
+{
+    b->msgs[i] = NULL;
+    b->bufs[i] = NULL;
+    return 0;
+}
+
+static void teardown_msg(struct bench *b, unsigned i)
+{
+    if (b->msgs[i])
+        fd_msg_free(b->msgs[i]);
+    free(b->bufs[i]);
+}
+
+/* A message of the shape, as built by the sender */
+static int setup_built(struct bench *b, unsigned i)
+{
+    setup_none(b, i);
+    if (!b->shape->answer)
+        return gy_build_ccr(&b->ccr, &b->msgs[i]);
+    CHECK_FCT(parse(b->req_wire, b->req_len, &b->msgs[i]));
+    return gy_build_cca(&b->msgs[i], &b->cca);
+}
+
+/* The request, as received by the server */
+static int setup_request(struct bench *b, unsigned i)
+{
+    setup_none(b, i);
+    return parse(b->req_wire, b->req_len, &b->msgs[i]);
+}
+
+/* A message of the shape, as received by its peer */
+static int setup_received(struct bench *b, unsigned i)
+{
+    setup_none(b, i);
+    return parse(b->wire, b->len, &b->msgs[i]);
+}
+
+static int run_build(struct bench *b, unsigned i)
+{
+    if (!b->shape->answer)
+        return gy_build_ccr(&b->ccr, &b->msgs[i]);
+    return gy_build_cca(&b->msgs[i], &b->cca);
+}
+
+static int run_encode(struct bench *b, unsigned i)
+{
+    return fd_msg_bufferize(b->msgs[i], &b->bufs[i], &b->lens[i]);
+}
+
+static int run_parse(struct bench *b, unsigned i)
+{
+    return parse(b->wire, b->len, &b->msgs[i]);
+}
+
+static int run_decode(struct bench *b, unsigned i)
+{
+    static struct ccr_view ccr;
+    static struct cca_view cca;
+
+    if (!b->shape->answer)
+        return gy_decode_ccr(b->msgs[i], &ccr);
+    return gy_decode_cca(b->msgs[i], &cca);
+}
+
+static const struct op ops_ccr[] = {
+    { "build",  setup_none,     run_build,  teardown_msg },
+    { "encode", setup_built,    run_encode, teardown_msg },
+    { "parse",  setup_none,     run_parse,  teardown_msg },
+    { "decode", setup_received, run_decode, teardown_msg },
+};
+
+/* The answer is built from the received request */
+static const struct op ops_cca[] = {
+    { "build",  setup_request,  run_build,  teardown_msg },
+    { "encode", setup_built,    run_encode, teardown_msg },
+    { "parse",  setup_none,     run_parse,  teardown_msg },
+    { "decode", setup_received, run_decode, teardown_msg },
+};
+
+static int measure(struct bench *b, const struct op *op, unsigned iterations)
+{
+    uint64_t ns = 0, n_allocs = 0, start, a0;
+    unsigned done, i, n;
+
+    for (done = 0; done < iterations; done += n) {
+        n = iterations - done < BATCH ? iterations - done : BATCH;
+        for (i = 0; i < n; i++)
+            CHECK_FCT(op->setup(b, i));
+
+        a0 = allocs;
+        start = now_ns();
+        for (i = 0; i < n; i++)
+            CHECK_FCT(op->run(b, i));
+        ns += now_ns() - start;
+        n_allocs += allocs - a0;
+
+        for (i = 0; i < n; i++)
+            op->teardown(b, i);
+    }
+
+    printf("%-14s %-7s %10.1f %10.2f %8zu\n", b->shape->name, op->name,
+           (double)ns / iterations, (double)n_allocs / iterations, b->len);
+    return 0;
+}
+
+/* Encode one message of the shape (and its request), for the parse and decode steps */
+static int bench_prepare(struct bench *b)
+{
+    struct msg *m;
+
+    CHECK_FCT(gy_build_ccr(&b->ccr, &m));
+    CHECK_FCT(fd_msg_bufferize(m, &b->req_wire, &b->req_len));
+    fd_msg_free(m);
+
+    if (!b->shape->answer) {
+        b->wire = b->req_wire;
+        b->len = b->req_len;
+        return 0;
+    }
+    CHECK_FCT(parse(b->req_wire, b->req_len, &m));
+    CHECK_FCT(gy_build_cca(&m, &b->cca));
+    CHECK_FCT(fd_msg_bufferize(m, &b->wire, &b->len));
+    fd_msg_free(m);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *conffile = argc > 1 ? argv[1] : "bench.conf";
+    unsigned iterations = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 10) : 100000;
+    static struct bench b;
+    unsigned s, o;
+
+    if (argc > 3 || !iterations) {
+        fprintf(stderr, "usage: %s [config file] [iterations]\n", argv[0]);
+        return 2;
+    }
+
+    CHECK_FCT(fd_core_initialize());
+    CHECK_FCT(fd_core_parseconf(conffile));
+    CHECK_FCT(gy_build_init(fd_g_config->cnf_diamrlm));
+
+    printf("%u iterations per operation\n", iterations);
+    printf("%-14s %-7s %10s %10s %8s\n", "message", "step", "ns/op", "allocs/op", "bytes");
+    for (s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        const struct op *ops = shapes[s].answer ? ops_cca : ops_ccr;
+
+        memset(&b, 0, sizeof(b));
+        b.shape = &shapes[s];
+        bench_fields(&b);
+        CHECK_FCT(bench_prepare(&b));
+        for (o = 0; o < 4; o++)
+            CHECK_FCT(measure(&b, &ops[o], iterations));
+
+        free(b.req_wire);
+        if (b.wire != b.req_wire)
+            free(b.wire);
+    }
+
+    (void) fd_core_shutdown();
+    return 0;
+}
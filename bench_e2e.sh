@@ -0,0 +1,172 @@
+#!/bin/sh
+#
+# End-to-end benchmark on the loopback interface: for each concurrency
+# level, start the OCS and the load generator as two freeDiameterd, run the
+# client in load mode for DURATION seconds and append one line to a CSV
+# report: throughput, latency percentiles and CPU time per answered CCR of
+# each daemon.
+#
+# The configurations are generated from the bench_e2e_*.in templates in a
+# scratch directory, so nothing has to be edited by hand. All settings come
+# from the environment:
+#
+#   FD_BUILD          freeDiameter build tree (../freeDiameter/build)
+#   CONCURRENCY       in-flight windows to sweep ("16 64 256 1024")
+#   DURATION          seconds of load per level (30)
+#   SUBSCRIBERS       simulated sessions (100000)
+#   SESSION_DURATION  seconds from CCR-I to CCR-T of a session (10)
+#   RATING_GROUPS     MSCC blocks per CCR, 0 = none (0)
+#   RATE              CCR/s asked from the generator (1000000, i.e. as fast as the window allows)
+#   SERVER_WORKERS    server rating threads, 0 = synchronous (0)
+#   SERVER_PORT       (13868), CLIENT_PORT (13869)
+#   REPORT            CSV file to append to (bench_e2e.csv)
+#   LABEL             first column of the report (git describe of this tree)
+#
+# usage: ./bench_e2e.sh   (or make bench-e2e)
+
+set -eu
+
+SRC_DIR=$(cd "$(dirname "$0")" && pwd)
+FD_BUILD=$(cd "${FD_BUILD:-$SRC_DIR/../freeDiameter/build}" && pwd)
+FD_DAEMON=$FD_BUILD/freeDiameterd/freeDiameterd
+FD_EXT_DIR=$FD_BUILD/extensions
+CONCURRENCY=${CONCURRENCY:-"16 64 256 1024"}
+DURATION=${DURATION:-30}
+SUBSCRIBERS=${SUBSCRIBERS:-100000}
+SESSION_DURATION=${SESSION_DURATION:-10}
+RATING_GROUPS=${RATING_GROUPS:-0}
+RATE=${RATE:-1000000}
+SERVER_WORKERS=${SERVER_WORKERS:-0}
+SERVER_PORT=${SERVER_PORT:-13868}
+CLIENT_PORT=${CLIENT_PORT:-13869}
+REPORT=${REPORT:-bench_e2e.csv}
+LABEL=${LABEL:-$(git -C "$SRC_DIR" describe --always --dirty 2>/dev/null || echo unknown)}
+
+CLK_TCK=$(getconf CLK_TCK)
+WORK=$(mktemp -d /tmp/gy_bench_e2e.XXXXXX)
+SERVER_PID=
+CLIENT_PID=
+
+for f in "$FD_DAEMON" "$SRC_DIR/server.fdx" "$SRC_DIR/client.fdx"; do
+    if [ ! -e "$f" ]; then
+        echo "$f not found: build freeDiameter and run make first" >&2
+        exit 1
+    fi
+done
+
+# Fill in a template: fill <template> <output> <run dir> <window>
+fill() {
+    sed -e "s|@SRC_DIR@|$SRC_DIR|g" -e "s|@FD_EXT_DIR@|$FD_EXT_DIR|g" -e "s|@RUN_DIR@|$3|g" \
+        -e "s|@SERVER_PORT@|$SERVER_PORT|g" -e "s|@CLIENT_PORT@|$CLIENT_PORT|g" \
+        -e "s|@SERVER_WORKERS@|$SERVER_WORKERS|g" -e "s|@SUBSCRIBERS@|$SUBSCRIBERS|g" \
+        -e "s|@RATE@|$RATE|g" -e "s|@SESSION_DURATION@|$SESSION_DURATION|g" \
+        -e "s|@RATING_GROUPS@|$RATING_GROUPS|g" -e "s|@DURATION@|$DURATION|g" \
+        -e "s|@WINDOW@|$4|g" "$SRC_DIR/$1" > "$2"
+}
+
+# CPU time (user + system) of a process, in seconds
+cpu_seconds() {
+    awk -v tck="$CLK_TCK" '{ printf "%.3f\n", ($14 + $15) / tck }' "/proc/$1/stat"
+}
+
+# Wait until a line matching $2 shows up in log $1, for at most $3 seconds
+wait_log() {
+    n=0
+    while ! grep -q "$2" "$1" 2>/dev/null; do
+        n=$((n + 1))
+        if [ $n -gt $(($3 * 10)) ]; then
+            echo "timeout waiting for '$2' in $1" >&2
+            return 1
+        fi
+        sleep 0.1
+    done
+}
+
+stop() {
+    for pid in $CLIENT_PID $SERVER_PID; do
+        kill "$pid" 2>/dev/null || continue
+        n=0
+        while kill -0 "$pid" 2>/dev/null && [ $n -lt 100 ]; do
+            sleep 0.1
+            n=$((n + 1))
+        done
+        kill -9 "$pid" 2>/dev/null || true
+    done
+    CLIENT_PID=
+    SERVER_PID=
+}
+trap 'stop' EXIT INT TERM
+
+# Answers and latency percentiles from the client metrics file:
+# prints "answers failed p50 p90 p99 p999" (latencies in ms)
+summarize() {
+    awk '
+    /^gy_client_answers_total/ {
+        n = $NF; answers += n
+        if ($0 !~ /result="2001"/) failed += n
+    }
+    /^gy_client_latency_seconds_bucket/ {
+        le = $0; sub(/.*le="/, "", le); sub(/".*/, "", le)
+        if (le == "+Inf") inf += $NF
+        else { k = le + 0; if (!(k in cum)) les[nle++] = k; cum[k] += $NF }
+    }
+    # histogram_quantile: linear interpolation inside the bucket holding rank q
+    function quantile(q,    i, rank, prev, prevc, c) {
+        if (!inf) return 0
+        rank = q * inf; prev = 0; prevc = 0
+        for (i = 0; i < nle; i++) {
+            c = cum[les[i]]
+            if (c >= rank)
+                return 1000 * (prev + (les[i] - prev) * (c > prevc ? (rank - prevc) / (c - prevc) : 1))
+            prev = les[i]; prevc = c
+        }
+        return 1000 * prev
+    }
+    END {
+        # bucket bounds in increasing order
+        for (i = 1; i < nle; i++)
+            for (j = i; j > 0 && les[j - 1] > les[j]; j--) { t = les[j]; les[j] = les[j - 1]; les[j - 1] = t }
+        printf "%d %d %.3f %.3f %.3f %.3f\n", answers, failed,
+               quantile(0.5), quantile(0.9), quantile(0.99), quantile(0.999)
+    }' "$1"
+}
+
+if [ ! -s "$REPORT" ]; then
+    echo "label,window,rating_groups,server_workers,seconds,answers,failed,answers_per_s,p50_ms,p90_ms,p99_ms,p999_ms,server_cpu_us_per_answer,client_cpu_us_per_answer" > "$REPORT"
+fi
+
+for window in $CONCURRENCY; do
+    run=$WORK/w$window
+    mkdir -p "$run"
+    fill bench_e2e_server.conf.in "$run/server.conf" "$run" "$window"
+    fill bench_e2e_server_ext.conf.in "$run/server_ext.conf" "$run" "$window"
+    fill bench_e2e_client.conf.in "$run/client.conf" "$run" "$window"
+    fill bench_e2e_client_load.conf.in "$run/client_load.conf" "$run" "$window"
+
+    echo "window $window: starting the OCS and the load generator ($run)"
+    "$FD_DAEMON" -c "$run/server.conf" > "$run/server.log" 2>&1 &
+    SERVER_PID=$!
+    wait_log "$run/server.log" "Gy server extension" 30
+    "$FD_DAEMON" -c "$run/client.conf" > "$run/client.log" 2>&1 &
+    CLIENT_PID=$!
+
+    # The generator starts once the peers are connected: count CPU from there
+    wait_log "$run/client.log" "Gy load generator:" 60
+    server_cpu0=$(cpu_seconds $SERVER_PID)
+    client_cpu0=$(cpu_seconds $CLIENT_PID)
+    wait_log "$run/client.log" "Gy load generator stopped" $((DURATION + 60))
+    seconds=$(sed -n 's/.*Gy load generator stopped after \([0-9.]*\)s.*/\1/p' "$run/client.log")
+    # Late answers, then one more metrics write
+    sleep 3
+    server_cpu=$(echo "$(cpu_seconds $SERVER_PID) $server_cpu0" | awk '{ print $1 - $2 }')
+    client_cpu=$(echo "$(cpu_seconds $CLIENT_PID) $client_cpu0" | awk '{ print $1 - $2 }')
+    stop
+
+    set -- $(summarize "$run/client.prom")
+    echo "$LABEL $window $RATING_GROUPS $SERVER_WORKERS $seconds $* $server_cpu $client_cpu" | awk '
+        { ok = $6 - $7
+          printf "%s,%s,%s,%s,%s,%d,%d,%.1f,%s,%s,%s,%s,%.2f,%.2f\n", $1, $2, $3, $4, $5, $6, $7,
+                 ok / $5, $8, $9, $10, $11, ok ? $12 * 1e6 / ok : 0, ok ? $13 * 1e6 / ok : 0 }' | tee -a "$REPORT"
+done
+
+echo "report: $REPORT, logs and configurations: $WORK"
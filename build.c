@@ -0,0 +1,303 @@
+#include "build.h"
+
+#define GY_AUTH_APPLICATION_ID  4                   /* Diameter Credit Control */
+#define GY_SERVICE_CONTEXT_ID   "32251@3gpp.org"    /* 3GPP TS 32.251, PS charging */
+
+static struct {
+    struct dict_object *ccr_cmd;
+    struct dict_object *rar_cmd;
+    struct dict_object *session_id;
+    struct dict_object *origin_host;
+    struct dict_object *origin_realm;
+    struct dict_object *dest_realm;
+    struct dict_object *dest_host;
+    struct dict_object *auth_app_id;
+    struct dict_object *result_code;
+    struct dict_object *cc_request_type;
+    struct dict_object *cc_request_number;
+    struct dict_object *service_context_id;
+    struct dict_object *requested_service_unit;
+    struct dict_object *used_service_unit;
+    struct dict_object *granted_service_unit;
+    struct dict_object *cc_total_octets;
+    struct dict_object *subscription_id;
+    struct dict_object *subscription_id_type;
+    struct dict_object *subscription_id_data;
+    struct dict_object *multiple_services_indicator;
+    struct dict_object *mscc;
+    struct dict_object *rating_group;
+    struct dict_object *validity_time;
+    struct dict_object *re_auth_request_type;
+} d;
+
+/* Values of the constant AVPs, prepared once */
+static struct {
+    union avp_value origin_host;
+    union avp_value origin_realm;
+    union avp_value dest_realm;
+    union avp_value auth_app_id;
+    union avp_value service_context_id;
+} tpl;
+
+static char *dest_realm_copy;
+
+int gy_build_init(const char *dest_realm)
+{
+    struct dictionary *dict = fd_g_config->cnf_dict;
+
+    CHECK_FCT(fd_dict_search(dict, DICT_COMMAND, CMD_BY_NAME, "Credit-Control-Request", &d.ccr_cmd, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Session-Id", &d.session_id, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Origin-Host", &d.origin_host, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Origin-Realm", &d.origin_realm, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Destination-Realm", &d.dest_realm, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Auth-Application-Id", &d.auth_app_id, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Result-Code", &d.result_code, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "CC-Request-Type", &d.cc_request_type, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "CC-Request-Number", &d.cc_request_number, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Service-Context-Id", &d.service_context_id, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Requested-Service-Unit", &d.requested_service_unit, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Used-Service-Unit", &d.used_service_unit, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Granted-Service-Unit", &d.granted_service_unit, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "CC-Total-Octets", &d.cc_total_octets, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Subscription-Id", &d.subscription_id, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Subscription-Id-Type", &d.subscription_id_type, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Subscription-Id-Data", &d.subscription_id_data, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Multiple-Services-Indicator", &d.multiple_services_indicator, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Multiple-Services-Credit-Control", &d.mscc, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Rating-Group", &d.rating_group, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Validity-Time", &d.validity_time, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_COMMAND, CMD_BY_NAME, "Re-Auth-Request", &d.rar_cmd, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Destination-Host", &d.dest_host, ENOENT));
+    CHECK_FCT(fd_dict_search(dict, DICT_AVP, AVP_BY_NAME, "Re-Auth-Request-Type", &d.re_auth_request_type, ENOENT));
+
+    tpl.origin_host.os.data = (uint8_t *)fd_g_config->cnf_diamid;
+    tpl.origin_host.os.len = fd_g_config->cnf_diamid_len;
+    tpl.origin_realm.os.data = (uint8_t *)fd_g_config->cnf_diamrlm;
+    tpl.origin_realm.os.len = fd_g_config->cnf_diamrlm_len;
+    tpl.auth_app_id.u32 = GY_AUTH_APPLICATION_ID;
+    tpl.service_context_id.os.data = (uint8_t *)GY_SERVICE_CONTEXT_ID;
+    tpl.service_context_id.os.len = strlen(GY_SERVICE_CONTEXT_ID);
+    if (dest_realm) {
+        CHECK_MALLOC(dest_realm_copy = strdup(dest_realm));
+        tpl.dest_realm.os.data = (uint8_t *)dest_realm_copy;
+        tpl.dest_realm.os.len = strlen(dest_realm_copy);
+    }
+    return 0;
+}
+
+/* Create an AVP with the given value and append it to parent */
+static inline int add_avp(msg_or_avp *parent, struct dict_object *model, union avp_value *val)
+{
+    struct avp *avp;
+
+    CHECK_FCT(fd_msg_avp_new(model, 0, &avp));
+    CHECK_FCT(fd_msg_avp_setvalue(avp, val));
+    CHECK_FCT(fd_msg_avp_add(parent, MSG_BRW_LAST_CHILD, avp));
+    return 0;
+}
+
+static inline int add_u32(msg_or_avp *parent, struct dict_object *model, uint32_t v)
+{
+    union avp_value val;
+
+    val.u32 = v;
+    return add_avp(parent, model, &val);
+}
+
+/* Grouped Service-Unit holding a CC-Total-Octets */
+static int add_service_unit(msg_or_avp *parent, struct dict_object *model, uint64_t octets)
+{
+    struct avp *su;
+    union avp_value val;
+
+    CHECK_FCT(fd_msg_avp_new(model, 0, &su));
+    val.u64 = octets;
+    CHECK_FCT(add_avp(su, d.cc_total_octets, &val));
+    CHECK_FCT(fd_msg_avp_add(parent, MSG_BRW_LAST_CHILD, su));
+    return 0;
+}
+
+/* Grouped Subscription-Id of type END_USER_E164 */
+static int add_msisdn(msg_or_avp *parent, const uint8_t *msisdn, size_t len)
+{
+    struct avp *grp;
+    union avp_value val;
+
+    CHECK_FCT(fd_msg_avp_new(d.subscription_id, 0, &grp));
+    CHECK_FCT(add_u32(grp, d.subscription_id_type, 0 /* END_USER_E164 */));
+    val.os.data = (uint8_t *)msisdn;
+    val.os.len = len;
+    CHECK_FCT(add_avp(grp, d.subscription_id_data, &val));
+    CHECK_FCT(fd_msg_avp_add(parent, MSG_BRW_LAST_CHILD, grp));
+    return 0;
+}
+
+/* Multiple-Services-Credit-Control of a CCR */
+static int add_ccr_mscc(msg_or_avp *parent, const struct gy_ccr_mscc *m)
+{
+    struct avp *grp;
+
+    CHECK_FCT(fd_msg_avp_new(d.mscc, 0, &grp));
+    if (m->has_rsu)
+        CHECK_FCT(add_service_unit(grp, d.requested_service_unit, m->rsu_octets));
+    if (m->has_usu)
+        CHECK_FCT(add_service_unit(grp, d.used_service_unit, m->usu_octets));
+    CHECK_FCT(add_u32(grp, d.rating_group, m->rating_group));
+    CHECK_FCT(fd_msg_avp_add(parent, MSG_BRW_LAST_CHILD, grp));
+    return 0;
+}
+
+/* Multiple-Services-Credit-Control of a CCA */
+static int add_cca_mscc(msg_or_avp *parent, const struct gy_cca_mscc *m)
+{
+    struct avp *grp;
+
+    CHECK_FCT(fd_msg_avp_new(d.mscc, 0, &grp));
+    if (m->has_gsu)
+        CHECK_FCT(add_service_unit(grp, d.granted_service_unit, m->gsu_octets));
+    CHECK_FCT(add_u32(grp, d.rating_group, m->rating_group));
+    if (m->validity_time)
+        CHECK_FCT(add_u32(grp, d.validity_time, m->validity_time));
+    CHECK_FCT(add_u32(grp, d.result_code, m->result_code));
+    CHECK_FCT(fd_msg_avp_add(parent, MSG_BRW_LAST_CHILD, grp));
+    return 0;
+}
+
+int gy_build_ccr(const struct gy_ccr_fields *f, struct msg **out)
+{
+    struct msg *req = NULL;
+    union avp_value val;
+    int ret;
+
+    CHECK_PARAMS(f && out && f->session_id && tpl.dest_realm.os.data);
+
+    CHECK_FCT(fd_msg_new(d.ccr_cmd, MSGFL_ALLOC_ETEID, &req));
+
+    val.os.data = (uint8_t *)f->session_id;
+    val.os.len = f->session_id_len;
+    CHECK_FCT_DO(ret = add_avp(req, d.session_id, &val), goto error);
+    CHECK_FCT_DO(ret = add_avp(req, d.origin_host, &tpl.origin_host), goto error);
+    CHECK_FCT_DO(ret = add_avp(req, d.origin_realm, &tpl.origin_realm), goto error);
+    CHECK_FCT_DO(ret = add_avp(req, d.dest_realm, &tpl.dest_realm), goto error);
+    CHECK_FCT_DO(ret = add_avp(req, d.auth_app_id, &tpl.auth_app_id), goto error);
+    CHECK_FCT_DO(ret = add_u32(req, d.cc_request_type, f->cc_request_type), goto error);
+    CHECK_FCT_DO(ret = add_u32(req, d.cc_request_number, f->cc_request_number), goto error);
+    CHECK_FCT_DO(ret = add_avp(req, d.service_context_id, &tpl.service_context_id), goto error);
+    if (f->msisdn)
+        CHECK_FCT_DO(ret = add_msisdn(req, f->msisdn, f->msisdn_len), goto error);
+    if (f->has_rsu)
+        CHECK_FCT_DO(ret = add_service_unit(req, d.requested_service_unit, f->rsu_octets), goto error);
+    if (f->has_usu)
+        CHECK_FCT_DO(ret = add_service_unit(req, d.used_service_unit, f->usu_octets), goto error);
+    if (f->mscc_count) {
+        unsigned i;
+        CHECK_FCT_DO(ret = add_u32(req, d.multiple_services_indicator, 1 /* MULTIPLE_SERVICES_SUPPORTED */), goto error);
+        for (i = 0; i < f->mscc_count; i++)
+            CHECK_FCT_DO(ret = add_ccr_mscc(req, &f->mscc[i]), goto error);
+    }
+
+    *out = req;
+    return 0;
+
+error:
+    fd_msg_free(req);
+    return ret;
+}
+
+int gy_build_cca(struct msg **msg, const struct gy_cca_fields *f)
+{
+    struct msg *ans;
+    unsigned i;
+
+    CHECK_PARAMS(msg && *msg && f && (f->mscc || !f->mscc_count));
+
+    /* Create answer from request (copies the Session-Id) */
+    CHECK_FCT(fd_msg_new_answer_from_req(fd_g_config->cnf_dict, msg, 0));
+    ans = *msg;
+
+    /* Result-Code, then Origin-Host / Origin-Realm */
+    CHECK_FCT(add_u32(ans, d.result_code, f->result_code));
+    CHECK_FCT(fd_msg_add_origin(ans, 0));
+    if (f->result_code >= 3000 && f->result_code < 4000) {
+        /* Protocol errors are sent with the E bit */
+        struct msg_hdr *hdr;
+        CHECK_FCT(fd_msg_hdr(ans, &hdr));
+        hdr->msg_flags |= CMD_FLAG_ERROR;
+    }
+
+    CHECK_FCT(add_avp(ans, d.auth_app_id, &tpl.auth_app_id));
+    CHECK_FCT(add_u32(ans, d.cc_request_type, f->cc_request_type));
+    CHECK_FCT(add_u32(ans, d.cc_request_number, f->cc_request_number));
+    if (f->has_gsu)
+        CHECK_FCT(add_service_unit(ans, d.granted_service_unit, f->gsu_octets));
+    if (f->validity_time)
+        CHECK_FCT(add_u32(ans, d.validity_time, f->validity_time));
+    for (i = 0; i < f->mscc_count; i++)
+        CHECK_FCT(add_cca_mscc(ans, &f->mscc[i]));
+
+    return 0;
+}
+
+int gy_build_rar(const uint8_t *sid, size_t sidlen, const uint8_t *dest_host, size_t dest_host_len,
+                 const uint8_t *dest_realm, size_t dest_realm_len, struct msg **out)
+{
+    struct msg *req = NULL;
+    struct msg_hdr *hdr;
+    union avp_value val;
+    int ret;
+
+    CHECK_PARAMS(sid && dest_host && dest_realm && out);
+
+    CHECK_FCT(fd_msg_new(d.rar_cmd, MSGFL_ALLOC_ETEID, &req));
+    /* The base protocol command, sent within the Credit Control application */
+    CHECK_FCT_DO(ret = fd_msg_hdr(req, &hdr), goto error);
+    hdr->msg_appl = GY_AUTH_APPLICATION_ID;
+
+    val.os.data = (uint8_t *)sid;
+    val.os.len = sidlen;
+    CHECK_FCT_DO(ret = add_avp(req, d.session_id, &val), goto error);
+    CHECK_FCT_DO(ret = add_avp(req, d.origin_host, &tpl.origin_host), goto error);
+    CHECK_FCT_DO(ret = add_avp(req, d.origin_realm, &tpl.origin_realm), goto error);
+    val.os.data = (uint8_t *)dest_realm;
+    val.os.len = dest_realm_len;
+    CHECK_FCT_DO(ret = add_avp(req, d.dest_realm, &val), goto error);
+    val.os.data = (uint8_t *)dest_host;
+    val.os.len = dest_host_len;
+    CHECK_FCT_DO(ret = add_avp(req, d.dest_host, &val), goto error);
+    CHECK_FCT_DO(ret = add_avp(req, d.auth_app_id, &tpl.auth_app_id), goto error);
+    CHECK_FCT_DO(ret = add_u32(req, d.re_auth_request_type, 0 /* AUTHORIZE_ONLY */), goto error);
+
+    *out = req;
+    return 0;
+
+error:
+    fd_msg_free(req);
+    return ret;
+}
+
+int gy_build_raa(struct msg **msg, uint32_t result_code)
+{
+    CHECK_PARAMS(msg && *msg);
+
+    /* Create answer from request (copies the Session-Id) */
+    CHECK_FCT(fd_msg_new_answer_from_req(fd_g_config->cnf_dict, msg, 0));
+    CHECK_FCT(add_u32(*msg, d.result_code, result_code));
+    CHECK_FCT(fd_msg_add_origin(*msg, 0));
+    return 0;
+}
+
+int gy_result_code(struct msg *msg, uint32_t *result_code)
+{
+    struct avp *avp;
+    struct avp_hdr *hdr;
+
+    *result_code = 0;
+    CHECK_FCT(fd_msg_search_avp(msg, d.result_code, &avp));
+    if (!avp)
+        return ENOENT;
+    CHECK_FCT(fd_msg_avp_hdr(avp, &hdr));
+    if (!hdr->avp_value)
+        return ENOENT;
+    *result_code = hdr->avp_value->u32;
+    return 0;
+}
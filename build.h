@@ -0,0 +1,83 @@
+#ifndef GY_BUILD_H
+#define GY_BUILD_H
+
+#include "utils.h"
+
+/*
+ * Construction of Gy CCR / CCA messages, and of the RAR / RAA of
+ * server-initiated re-authorization.
+ * Dictionary objects and the values of the AVPs that are identical in
+ * every message (Origin-Host, Origin-Realm, Destination-Realm,
+ * Auth-Application-Id, Service-Context-Id) are resolved once by
+ * gy_build_init; building a message then only sets the variable fields.
+ */
+
+/* One Multiple-Services-Credit-Control block of a CCR */
+struct gy_ccr_mscc {
+    uint32_t rating_group;
+    int has_rsu;
+    uint64_t rsu_octets;
+    int has_usu;
+    uint64_t usu_octets;
+};
+
+/* One Multiple-Services-Credit-Control block of a CCA */
+struct gy_cca_mscc {
+    uint32_t rating_group;
+    uint32_t result_code;
+    int has_gsu;
+    uint64_t gsu_octets;
+    uint32_t validity_time;     /* seconds, 0 = no Validity-Time */
+};
+
+/* Variable part of a CCR */
+struct gy_ccr_fields {
+    const uint8_t *session_id;
+    size_t session_id_len;
+    uint32_t cc_request_type;
+    uint32_t cc_request_number;
+    const uint8_t *msisdn;      /* Subscription-Id (END_USER_E164), NULL = none */
+    size_t msisdn_len;
+    int has_rsu;                /* add a Requested-Service-Unit */
+    uint64_t rsu_octets;
+    int has_usu;                /* add a Used-Service-Unit */
+    uint64_t usu_octets;
+    unsigned mscc_count;        /* MSCC blocks, sent with Multiple-Services-Indicator */
+    const struct gy_ccr_mscc *mscc;
+};
+
+/* Variable part of a CCA */
+struct gy_cca_fields {
+    uint32_t result_code;       /* e.g. 2001 DIAMETER_SUCCESS, 4012 DIAMETER_CREDIT_LIMIT_REACHED */
+    uint32_t cc_request_type;
+    uint32_t cc_request_number;
+    int has_gsu;                /* add a Granted-Service-Unit */
+    uint64_t gsu_octets;
+    uint32_t validity_time;     /* seconds, 0 = no Validity-Time */
+    unsigned mscc_count;        /* one MSCC block per rating group of the request */
+    const struct gy_cca_mscc *mscc;
+};
+
+/* Resolve dictionary objects and constant AVP values; dest_realm may be NULL for the server */
+int gy_build_init(const char *dest_realm);
+
+/* Create a new CCR in *out */
+int gy_build_ccr(const struct gy_ccr_fields *f, struct msg **out);
+
+/* Replace the request in *msg by its answer, filled from f */
+int gy_build_cca(struct msg **msg, const struct gy_cca_fields *f);
+
+/*
+ * Create a Re-Auth-Request (AUTHORIZE_ONLY) for an open session in *out,
+ * addressed to the peer that opened it.
+ */
+int gy_build_rar(const uint8_t *sid, size_t sidlen, const uint8_t *dest_host, size_t dest_host_len,
+                 const uint8_t *dest_realm, size_t dest_realm_len, struct msg **out);
+
+/* Replace the RAR in *msg by its answer */
+int gy_build_raa(struct msg **msg, uint32_t result_code);
+
+/* Result-Code of an answer; ENOENT when it has none */
+int gy_result_code(struct msg *msg, uint32_t *result_code);
+
+#endif /* GY_BUILD_H */
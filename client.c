@@ -1,25 +1,185 @@
 #include "utils.h"
+#include "conf.h"
+#include "latency.h"
+#include "codec.h"
+#include "build.h"
+#include "pool.h"
+#include "evlog.h"
+#include "twheel.h"
+#include "metrics.h"
+#include "trace.h"
+#include "balance.h"
+
+#include <stdatomic.h>
 
-static struct dict_object *ccr_cmd = NULL;
-static struct dict_object *cca_cmd = NULL;
 static struct dict_object *app_dcca = NULL;
-static struct dict_object *avp_session_id = NULL;
-static struct dict_object *avp_origin_host = NULL;
-static struct dict_object *avp_origin_realm = NULL;
-static struct dict_object *avp_dest_realm = NULL;
-static struct dict_object *avp_auth_app_id = NULL;
-static struct dict_object *avp_cc_request_type = NULL;
-static struct dict_object *avp_cc_request_number = NULL;
-static struct dict_object *avp_result_code = NULL;
-static struct dict_object *avp_service_context_id = NULL;
-static struct dict_object *avp_requested_service_unit = NULL;
-static struct dict_object *avp_used_service_unit = NULL;
-static struct dict_object *avp_granted_service_unit = NULL;
-static struct dict_object *avp_cc_total_octets = NULL;
+static struct disp_hdl *rar_hdl = NULL;
+static struct session_handler *sess_hdl = NULL;
+static struct fd_rt_out_hdl *rt_hdl = NULL;
 static int keep_running = 1;
 
-static uint64_t granted_quota = 0;
-static uint64_t total_used = 0;
+enum client_mode {
+    MODE_DEMO = 0,      /* narrated I/U/T sequences on one session */
+    MODE_LOAD,          /* open-loop CCRs at a fixed rate */
+    MODE_SESSIONS,      /* quota-driven sessions on timer wheels */
+    MODE_REPLAY,        /* CCRs of a captured trace, at their original pace or faster */
+};
+
+/* Where a subscriber is in its session cycle (sessions mode) */
+enum sub_state {
+    SUB_IDLE = 0,       /* between sessions, the timer starts the next one */
+    SUB_WAITING,        /* CCR in flight, the timer is the answer timeout */
+    SUB_ACTIVE,         /* consuming its grant, the timer is the next CCR-U or CCR-T */
+};
+
+struct sched_thread;
+
+/* One simulated subscriber (UE) with its own Gy session and counters */
+struct subscriber {
+    struct session *sess;
+    uint32_t request_number;
+    uint32_t updates_sent;
+    int active;                          /* between CCR-I and CCR-T */
+    uint64_t next_due_ns;                /* earliest time of the next CCR */
+    uint64_t sess_hash;                  /* hash of the Session-Id, for the event log */
+    atomic_uint_fast64_t granted_quota;  /* last grant, written by cca_cb */
+    atomic_uint_fast64_t granted_rg[GY_MSCC_MAX];  /* last grant of each rating group, with MSCC */
+    atomic_int credit_exhausted;         /* 4012 received, the session must end */
+    uint64_t total_used;
+    uint8_t msisdn_len;
+    char msisdn[20];                     /* Subscription-Id-Data, E.164 digits */
+    uint8_t rating_groups;               /* MSCC per CCR, 0 = top-level service units */
+    atomic_int pending;                  /* replay mode: a CCR awaits its answer */
+    atomic_int reauth;                   /* sessions mode: a RAR asked for a CCR-U */
+    atomic_uint validity_time;           /* Validity-Time of the last answer, seconds */
+    atomic_int peer;                     /* OCS the session is pinned to, BALANCE_NONE before its first CCR */
+
+    /* Sessions mode: owned by the scheduler thread, except the inbox fields */
+    struct sched_thread *owner;
+    struct tw_timer timer;
+    enum sub_state state;
+    uint32_t waiting_number;             /* CC-Request-Number of the CCR in flight */
+    uint64_t grant_ns;                   /* when the current grant arrived */
+    uint64_t session_end_ns;             /* when the session sends its CCR-T */
+    struct subscriber *inbox_next;       /* protected by owner->lock (reauth_queue.lock in load mode) */
+    uint32_t answered_number;            /* protected by owner->lock */
+    int answered_ok;                     /* protected by owner->lock */
+    int answer_posted;                   /* protected by owner->lock */
+    int queued;                          /* protected by owner->lock (reauth_queue.lock in load mode) */
+};
+
+/* What the session state of freeDiameter keeps for us: the subscriber owning the session, for RARs */
+struct sess_state {
+    struct subscriber *sub;
+};
+
+/* Client configuration, from the file given on the LoadExtension line */
+static struct {
+    enum client_mode mode;      /* mode = demo | load | sessions */
+    uint32_t subscribers;       /* number of simulated subscribers */
+    double rate;                /* target CCR/s, open loop */
+    uint32_t updates;           /* CCR-U per session: I:U:T mix is 1:updates:1 */
+    uint32_t rating_groups;     /* MSCC per CCR in load mode, 0 = top-level service units */
+    double session_duration;    /* seconds from CCR-I to CCR-T of one session */
+    double duration;            /* length of the load run in seconds, 0 = until shutdown */
+    double report_interval;     /* seconds between latency reports, 0 = only at the end */
+    char dest_realm[256];       /* Destination-Realm of the CCRs */
+    uint64_t msisdn_base;       /* MSISDN of subscriber 0, the others follow */
+    enum evlog_level log_level; /* event log verbosity */
+    int log_level_set;
+    char log_file[256];         /* binary event log, empty = text through fd_log */
+    uint32_t scheduler_threads; /* sessions mode: threads sharing the subscribers */
+    double consumption_rate;    /* sessions mode: octets/s used by each subscriber */
+    double update_threshold;    /* sessions mode: share of the grant used before a CCR-U */
+    double session_gap;         /* sessions mode: seconds between two sessions of a subscriber */
+    double answer_timeout;      /* sessions mode: seconds before a CCR is given up */
+    uint32_t window;            /* CCRs in flight before sending blocks, 0 = no limit */
+    double request_timeout;     /* seconds before a CCR is retransmitted, 0 = wait forever */
+    uint32_t retransmits;       /* retransmissions of a CCR before it counts as timed out */
+    char metrics_file[256];     /* Prometheus textfile, empty = no metrics */
+    double metrics_interval;    /* seconds between rewrites of the metrics file */
+    char trace_file[256];       /* replay mode: trace captured by the server */
+    double replay_speed;        /* replay mode: 1 = original pace, N = N times faster */
+    uint32_t balance;           /* spread sessions over the OCS peers of the realm by latency */
+    double balance_decay;       /* seconds for a latency peak of a peer to fade */
+} client_conf = {
+    .mode = MODE_DEMO,
+    .subscribers = 1000,
+    .rate = 100,
+    .updates = 1,
+    .session_duration = 30,
+    .duration = 0,
+    .report_interval = 10,
+    .dest_realm = "dpc.mnc005.mcc226.3gppnetwork.org",
+    .msisdn_base = 46700000000ULL,
+    .scheduler_threads = 1,
+    .consumption_rate = 1048576,
+    .update_threshold = 0.8,
+    .session_gap = 1,
+    .answer_timeout = 5,
+    .window = 1024,
+    .request_timeout = 2,
+    .retransmits = 1,
+    .metrics_interval = 10,
+    .replay_speed = 1,
+    .balance = 1,
+    .balance_decay = 10,
+};
+
+/* Per-request context, handed to cca_cb through fd_msg_send */
+struct ccr_ctx {
+    struct subscriber *sub;
+    uint64_t sent_ns;
+    uint32_t request_type;
+    uint32_t request_number;
+    uint32_t attempts;          /* transmissions so far, the first one included */
+    int peer;                   /* OCS of the current transmission, set by the routing */
+    uint64_t routed_ns;
+};
+
+/* Routing-out priority, the one of freeDiameter's rt_load_balance: load only one of the two */
+#define BALANCE_RT_PRIORITY 10
+
+/* Request contexts are recycled: one per CCR in flight */
+static struct pool ctx_pool;
+
+
+static atomic_uint_fast64_t ccr_sent[4];
+static atomic_uint_fast64_t cca_received;
+static atomic_uint_fast64_t cca_failed;
+static atomic_uint_fast64_t units_answered;   /* rating groups answered, 1 per CCA without MSCC */
+static atomic_uint_fast64_t ccr_retransmits;  /* CCRs sent again with the T flag */
+static atomic_uint_fast64_t ccr_timeouts;     /* CCRs given up after the last retransmission */
+static atomic_uint_fast64_t rar_received;
+static atomic_uint_fast64_t rar_unknown;      /* RARs for a session we do not have, answered 5002 */
+static atomic_uint_fast64_t ccr_reauth;       /* CCR-U sent because of a RAR */
+
+/* Subscribers re-authorized by a RAR in load mode, served ahead of the schedule */
+static struct {
+    pthread_mutex_t lock;
+    struct subscriber *head;
+} reauth_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * In-flight window. One window covers all the OCS peers: a CCR takes a slot
+ * when it is sent and gives it back when its answer arrives or when it
+ * finally times out. A full window blocks the sender, which turns a slow
+ * OCS into a lower send rate rather than a growing backlog. The balancing
+ * keeps its own in-flight count per peer.
+ */
+static struct {
+    atomic_uint in_flight;
+    atomic_int waiters;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    atomic_uint_fast64_t stalls;      /* sends that found the window full */
+    atomic_uint_fast64_t stall_ns;    /* time spent waiting for a slot */
+} window = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
 
 uint64_t quotas[] = {
     800ULL * 1024 * 1024,   /* 800MB */
@@ -34,288 +194,1198 @@ static void signal_handler(int sig)
     keep_running = 0;
 }
 
-/* Helper function to add Service-Unit AVP with octets */
-static int add_service_unit(struct msg *msg, struct dict_object *service_unit_avp, uint64_t octets)
+static int client_conf_handler(const char *key, const char *value, void *opaque)
 {
-    struct avp *avp_su, *avp_octets;
-    union avp_value val;
+    if (!strcmp(key, "mode")) {
+        if (!strcmp(value, "demo"))
+            client_conf.mode = MODE_DEMO;
+        else if (!strcmp(value, "load"))
+            client_conf.mode = MODE_LOAD;
+        else if (!strcmp(value, "sessions"))
+            client_conf.mode = MODE_SESSIONS;
+        else if (!strcmp(value, "replay"))
+            client_conf.mode = MODE_REPLAY;
+        else
+            return EINVAL;
+        return 0;
+    }
+    if (!strcmp(key, "subscribers"))
+        return conf_get_u32(key, value, &client_conf.subscribers);
+    if (!strcmp(key, "rate"))
+        return conf_get_double(key, value, &client_conf.rate);
+    if (!strcmp(key, "updates"))
+        return conf_get_u32(key, value, &client_conf.updates);
+    if (!strcmp(key, "rating_groups"))
+        return conf_get_u32(key, value, &client_conf.rating_groups);
+    if (!strcmp(key, "session_duration"))
+        return conf_get_double(key, value, &client_conf.session_duration);
+    if (!strcmp(key, "duration"))
+        return conf_get_double(key, value, &client_conf.duration);
+    if (!strcmp(key, "report_interval"))
+        return conf_get_double(key, value, &client_conf.report_interval);
+    if (!strcmp(key, "scheduler_threads"))
+        return conf_get_u32(key, value, &client_conf.scheduler_threads);
+    if (!strcmp(key, "consumption_rate"))
+        return conf_get_double(key, value, &client_conf.consumption_rate);
+    if (!strcmp(key, "update_threshold"))
+        return conf_get_double(key, value, &client_conf.update_threshold);
+    if (!strcmp(key, "session_gap"))
+        return conf_get_double(key, value, &client_conf.session_gap);
+    if (!strcmp(key, "answer_timeout"))
+        return conf_get_double(key, value, &client_conf.answer_timeout);
+    if (!strcmp(key, "window"))
+        return conf_get_u32(key, value, &client_conf.window);
+    if (!strcmp(key, "request_timeout"))
+        return conf_get_double(key, value, &client_conf.request_timeout);
+    if (!strcmp(key, "retransmits"))
+        return conf_get_u32(key, value, &client_conf.retransmits);
+    if (!strcmp(key, "msisdn_base"))
+        return conf_get_u64(key, value, &client_conf.msisdn_base);
+    if (!strcmp(key, "log_level")) {
+        client_conf.log_level_set = 1;
+        return evlog_parse_level(value, &client_conf.log_level);
+    }
+    if (!strcmp(key, "log_file")) {
+        if (strlen(value) >= sizeof(client_conf.log_file))
+            return EINVAL;
+        strcpy(client_conf.log_file, value);
+        return 0;
+    }
+    if (!strcmp(key, "metrics_file")) {
+        if (strlen(value) >= sizeof(client_conf.metrics_file))
+            return EINVAL;
+        strcpy(client_conf.metrics_file, value);
+        return 0;
+    }
+    if (!strcmp(key, "metrics_interval"))
+        return conf_get_double(key, value, &client_conf.metrics_interval);
+    if (!strcmp(key, "trace_file")) {
+        if (strlen(value) >= sizeof(client_conf.trace_file))
+            return EINVAL;
+        strcpy(client_conf.trace_file, value);
+        return 0;
+    }
+    if (!strcmp(key, "replay_speed"))
+        return conf_get_double(key, value, &client_conf.replay_speed);
+    if (!strcmp(key, "balance"))
+        return conf_get_u32(key, value, &client_conf.balance);
+    if (!strcmp(key, "balance_decay"))
+        return conf_get_double(key, value, &client_conf.balance_decay);
+    if (!strcmp(key, "dest_realm")) {
+        if (strlen(value) >= sizeof(client_conf.dest_realm))
+            return EINVAL;
+        strcpy(client_conf.dest_realm, value);
+        return 0;
+    }
 
-    /* Create Service-Unit AVP (grouped) */
-    CHECK_FCT(fd_msg_avp_new(service_unit_avp, 0, &avp_su));
-    
-    /* Add CC-Total-Octets inside Service-Unit */
-    CHECK_FCT(fd_msg_avp_new(avp_cc_total_octets, 0, &avp_octets));
-    val.u64 = octets;
-    CHECK_FCT(fd_msg_avp_setvalue(avp_octets, &val));
-    CHECK_FCT(fd_msg_avp_add(avp_su, MSG_BRW_LAST_CHILD, avp_octets));
-    
-    /* Add Service-Unit to message */
-    CHECK_FCT(fd_msg_avp_add(msg, MSG_BRW_LAST_CHILD, avp_su));
-    
+    fd_log_error("Unknown client configuration key '%s'\n", key);
+    return EINVAL;
+}
+
+static void sched_post(struct subscriber *sub, uint32_t request_number, int success);
+
+static int window_try(void)
+{
+    unsigned cur = atomic_load_explicit(&window.in_flight, memory_order_relaxed);
+
+    while (cur < client_conf.window) {
+        if (atomic_compare_exchange_weak(&window.in_flight, &cur, cur + 1))
+            return 1;
+    }
     return 0;
 }
 
-/* Callback when CCA is received */
-static void cca_cb(void *data, struct msg **msg)
+/* Take a slot in the window, waiting for one if needed; ECANCELED when the client stops */
+static int window_acquire(void)
 {
-    struct msg *qry;
-    struct avp *a, *child;
-    struct avp_hdr *hdr;
-    uint32_t result_code = 0;
-    uint32_t request_type = 0;
+    uint64_t start;
 
-    if (!msg || !*msg) {
-        fd_log_error("Invalid message in CCA callback\n");
+    if (!client_conf.window || window_try())
+        return 0;
+
+    atomic_fetch_add_explicit(&window.stalls, 1, memory_order_relaxed);
+    start = now_ns();
+    pthread_mutex_lock(&window.lock);
+    atomic_fetch_add(&window.waiters, 1);
+    while (keep_running && !window_try()) {
+        /* Bounded wait, so that a shutdown is noticed */
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&window.cond, &window.lock, &ts);
+    }
+    atomic_fetch_sub(&window.waiters, 1);
+    pthread_mutex_unlock(&window.lock);
+    atomic_fetch_add_explicit(&window.stall_ns, now_ns() - start, memory_order_relaxed);
+    return keep_running ? 0 : ECANCELED;
+}
+
+static void window_release(void)
+{
+    if (!client_conf.window)
         return;
+    atomic_fetch_sub(&window.in_flight, 1);
+    if (atomic_load(&window.waiters)) {
+        pthread_mutex_lock(&window.lock);
+        pthread_cond_signal(&window.cond);
+        pthread_mutex_unlock(&window.lock);
     }
+}
+
+/* Absolute (CLOCK_REALTIME) deadline of a transmission, as fd_msg_send_timeout wants it */
+static void request_deadline(struct timespec *ts)
+{
+    uint64_t t;
 
-    qry = *msg;
-    fd_log_notice("Gy client: received CCA\n");
+    clock_gettime(CLOCK_REALTIME, ts);
+    t = (uint64_t)ts->tv_sec * NS_PER_SEC + ts->tv_nsec + (uint64_t)(client_conf.request_timeout * NS_PER_SEC);
+    ts->tv_sec = t / NS_PER_SEC;
+    ts->tv_nsec = t % NS_PER_SEC;
+}
 
-    /* Look for Result-Code */
-    if (fd_msg_search_avp(qry, avp_result_code, &a) == 0 && a) {
-        if (fd_msg_avp_hdr(a, &hdr) == 0) {
-            result_code = hdr->avp_value->u32;
-            fd_log_notice("CCA Result-Code: %u\n", result_code);
-        }
+static void cca_cb(void *data, struct msg **msg);
+
+/*
+ * No answer before the deadline: send the same request again with the T
+ * flag (RFC 6733, 3), keeping its End-to-End Identifier so that the OCS
+ * can recognize it, until retransmits is exhausted.
+ */
+static void ccr_expired(void *data, DiamId_t sentto, size_t senttolen, struct msg **req)
+{
+    struct ccr_ctx *ctx = data;
+    struct subscriber *sub = ctx->sub;
+    struct msg_hdr *hdr;
+    struct timespec ts;
+
+    /* The retransmission is routed again, most likely to the same OCS */
+    if (ctx->peer != BALANCE_NONE) {
+        balance_expired(ctx->peer, now_ns() - ctx->routed_ns);
+        ctx->peer = BALANCE_NONE;
     }
 
-    /* Look for CC-Request-Type */
-    if (fd_msg_search_avp(qry, avp_cc_request_type, &a) == 0 && a) {
-        if (fd_msg_avp_hdr(a, &hdr) == 0) {
-            request_type = hdr->avp_value->u32;
+    if (ctx->attempts <= client_conf.retransmits && keep_running && fd_msg_hdr(*req, &hdr) == 0) {
+        hdr->msg_flags |= CMD_FLAG_RETRANSMIT;
+        request_deadline(&ts);
+        ctx->attempts++;
+        /* The request still carries the callbacks of the first send, which fd_msg_send_timeout will not overwrite */
+        if (fd_msg_anscb_reset(*req, 1, 1) == 0 && fd_msg_send_timeout(req, cca_cb, ctx, ccr_expired, &ts) == 0) {
+            atomic_fetch_add_explicit(&ccr_retransmits, 1, memory_order_relaxed);
+            evlog_emit(EVL_INFO, EV_CCR_RETRANSMIT, ctx->request_type, ctx->request_number, sub->sess_hash, ctx->attempts, 0, 0);
+            return;
         }
+        ctx->attempts--;
     }
 
-    /* Look for Granted-Service-Unit */
-    if (fd_msg_search_avp(qry, avp_granted_service_unit, &a) == 0 && a) {
-        /* Search for CC-Total-Octets inside Granted-Service-Unit */
-        if (fd_msg_browse(a, MSG_BRW_FIRST_CHILD, &child, NULL) == 0) {
-            while (child != NULL) {
-                if (fd_msg_avp_hdr(child, &hdr) == 0) {
-                    if (hdr->avp_code == 421) { /* CC-Total-Octets */
-                        granted_quota = hdr->avp_value->u64;
-                        fd_log_notice("CCA: Granted quota: %lu bytes (%.1f GB)\n", granted_quota, (double)granted_quota / (1024*1024*1024));
-                        break;
-                    }
-                }
-                if (fd_msg_browse(child, MSG_BRW_NEXT, &child, NULL) != 0) {
-                    break;
-                }
-            }
-        }
+    atomic_fetch_add_explicit(&ccr_timeouts, 1, memory_order_relaxed);
+    metrics_answer(ctx->request_type, METRICS_NO_ANSWER, 0);
+    evlog_emit(EVL_ERROR, EV_CCR_TIMEOUT, ctx->request_type, ctx->request_number, sub->sess_hash, ctx->attempts, 0, 0);
+    pool_put(&ctx_pool, ctx);
+    window_release();
+    atomic_store_explicit(&sub->pending, 0, memory_order_release);
+    if (*req) {
+        fd_msg_free(*req);
+        *req = NULL;
     }
+}
 
-    const char *request_name;
-    if (request_type == 1) {
-        request_name = "INITIAL";
-    } else if (request_type == 2) {
-        request_name = "UPDATE";
-    } else if (request_type == 3) {
-        request_name = "TERMINATE";
-    } else {
-        request_name = "UNKNOWN";
+/* Send counters, printed with the final summaries */
+static void window_log_stats(void)
+{
+    if (atomic_load(&rar_received))
+        fd_log_notice("Gy client re-authorizations: %lu RARs received (%lu for unknown sessions), %lu CCR-U sent on RAR in load mode\n",
+                      (unsigned long)atomic_load(&rar_received), (unsigned long)atomic_load(&rar_unknown),
+                      (unsigned long)atomic_load(&ccr_reauth));
+    fd_log_notice("Gy client send path: window %u, %lu stalls (%.1f s waiting), %lu retransmissions, %lu timeouts\n",
+                  client_conf.window, (unsigned long)atomic_load(&window.stalls),
+                  (double)atomic_load(&window.stall_ns) / NS_PER_SEC,
+                  (unsigned long)atomic_load(&ccr_retransmits), (unsigned long)atomic_load(&ccr_timeouts));
+    balance_log_stats();
+}
+
+/* Callback when CCA is received */
+static void cca_cb(void *data, struct msg **msg)
+{
+    struct ccr_ctx *ctx = data;
+    struct subscriber *sub = ctx ? ctx->sub : NULL;
+    struct cca_view cca;
+    uint32_t request_type = 0, request_number = 0, validity;
+    uint64_t rtt = 0, granted;
+    unsigned i;
+
+    if (ctx) {
+        rtt = now_ns() - ctx->sent_ns;
+        request_type = ctx->request_type;
+        request_number = ctx->request_number;
+        latency_record(request_type, rtt);
+        metrics_latency(request_type, rtt);
+        if (ctx->peer != BALANCE_NONE)
+            balance_answered(ctx->peer, now_ns() - ctx->routed_ns);
+        pool_put(&ctx_pool, ctx);
+        window_release();
     }
-    
-    if (result_code == 2001) {
-        fd_log_notice("CCA: %s request approved successfully\n", request_name);
-    } else {
-        fd_log_notice("CCA: %s request failed with code %u\n", request_name, result_code);
+
+    if (!msg || !*msg) {
+        fd_log_error("Invalid message in CCA callback\n");
+        return;
+    }
+
+    /* Decode Result-Code, CC-Request-Type and Granted-Service-Unit in one pass */
+    if (gy_decode_cca(*msg, &cca) != 0)
+        memset(&cca, 0, sizeof(cca));
+
+    granted = cca.gsu.present ? cca.gsu.total_octets : 0;
+    for (i = 0; i < cca.mscc_count; i++)
+        granted += cca.mscc[i].gsu.present ? cca.mscc[i].gsu.total_octets : 0;
+
+    if (cca.gsu.present && sub)
+        atomic_store_explicit(&sub->granted_quota, cca.gsu.total_octets, memory_order_relaxed);
+
+    /* One grant per rating group; the session total is what the user will consume */
+    validity = cca.validity_time;
+    if (cca.mscc_count && sub) {
+        uint64_t total = 0;
+        for (i = 0; i < cca.mscc_count; i++) {
+            const struct gy_mscc *m = &cca.mscc[i];
+            uint64_t g = m->gsu.present ? m->gsu.total_octets : 0;
+            if (m->rating_group >= 1 && m->rating_group <= GY_MSCC_MAX)
+                atomic_store_explicit(&sub->granted_rg[m->rating_group - 1], g, memory_order_relaxed);
+            total += g;
+            if (m->result_code == 4012)
+                atomic_store_explicit(&sub->credit_exhausted, 1, memory_order_relaxed);
+            /* The first group to expire drives the next update */
+            if (m->validity_time && (!validity || m->validity_time < validity))
+                validity = m->validity_time;
+        }
+        atomic_store_explicit(&sub->granted_quota, total, memory_order_relaxed);
     }
+    if (sub)
+        atomic_store_explicit(&sub->validity_time, validity, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&cca_received, 1, memory_order_relaxed);
+    metrics_answer(request_type, cca.result_code, granted);
+    atomic_fetch_add_explicit(&units_answered, cca.mscc_count ? cca.mscc_count : 1, memory_order_relaxed);
+    if (cca.result_code != 2001)
+        atomic_fetch_add_explicit(&cca_failed, 1, memory_order_relaxed);
+    if (cca.result_code == 4012 && sub)   /* DIAMETER_CREDIT_LIMIT_REACHED */
+        atomic_store_explicit(&sub->credit_exhausted, 1, memory_order_relaxed);
+
+    evlog_emit(cca.result_code == 2001 ? EVL_INFO : EVL_ERROR, EV_CCA_RECEIVED, cca.cc_request_type, cca.result_code,
+               sub ? sub->sess_hash : 0, cca.gsu.total_octets, rtt, 0);
+
+    /* Sessions mode: the grant decides when the next CCR goes */
+    if (sub && sub->owner && (request_type == 1 || request_type == 2))
+        sched_post(sub, request_number, cca.result_code == 2001);
+    /* Replay mode: the next CCR of the session may go */
+    if (sub)
+        atomic_store_explicit(&sub->pending, 0, memory_order_release);
     
     fd_msg_free(*msg);
     *msg = NULL;
 }
 
-/* Function to send a CCR */
-static int send_ccr(uint32_t request_type, uint32_t request_number)
+static void sched_reauth(struct subscriber *sub);
+static void load_reauth_post(struct subscriber *sub);
+
+/*
+ * Re-Auth-Request from the OCS: answer it at once, then have the session
+ * report its usage and ask for quota again with a CCR-U. The sender of the
+ * CCRs does that (the scheduler thread, or the load generator on its next
+ * tick), so the session's CCRs stay in order. In demo and replay modes the
+ * RAR is only answered.
+ */
+static int rar_cb(struct msg **msg, struct avp *avp, struct session *sess, void *opaque, enum disp_action *act)
+{
+    struct sess_state *st = NULL;
+    struct subscriber *sub = NULL;
+    uint32_t result_code = 2001;
+    uint64_t sess_hash = 0;
+    os0_t sid;
+    size_t sidlen;
+    int ret;
+
+    if (!msg || !*msg)
+        return EINVAL;
+    atomic_fetch_add_explicit(&rar_received, 1, memory_order_relaxed);
+
+    /* Retrieving the state takes it out of the session: put it back */
+    if (sess && fd_sess_state_retrieve(sess_hdl, sess, &st) == 0 && st) {
+        sub = st->sub;
+        if (fd_sess_state_store(sess_hdl, sess, &st) != 0)
+            free(st);
+    }
+    if (sub) {
+        sess_hash = sub->sess_hash;
+        if (sub->owner)
+            sched_reauth(sub);
+        else if (client_conf.mode == MODE_LOAD)
+            load_reauth_post(sub);
+    } else {
+        result_code = 5002; /* DIAMETER_UNKNOWN_SESSION_ID */
+        atomic_fetch_add_explicit(&rar_unknown, 1, memory_order_relaxed);
+        if (sess && fd_sess_getsid(sess, &sid, &sidlen) == 0)
+            sess_hash = gy_hash(sid, sidlen);
+    }
+
+    evlog_emit(result_code == 2001 ? EVL_INFO : EVL_ERROR, EV_RAR_RECEIVED, 0, result_code, sess_hash, 0, 0, 0);
+    CHECK_FCT(gy_build_raa(msg, result_code));
+    if ((ret = fd_msg_send(msg, NULL, NULL)) != 0)
+        evlog_emit(EVL_ERROR, EV_SEND_FAILED, 0, ret, sess_hash, 0, 0, 0);
+    return ret;
+}
+
+/*
+ * Routing out of every request: ours are recognized by their answer
+ * callback. A CCR goes to the OCS its session is pinned to, or, for a new
+ * session or when that OCS is gone, to the cheapest one, which the session
+ * is pinned to from then on.
+ */
+static int ccr_route(void *cbdata, struct msg **pmsg, struct fd_list *candidates)
+{
+    void (*anscb)(void *, struct msg **) = NULL;
+    void (*expirecb)(void *, DiamId_t, size_t, struct msg **) = NULL;
+    struct ccr_ctx *ctx = NULL;
+    int peer;
+
+    if (fd_msg_anscb_get(*pmsg, &anscb, &expirecb, (void **)&ctx) != 0 || anscb != cca_cb || !ctx)
+        return 0;
+
+    peer = balance_route(candidates, atomic_load_explicit(&ctx->sub->peer, memory_order_relaxed));
+    if (peer != BALANCE_NONE) {
+        atomic_store_explicit(&ctx->sub->peer, peer, memory_order_relaxed);
+        ctx->routed_ns = now_ns();
+    }
+    ctx->peer = peer;
+    return 0;
+}
+
+/* Session states are only freed here when freeDiameter destroys a session still holding one */
+static void sess_state_cleanup(struct sess_state *st, os0_t sid, void *opaque)
+{
+    free(st);
+}
+
+/*
+ * Function to send a CCR for one subscriber. With rating groups for the
+ * subscriber and group_used given (load, sessions and replay modes), the
+ * request is split evenly over that many MSCC (Rating-Group 1..K) and
+ * group_used[g] is the usage of group g+1.
+ */
+static int send_ccr(struct subscriber *sub, uint32_t request_type, uint64_t request_quota, uint64_t used_quota,
+                    const uint64_t *group_used)
 {
     struct msg *req = NULL;
-    struct avp *avp;
     struct session *sess;
-    union avp_value val;
+    struct ccr_ctx *ctx;
+    struct gy_ccr_fields f;
+    struct gy_ccr_mscc mscc[GY_MSCC_MAX];
     os0_t sid;
     size_t sidlen;
-    static struct session *global_sess = NULL;
-    
-    const char *request_type_name;
-    uint64_t request_quota = 0;
-    uint64_t used_quota = 0;
-    
-    switch(request_type) {
-        case 1: 
-        request_type_name = "INITIAL";
-            request_quota = quotas[rand() % 3];
-            break;
-            case 2: 
-            request_type_name = "UPDATE";
-            request_quota = quotas[rand() % 3];
-            used_quota = 800ULL * 1024 * 1024;     /* Report 800MB used */
-            total_used += used_quota;
-            break;
-            case 3: 
-            request_type_name = "TERMINATE";
-            used_quota = 400ULL * 1024 * 1024;     /* Report remaining 400MB used */
-            total_used += used_quota;
-            break;
-        default: 
-            request_type_name = "UNKNOWN"; 
-            break;
-    }
+    uint32_t request_number = sub->request_number++;
+    int ret;
     
-    fd_log_notice("\n=== Gy client: creating CCR (%s) ===\n", request_type_name);
-    
-    if (request_type == 1) {
-        fd_log_notice("Scenario: User starts browsing internet\n");
-        fd_log_notice("CCRI: \"Give me %.1f GB data quota\"\n", (double)request_quota / (1024*1024*1024));
-    } else if (request_type == 2) {
-        fd_log_notice("Scenario: User has used 800MB, quota running low\n");
-        fd_log_notice("CCRU: \"I used 800MB, give me more quota\"\n");
-    } else if (request_type == 3) {
-        fd_log_notice("Scenario: User disconnects\n");
-        fd_log_notice("CCRT: \"Session ended, I used %.1fGB total\"\n", (double)total_used / (1024*1024*1024));
-    }
+    sub->total_used += used_quota;
     
-    /* Create or reuse session */
+    /* Create or reuse session; the session state leads RARs to the subscriber */
     if (request_type == 1) {
-        CHECK_FCT(fd_sess_new(&global_sess, fd_g_config->cnf_diamid, fd_g_config->cnf_diamid_len, (os0_t)"gy-demo", strlen("gy-demo")));
+        struct sess_state *st = NULL;
+        if (sub->sess) {
+            if (fd_sess_state_retrieve(sess_hdl, sub->sess, &st) == 0)
+                free(st);
+            (void) fd_sess_reclaim(&sub->sess);
+        }
+        CHECK_FCT(fd_sess_new(&sub->sess, fd_g_config->cnf_diamid, fd_g_config->cnf_diamid_len, (os0_t)"gy-demo", strlen("gy-demo")));
+        CHECK_FCT(fd_sess_getsid(sub->sess, &sid, &sidlen));
+        sub->sess_hash = gy_hash(sid, sidlen);
+        atomic_store_explicit(&sub->peer, BALANCE_NONE, memory_order_relaxed);
+        CHECK_MALLOC(st = malloc(sizeof(*st)));
+        st->sub = sub;
+        CHECK_FCT_DO(fd_sess_state_store(sess_hdl, sub->sess, &st), free(st));
     }
-    sess = global_sess;
+    sess = sub->sess;
+    CHECK_PARAMS(sess);
     
     /* Get session ID */
     CHECK_FCT(fd_sess_getsid(sess, &sid, &sidlen));
     
+    /* Fill the variable fields of the request */
+    memset(&f, 0, sizeof(f));
+    f.session_id = sid;
+    f.session_id_len = sidlen;
+    f.cc_request_type = request_type;
+    f.cc_request_number = request_number;
+    f.msisdn = (uint8_t *)sub->msisdn;
+    f.msisdn_len = sub->msisdn_len;
+
+    if (sub->rating_groups && group_used) {
+        unsigned g;
+        memset(mscc, 0, sizeof(mscc));
+        for (g = 0; g < sub->rating_groups; g++) {
+            mscc[g].rating_group = g + 1;
+            if (request_type == 1 || request_type == 2) {
+                mscc[g].has_rsu = 1;
+                mscc[g].rsu_octets = request_quota / sub->rating_groups;
+            }
+            if (request_type == 2 || request_type == 3) {
+                mscc[g].has_usu = 1;
+                mscc[g].usu_octets = group_used[g];
+            }
+        }
+        f.mscc_count = sub->rating_groups;
+        f.mscc = mscc;
+    } else {
+        /* Add quota request for INITIAL and UPDATE */
+        if (request_type == 1 || request_type == 2) {
+            f.has_rsu = 1;
+            f.rsu_octets = request_quota;
+        }
+
+        /* Add usage report for UPDATE and TERMINATE */
+        if (request_type == 2 || request_type == 3) {
+            f.has_usu = 1;
+            f.usu_octets = used_quota;
+        }
+    }
+    
     /* Create the request */
-    CHECK_FCT(fd_msg_new(ccr_cmd, MSGFL_ALLOC_ETEID, &req));
-
-    /* Add Session-Id */
-    CHECK_FCT(fd_msg_avp_new(avp_session_id, 0, &avp));
-    val.os.data = sid;
-    val.os.len = sidlen;
-    CHECK_FCT(fd_msg_avp_setvalue(avp, &val));
-    CHECK_FCT(fd_msg_avp_add(req, MSG_BRW_LAST_CHILD, avp));
-
-    /* Add Origin-Host */
-    CHECK_FCT(fd_msg_avp_new(avp_origin_host, 0, &avp));
-    val.os.data = (unsigned char *)fd_g_config->cnf_diamid;
-    val.os.len = fd_g_config->cnf_diamid_len;
-    CHECK_FCT(fd_msg_avp_setvalue(avp, &val));
-    CHECK_FCT(fd_msg_avp_add(req, MSG_BRW_LAST_CHILD, avp));
-
-    /* Add Origin-Realm */
-    CHECK_FCT(fd_msg_avp_new(avp_origin_realm, 0, &avp));
-    val.os.data = (unsigned char *)fd_g_config->cnf_diamrlm;
-    val.os.len = fd_g_config->cnf_diamrlm_len;
-    CHECK_FCT(fd_msg_avp_setvalue(avp, &val));
-    CHECK_FCT(fd_msg_avp_add(req, MSG_BRW_LAST_CHILD, avp));
-
-    /* Add Destination-Realm */
-    CHECK_FCT(fd_msg_avp_new(avp_dest_realm, 0, &avp));
-    val.os.data = (unsigned char *)"dpc.mnc005.mcc226.3gppnetwork.org";
-    val.os.len = strlen("dpc.mnc005.mcc226.3gppnetwork.org");
-    CHECK_FCT(fd_msg_avp_setvalue(avp, &val));
-    CHECK_FCT(fd_msg_avp_add(req, MSG_BRW_LAST_CHILD, avp));
-
-    /* Add Auth-Application-Id (4 for DCCA/Gy) */
-    CHECK_FCT(fd_msg_avp_new(avp_auth_app_id, 0, &avp));
-    val.u32 = 4;
-    CHECK_FCT(fd_msg_avp_setvalue(avp, &val));
-    CHECK_FCT(fd_msg_avp_add(req, MSG_BRW_LAST_CHILD, avp));
+    CHECK_FCT(gy_build_ccr(&f, &req));
     
-    /* Add CC-Request-Type */
-    CHECK_FCT(fd_msg_avp_new(avp_cc_request_type, 0, &avp));
-    val.u32 = request_type;
-    CHECK_FCT(fd_msg_avp_setvalue(avp, &val));
-    CHECK_FCT(fd_msg_avp_add(req, MSG_BRW_LAST_CHILD, avp));
-
-    /* Add CC-Request-Number */
-    CHECK_FCT(fd_msg_avp_new(avp_cc_request_number, 0, &avp));
-    val.u32 = request_number;
-    CHECK_FCT(fd_msg_avp_setvalue(avp, &val));
-    CHECK_FCT(fd_msg_avp_add(req, MSG_BRW_LAST_CHILD, avp));
-
-    /* Add Service-Context-Id */
-    CHECK_FCT(fd_msg_avp_new(avp_service_context_id, 0, &avp));
-    val.os.data = (unsigned char *)"32251@3gpp.org";
-    val.os.len = strlen("32251@3gpp.org");
-    CHECK_FCT(fd_msg_avp_setvalue(avp, &val));
-    CHECK_FCT(fd_msg_avp_add(req, MSG_BRW_LAST_CHILD, avp));
-
-    /* Add quota request for INITIAL and UPDATE */
-    if (request_type == 1 || request_type == 2) {
-        fd_log_notice("Requesting quota: %.1f GB\n", (double)request_quota / (1024*1024*1024));
-        add_service_unit(req, avp_requested_service_unit, request_quota);
+    /* Send the request, stamped with its send time */
+    CHECK_MALLOC_DO(ctx = pool_get(&ctx_pool), { fd_msg_free(req); return ENOMEM; });
+    ctx->sub = sub;
+    ctx->request_type = request_type;
+    ctx->request_number = request_number;
+    ctx->attempts = 1;
+    ctx->peer = BALANCE_NONE;
+    if ((ret = window_acquire()) != 0) {
+        pool_put(&ctx_pool, ctx);
+        fd_msg_free(req);
+        return ret;
     }
-    
-    /* Add usage report for UPDATE and TERMINATE */
-    if (request_type == 2 || request_type == 3) {
-        fd_log_notice("Reporting usage: %.1f GB\n", (double)used_quota / (1024*1024*1024));
-        add_service_unit(req, avp_used_service_unit, used_quota);
+    ctx->sent_ns = now_ns();
+    if (client_conf.request_timeout > 0) {
+        struct timespec ts;
+        request_deadline(&ts);
+        ret = fd_msg_send_timeout(&req, cca_cb, ctx, ccr_expired, &ts);
+    } else {
+        ret = fd_msg_send(&req, cca_cb, ctx);
     }
+    if (ret != 0) {
+        pool_put(&ctx_pool, ctx);
+        window_release();
+        evlog_emit(EVL_ERROR, EV_SEND_FAILED, request_type, ret, sub->sess_hash, 0, 0, 0);
+        return ret;
+    }
+    atomic_fetch_add_explicit(&ccr_sent[request_type <= 3 ? request_type : 0], 1, memory_order_relaxed);
+    metrics_request(request_type, used_quota);
     
-    /* Send the request */
-    CHECK_FCT(fd_msg_send(&req, cca_cb, NULL));
-    
-    fd_log_notice("CCR (%s) sent successfully\n", request_type_name);
+    evlog_emit(EVL_INFO, EV_CCR_SENT, request_type, request_number, sub->sess_hash, request_quota, used_quota, sub->total_used);
     return 0;
 }
+
+/* Subscriber n of the run gets MSISDN msisdn_base + n */
+static void subscriber_init(struct subscriber *sub, uint32_t n)
+{
+    sub->msisdn_len = snprintf(sub->msisdn, sizeof(sub->msisdn), "%llu",
+                               (unsigned long long)(client_conf.msisdn_base + n));
+    sub->rating_groups = client_conf.rating_groups;
+    atomic_init(&sub->peer, BALANCE_NONE);
+}
+
 /* Repeat the entire sequence multiple times */
-static void* client_thread(void *arg)
+static void demo_run(void)
 {
     int sequence_count = 0;
-    uint32_t request_number = 0;
     const int MAX_SEQUENCES = 10;
+    static struct subscriber demo_sub;
     
-    srand(time(NULL));
+    subscriber_init(&demo_sub, 0);
     // time_t start_time = time(NULL);
-    /* Wait for daemon to be ready */
-    CHECK_FCT_DO(fd_core_waitstartcomplete(), return NULL);
-    sleep(5);
-    
     while (keep_running && sequence_count < MAX_SEQUENCES) {
         fd_log_notice("\n+++ STARTING SEQUENCE %d of %d +++\n", sequence_count + 1, MAX_SEQUENCES);
         
         /* Reset usage tracking for each sequence */
-        total_used = 0;
-        granted_quota = 0;
+        demo_sub.total_used = 0;
+        atomic_store(&demo_sub.granted_quota, 0);
         
         /* INITIAL REQUEST */
         if (keep_running) {
+            uint64_t request_quota = quotas[rand() % 3];
             fd_log_notice("\n--- PHASE 1: Session Establishment ---\n");
-            if (send_ccr(1, request_number) != 0) {
+            fd_log_notice("Scenario: User starts browsing internet\n");
+            fd_log_notice("CCRI: \"Give me %.1f GB data quota\"\n", (double)request_quota / (1024*1024*1024));
+            if (send_ccr(&demo_sub, 1, request_quota, 0, NULL) != 0) {
                 fd_log_error("Failed to send CCR INITIAL in sequence %d\n", sequence_count + 1);
             }
-            request_number++;
             sleep(2);
         }
         
         /* UPDATE REQUEST */
         if (keep_running) {
             fd_log_notice("\n--- PHASE 2: Quota Update ---\n");
-            if (send_ccr(2, request_number) != 0) {
+            fd_log_notice("Scenario: User has used 800MB, quota running low\n");
+            fd_log_notice("CCRU: \"I used 800MB, give me more quota\"\n");
+            /* Report 800MB used */
+            if (send_ccr(&demo_sub, 2, quotas[rand() % 3], 800ULL * 1024 * 1024, NULL) != 0) {
                 fd_log_error("Failed to send CCR UPDATE in sequence %d\n", sequence_count + 1);
             }
-            request_number++;
             sleep(2);
         }
         
         /* TERMINATE REQUEST */
         if (keep_running) {
             fd_log_notice("\n--- PHASE 3: Session Termination ---\n");
-            if (send_ccr(3, request_number) != 0) {
+            fd_log_notice("Scenario: User disconnects\n");
+            /* Report remaining 400MB used */
+            if (send_ccr(&demo_sub, 3, 0, 400ULL * 1024 * 1024, NULL) != 0) {
                 fd_log_error("Failed to send CCR TERMINATE in sequence %d\n", sequence_count + 1);
             }
-            request_number++;
         }
         
         sequence_count++;
         
         fd_log_notice("\n+++ SEQUENCE %d COMPLETE +++\n", sequence_count);
-        fd_log_notice("Total data used this session: %.1f GB\n", (double)total_used / (1024*1024*1024));
+        fd_log_notice("Total data used this session: %.1f GB\n", (double)demo_sub.total_used / (1024*1024*1024));
         // time_t end_time = time(NULL);
         // fd_log_notice("Total execution time: %ld seconds\n", end_time - start_time);
     }
+}
+
+/* Send the next CCR of a subscriber's I/U.../T cycle */
+static int load_step(struct subscriber *sub, uint64_t now, uint64_t step_ns)
+{
+    uint64_t granted = atomic_load_explicit(&sub->granted_quota, memory_order_relaxed);
+    uint64_t group_used[GY_MSCC_MAX];
+    unsigned g;
+    int ret;
+
+    sub->next_due_ns = now + step_ns;
+
+    /* The simulated user consumes the whole of its last grant, group by group */
+    for (g = 0; g < client_conf.rating_groups; g++)
+        group_used[g] = atomic_load_explicit(&sub->granted_rg[g], memory_order_relaxed);
+
+    if (!sub->active) {
+        sub->request_number = 0;
+        sub->updates_sent = 0;
+        sub->total_used = 0;
+        atomic_store_explicit(&sub->granted_quota, 0, memory_order_relaxed);
+        atomic_store_explicit(&sub->credit_exhausted, 0, memory_order_relaxed);
+        for (g = 0; g < client_conf.rating_groups; g++)
+            atomic_store_explicit(&sub->granted_rg[g], 0, memory_order_relaxed);
+        ret = send_ccr(sub, 1, quotas[rand() % 3], 0, group_used);
+        if (ret == 0)
+            sub->active = 1;
+        return ret;
+    }
+
+    /* The simulated user consumed the whole of its last grant; no more credit ends the session */
+    if (sub->updates_sent < client_conf.updates
+        && !atomic_load_explicit(&sub->credit_exhausted, memory_order_relaxed)) {
+        sub->updates_sent++;
+        return send_ccr(sub, 2, quotas[rand() % 3], granted, group_used);
+    }
+
+    sub->active = 0;
+    return send_ccr(sub, 3, 0, granted, group_used);
+}
+
+/* A RAR for a subscriber in load mode: its CCR-U takes the next tick */
+static void load_reauth_post(struct subscriber *sub)
+{
+    pthread_mutex_lock(&reauth_queue.lock);
+    if (!sub->queued) {
+        sub->queued = 1;
+        sub->inbox_next = reauth_queue.head;
+        reauth_queue.head = sub;
+    }
+    pthread_mutex_unlock(&reauth_queue.lock);
+}
+
+static struct subscriber *load_reauth_pop(void)
+{
+    struct subscriber *sub;
+
+    pthread_mutex_lock(&reauth_queue.lock);
+    if ((sub = reauth_queue.head) != NULL) {
+        reauth_queue.head = sub->inbox_next;
+        sub->queued = 0;
+    }
+    pthread_mutex_unlock(&reauth_queue.lock);
+    return sub;
+}
+
+/* CCR-U asked by a RAR: report the usage of the last grant and ask again, outside of the I:U:T schedule */
+static int load_reauth(struct subscriber *sub, uint64_t now, uint64_t step_ns)
+{
+    uint64_t granted = atomic_load_explicit(&sub->granted_quota, memory_order_relaxed);
+    uint64_t group_used[GY_MSCC_MAX];
+    unsigned g;
+
+    sub->next_due_ns = now + step_ns;
+    for (g = 0; g < client_conf.rating_groups; g++)
+        group_used[g] = atomic_load_explicit(&sub->granted_rg[g], memory_order_relaxed);
+    atomic_fetch_add_explicit(&ccr_reauth, 1, memory_order_relaxed);
+    return send_ccr(sub, 2, quotas[rand() % 3], granted, group_used);
+}
+
+/*
+ * Open-loop load generator: CCRs are emitted at the configured rate whatever
+ * the answers do. Each tick sends the next message of the first subscriber
+ * (round robin) whose session timing allows it.
+ */
+static void load_run(void)
+{
+    struct subscriber *subs;
+    uint32_t n = client_conf.subscribers, cursor = 0, i;
+    uint64_t interval_ns = (uint64_t)(NS_PER_SEC / client_conf.rate);
+    uint64_t step_ns = (uint64_t)(client_conf.session_duration * NS_PER_SEC) / (client_conf.updates + 1);
+    uint64_t start, end = 0, next_tick, idle_ticks = 0, errors = 0;
+    double elapsed;
+
+    CHECK_MALLOC_DO(subs = calloc(n, sizeof(*subs)), return);
+    for (i = 0; i < n; i++)
+        subscriber_init(&subs[i], i);
+
+    fd_log_notice("Gy load generator: %u subscribers, %.1f CCR/s, mix I:U:T = 1:%u:1, session duration %.1fs, %u rating groups per CCR\n",
+                  n, client_conf.rate, client_conf.updates, client_conf.session_duration, client_conf.rating_groups);
+
+    start = next_tick = now_ns();
+    if (client_conf.duration > 0)
+        end = start + (uint64_t)(client_conf.duration * NS_PER_SEC);
+
+    while (keep_running && (!end || next_tick < end)) {
+        struct timespec ts = { .tv_sec = next_tick / NS_PER_SEC, .tv_nsec = next_tick % NS_PER_SEC };
+        struct subscriber *reauth;
+        uint64_t now;
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        next_tick += interval_ns;
+        now = now_ns();
+
+        /* A session re-authorized by the OCS goes first; the tick is its CCR-U */
+        if ((reauth = load_reauth_pop()) != NULL && reauth->active) {
+            if (load_reauth(reauth, now, step_ns) != 0)
+                errors++;
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            struct subscriber *sub = &subs[cursor];
+            cursor = (cursor + 1 == n) ? 0 : cursor + 1;
+            if (sub->next_due_ns <= now) {
+                if (load_step(sub, now, step_ns) != 0)
+                    errors++;
+                break;
+            }
+        }
+        if (i == n)
+            idle_ticks++;
+    }
+
+    elapsed = (double)(now_ns() - start) / NS_PER_SEC;
+    fd_log_notice("Gy load generator stopped after %.1fs: sent I=%lu U=%lu T=%lu, answers=%lu (failed %lu), send errors=%lu, idle ticks=%lu\n",
+                  elapsed,
+                  (unsigned long)atomic_load(&ccr_sent[1]), (unsigned long)atomic_load(&ccr_sent[2]),
+                  (unsigned long)atomic_load(&ccr_sent[3]), (unsigned long)atomic_load(&cca_received),
+                  (unsigned long)atomic_load(&cca_failed), (unsigned long)errors, (unsigned long)idle_ticks);
+    fd_log_notice("Gy load generator: %.1f answers/s, %.1f rated units/s\n",
+                  atomic_load(&cca_received) / elapsed, atomic_load(&units_answered) / elapsed);
+    window_log_stats();
+    if (idle_ticks)
+        fd_log_notice("Target rate not reachable with %u subscribers and %.1fs sessions\n", n, client_conf.session_duration);
+    if (atomic_load(&window.stalls))
+        fd_log_notice("The window was full %lu times: the OCS does not keep up with %.1f CCR/s\n",
+                      (unsigned long)atomic_load(&window.stalls), client_conf.rate);
+
+    /* Sessions may still be referenced by pending answers: keep them allocated */
+}
+
+/*
+ * Sessions mode. The subscribers are split over scheduler threads, each
+ * with its own timer wheel holding one timer per subscriber. A session
+ * starts with a CCR-I. It then consumes its grant at consumption_rate and
+ * sends a CCR-U once update_threshold of the grant is used, or when the
+ * Validity-Time of the grant expires, whichever comes first. After
+ * session_duration it ends with a CCR-T and starts again session_gap later.
+ * Answers arrive on freeDiameter threads. They go to the owning scheduler
+ * through a small inbox, and the scheduler re-arms the timer.
+ */
+#define SCHED_TICK_NS 1000000ULL   /* 1 ms */
+
+struct sched_thread {
+    pthread_t thr;
+    pthread_mutex_t lock;
+    struct subscriber *inbox;      /* answered subscribers, protected by lock */
+    struct timer_wheel wheel;
+    unsigned seed;
+    uint64_t end_ns;
+    /* Statistics, owned by the thread */
+    uint64_t sessions;             /* CCR-I sent */
+    uint64_t updates_quota;        /* CCR-U sent because the threshold was reached */
+    uint64_t updates_validity;     /* CCR-U sent because Validity-Time expired */
+    uint64_t updates_reauth;       /* CCR-U sent because of a RAR */
+    uint64_t terminates;
+    uint64_t timeouts;             /* CCRs without answer after answer_timeout */
+    uint64_t refused;              /* sessions ended by a non-2001 answer */
+};
+
+#define sub_of_timer(t) ((struct subscriber *)((char *)(t) - offsetof(struct subscriber, timer)))
+
+static void sched_post(struct subscriber *sub, uint32_t request_number, int success)
+{
+    struct sched_thread *st = sub->owner;
+
+    pthread_mutex_lock(&st->lock);
+    sub->answered_number = request_number;
+    sub->answered_ok = success;
+    sub->answer_posted = 1;
+    if (!sub->queued) {
+        sub->queued = 1;
+        sub->inbox_next = st->inbox;
+        st->inbox = sub;
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+/* A RAR for the subscriber's session: the owning scheduler sends a CCR-U on its next tick */
+static void sched_reauth(struct subscriber *sub)
+{
+    struct sched_thread *st = sub->owner;
+
+    atomic_store_explicit(&sub->reauth, 1, memory_order_relaxed);
+    pthread_mutex_lock(&st->lock);
+    if (!sub->queued) {
+        sub->queued = 1;
+        sub->inbox_next = st->inbox;
+        st->inbox = sub;
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+static inline uint64_t sec_to_ns(double s)
+{
+    return (uint64_t)(s * NS_PER_SEC);
+}
+
+/* An answer arrived: schedule the next CCR from the grant; called with st->lock held */
+static void sched_answered(struct sched_thread *st, struct subscriber *sub, uint64_t now)
+{
+    uint64_t granted = atomic_load_explicit(&sub->granted_quota, memory_order_relaxed);
+    uint32_t validity = atomic_load_explicit(&sub->validity_time, memory_order_relaxed);
+    uint64_t when;
+
+    /* Late answer of a CCR already given up */
+    if (sub->state != SUB_WAITING || sub->answered_number != sub->waiting_number)
+        return;
+
+    sub->state = SUB_ACTIVE;
+    sub->grant_ns = now;
+
+    if (!sub->answered_ok || !granted || atomic_load_explicit(&sub->credit_exhausted, memory_order_relaxed)) {
+        /* Nothing to consume: end the session now */
+        st->refused++;
+        sub->session_end_ns = now;
+        tw_add(&st->wheel, &sub->timer, now);
+        return;
+    }
+
+    when = now + sec_to_ns(granted * client_conf.update_threshold / client_conf.consumption_rate);
+    if (validity && now + validity * NS_PER_SEC < when)
+        when = now + validity * NS_PER_SEC;
+    if (sub->session_end_ns < when)
+        when = sub->session_end_ns;
+    tw_add(&st->wheel, &sub->timer, when);
+}
+
+static void sched_fire(struct tw_timer *t, void *opaque)
+{
+    struct sched_thread *st = opaque;
+    struct subscriber *sub = sub_of_timer(t);
+    uint64_t now = now_ns(), granted, used, elapsed;
+    uint64_t group_used[GY_MSCC_MAX];
+    unsigned g;
+
+    switch (sub->state) {
+        case SUB_IDLE:
+            sub->request_number = 0;
+            sub->total_used = 0;
+            sub->session_end_ns = now + sec_to_ns(client_conf.session_duration);
+            atomic_store_explicit(&sub->reauth, 0, memory_order_relaxed);
+            atomic_store_explicit(&sub->granted_quota, 0, memory_order_relaxed);
+            atomic_store_explicit(&sub->credit_exhausted, 0, memory_order_relaxed);
+            for (g = 0; g < client_conf.rating_groups; g++) {
+                atomic_store_explicit(&sub->granted_rg[g], 0, memory_order_relaxed);
+                group_used[g] = 0;
+            }
+            sub->waiting_number = sub->request_number;
+            sub->state = SUB_WAITING;
+            if (send_ccr(sub, 1, quotas[rand_r(&st->seed) % 3], 0, group_used) != 0) {
+                sub->state = SUB_IDLE;
+                tw_add(&st->wheel, &sub->timer, now + sec_to_ns(client_conf.session_gap));
+                return;
+            }
+            st->sessions++;
+            tw_add(&st->wheel, &sub->timer, now + sec_to_ns(client_conf.answer_timeout));
+            return;
+
+        case SUB_WAITING:
+            /* No answer in time: give the session up */
+            st->timeouts++;
+            sub->state = SUB_IDLE;
+            tw_add(&st->wheel, &sub->timer, now + sec_to_ns(client_conf.session_gap));
+            return;
+
+        case SUB_ACTIVE:
+            break;
+    }
+
+    /* What the user consumed of its grant since it arrived */
+    granted = atomic_load_explicit(&sub->granted_quota, memory_order_relaxed);
+    elapsed = now - sub->grant_ns;
+    used = (uint64_t)((double)elapsed / NS_PER_SEC * client_conf.consumption_rate);
+    if (used > granted)
+        used = granted;
+    for (g = 0; g < client_conf.rating_groups; g++) {
+        uint64_t gg = atomic_load_explicit(&sub->granted_rg[g], memory_order_relaxed);
+        group_used[g] = granted ? (uint64_t)((double)gg * used / granted) : 0;
+    }
+
+    if (now >= sub->session_end_ns) {
+        sub->state = SUB_IDLE;
+        (void) send_ccr(sub, 3, 0, used, group_used);
+        st->terminates++;
+        tw_add(&st->wheel, &sub->timer, now + sec_to_ns(client_conf.session_gap));
+        return;
+    }
+
+    /* A RAR, Validity-Time expiry, or the usage threshold */
+    if (atomic_exchange_explicit(&sub->reauth, 0, memory_order_relaxed))
+        st->updates_reauth++;
+    else if (used < (uint64_t)(granted * client_conf.update_threshold))
+        st->updates_validity++;
+    else
+        st->updates_quota++;
+    sub->waiting_number = sub->request_number;
+    sub->state = SUB_WAITING;
+    if (send_ccr(sub, 2, quotas[rand_r(&st->seed) % 3], used, group_used) != 0) {
+        st->timeouts++;
+        sub->state = SUB_IDLE;
+        tw_add(&st->wheel, &sub->timer, now + sec_to_ns(client_conf.session_gap));
+        return;
+    }
+    tw_add(&st->wheel, &sub->timer, now + sec_to_ns(client_conf.answer_timeout));
+}
+
+static void *sched_thread_run(void *arg)
+{
+    struct sched_thread *st = arg;
+    uint64_t next = now_ns();
+
+    while (keep_running && (!st->end_ns || next < st->end_ns)) {
+        struct timespec ts = { .tv_sec = next / NS_PER_SEC, .tv_nsec = next % NS_PER_SEC };
+        struct subscriber *sub;
+        uint64_t now;
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        next += SCHED_TICK_NS;
+        now = now_ns();
+
+        /* Answers first, they re-arm timers; arming is cheap so the lock is kept */
+        pthread_mutex_lock(&st->lock);
+        while ((sub = st->inbox) != NULL) {
+            st->inbox = sub->inbox_next;
+            sub->queued = 0;
+            if (sub->answer_posted) {
+                sub->answer_posted = 0;
+                sched_answered(st, sub, now);
+            }
+            /* Re-authorized: report and ask again now, unless a CCR is already in flight */
+            if (sub->state == SUB_ACTIVE && atomic_load_explicit(&sub->reauth, memory_order_relaxed))
+                tw_add(&st->wheel, &sub->timer, now);
+        }
+        pthread_mutex_unlock(&st->lock);
+
+        tw_advance(&st->wheel, now, sched_fire, st);
+    }
+    return NULL;
+}
+
+static void sessions_run(void)
+{
+    struct subscriber *subs;
+    struct sched_thread *threads;
+    uint32_t n = client_conf.subscribers, nt = client_conf.scheduler_threads, i;
+    uint64_t start = now_ns(), end = 0, ramp = sec_to_ns(client_conf.session_duration);
+    struct sched_thread total;
+    double elapsed;
+
+    CHECK_MALLOC_DO(subs = calloc(n, sizeof(*subs)), return);
+    CHECK_MALLOC_DO(threads = calloc(nt, sizeof(*threads)), { free(subs); return; });
+
+    fd_log_notice("Gy session scheduler: %u subscribers on %u threads, %.0f octets/s each, CCR-U at %.0f%% of the grant, session duration %.1fs\n",
+                  n, nt, client_conf.consumption_rate, client_conf.update_threshold * 100, client_conf.session_duration);
+
+    if (client_conf.duration > 0)
+        end = start + sec_to_ns(client_conf.duration);
+    for (i = 0; i < nt; i++) {
+        CHECK_POSIX_DO(pthread_mutex_init(&threads[i].lock, NULL), return);
+        tw_init(&threads[i].wheel, SCHED_TICK_NS, start);
+        threads[i].seed = (unsigned)start + i;
+        threads[i].end_ns = end;
+    }
+
+    /* Session starts are spread over one session duration, so that the load is steady */
+    for (i = 0; i < n; i++) {
+        struct sched_thread *st = &threads[i % nt];
+        subscriber_init(&subs[i], i);
+        subs[i].owner = st;
+        tw_add(&st->wheel, &subs[i].timer, start + ramp / n * i);
+    }
+
+    for (i = 0; i < nt; i++)
+        CHECK_POSIX_DO(pthread_create(&threads[i].thr, NULL, sched_thread_run, &threads[i]), return);
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < nt; i++) {
+        pthread_join(threads[i].thr, NULL);
+        total.sessions += threads[i].sessions;
+        total.updates_quota += threads[i].updates_quota;
+        total.updates_validity += threads[i].updates_validity;
+        total.updates_reauth += threads[i].updates_reauth;
+        total.terminates += threads[i].terminates;
+        total.timeouts += threads[i].timeouts;
+        total.refused += threads[i].refused;
+    }
+
+    elapsed = (double)(now_ns() - start) / NS_PER_SEC;
+    fd_log_notice("Gy session scheduler stopped after %.1fs: %lu sessions, CCR-U %lu on quota + %lu on Validity-Time + %lu on RAR, %lu CCR-T, %lu timeouts, %lu refused\n",
+                  elapsed, (unsigned long)total.sessions, (unsigned long)total.updates_quota,
+                  (unsigned long)total.updates_validity, (unsigned long)total.updates_reauth, (unsigned long)total.terminates,
+                  (unsigned long)total.timeouts, (unsigned long)total.refused);
+    fd_log_notice("Gy session scheduler: answers=%lu (failed %lu), %.1f answers/s, %.1f rated units/s\n",
+                  (unsigned long)atomic_load(&cca_received), (unsigned long)atomic_load(&cca_failed),
+                  atomic_load(&cca_received) / elapsed, atomic_load(&units_answered) / elapsed);
+    window_log_stats();
+
+    /* Sessions may still be referenced by pending answers: keep them allocated */
+}
+
+/*
+ * Replay mode. The CCRs of a trace captured by the server are sent again at
+ * their original pace, or replay_speed times faster. Each captured session
+ * gets its own subscriber, and a CCR only goes once the previous CCR of its
+ * session is answered: when the OCS falls behind the trace, the session is
+ * delayed rather than reordered.
+ */
+#define REPLAY_POLL_NS 1000000ULL   /* 1 ms, while CCRs wait for an answer */
+
+static const struct trace_record *replay_rec;
+
+static int replay_cmp_session(const void *a, const void *b)
+{
+    const struct trace_record *x = &replay_rec[*(const uint32_t *)a], *y = &replay_rec[*(const uint32_t *)b];
+
+    if (x->session != y->session)
+        return x->session < y->session ? -1 : 1;
+    return x->ts_ns < y->ts_ns ? -1 : x->ts_ns > y->ts_ns;
+}
+
+static int replay_cmp_time(const void *a, const void *b)
+{
+    const struct trace_record *x = &replay_rec[*(const uint32_t *)a], *y = &replay_rec[*(const uint32_t *)b];
+
+    if (x->ts_ns != y->ts_ns)
+        return x->ts_ns < y->ts_ns ? -1 : 1;
+    if (x->session != y->session)
+        return x->session < y->session ? -1 : 1;
+    return x->request_number < y->request_number ? -1 : x->request_number > y->request_number;
+}
+
+/* When a CCR captured at ts_ns is sent: the trace starts at t0, the replay at start */
+static inline uint64_t replay_due(const struct trace_record *r, uint64_t start, uint64_t t0, double speed)
+{
+    return start + (uint64_t)((double)(r->ts_ns - t0) / speed);
+}
+
+/* Send one captured CCR on its session; ENOENT when the session opened before the capture */
+static int replay_ccr(struct subscriber *sub, const struct trace_record *r)
+{
+    uint64_t group_used[GY_MSCC_MAX];
+    unsigned g;
+    int ret;
+
+    if (r->request_type != 1 && !sub->sess)
+        return ENOENT;
+
+    /* Same numbering and rating groups as the captured request; the usage is split evenly */
+    sub->request_number = r->request_number;
+    sub->rating_groups = r->rating_groups < GY_MSCC_MAX ? r->rating_groups : GY_MSCC_MAX;
+    for (g = 0; g < sub->rating_groups; g++)
+        group_used[g] = r->used / sub->rating_groups + (g == 0 ? r->used % sub->rating_groups : 0);
+
+    atomic_store_explicit(&sub->pending, 1, memory_order_relaxed);
+    if ((ret = send_ccr(sub, r->request_type, r->requested, r->used, group_used)) != 0)
+        atomic_store_explicit(&sub->pending, 0, memory_order_relaxed);
+    return ret;
+}
+
+static void replay_run(void)
+{
+    struct trace_map tm;
+    struct subscriber *subs = NULL;
+    uint32_t *order = NULL, *slot = NULL, *held = NULL, *backlog = NULL;
+    uint32_t count, nsess = 0, next = 0, nheld = 0, i;
+    uint64_t start, end = 0, t0, span, max_lag = 0, deferred = 0, skipped = 0, errors = 0;
+    double speed = client_conf.replay_speed, elapsed;
+
+    if (trace_open(client_conf.trace_file, &tm) != 0)
+        return;
+    if (!tm.count || tm.count > UINT32_MAX) {
+        fd_log_error("Trace %s holds %zu CCRs, nothing to replay\n", client_conf.trace_file, tm.count);
+        goto out;
+    }
+    count = tm.count;
+    replay_rec = tm.rec;
+    CHECK_MALLOC_DO(order = malloc(count * sizeof(*order)), goto out);
+    CHECK_MALLOC_DO(slot = malloc(count * sizeof(*slot)), goto out);
+    CHECK_MALLOC_DO(held = malloc(count * sizeof(*held)), goto out);
+
+    /* One subscriber per captured session */
+    for (i = 0; i < count; i++)
+        order[i] = i;
+    qsort(order, count, sizeof(*order), replay_cmp_session);
+    for (i = 0; i < count; i++) {
+        if (i && tm.rec[order[i]].session != tm.rec[order[i - 1]].session)
+            nsess++;
+        slot[order[i]] = nsess;
+    }
+    nsess++;
+    CHECK_MALLOC_DO(subs = calloc(nsess, sizeof(*subs)), goto out);
+    CHECK_MALLOC_DO(backlog = calloc(nsess, sizeof(*backlog)), goto out);
+    for (i = 0; i < count; i++) {
+        struct subscriber *sub = &subs[slot[i]];
+        if (sub->msisdn_len)
+            continue;
+        subscriber_init(sub, slot[i]);
+        if (tm.rec[i].msisdn)
+            sub->msisdn_len = snprintf(sub->msisdn, sizeof(sub->msisdn), "%llu", (unsigned long long)tm.rec[i].msisdn);
+    }
+
+    /* Captured order is per server thread: merge it back into one timeline */
+    qsort(order, count, sizeof(*order), replay_cmp_time);
+    t0 = tm.rec[order[0]].ts_ns;
+    span = tm.rec[order[count - 1]].ts_ns - t0;
+    fd_log_notice("Gy trace replay: %u CCRs of %u sessions over %.1fs from %s, at %.1fx speed\n",
+                  count, nsess, (double)span / NS_PER_SEC, client_conf.trace_file, speed);
+
+    start = now_ns();
+    if (client_conf.duration > 0)
+        end = start + sec_to_ns(client_conf.duration);
+
+    while (keep_running && (next < count || nheld)) {
+        uint64_t now = now_ns(), wake;
+        struct timespec ts;
+        uint32_t kept = 0, j;
+
+        if (end && now >= end)
+            break;
+
+        /* CCRs held behind an unanswered one of their session, oldest first */
+        for (j = 0; j < nheld; j++) {
+            uint32_t idx = held[j];
+            struct subscriber *sub = &subs[slot[idx]];
+            uint64_t lag;
+            int ret;
+
+            if (atomic_load_explicit(&sub->pending, memory_order_acquire)) {
+                held[kept++] = idx;
+                continue;
+            }
+            backlog[slot[idx]]--;
+            if ((lag = now - replay_due(&tm.rec[idx], start, t0, speed)) > max_lag)
+                max_lag = lag;
+            if ((ret = replay_ccr(sub, &tm.rec[idx])) == ENOENT)
+                skipped++;
+            else if (ret)
+                errors++;
+        }
+        nheld = kept;
+
+        /* CCRs now due */
+        while (next < count) {
+            uint32_t idx = order[next];
+            uint64_t due = replay_due(&tm.rec[idx], start, t0, speed);
+            struct subscriber *sub = &subs[slot[idx]];
+            int ret;
+
+            if (due > now)
+                break;
+            next++;
+            if (backlog[slot[idx]] || atomic_load_explicit(&sub->pending, memory_order_acquire)) {
+                held[nheld++] = idx;
+                backlog[slot[idx]]++;
+                deferred++;
+                continue;
+            }
+            if (now - due > max_lag)
+                max_lag = now - due;
+            if ((ret = replay_ccr(sub, &tm.rec[idx])) == ENOENT)
+                skipped++;
+            else if (ret)
+                errors++;
+        }
+
+        /* Sleep until the next CCR is due, checking the held ones every millisecond */
+        wake = next < count ? replay_due(&tm.rec[order[next]], start, t0, speed) : now + REPLAY_POLL_NS;
+        if (nheld && wake > now + REPLAY_POLL_NS)
+            wake = now + REPLAY_POLL_NS;
+        if (end && wake > end)
+            wake = end;
+        ts.tv_sec = wake / NS_PER_SEC;
+        ts.tv_nsec = wake % NS_PER_SEC;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+
+    elapsed = (double)(now_ns() - start) / NS_PER_SEC;
+    fd_log_notice("Gy trace replay stopped after %.1fs: %u of %u CCRs replayed, sent I=%lu U=%lu T=%lu, answers=%lu (failed %lu), send errors=%lu\n",
+                  elapsed, next - nheld, count,
+                  (unsigned long)atomic_load(&ccr_sent[1]), (unsigned long)atomic_load(&ccr_sent[2]),
+                  (unsigned long)atomic_load(&ccr_sent[3]), (unsigned long)atomic_load(&cca_received),
+                  (unsigned long)atomic_load(&cca_failed), (unsigned long)errors);
+    fd_log_notice("Gy trace replay: %.1f answers/s, %lu CCRs waited for their session's previous answer, largest delay %.1f ms, %lu skipped (session opened before the capture)\n",
+                  atomic_load(&cca_received) / elapsed, (unsigned long)deferred, (double)max_lag / 1e6, (unsigned long)skipped);
+    window_log_stats();
+
+    /* Sessions may still be referenced by pending answers: keep them allocated */
+out:
+    free(order);
+    free(slot);
+    free(held);
+    free(backlog);
+    trace_close(&tm);
+}
+
+static void* client_thread(void *arg)
+{
+    srand(time(NULL));
+    /* Wait for daemon to be ready */
+    CHECK_FCT_DO(fd_core_waitstartcomplete(), return NULL);
+    sleep(5);
     
+    CHECK_FCT_DO(latency_start(client_conf.mode != MODE_DEMO ? client_conf.report_interval : 0), return NULL);
+    switch (client_conf.mode) {
+        case MODE_LOAD:     load_run(); break;
+        case MODE_SESSIONS: sessions_run(); break;
+        case MODE_REPLAY:   replay_run(); break;
+        default:            demo_run(); break;
+    }
+    
+    /* Let the last answers arrive before the final report */
+    sleep(2);
+    latency_stop();
     return NULL;
 }
 
@@ -327,6 +1397,41 @@ static int client_entry(char *conffile)
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
+    /* Optional configuration file */
+    if (conffile) {
+        CHECK_FCT(conf_parse(conffile, client_conf_handler, NULL));
+    }
+    if (client_conf.mode == MODE_SESSIONS) {
+        if (!client_conf.subscribers || !client_conf.scheduler_threads || client_conf.consumption_rate <= 0
+            || client_conf.update_threshold <= 0 || client_conf.update_threshold > 1 || client_conf.session_duration <= 0) {
+            fd_log_error("Sessions mode needs subscribers, scheduler_threads, consumption_rate and session_duration > 0, update_threshold in (0, 1]\n");
+            return EINVAL;
+        }
+        if (client_conf.request_timeout > 0
+            && client_conf.answer_timeout < client_conf.request_timeout * (client_conf.retransmits + 1))
+            fd_log_notice("answer_timeout is shorter than request_timeout x (retransmits + 1): retransmitted CCRs will be given up early\n");
+    }
+    if (client_conf.mode == MODE_REPLAY && (!client_conf.trace_file[0] || client_conf.replay_speed <= 0)) {
+        fd_log_error("Replay mode needs trace_file and replay_speed > 0\n");
+        return EINVAL;
+    }
+    if (client_conf.mode != MODE_DEMO && client_conf.rating_groups > GY_MSCC_MAX) {
+        fd_log_error("rating_groups is limited to %d\n", GY_MSCC_MAX);
+        return EINVAL;
+    }
+    if (client_conf.mode == MODE_LOAD) {
+        if (!client_conf.subscribers || client_conf.rate <= 0 || client_conf.session_duration <= 0) {
+            fd_log_error("Load mode needs subscribers, rate and session_duration > 0\n");
+            return EINVAL;
+        }
+    }
+
+    /* Per-message events: all of them in demo mode, errors only in load mode unless configured */
+    if (!client_conf.log_level_set)
+        client_conf.log_level = client_conf.mode != MODE_DEMO ? EVL_ERROR : EVL_INFO;
+    CHECK_FCT(evlog_init(client_conf.log_file[0] ? client_conf.log_file : NULL, client_conf.log_level));
+    CHECK_FCT(metrics_start("gy_client", client_conf.metrics_file, client_conf.metrics_interval));
+
     /* Look up the DCCA application */
     application_id_t dcca_id = 4;
     CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_APPLICATION, APPLICATION_BY_ID, &dcca_id, &app_dcca, ENOENT));
@@ -334,22 +1439,28 @@ static int client_entry(char *conffile)
     /* Advertise support for DCCA application */
     CHECK_FCT(fd_disp_app_support(app_dcca, NULL, 1, 0));
 
-    /* Look up dictionary objects */
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Credit-Control-Request", &ccr_cmd, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Credit-Control-Answer", &cca_cmd, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Session-Id", &avp_session_id, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Origin-Host", &avp_origin_host, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Origin-Realm", &avp_origin_realm, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Destination-Realm", &avp_dest_realm, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Auth-Application-Id", &avp_auth_app_id, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "CC-Request-Type", &avp_cc_request_type, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "CC-Request-Number", &avp_cc_request_number, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Result-Code", &avp_result_code, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Service-Context-Id", &avp_service_context_id, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Requested-Service-Unit", &avp_requested_service_unit, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Used-Service-Unit", &avp_used_service_unit, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Granted-Service-Unit", &avp_granted_service_unit, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "CC-Total-Octets", &avp_cc_total_octets, ENOENT));
+    /* Look up dictionary objects and prepare the CCR template */
+    CHECK_FCT(gy_build_init(client_conf.dest_realm));
+    CHECK_FCT(pool_init(&ctx_pool, "ccr_ctx", sizeof(struct ccr_ctx)));
+
+    /* Answer the OCS's Re-Auth-Requests; sessions carry their subscriber for that */
+    CHECK_FCT(fd_sess_handler_create(&sess_hdl, sess_state_cleanup, NULL, NULL));
+    {
+        struct dict_object *rar_cmd;
+        struct disp_when data;
+
+        CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Re-Auth-Request", &rar_cmd, ENOENT));
+        memset(&data, 0, sizeof(data));
+        data.command = rar_cmd;
+        data.app = app_dcca;
+        CHECK_FCT(fd_disp_register(rar_cb, DISP_HOW_CC, &data, NULL, &rar_hdl));
+    }
+
+    /* Spread the sessions over the OCS peers of the realm */
+    if (client_conf.balance) {
+        CHECK_FCT(balance_init(client_conf.balance_decay));
+        CHECK_FCT(fd_rt_out_register(ccr_route, NULL, BALANCE_RT_PRIORITY, &rt_hdl));
+    }
 
     /* Start client thread */
     if (pthread_create(&thread, NULL, client_thread, NULL) != 0) {
@@ -367,6 +1478,14 @@ static int client_entry(char *conffile)
 void fd_ext_fini(void)
 {
     keep_running = 0;
+    if (rar_hdl)
+        (void) fd_disp_unregister(&rar_hdl, NULL);
+    if (rt_hdl)
+        (void) fd_rt_out_unregister(rt_hdl, NULL);
+    latency_stop();
+    pool_log_stats(&ctx_pool);
+    metrics_stop();
+    evlog_fini();
     fd_log_notice("Gy client extension unloaded\n");
 }
 
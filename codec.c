@@ -0,0 +1,285 @@
+#include "codec.h"
+
+/* Fields the decoder knows how to fill */
+enum gy_field {
+    F_NONE = 0,
+    F_SESSION_ID,
+    F_AUTH_APP_ID,
+    F_RESULT_CODE,
+    F_CC_REQUEST_TYPE,
+    F_CC_REQUEST_NUMBER,
+    F_RSU,
+    F_USU,
+    F_GSU,
+    F_SU_TOTAL,
+    F_SU_INPUT,
+    F_SU_OUTPUT,
+    F_SU_TIME,
+    F_SUBSCRIPTION_ID,
+    F_SUB_ID_TYPE,
+    F_SUB_ID_DATA,
+    F_MSCC,
+    F_RATING_GROUP,
+    F_VALIDITY_TIME,
+};
+
+/* AVP code -> field; all the codes we care about are below 512 */
+#define GY_CODE_TABLE_SIZE 512
+
+static const uint8_t field_of_code[GY_CODE_TABLE_SIZE] = {
+    [AVP_CODE_SESSION_ID]             = F_SESSION_ID,
+    [AVP_CODE_AUTH_APPLICATION_ID]    = F_AUTH_APP_ID,
+    [AVP_CODE_RESULT_CODE]            = F_RESULT_CODE,
+    [AVP_CODE_CC_REQUEST_TYPE]        = F_CC_REQUEST_TYPE,
+    [AVP_CODE_CC_REQUEST_NUMBER]      = F_CC_REQUEST_NUMBER,
+    [AVP_CODE_REQUESTED_SERVICE_UNIT] = F_RSU,
+    [AVP_CODE_USED_SERVICE_UNIT]      = F_USU,
+    [AVP_CODE_GRANTED_SERVICE_UNIT]   = F_GSU,
+    [AVP_CODE_CC_TOTAL_OCTETS]        = F_SU_TOTAL,
+    [AVP_CODE_CC_INPUT_OCTETS]        = F_SU_INPUT,
+    [AVP_CODE_CC_OUTPUT_OCTETS]       = F_SU_OUTPUT,
+    [AVP_CODE_CC_TIME]                = F_SU_TIME,
+    [AVP_CODE_SUBSCRIPTION_ID]        = F_SUBSCRIPTION_ID,
+    [AVP_CODE_SUBSCRIPTION_ID_TYPE]   = F_SUB_ID_TYPE,
+    [AVP_CODE_SUBSCRIPTION_ID_DATA]   = F_SUB_ID_DATA,
+    [AVP_CODE_MSCC]                   = F_MSCC,
+    [AVP_CODE_RATING_GROUP]           = F_RATING_GROUP,
+    [AVP_CODE_VALIDITY_TIME]          = F_VALIDITY_TIME,
+};
+
+/* Where the decoded values go; NULL members are not wanted by the caller */
+struct gy_sink {
+    uint32_t *auth_application_id;
+    uint32_t *result_code;
+    uint32_t *validity_time;
+    uint32_t *cc_request_type;
+    uint32_t *cc_request_number;
+    struct gy_service_unit *rsu;
+    struct gy_service_unit *usu;
+    struct gy_service_unit *gsu;
+    struct gy_subscription_id *subscription_id;
+    const uint8_t **session_id;
+    size_t *session_id_len;
+    struct gy_mscc *mscc;         /* GY_MSCC_MAX entries */
+    unsigned *mscc_count;
+    unsigned *mscc_truncated;
+};
+
+static inline enum gy_field field_of(struct avp_hdr *hdr)
+{
+    if (hdr->avp_flags & AVP_FLAG_VENDOR)
+        return F_NONE;
+    if (hdr->avp_code >= GY_CODE_TABLE_SIZE)
+        return F_NONE;
+    return field_of_code[hdr->avp_code];
+}
+
+/* Flatten the children of a grouped Service-Unit AVP */
+static int decode_service_unit(struct avp *su, struct gy_service_unit *out)
+{
+    struct avp *child;
+    struct avp_hdr *hdr;
+
+    memset(out, 0, sizeof(*out));
+    out->present = 1;
+
+    CHECK_FCT(fd_msg_browse(su, MSG_BRW_FIRST_CHILD, &child, NULL));
+    while (child) {
+        CHECK_FCT(fd_msg_avp_hdr(child, &hdr));
+        if (hdr->avp_value) {
+            switch (field_of(hdr)) {
+                case F_SU_TOTAL:  out->total_octets = hdr->avp_value->u64; break;
+                case F_SU_INPUT:  out->input_octets = hdr->avp_value->u64; break;
+                case F_SU_OUTPUT: out->output_octets = hdr->avp_value->u64; break;
+                case F_SU_TIME:   out->time = hdr->avp_value->u32; break;
+                default: break;
+            }
+        }
+        CHECK_FCT(fd_msg_browse(child, MSG_BRW_NEXT, &child, NULL));
+    }
+    return 0;
+}
+
+/* Read a Multiple-Services-Credit-Control block: Rating-Group, its service units and Result-Code */
+static int decode_mscc(struct avp *grp, struct gy_mscc *out)
+{
+    struct avp *child;
+    struct avp_hdr *hdr;
+
+    memset(out, 0, sizeof(*out));
+    CHECK_FCT(fd_msg_browse(grp, MSG_BRW_FIRST_CHILD, &child, NULL));
+    while (child) {
+        CHECK_FCT(fd_msg_avp_hdr(child, &hdr));
+        switch (field_of(hdr)) {
+            case F_RATING_GROUP:
+                if (hdr->avp_value)
+                    out->rating_group = hdr->avp_value->u32;
+                break;
+            case F_RESULT_CODE:
+                if (hdr->avp_value)
+                    out->result_code = hdr->avp_value->u32;
+                break;
+            case F_VALIDITY_TIME:
+                if (hdr->avp_value)
+                    out->validity_time = hdr->avp_value->u32;
+                break;
+            case F_RSU: CHECK_FCT(decode_service_unit(child, &out->rsu)); break;
+            case F_USU: CHECK_FCT(decode_service_unit(child, &out->usu)); break;
+            case F_GSU: CHECK_FCT(decode_service_unit(child, &out->gsu)); break;
+            default: break;
+        }
+        CHECK_FCT(fd_msg_browse(child, MSG_BRW_NEXT, &child, NULL));
+    }
+    return 0;
+}
+
+/* Read a grouped Subscription-Id; an E.164 identity wins over the other types */
+static int decode_subscription_id(struct avp *grp, struct gy_subscription_id *out)
+{
+    struct gy_subscription_id id = { 0, NULL, 0 };
+    struct avp *child;
+    struct avp_hdr *hdr;
+
+    CHECK_FCT(fd_msg_browse(grp, MSG_BRW_FIRST_CHILD, &child, NULL));
+    while (child) {
+        CHECK_FCT(fd_msg_avp_hdr(child, &hdr));
+        if (hdr->avp_value) {
+            switch (field_of(hdr)) {
+                case F_SUB_ID_TYPE: id.type = hdr->avp_value->u32; break;
+                case F_SUB_ID_DATA:
+                    id.data = hdr->avp_value->os.data;
+                    id.len = hdr->avp_value->os.len;
+                    break;
+                default: break;
+            }
+        }
+        CHECK_FCT(fd_msg_browse(child, MSG_BRW_NEXT, &child, NULL));
+    }
+
+    if (id.data && (!out->data || (out->type != GY_SUBSCRIPTION_ID_E164 && id.type == GY_SUBSCRIPTION_ID_E164)))
+        *out = id;
+    return 0;
+}
+
+static int decode_msg(struct msg *msg, const struct gy_sink *sink)
+{
+    struct avp *avp;
+    struct avp_hdr *hdr;
+
+    CHECK_FCT(fd_msg_browse(msg, MSG_BRW_FIRST_CHILD, &avp, NULL));
+    while (avp) {
+        struct gy_service_unit *su = NULL;
+        uint32_t *u32 = NULL;
+
+        CHECK_FCT(fd_msg_avp_hdr(avp, &hdr));
+        switch (field_of(hdr)) {
+            case F_SESSION_ID:
+                if (sink->session_id && hdr->avp_value) {
+                    *sink->session_id = hdr->avp_value->os.data;
+                    *sink->session_id_len = hdr->avp_value->os.len;
+                }
+                break;
+            case F_AUTH_APP_ID:       u32 = sink->auth_application_id; break;
+            case F_RESULT_CODE:       u32 = sink->result_code; break;
+            case F_VALIDITY_TIME:     u32 = sink->validity_time; break;
+            case F_CC_REQUEST_TYPE:   u32 = sink->cc_request_type; break;
+            case F_CC_REQUEST_NUMBER: u32 = sink->cc_request_number; break;
+            case F_RSU:               su = sink->rsu; break;
+            case F_USU:               su = sink->usu; break;
+            case F_GSU:               su = sink->gsu; break;
+            case F_SUBSCRIPTION_ID:
+                if (sink->subscription_id)
+                    CHECK_FCT(decode_subscription_id(avp, sink->subscription_id));
+                break;
+            case F_MSCC:
+                if (*sink->mscc_count < GY_MSCC_MAX)
+                    CHECK_FCT(decode_mscc(avp, &sink->mscc[(*sink->mscc_count)++]));
+                else
+                    *sink->mscc_truncated = 1;
+                break;
+            default: break;
+        }
+        if (u32 && hdr->avp_value)
+            *u32 = hdr->avp_value->u32;
+        if (su)
+            CHECK_FCT(decode_service_unit(avp, su));
+
+        CHECK_FCT(fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL));
+    }
+    return 0;
+}
+
+int gy_decode_ccr(struct msg *msg, struct ccr_view *view)
+{
+    struct gy_sink sink = {
+        .auth_application_id = &view->auth_application_id,
+        .cc_request_type = &view->cc_request_type,
+        .cc_request_number = &view->cc_request_number,
+        .rsu = &view->rsu,
+        .usu = &view->usu,
+        .subscription_id = &view->subscription_id,
+        .session_id = &view->session_id,
+        .session_id_len = &view->session_id_len,
+        .mscc = view->mscc,
+        .mscc_count = &view->mscc_count,
+        .mscc_truncated = &view->mscc_truncated,
+    };
+
+    CHECK_PARAMS(msg && view);
+    memset(view, 0, offsetof(struct ccr_view, mscc));
+    return decode_msg(msg, &sink);
+}
+
+int gy_decode_cca(struct msg *msg, struct cca_view *view)
+{
+    struct gy_sink sink = {
+        .result_code = &view->result_code,
+        .validity_time = &view->validity_time,
+        .cc_request_type = &view->cc_request_type,
+        .cc_request_number = &view->cc_request_number,
+        .gsu = &view->gsu,
+        .session_id = &view->session_id,
+        .session_id_len = &view->session_id_len,
+        .mscc = view->mscc,
+        .mscc_count = &view->mscc_count,
+        .mscc_truncated = &view->mscc_truncated,
+    };
+
+    CHECK_PARAMS(msg && view);
+    memset(view, 0, offsetof(struct cca_view, mscc));
+    return decode_msg(msg, &sink);
+}
+
+int gy_peek_ccr(struct msg *msg, uint32_t *cc_request_type, uint32_t *cc_request_number)
+{
+    struct avp *avp;
+    struct avp_hdr *hdr;
+    int found = 0;
+
+    CHECK_PARAMS(msg && cc_request_type && cc_request_number);
+    *cc_request_type = *cc_request_number = 0;
+    CHECK_FCT(fd_msg_browse(msg, MSG_BRW_FIRST_CHILD, &avp, NULL));
+    while (avp && found != 3) {
+        CHECK_FCT(fd_msg_avp_hdr(avp, &hdr));
+        if (hdr->avp_value) {
+            switch (field_of(hdr)) {
+                case F_CC_REQUEST_TYPE:   *cc_request_type = hdr->avp_value->u32; found |= 1; break;
+                case F_CC_REQUEST_NUMBER: *cc_request_number = hdr->avp_value->u32; found |= 2; break;
+                default: break;
+            }
+        }
+        CHECK_FCT(fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL));
+    }
+    return 0;
+}
+
+const char *gy_request_type_name(uint32_t cc_request_type)
+{
+    switch (cc_request_type) {
+        case 1: return "INITIAL";
+        case 2: return "UPDATE";
+        case 3: return "TERMINATE";
+        case 4: return "EVENT";
+        default: return "UNKNOWN";
+    }
+}
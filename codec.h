@@ -0,0 +1,105 @@
+#ifndef GY_CODEC_H
+#define GY_CODEC_H
+
+#include "utils.h"
+
+/*
+ * Single-pass decoding of Gy Credit-Control messages.
+ * The top-level AVP list is walked once; each AVP code is mapped to the
+ * field it fills through a small lookup table, and grouped Service-Unit,
+ * Subscription-Id and Multiple-Services-Credit-Control AVPs are flattened on
+ * the way. Unknown and vendor-specific AVPs are skipped.
+ */
+
+/* AVP codes used by the Gy extensions (RFC 6733 / RFC 4006) */
+#define AVP_CODE_SESSION_ID              263
+#define AVP_CODE_AUTH_APPLICATION_ID     258
+#define AVP_CODE_RESULT_CODE             268
+#define AVP_CODE_CC_INPUT_OCTETS         412
+#define AVP_CODE_CC_OUTPUT_OCTETS        414
+#define AVP_CODE_CC_REQUEST_NUMBER       415
+#define AVP_CODE_CC_REQUEST_TYPE         416
+#define AVP_CODE_CC_TIME                 420
+#define AVP_CODE_CC_TOTAL_OCTETS         421
+#define AVP_CODE_GRANTED_SERVICE_UNIT    431
+#define AVP_CODE_RATING_GROUP            432
+#define AVP_CODE_SUBSCRIPTION_ID         443
+#define AVP_CODE_SUBSCRIPTION_ID_DATA    444
+#define AVP_CODE_REQUESTED_SERVICE_UNIT  437
+#define AVP_CODE_USED_SERVICE_UNIT       446
+#define AVP_CODE_VALIDITY_TIME           448
+#define AVP_CODE_SUBSCRIPTION_ID_TYPE    450
+#define AVP_CODE_MULTIPLE_SERVICES_INDICATOR 455
+#define AVP_CODE_MSCC                    456   /* Multiple-Services-Credit-Control */
+#define AVP_CODE_SERVICE_CONTEXT_ID      461
+
+/* Flattened content of a Requested/Used/Granted-Service-Unit AVP */
+struct gy_service_unit {
+    uint64_t total_octets;
+    uint64_t input_octets;
+    uint64_t output_octets;
+    uint32_t time;
+    uint32_t present;   /* non-zero when the AVP was in the message */
+};
+
+/* Multiple-Services-Credit-Control blocks decoded per message; more make the view truncated */
+#define GY_MSCC_MAX 16
+
+/* Content of one Multiple-Services-Credit-Control AVP */
+struct gy_mscc {
+    uint32_t rating_group;
+    uint32_t result_code;         /* answers only */
+    uint32_t validity_time;       /* answers only, seconds, 0 = none */
+    struct gy_service_unit rsu;   /* requests */
+    struct gy_service_unit usu;   /* requests */
+    struct gy_service_unit gsu;   /* answers */
+};
+
+/* Subscription-Id-Type values */
+#define GY_SUBSCRIPTION_ID_E164  0   /* END_USER_E164, the MSISDN */
+#define GY_SUBSCRIPTION_ID_IMSI  1   /* END_USER_IMSI */
+
+/* Content of a Subscription-Id AVP; data is NULL when the CCR has none */
+struct gy_subscription_id {
+    uint32_t type;
+    const uint8_t *data;          /* points into the message, not copied */
+    size_t len;
+};
+
+struct ccr_view {
+    uint32_t cc_request_type;
+    uint32_t cc_request_number;
+    uint32_t auth_application_id;
+    struct gy_service_unit rsu;   /* Requested-Service-Unit */
+    struct gy_service_unit usu;   /* Used-Service-Unit */
+    struct gy_subscription_id subscription_id;   /* the E.164 one if several */
+    const uint8_t *session_id;    /* points into the message, not copied */
+    size_t session_id_len;
+    unsigned mscc_truncated;      /* the message had more than GY_MSCC_MAX MSCC */
+    unsigned mscc_count;
+    struct gy_mscc mscc[GY_MSCC_MAX];   /* keep last: only mscc_count entries are initialized */
+};
+
+struct cca_view {
+    uint32_t result_code;
+    uint32_t cc_request_type;
+    uint32_t cc_request_number;
+    struct gy_service_unit gsu;   /* Granted-Service-Unit */
+    uint32_t validity_time;       /* Validity-Time in seconds, 0 = none */
+    const uint8_t *session_id;
+    size_t session_id_len;
+    unsigned mscc_truncated;
+    unsigned mscc_count;
+    struct gy_mscc mscc[GY_MSCC_MAX];   /* keep last: only mscc_count entries are initialized */
+};
+
+int gy_decode_ccr(struct msg *msg, struct ccr_view *view);
+int gy_decode_cca(struct msg *msg, struct cca_view *view);
+
+/* CC-Request-Type and CC-Request-Number only, stopping as soon as both are found */
+int gy_peek_ccr(struct msg *msg, uint32_t *cc_request_type, uint32_t *cc_request_number);
+
+/* Printable name of a CC-Request-Type value */
+const char *gy_request_type_name(uint32_t cc_request_type);
+
+#endif /* GY_CODEC_H */
@@ -0,0 +1,106 @@
+#include "utils.h"
+#include "conf.h"
+
+#include <ctype.h>
+
+static char *trim(char *s)
+{
+    char *end;
+
+    while (isspace((unsigned char)*s))
+        s++;
+    end = s + strlen(s);
+    while (end > s && (isspace((unsigned char)end[-1]) || end[-1] == ';'))
+        *--end = '\0';
+    return s;
+}
+
+int conf_parse(const char *path, conf_handler_t handler, void *opaque)
+{
+    FILE *f;
+    char line[512];
+    unsigned lineno = 0;
+    int ret = 0;
+
+    CHECK_PARAMS(path && handler);
+
+    if ((f = fopen(path, "r")) == NULL) {
+        fd_log_error("Unable to open configuration file %s: %s\n", path, strerror(errno));
+        return errno;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char *key, *value, *eq;
+
+        lineno++;
+        key = trim(line);
+        if (*key == '\0' || *key == '#')
+            continue;
+
+        if ((eq = strchr(key, '=')) == NULL) {
+            fd_log_error("%s:%u: expected 'key = value;'\n", path, lineno);
+            ret = EINVAL;
+            break;
+        }
+        *eq = '\0';
+        key = trim(key);
+        value = trim(eq + 1);
+
+        /* Strip optional quotes */
+        if (*value == '"' && strlen(value) >= 2 && value[strlen(value) - 1] == '"') {
+            value[strlen(value) - 1] = '\0';
+            value++;
+        }
+
+        if ((ret = handler(key, value, opaque)) != 0) {
+            fd_log_error("%s:%u: invalid entry '%s'\n", path, lineno, key);
+            break;
+        }
+    }
+
+    fclose(f);
+    return ret;
+}
+
+int conf_get_u32(const char *key, const char *value, uint32_t *out)
+{
+    uint64_t v;
+
+    CHECK_FCT(conf_get_u64(key, value, &v));
+    if (v > UINT32_MAX) {
+        fd_log_error("Value of '%s' is out of range: %s\n", key, value);
+        return EINVAL;
+    }
+    *out = (uint32_t)v;
+    return 0;
+}
+
+int conf_get_u64(const char *key, const char *value, uint64_t *out)
+{
+    char *end;
+    unsigned long long v;
+
+    errno = 0;
+    v = strtoull(value, &end, 0);
+    if (errno || end == value || *end != '\0') {
+        fd_log_error("Value of '%s' is not a valid number: %s\n", key, value);
+        return EINVAL;
+    }
+    *out = v;
+    return 0;
+}
+
+int conf_get_double(const char *key, const char *value, double *out)
+{
+    char *end;
+    double v;
+
+    errno = 0;
+    v = strtod(value, &end);
+    if (errno || end == value || *end != '\0') {
+        fd_log_error("Value of '%s' is not a valid number: %s\n", key, value);
+        return EINVAL;
+    }
+    *out = v;
+    return 0;
+}
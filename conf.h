@@ -0,0 +1,21 @@
+#ifndef GY_CONF_H
+#define GY_CONF_H
+
+#include <stdint.h>
+
+/*
+ * Minimal reader for the extensions' own configuration files, which use the
+ * same "key = value;" layout as freeDiameter's. Lines starting with '#' are
+ * comments; values may be quoted. The handler is called once per entry and
+ * a non-zero return aborts the parsing with that error.
+ */
+typedef int (*conf_handler_t)(const char *key, const char *value, void *opaque);
+
+int conf_parse(const char *path, conf_handler_t handler, void *opaque);
+
+/* Value conversion helpers, returning EINVAL on malformed input */
+int conf_get_u32(const char *key, const char *value, uint32_t *out);
+int conf_get_u64(const char *key, const char *value, uint64_t *out);
+int conf_get_double(const char *key, const char *value, double *out);
+
+#endif /* GY_CONF_H */
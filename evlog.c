@@ -0,0 +1,213 @@
+#include "utils.h"
+#include "evlog.h"
+
+#include <stdatomic.h>
+
+#define EVLOG_RING_SIZE  8192   /* records per thread, power of two */
+#define EVLOG_IDLE_US    1000   /* drain thread sleep when all rings are empty */
+
+/* Single producer (the owner thread), single consumer (the drain thread) */
+struct evlog_ring {
+    atomic_uint head __attribute__((aligned(64)));   /* next slot to write */
+    atomic_uint tail __attribute__((aligned(64)));   /* next slot to read */
+    atomic_uint_fast64_t dropped __attribute__((aligned(64)));
+    uint32_t thread;
+    struct evlog_ring *next;
+    struct evlog_record rec[EVLOG_RING_SIZE];
+};
+
+static __thread struct evlog_ring *self;
+static struct evlog_ring *_Atomic rings;   /* lock-free push-only list */
+static atomic_uint thread_count;
+static atomic_int cur_level = EVL_ERROR;
+
+static pthread_t drainer;
+static volatile int drain_running;
+static FILE *out;
+
+void evlog_set_level(enum evlog_level level)
+{
+    atomic_store_explicit(&cur_level, level, memory_order_relaxed);
+}
+
+enum evlog_level evlog_get_level(void)
+{
+    return atomic_load_explicit(&cur_level, memory_order_relaxed);
+}
+
+int evlog_parse_level(const char *name, enum evlog_level *level)
+{
+    if (!strcmp(name, "off"))
+        *level = EVL_OFF;
+    else if (!strcmp(name, "error"))
+        *level = EVL_ERROR;
+    else if (!strcmp(name, "info"))
+        *level = EVL_INFO;
+    else if (!strcmp(name, "debug"))
+        *level = EVL_DEBUG;
+    else
+        return EINVAL;
+    return 0;
+}
+
+uint64_t evlog_dropped(void)
+{
+    struct evlog_ring *r;
+    uint64_t total = 0;
+
+    for (r = atomic_load(&rings); r; r = r->next)
+        total += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    return total;
+}
+
+static struct evlog_ring *ring_register(void)
+{
+    struct evlog_ring *r;
+
+    if ((r = calloc(1, sizeof(*r))) == NULL)
+        return NULL;
+    r->thread = atomic_fetch_add(&thread_count, 1);
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+        ;
+    return r;
+}
+
+void evlog_emit(enum evlog_level level, enum evlog_event event,
+                uint32_t a, uint32_t b, uint64_t x, uint64_t y, uint64_t z, uint64_t w)
+{
+    struct evlog_ring *r = self;
+    struct evlog_record *rec;
+    struct timespec ts;
+    unsigned h;
+
+    if (level > atomic_load_explicit(&cur_level, memory_order_relaxed))
+        return;
+
+    if (!r && (r = self = ring_register()) == NULL)
+        return;
+
+    h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (h - atomic_load_explicit(&r->tail, memory_order_acquire) >= EVLOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    rec = &r->rec[h & (EVLOG_RING_SIZE - 1)];
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->ts_ns = (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+    rec->event = event;
+    rec->level = level;
+    rec->thread = r->thread;
+    rec->u32[0] = a;
+    rec->u32[1] = b;
+    rec->u64[0] = x;
+    rec->u64[1] = y;
+    rec->u64[2] = z;
+    rec->u64[3] = w;
+
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+/* Move everything currently queued to the output; returns the number of records */
+static unsigned drain_once(void)
+{
+    struct evlog_ring *r;
+    unsigned n = 0;
+    char line[256];
+
+    for (r = atomic_load(&rings); r; r = r->next) {
+        unsigned t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        unsigned h = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        for (; t != h; t++, n++) {
+            struct evlog_record *rec = &r->rec[t & (EVLOG_RING_SIZE - 1)];
+            if (out) {
+                fwrite(rec, sizeof(*rec), 1, out);
+            } else {
+                evlog_format(rec, line, sizeof(line));
+                if (rec->level == EVL_ERROR)
+                    fd_log_error("%s\n", line);
+                else
+                    fd_log_notice("%s\n", line);
+            }
+        }
+        atomic_store_explicit(&r->tail, t, memory_order_release);
+    }
+    if (out && n)
+        fflush(out);
+    return n;
+}
+
+static void *evlog_drain(void *arg)
+{
+    uint64_t reported_drops = 0, last_check = now_ns();
+
+    while (drain_running) {
+        if (!drain_once())
+            usleep(EVLOG_IDLE_US);
+
+        /* Warn about lost records at most every 10 seconds */
+        if (now_ns() - last_check > 10 * NS_PER_SEC) {
+            uint64_t d = evlog_dropped();
+            if (d != reported_drops) {
+                fd_log_error("Event log: %lu records dropped so far (rings full)\n", (unsigned long)d);
+                reported_drops = d;
+            }
+            last_check = now_ns();
+        }
+    }
+    drain_once();
+    return NULL;
+}
+
+/* SIGUSR2 cycles the verbosity: error -> info -> debug -> error */
+static void evlog_cycle_level(void)
+{
+    enum evlog_level l = evlog_get_level();
+
+    l = (l >= EVL_DEBUG) ? EVL_ERROR : l + 1;
+    evlog_set_level(l);
+    fd_log_notice("Event log verbosity set to %d\n", l);
+}
+
+int evlog_init(const char *path, enum evlog_level level)
+{
+    evlog_set_level(level);
+
+    if (path) {
+        struct evlog_file_header hdr;
+
+        if ((out = fopen(path, "ab")) == NULL) {
+            fd_log_error("Unable to open event log %s: %s\n", path, strerror(errno));
+            return errno;
+        }
+        setvbuf(out, NULL, _IOFBF, 1 << 20);
+        if (ftell(out) == 0) {
+            memset(&hdr, 0, sizeof(hdr));
+            memcpy(hdr.magic, EVLOG_MAGIC, sizeof(hdr.magic));
+            hdr.version = EVLOG_VERSION;
+            hdr.record_size = sizeof(struct evlog_record);
+            fwrite(&hdr, sizeof(hdr), 1, out);
+        }
+    }
+
+    drain_running = 1;
+    CHECK_POSIX(pthread_create(&drainer, NULL, evlog_drain, NULL));
+    CHECK_FCT(fd_event_trig_regcb(SIGUSR2, "gy_evlog", evlog_cycle_level));
+    return 0;
+}
+
+void evlog_fini(void)
+{
+    if (!drain_running)
+        return;
+    drain_running = 0;
+    pthread_join(drainer, NULL);
+    if (evlog_dropped())
+        fd_log_error("Event log: %lu records dropped\n", (unsigned long)evlog_dropped());
+    if (out) {
+        fclose(out);
+        out = NULL;
+    }
+}
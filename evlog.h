@@ -0,0 +1,83 @@
+#ifndef GY_EVLOG_H
+#define GY_EVLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Structured event log for the charging hot path.
+ *
+ * Callers only copy a few integers into a per-thread single-producer ring;
+ * a background thread drains the rings and either writes the raw records
+ * to a binary file (read back with the evlogdump tool) or formats them as
+ * text through fd_log_notice. When a ring is full the record is dropped
+ * and counted, so logging never blocks charging.
+ */
+
+enum evlog_level {
+    EVL_OFF = 0,
+    EVL_ERROR,
+    EVL_INFO,
+    EVL_DEBUG,
+};
+
+enum evlog_event {
+    EV_NONE = 0,
+    EV_CCR_RECEIVED,      /* server: u32 type, number; u64 session hash, requested, used, rating groups */
+    EV_CCA_SENT,          /* server: u32 type, result; u64 session hash, granted, session granted, session used */
+    EV_SESSION_CLOSED,    /* server: u64 session hash, granted, used, live sessions */
+    EV_CCR_SENT,          /* client: u32 type, number; u64 session hash, requested, used, session used */
+    EV_CCA_RECEIVED,      /* client: u32 type, result; u64 session hash, granted, round trip ns */
+    EV_SEND_FAILED,       /* both:   u32 type, error */
+    EV_CCR_RETRANSMIT,    /* client: u32 type, number; u64 session hash, attempt */
+    EV_CCR_TIMEOUT,       /* client: u32 type, number; u64 session hash, attempts */
+    EV_CCR_SHED,          /* server: u32 type, number; u64 session hash */
+    EV_CCR_DUPLICATE,     /* server: u32 type, number; u64 session hash, answered (1) or held for the first copy's answer (0) */
+    EV_SESSION_EXPIRED,   /* server: u32 CCRs seen; u64 session hash, granted, used, reserved released */
+    EV_RAA_RECEIVED,      /* server: u32 result; u64 session hash, round trip ns */
+    EV_RAR_TIMEOUT,       /* server: u64 session hash */
+    EV_RAR_RECEIVED,      /* client: u32 result answered; u64 session hash */
+    EV_MAX
+};
+
+/* On-disk and in-ring record, 56 bytes */
+struct evlog_record {
+    uint64_t ts_ns;       /* CLOCK_REALTIME */
+    uint16_t event;       /* enum evlog_event */
+    uint8_t  level;       /* enum evlog_level */
+    uint8_t  reserved;
+    uint32_t thread;      /* index of the emitting thread */
+    uint32_t u32[2];
+    uint64_t u64[4];
+};
+
+/* Binary file layout: header followed by records */
+#define EVLOG_MAGIC    "GYEVLOG1"
+#define EVLOG_VERSION  2    /* 2: EV_CCR_RECEIVED sums the rating groups and counts them */
+
+struct evlog_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+/* Start the drain thread. path == NULL formats records as text through fd_log_notice */
+int  evlog_init(const char *path, enum evlog_level level);
+void evlog_fini(void);
+
+/* Verbosity, can be changed at any time */
+void evlog_set_level(enum evlog_level level);
+enum evlog_level evlog_get_level(void);
+int  evlog_parse_level(const char *name, enum evlog_level *level);
+
+/* Records lost because a ring was full */
+uint64_t evlog_dropped(void);
+
+/* Queue one record; cheap no-op when level is above the current verbosity */
+void evlog_emit(enum evlog_level level, enum evlog_event event,
+                uint32_t a, uint32_t b, uint64_t x, uint64_t y, uint64_t z, uint64_t w);
+
+/* Text rendering of a record, shared by the drain thread and evlogdump */
+int evlog_format(const struct evlog_record *r, char *buf, size_t len);
+
+#endif /* GY_EVLOG_H */
@@ -0,0 +1,81 @@
+#include "evlog.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define GB(x) ((double)(x) / (1024*1024*1024))
+
+static const char *type_name(uint32_t t)
+{
+    switch (t) {
+        case 1: return "INITIAL";
+        case 2: return "UPDATE";
+        case 3: return "TERMINATE";
+        case 4: return "EVENT";
+        default: return "UNKNOWN";
+    }
+}
+
+int evlog_format(const struct evlog_record *r, char *buf, size_t len)
+{
+    static const char *levels[] = { "-", "E", "I", "D" };
+    struct tm tm;
+    time_t sec = (time_t)(r->ts_ns / 1000000000ULL);
+    int n;
+
+    gmtime_r(&sec, &tm);
+    n = snprintf(buf, len, "%02d:%02d:%02d.%06lu %s t%u ",
+                 tm.tm_hour, tm.tm_min, tm.tm_sec, (unsigned long)(r->ts_ns % 1000000000ULL) / 1000,
+                 r->level < 4 ? levels[r->level] : "?", r->thread);
+    if (n < 0 || (size_t)n >= len)
+        return n;
+    buf += n;
+    len -= n;
+
+    switch (r->event) {
+        case EV_CCR_RECEIVED:
+            return n + snprintf(buf, len, "CCR %s #%u sess=%016llx requested=%.1f GB used=%.1f GB rating groups=%llu",
+                                type_name(r->u32[0]), r->u32[1], (unsigned long long)r->u64[0], GB(r->u64[1]), GB(r->u64[2]),
+                                (unsigned long long)r->u64[3]);
+        case EV_CCA_SENT:
+            return n + snprintf(buf, len, "CCA %s result=%u sess=%016llx granted=%.1f GB (session granted %.1f GB, used %.1f GB)",
+                                type_name(r->u32[0]), r->u32[1], (unsigned long long)r->u64[0], GB(r->u64[1]), GB(r->u64[2]), GB(r->u64[3]));
+        case EV_SESSION_CLOSED:
+            return n + snprintf(buf, len, "session closed sess=%016llx granted=%.1f GB used=%.1f GB (%llu live sessions)",
+                                (unsigned long long)r->u64[0], GB(r->u64[1]), GB(r->u64[2]), (unsigned long long)r->u64[3]);
+        case EV_SESSION_EXPIRED:
+            return n + snprintf(buf, len, "session expired sess=%016llx after %u CCRs granted=%.1f GB used=%.1f GB released=%.1f GB",
+                                (unsigned long long)r->u64[0], r->u32[0], GB(r->u64[1]), GB(r->u64[2]), GB(r->u64[3]));
+        case EV_CCR_SENT:
+            return n + snprintf(buf, len, "CCR %s #%u sent sess=%016llx requested=%.1f GB used=%.1f GB (session used %.1f GB)",
+                                type_name(r->u32[0]), r->u32[1], (unsigned long long)r->u64[0], GB(r->u64[1]), GB(r->u64[2]), GB(r->u64[3]));
+        case EV_CCA_RECEIVED:
+            return n + snprintf(buf, len, "CCA %s result=%u sess=%016llx granted=%.1f GB rtt=%.3f ms",
+                                type_name(r->u32[0]), r->u32[1], (unsigned long long)r->u64[0], GB(r->u64[1]), r->u64[2] / 1e6);
+        case EV_SEND_FAILED:
+            return n + snprintf(buf, len, "sending %s failed: error %u", type_name(r->u32[0]), r->u32[1]);
+        case EV_CCR_RETRANSMIT:
+            return n + snprintf(buf, len, "CCR %s #%u retransmitted sess=%016llx attempt %llu",
+                                type_name(r->u32[0]), r->u32[1], (unsigned long long)r->u64[0], (unsigned long long)r->u64[1]);
+        case EV_CCR_TIMEOUT:
+            return n + snprintf(buf, len, "CCR %s #%u timed out sess=%016llx after %llu attempts",
+                                type_name(r->u32[0]), r->u32[1], (unsigned long long)r->u64[0], (unsigned long long)r->u64[1]);
+        case EV_CCR_SHED:
+            return n + snprintf(buf, len, "CCR %s #%u shed sess=%016llx: answered 3004",
+                                type_name(r->u32[0]), r->u32[1], (unsigned long long)r->u64[0]);
+        case EV_CCR_DUPLICATE:
+            return n + snprintf(buf, len, "CCR %s #%u duplicate sess=%016llx: %s",
+                                type_name(r->u32[0]), r->u32[1], (unsigned long long)r->u64[0],
+                                r->u64[1] ? "answered from the replay cache" : "held until the first copy is answered");
+        case EV_RAA_RECEIVED:
+            return n + snprintf(buf, len, "RAA result=%u sess=%016llx rtt=%.3f ms",
+                                r->u32[1], (unsigned long long)r->u64[0], r->u64[1] / 1e6);
+        case EV_RAR_TIMEOUT:
+            return n + snprintf(buf, len, "RAR timed out sess=%016llx", (unsigned long long)r->u64[0]);
+        case EV_RAR_RECEIVED:
+            return n + snprintf(buf, len, "RAR received sess=%016llx: answered %u",
+                                (unsigned long long)r->u64[0], r->u32[1]);
+        default:
+            return n + snprintf(buf, len, "event %u", r->event);
+    }
+}
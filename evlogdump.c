@@ -0,0 +1,38 @@
+/* Offline formatter for the binary event logs written by the Gy extensions */
+#include "evlog.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int main(int argc, char *argv[])
+{
+    struct evlog_file_header hdr;
+    struct evlog_record rec;
+    char line[256];
+    FILE *f;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <event log file>\n", argv[0]);
+        return 2;
+    }
+    if ((f = fopen(argv[1], "rb")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, EVLOG_MAGIC, sizeof(hdr.magic))) {
+        fprintf(stderr, "%s: not a Gy event log\n", argv[1]);
+        return 1;
+    }
+    if (hdr.version != EVLOG_VERSION || hdr.record_size != sizeof(rec)) {
+        fprintf(stderr, "%s: unsupported version %u (record size %u)\n", argv[1], hdr.version, hdr.record_size);
+        return 1;
+    }
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        evlog_format(&rec, line, sizeof(line));
+        puts(line);
+    }
+
+    fclose(f);
+    return 0;
+}
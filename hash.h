@@ -0,0 +1,20 @@
+#ifndef GY_HASH_H
+#define GY_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* FNV-1a 64 bits, used to hash Session-Ids and subscriber identities */
+static inline uint64_t gy_hash(const uint8_t *data, size_t len)
+{
+    uint64_t h = 1469598103934665603ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+#endif /* GY_HASH_H */
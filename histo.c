@@ -0,0 +1,115 @@
+#include "histo.h"
+
+#include <string.h>
+
+#define SUB_HALF  (1U << (HISTO_SUB_BITS - 1))
+
+static inline unsigned histo_index(uint64_t v)
+{
+    unsigned shift;
+
+    if (v >> HISTO_MAX_BITS)
+        v = (1ULL << HISTO_MAX_BITS) - 1;
+    if (v < (1U << HISTO_SUB_BITS))
+        return (unsigned)v;
+
+    /* (v >> shift) falls in [SUB_HALF, 2 * SUB_HALF) */
+    shift = (63 - __builtin_clzll(v)) - HISTO_SUB_BITS + 1;
+    return shift * SUB_HALF + (unsigned)(v >> shift);
+}
+
+/* Highest value that maps to bucket idx */
+static inline uint64_t histo_value(unsigned idx)
+{
+    unsigned shift;
+    uint64_t sub;
+
+    if (idx < (1U << HISTO_SUB_BITS))
+        return idx;
+    shift = idx / SUB_HALF - 1;
+    sub = idx - shift * SUB_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+void histo_record(struct histo *h, uint64_t value)
+{
+    atomic_uint_fast64_t *c = &h->counts[histo_index(value)];
+
+    /* Single writer: a relaxed load + store is enough and avoids a locked op */
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + 1, memory_order_relaxed);
+    if (value > atomic_load_explicit(&h->max, memory_order_relaxed))
+        atomic_store_explicit(&h->max, value, memory_order_relaxed);
+}
+
+void histo_merge(struct histo_snapshot *snap, const struct histo *h)
+{
+    unsigned i;
+    uint64_t max;
+
+    for (i = 0; i < HISTO_BUCKETS; i++) {
+        uint64_t c = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        snap->counts[i] += c;
+        snap->total += c;
+    }
+    max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    if (max > snap->max)
+        snap->max = max;
+}
+
+void histo_diff(struct histo_snapshot *snap, const struct histo_snapshot *a, const struct histo_snapshot *b)
+{
+    unsigned i;
+
+    memset(snap, 0, sizeof(*snap));
+    for (i = 0; i < HISTO_BUCKETS; i++) {
+        snap->counts[i] = a->counts[i] - b->counts[i];
+        snap->total += snap->counts[i];
+        if (snap->counts[i])
+            snap->max = histo_value(i);
+    }
+    /* The exact maximum is only known for cumulative snapshots */
+    if (a->max < snap->max)
+        snap->max = a->max;
+}
+
+uint64_t histo_percentile(const struct histo_snapshot *snap, double p)
+{
+    uint64_t rank, seen = 0;
+    unsigned i;
+
+    if (!snap->total)
+        return 0;
+    rank = (uint64_t)(p / 100.0 * snap->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < HISTO_BUCKETS; i++) {
+        seen += snap->counts[i];
+        if (seen >= rank) {
+            uint64_t v = histo_value(i);
+            return v < snap->max ? v : snap->max;
+        }
+    }
+    return snap->max;
+}
+
+uint64_t histo_count_le(const struct histo_snapshot *snap, uint64_t v)
+{
+    uint64_t n = 0;
+    unsigned i;
+
+    for (i = 0; i < HISTO_BUCKETS && histo_value(i) <= v; i++)
+        n += snap->counts[i];
+    return n;
+}
+
+uint64_t histo_sum(const struct histo_snapshot *snap)
+{
+    uint64_t sum = 0;
+    unsigned i;
+
+    for (i = 0; i < HISTO_BUCKETS; i++) {
+        if (snap->counts[i])
+            sum += snap->counts[i] * histo_value(i);
+    }
+    return sum;
+}
@@ -0,0 +1,48 @@
+#ifndef GY_HISTO_H
+#define GY_HISTO_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Log-linear (HDR style) histogram of nanosecond values: 64 linear
+ * sub-buckets per power of two, i.e. about 1.5% relative precision, for
+ * values up to 2^41 ns (~36 min). Larger values are clamped.
+ *
+ * A struct histo has a single writer (its owner thread) and any number of
+ * readers; counters are updated with relaxed atomics so that readers never
+ * see torn values and the writer never takes a lock.
+ */
+#define HISTO_SUB_BITS  7
+#define HISTO_MAX_BITS  41
+#define HISTO_BUCKETS   ((HISTO_MAX_BITS - HISTO_SUB_BITS + 1) * (1 << (HISTO_SUB_BITS - 1)) + (1 << (HISTO_SUB_BITS - 1)))
+
+struct histo {
+    atomic_uint_fast64_t counts[HISTO_BUCKETS];
+    atomic_uint_fast64_t max;
+};
+
+/* Plain copy of one or more histograms, for reporting */
+struct histo_snapshot {
+    uint64_t counts[HISTO_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+/* Record one value; must only be called by the owner thread of h */
+void histo_record(struct histo *h, uint64_t value);
+
+/* Add the current content of h into snap */
+void histo_merge(struct histo_snapshot *snap, const struct histo *h);
+
+/* snap = a - b, for interval statistics out of two cumulative snapshots */
+void histo_diff(struct histo_snapshot *snap, const struct histo_snapshot *a, const struct histo_snapshot *b);
+
+/* Value at percentile p (0..100), 0 if the snapshot is empty */
+uint64_t histo_percentile(const struct histo_snapshot *snap, double p);
+
+/* Number of values <= v, and sum of all values, within the histogram's precision */
+uint64_t histo_count_le(const struct histo_snapshot *snap, uint64_t v);
+uint64_t histo_sum(const struct histo_snapshot *snap);
+
+#endif /* GY_HISTO_H */
@@ -0,0 +1,144 @@
+#include "utils.h"
+#include "histo.h"
+#include "latency.h"
+
+/* Histograms owned by one answering thread */
+struct latency_thread {
+    struct histo h[3];  /* INITIAL, UPDATE, TERMINATE */
+    struct latency_thread *next;
+};
+
+static __thread struct latency_thread *self;
+static struct latency_thread *threads;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *type_names[3] = { "INITIAL", "UPDATE", "TERMINATE" };
+
+static pthread_t reporter;
+static volatile int reporter_running;
+static double report_interval;
+static uint64_t start_ns;
+
+/* Cumulative snapshot at the previous interval report */
+static struct histo_snapshot *prev_snap;
+
+void latency_record(uint32_t request_type, uint64_t rtt_ns)
+{
+    if (request_type < 1 || request_type > 3)
+        return;
+
+    if (!self) {
+        /* First answer handled by this thread: register its histograms */
+        CHECK_MALLOC_DO(self = calloc(1, sizeof(*self)), return);
+        pthread_mutex_lock(&threads_lock);
+        self->next = threads;
+        threads = self;
+        pthread_mutex_unlock(&threads_lock);
+    }
+    histo_record(&self->h[request_type - 1], rtt_ns);
+}
+
+/* Merge all threads' histograms into snap[3] */
+static void latency_collect(struct histo_snapshot *snap)
+{
+    struct latency_thread *t;
+    int i;
+
+    memset(snap, 0, 3 * sizeof(*snap));
+    pthread_mutex_lock(&threads_lock);
+    for (t = threads; t; t = t->next) {
+        for (i = 0; i < 3; i++)
+            histo_merge(&snap[i], &t->h[i]);
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
+
+static void latency_print(const char *label, const struct histo_snapshot *snap, double seconds)
+{
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        const struct histo_snapshot *s = &snap[i];
+        total += s->total;
+        if (!s->total)
+            continue;
+        fd_log_notice("Gy latency [%s] %-9s n=%lu tps=%.1f p50=%.3fms p90=%.3fms p99=%.3fms p99.9=%.3fms max=%.3fms\n",
+                      label, type_names[i], (unsigned long)s->total, seconds > 0 ? s->total / seconds : 0.0,
+                      histo_percentile(s, 50) / 1e6, histo_percentile(s, 90) / 1e6,
+                      histo_percentile(s, 99) / 1e6, histo_percentile(s, 99.9) / 1e6, s->max / 1e6);
+    }
+    fd_log_notice("Gy latency [%s] total     n=%lu tps=%.1f over %.1fs\n",
+                  label, (unsigned long)total, seconds > 0 ? total / seconds : 0.0, seconds);
+}
+
+static void *latency_reporter(void *arg)
+{
+    struct histo_snapshot *cur, *diff;
+    uint64_t last = start_ns;
+
+    CHECK_MALLOC_DO(cur = malloc(3 * sizeof(*cur)), return NULL);
+    CHECK_MALLOC_DO(diff = malloc(3 * sizeof(*diff)), { free(cur); return NULL; });
+
+    while (reporter_running) {
+        uint64_t deadline = last + (uint64_t)(report_interval * NS_PER_SEC), now;
+        int i;
+
+        /* Sleep in short steps so that latency_stop does not wait long */
+        while (reporter_running && (now = now_ns()) < deadline)
+            usleep(100000);
+        if (!reporter_running)
+            break;
+
+        latency_collect(cur);
+        for (i = 0; i < 3; i++)
+            histo_diff(&diff[i], &cur[i], &prev_snap[i]);
+        latency_print("interval", diff, (double)(now - last) / NS_PER_SEC);
+        memcpy(prev_snap, cur, 3 * sizeof(*cur));
+        last = now;
+    }
+
+    free(diff);
+    free(cur);
+    return NULL;
+}
+
+int latency_start(double interval_s)
+{
+    start_ns = now_ns();
+    CHECK_MALLOC(prev_snap = calloc(3, sizeof(*prev_snap)));
+
+    if (interval_s > 0) {
+        report_interval = interval_s;
+        reporter_running = 1;
+        CHECK_POSIX(pthread_create(&reporter, NULL, latency_reporter, NULL));
+    }
+    return 0;
+}
+
+void latency_stop(void)
+{
+    static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+    struct histo_snapshot *cur;
+
+    /* Called at the end of the run and again at unload, report only once */
+    pthread_mutex_lock(&stop_lock);
+    if (!prev_snap) {
+        pthread_mutex_unlock(&stop_lock);
+        return;
+    }
+
+    if (reporter_running) {
+        reporter_running = 0;
+        pthread_join(reporter, NULL);
+    }
+
+    if ((cur = malloc(3 * sizeof(*cur))) != NULL) {
+        latency_collect(cur);
+        latency_print("final", cur, (double)(now_ns() - start_ns) / NS_PER_SEC);
+        free(cur);
+    }
+    free(prev_snap);
+    prev_snap = NULL;
+    pthread_mutex_unlock(&stop_lock);
+}
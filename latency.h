@@ -0,0 +1,20 @@
+#ifndef GY_LATENCY_H
+#define GY_LATENCY_H
+
+#include <stdint.h>
+
+/*
+ * CCR/CCA round-trip statistics of the client, one histogram per
+ * CC-Request-Type (INITIAL, UPDATE, TERMINATE) and per answering thread.
+ */
+
+/* Record one round trip; cheap enough to be called from every cca_cb */
+void latency_record(uint32_t request_type, uint64_t rtt_ns);
+
+/* Start a thread printing interval statistics every interval_s seconds (0 = never) */
+int  latency_start(double interval_s);
+
+/* Stop the reporting thread and print the cumulative statistics */
+void latency_stop(void);
+
+#endif /* GY_LATENCY_H */
@@ -0,0 +1,572 @@
+#include "utils.h"
+#include "ledger.h"
+#include "wal.h"
+#include "repl.h"
+#include "twheel.h"
+
+#include <stdatomic.h>
+
+/*
+ * Session ledger: a lock-striped hash table keyed by Session-Id.
+ * The top bits of the hash select a shard, the low bits a bucket inside it,
+ * so dispatch threads working on different sessions rarely share a lock.
+ */
+
+#define LEDGER_INITIAL_BUCKETS 64
+
+/*
+ * One session, in a single allocation: the fixed part, then bucket_cap
+ * rating group buckets, then the Session-Id bytes (not NUL terminated).
+ */
+struct ledger_entry {
+    struct ledger_entry *next;
+    uint64_t hash;
+    uint64_t seq;   /* last logged change, see wal.c */
+    struct ledger_totals totals;
+    struct tw_timer timer;   /* expiry, in the shard's wheel; disarmed while the entry may move */
+    void *owner;
+    uint32_t sidlen;
+    uint16_t nbuckets;
+    uint16_t bucket_cap;
+    struct ledger_bucket buckets[];
+};
+
+struct ledger_shard {
+    pthread_mutex_t lock;
+    struct ledger_entry **buckets;
+    size_t nbuckets;   /* always a power of two */
+    size_t count;
+    struct timer_wheel *wheel;   /* NULL when sessions do not expire */
+} __attribute__((aligned(64)));
+
+static struct ledger_shard shards[LEDGER_SHARDS];
+static atomic_uint_fast64_t live_sessions;
+static atomic_uint_fast64_t expired_sessions;
+static uint64_t session_timeout_ns;
+
+static pthread_t reaper;
+static volatile int reaper_running;
+static unsigned reaper_batch;
+static void (*reaper_cb)(const struct ledger_record *rec);
+
+static inline unsigned shard_index(uint64_t hash)
+{
+    return (unsigned)(hash >> (64 - LEDGER_SHARD_BITS));
+}
+
+static inline size_t entry_size(unsigned bucket_cap, size_t sidlen)
+{
+    return sizeof(struct ledger_entry) + bucket_cap * sizeof(struct ledger_bucket) + sidlen;
+}
+
+static inline uint8_t *entry_sid(struct ledger_entry *e)
+{
+    return (uint8_t *)&e->buckets[e->bucket_cap];
+}
+
+/* Double the bucket array of a shard; called with the shard lock held */
+static int shard_grow(struct ledger_shard *s)
+{
+    size_t nb = s->nbuckets * 2, i;
+    struct ledger_entry **nt;
+
+    CHECK_MALLOC(nt = calloc(nb, sizeof(*nt)));
+    for (i = 0; i < s->nbuckets; i++) {
+        struct ledger_entry *e = s->buckets[i], *next;
+        for (; e; e = next) {
+            next = e->next;
+            e->next = nt[e->hash & (nb - 1)];
+            nt[e->hash & (nb - 1)] = e;
+        }
+    }
+    free(s->buckets);
+    s->buckets = nt;
+    s->nbuckets = nb;
+    return 0;
+}
+
+/* Find the session, or create it when create is set; called with the shard lock held */
+static int shard_lookup(struct ledger_shard *s, const uint8_t *sid, size_t sidlen, uint64_t h,
+                        int create, struct ledger_entry ***ppp)
+{
+    struct ledger_entry **pp, *e;
+
+    for (pp = &s->buckets[h & (s->nbuckets - 1)]; (e = *pp) != NULL; pp = &e->next) {
+        if (e->hash == h && e->sidlen == sidlen && !memcmp(entry_sid(e), sid, sidlen)) {
+            *ppp = pp;
+            return 0;
+        }
+    }
+
+    if (!create) {
+        *ppp = NULL;
+        return 0;
+    }
+
+    if (s->count >= s->nbuckets) {
+        CHECK_FCT(shard_grow(s));
+        pp = &s->buckets[h & (s->nbuckets - 1)];
+    }
+    /* Most sessions use a single rating group */
+    CHECK_MALLOC(e = calloc(1, entry_size(1, sidlen)));
+    e->hash = h;
+    e->sidlen = sidlen;
+    e->bucket_cap = 1;
+    memcpy(entry_sid(e), sid, sidlen);
+    e->next = *pp;
+    *pp = e;
+    s->count++;
+    atomic_fetch_add_explicit(&live_sessions, 1, memory_order_relaxed);
+    *ppp = pp;
+    return 0;
+}
+
+/* The session's timer runs from its last CCR */
+static inline void entry_arm(struct ledger_shard *s, struct ledger_entry *e)
+{
+    if (s->wheel)
+        tw_add(s->wheel, &e->timer, now_ns() + session_timeout_ns);
+}
+
+/* Before anything that may realloc the entry: the wheel points into it */
+static inline void entry_disarm(struct ledger_shard *s, struct ledger_entry *e)
+{
+    if (s->wheel)
+        tw_del(s->wheel, &e->timer);
+}
+
+static void shard_remove(struct ledger_shard *s, struct ledger_entry **pp)
+{
+    struct ledger_entry *e = *pp;
+
+    entry_disarm(s, e);
+    *pp = e->next;
+    s->count--;
+    atomic_fetch_sub_explicit(&live_sessions, 1, memory_order_relaxed);
+    free(e);
+}
+
+/* Make room for at least cap buckets; the entry may move, *pp is updated */
+static int entry_reserve(struct ledger_entry **pp, unsigned cap)
+{
+    struct ledger_entry *e = *pp;
+    unsigned ncap = e->bucket_cap;
+
+    if (cap <= ncap)
+        return 0;
+    if (cap > UINT16_MAX)
+        return ENOSPC;
+    while (ncap < cap)
+        ncap *= 2;
+    if (ncap > UINT16_MAX)
+        ncap = UINT16_MAX;
+
+    CHECK_MALLOC(e = realloc(e, entry_size(ncap, e->sidlen)));
+    /* The Session-Id follows the buckets: move it past the new ones */
+    memmove(&e->buckets[ncap], &e->buckets[e->bucket_cap], e->sidlen);
+    e->bucket_cap = ncap;
+    *pp = e;
+    return 0;
+}
+
+/* Bucket of a rating group, created if needed; the entry may move */
+static int entry_bucket(struct ledger_entry **pp, uint32_t rating_group, struct ledger_bucket **out)
+{
+    struct ledger_entry *e = *pp;
+    struct ledger_bucket *b;
+    unsigned i;
+
+    for (i = 0; i < e->nbuckets; i++) {
+        if (e->buckets[i].rating_group == rating_group) {
+            *out = &e->buckets[i];
+            return 0;
+        }
+    }
+    CHECK_FCT(entry_reserve(pp, e->nbuckets + 1));
+    e = *pp;
+    b = &e->buckets[e->nbuckets++];
+    memset(b, 0, sizeof(*b));
+    b->rating_group = rating_group;
+    *out = b;
+    return 0;
+}
+
+/* Counter update shared by live traffic and log replay */
+static int entry_update(struct ledger_entry **pp, const struct ledger_unit *units, unsigned nunits)
+{
+    unsigned i;
+
+    for (i = 0; i < nunits; i++) {
+        const struct ledger_unit *u = &units[i];
+        struct ledger_bucket *b;
+        struct ledger_entry *e;
+
+        CHECK_FCT(entry_bucket(pp, u->rating_group, &b));
+        e = *pp;
+
+        /* The usage settles the group's previous reservation, the new grant (if any) replaces it */
+        e->totals.used += u->used;
+        e->totals.granted += u->granted;
+        e->totals.reserved += u->granted - b->reserved;
+        b->used += u->used;
+        b->granted += u->granted;
+        b->reserved = u->granted;
+    }
+    (*pp)->totals.ccr_count++;
+    return 0;
+}
+
+/*
+ * Stamp a change of the session and hand it to the WAL and to the standby;
+ * called with the shard lock held, so both see the session's changes in order.
+ * The change is applied whatever the WAL says, so the standby gets it anyway.
+ */
+static int entry_log(unsigned idx, struct ledger_entry *e, const uint8_t *sid, size_t sidlen,
+                     uint32_t cc_request_type, const struct ledger_unit *units, unsigned nunits)
+{
+    int ret = 0;
+
+    if (!wal_enabled() && !repl_capturing())
+        return 0;
+    e->seq = wal_next_seq();
+    if (wal_enabled())
+        ret = wal_log(idx, e->seq, sid, sidlen, cc_request_type, units, nunits);
+    if (repl_capturing())
+        repl_log(idx, e->seq, sid, sidlen, cc_request_type, units, nunits);
+    return ret;
+}
+
+int ledger_init(uint32_t session_timeout_s)
+{
+    uint64_t now = now_ns();
+    unsigned i;
+
+    session_timeout_ns = (uint64_t)session_timeout_s * NS_PER_SEC;
+    for (i = 0; i < LEDGER_SHARDS; i++) {
+        struct ledger_shard *s = &shards[i];
+        CHECK_POSIX(pthread_mutex_init(&s->lock, NULL));
+        CHECK_MALLOC(s->buckets = calloc(LEDGER_INITIAL_BUCKETS, sizeof(*s->buckets)));
+        s->nbuckets = LEDGER_INITIAL_BUCKETS;
+        s->count = 0;
+        if (session_timeout_s) {
+            CHECK_MALLOC(s->wheel = malloc(sizeof(*s->wheel)));
+            tw_init(s->wheel, NS_PER_SEC, now);
+        }
+    }
+    atomic_store(&live_sessions, 0);
+    atomic_store(&expired_sessions, 0);
+    return 0;
+}
+
+void ledger_fini(void)
+{
+    unsigned i;
+    size_t b;
+
+    if (reaper_running) {
+        reaper_running = 0;
+        pthread_join(reaper, NULL);
+    }
+
+    for (i = 0; i < LEDGER_SHARDS; i++) {
+        struct ledger_shard *s = &shards[i];
+        if (!s->buckets)
+            continue;
+        for (b = 0; b < s->nbuckets; b++) {
+            struct ledger_entry *e = s->buckets[b], *next;
+            for (; e; e = next) {
+                next = e->next;
+                free(e);
+            }
+        }
+        free(s->buckets);
+        s->buckets = NULL;
+        free(s->wheel);
+        s->wheel = NULL;
+        pthread_mutex_destroy(&s->lock);
+    }
+}
+
+int ledger_apply(const uint8_t *sid, size_t sidlen, uint64_t h, uint32_t cc_request_type,
+                 struct ledger_unit *units, unsigned nunits, void *owner,
+                 ledger_rate_cb rate, void *rate_arg, struct ledger_totals *out)
+{
+    unsigned idx = shard_index(h);
+    struct ledger_shard *s = &shards[idx];
+    struct ledger_entry **pp, *e;
+    uint64_t reserved[LEDGER_RATE_UNITS_MAX];
+    unsigned i, j, missing = 0;
+    int ret;
+
+    CHECK_PARAMS(sid && sidlen && (units || !nunits) && (!rate || nunits <= LEDGER_RATE_UNITS_MAX));
+
+    CHECK_POSIX(pthread_mutex_lock(&s->lock));
+
+    /* First CCR seen for this session (normally the INITIAL one) creates it */
+    if ((ret = shard_lookup(s, sid, sidlen, h, 1, &pp)) != 0)
+        goto out;
+    e = *pp;
+    entry_disarm(s, e);
+
+    /* The reservations the CCR replaces, and room for its new groups, so that nothing fails once it is rated */
+    for (i = 0; i < nunits; i++) {
+        for (j = 0; j < e->nbuckets && e->buckets[j].rating_group != units[i].rating_group; j++)
+            ;
+        if (j == e->nbuckets)
+            missing++;
+        if (rate)
+            reserved[i] = j < e->nbuckets ? e->buckets[j].reserved : 0;
+    }
+    if ((ret = entry_reserve(pp, e->nbuckets + missing)) != 0)
+        goto rearm;
+    e = *pp;
+
+    if (rate)
+        rate(rate_arg, e->owner, reserved, e->totals.reserved, units, nunits);
+    if (owner)
+        e->owner = owner;
+
+    /* Cannot fail: the buckets are there */
+    (void) entry_update(pp, units, nunits);
+    e = *pp;
+
+    /* Log the change in the same critical section, so the log keeps per-session order */
+    if (entry_log(idx, e, sid, sidlen, cc_request_type, units, nunits) != 0)
+        fd_log_error("A ledger change could not be logged, it will be lost after a restart\n");
+
+    if (out)
+        *out = e->totals;
+
+    if (cc_request_type == 3) {
+        shard_remove(s, pp);
+        goto out;
+    }
+
+rearm:
+    entry_arm(s, *pp);
+out:
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+uint64_t ledger_live_sessions(void)
+{
+    return atomic_load_explicit(&live_sessions, memory_order_relaxed);
+}
+
+int ledger_foreach(int (*cb)(const struct ledger_record *rec, void *opaque), void *opaque)
+{
+    unsigned i;
+    size_t b, n;
+
+    for (i = 0; i < LEDGER_SHARDS; i++) {
+        struct ledger_shard *s = &shards[i];
+        struct ledger_entry **copy;
+        int ret = 0;
+
+        /* Copy the shard so that the callback (usually I/O) runs without the lock */
+        CHECK_POSIX(pthread_mutex_lock(&s->lock));
+        if ((copy = malloc((s->count + 1) * sizeof(*copy))) == NULL) {
+            pthread_mutex_unlock(&s->lock);
+            return ENOMEM;
+        }
+        for (n = 0, b = 0; b < s->nbuckets; b++) {
+            struct ledger_entry *e;
+            for (e = s->buckets[b]; e; e = e->next) {
+                size_t sz = entry_size(e->bucket_cap, e->sidlen);
+                struct ledger_entry *c = malloc(sz);
+                if (!c) {
+                    ret = ENOMEM;
+                    break;
+                }
+                memcpy(c, e, sz);
+                copy[n++] = c;
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        for (b = 0; b < n; b++) {
+            struct ledger_record rec = {
+                .sid = entry_sid(copy[b]),
+                .sidlen = copy[b]->sidlen,
+                .seq = copy[b]->seq,
+                .totals = copy[b]->totals,
+                .buckets = copy[b]->buckets,
+                .nbuckets = copy[b]->nbuckets,
+                .owner = copy[b]->owner,
+            };
+            if (!ret)
+                ret = cb(&rec, opaque);
+            free(copy[b]);
+        }
+        free(copy);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+int ledger_restore(const struct ledger_record *rec)
+{
+    uint64_t h = gy_hash(rec->sid, rec->sidlen);
+    struct ledger_shard *s = &shards[shard_index(h)];
+    struct ledger_entry **pp;
+    int ret;
+
+    CHECK_POSIX(pthread_mutex_lock(&s->lock));
+    if ((ret = shard_lookup(s, rec->sid, rec->sidlen, h, 1, &pp)) == 0) {
+        entry_disarm(s, *pp);
+        if ((ret = entry_reserve(pp, rec->nbuckets)) == 0) {
+            struct ledger_entry *e = *pp;
+            e->seq = rec->seq;
+            e->totals = rec->totals;
+            e->nbuckets = rec->nbuckets;
+            memcpy(e->buckets, rec->buckets, rec->nbuckets * sizeof(*rec->buckets));
+        }
+        /* The session gets a full timeout from the restart */
+        entry_arm(s, *pp);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+int ledger_replay(const uint8_t *sid, size_t sidlen, uint64_t seq, uint32_t cc_request_type,
+                  const struct ledger_unit *units, unsigned nunits)
+{
+    uint64_t h = gy_hash(sid, sidlen);
+    struct ledger_shard *s = &shards[shard_index(h)];
+    struct ledger_entry **pp;
+    int ret;
+
+    CHECK_POSIX(pthread_mutex_lock(&s->lock));
+    if ((ret = shard_lookup(s, sid, sidlen, h, 1, &pp)) != 0)
+        goto out;
+
+    /* Already part of the snapshot */
+    if ((*pp)->seq >= seq)
+        goto out;
+
+    entry_disarm(s, *pp);
+    (*pp)->seq = seq;
+    ret = entry_update(pp, units, nunits);
+    if (!ret && cc_request_type == 3)
+        shard_remove(s, pp);
+    else
+        entry_arm(s, *pp);
+out:
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+void ledger_clear(void)
+{
+    unsigned i;
+    size_t b;
+
+    for (i = 0; i < LEDGER_SHARDS; i++) {
+        struct ledger_shard *s = &shards[i];
+
+        pthread_mutex_lock(&s->lock);
+        for (b = 0; b < s->nbuckets; b++) {
+            while (s->buckets[b])
+                shard_remove(s, &s->buckets[b]);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/* Expired sessions of one shard, collected under its lock */
+struct reap_ctx {
+    struct ledger_shard *s;
+    unsigned idx;
+    struct ledger_entry **out;
+    unsigned n;
+};
+
+static void reap_fire(struct tw_timer *t, void *opaque)
+{
+    struct reap_ctx *ctx = opaque;
+    struct ledger_entry *e = (struct ledger_entry *)((char *)t - offsetof(struct ledger_entry, timer));
+    struct ledger_entry **pp;
+
+    if (shard_lookup(ctx->s, entry_sid(e), e->sidlen, e->hash, 0, &pp) != 0 || !pp || *pp != e)
+        return;
+
+    /* A final record, so that recovery (or the standby) does not keep the session */
+    if (entry_log(ctx->idx, e, entry_sid(e), e->sidlen, 3, NULL, 0) != 0)
+        fd_log_error("Expiry of a session could not be logged, it will be back after a restart\n");
+
+    /* Unlink only: the entry is reported and freed once the lock is released */
+    *pp = e->next;
+    ctx->s->count--;
+    atomic_fetch_sub_explicit(&live_sessions, 1, memory_order_relaxed);
+    ctx->out[ctx->n++] = e;
+}
+
+static void *ledger_reaper(void *arg)
+{
+    struct ledger_entry **out;
+    unsigned i, j;
+
+    CHECK_MALLOC_DO(out = calloc(reaper_batch, sizeof(*out)), return NULL);
+
+    while (reaper_running) {
+        struct timespec ts = { 1, 0 };
+        int busy = 0;
+
+        for (i = 0; i < LEDGER_SHARDS && reaper_running; i++) {
+            struct reap_ctx ctx = { &shards[i], i, out, 0 };
+
+            pthread_mutex_lock(&shards[i].lock);
+            (void) tw_advance_max(shards[i].wheel, now_ns(), reap_fire, &ctx, reaper_batch);
+            pthread_mutex_unlock(&shards[i].lock);
+
+            for (j = 0; j < ctx.n; j++) {
+                struct ledger_entry *e = out[j];
+                struct ledger_record rec = {
+                    .sid = entry_sid(e),
+                    .sidlen = e->sidlen,
+                    .seq = e->seq,
+                    .totals = e->totals,
+                    .buckets = e->buckets,
+                    .nbuckets = e->nbuckets,
+                    .owner = e->owner,
+                };
+                if (reaper_cb)
+                    reaper_cb(&rec);
+                free(e);
+            }
+            atomic_fetch_add_explicit(&expired_sessions, ctx.n, memory_order_relaxed);
+            if (ctx.n == reaper_batch)
+                busy = 1;
+        }
+
+        /* Come back soon while a backlog of expired sessions remains */
+        if (busy) {
+            ts.tv_sec = 0;
+            ts.tv_nsec = 10000000;
+        }
+        nanosleep(&ts, NULL);
+    }
+    free(out);
+    return NULL;
+}
+
+int ledger_reaper_start(unsigned batch, void (*expired)(const struct ledger_record *rec))
+{
+    if (!session_timeout_ns)
+        return 0;
+    CHECK_PARAMS(batch > 0);
+    reaper_batch = batch;
+    reaper_cb = expired;
+    reaper_running = 1;
+    CHECK_POSIX(pthread_create(&reaper, NULL, ledger_reaper, NULL));
+    fd_log_notice("Session expiry: %.0fs without CCR, at most %u sessions per shard and pass\n",
+                  (double)session_timeout_ns / NS_PER_SEC, batch);
+    return 0;
+}
+
+uint64_t ledger_expired_sessions(void)
+{
+    return atomic_load_explicit(&expired_sessions, memory_order_relaxed);
+}
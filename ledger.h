@@ -0,0 +1,119 @@
+#ifndef GY_LEDGER_H
+#define GY_LEDGER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Per-session quota counters, as seen after a ledger operation */
+struct ledger_totals {
+    uint64_t granted;    /* sum of all quota granted to the session */
+    uint64_t used;       /* sum of all usage reported by the session */
+    uint64_t reserved;   /* granted quota not yet settled by a usage report */
+    uint32_t ccr_count;  /* number of CCRs applied to the session */
+};
+
+/* Rating group of the service units found outside of any Multiple-Services-Credit-Control */
+#define LEDGER_NO_RATING_GROUP  UINT32_MAX
+
+/* What one CCR does to one rating group of the session */
+struct ledger_unit {
+    uint32_t rating_group;
+    uint32_t pad;
+    uint64_t used;       /* usage reported for the group */
+    uint64_t granted;    /* new grant for the group, 0 if none */
+};
+
+/* Counters of one rating group; a session keeps them in one contiguous array */
+struct ledger_bucket {
+    uint32_t rating_group;
+    uint32_t pad;
+    uint64_t granted;
+    uint64_t used;
+    uint64_t reserved;
+};
+
+/*
+ * Create / destroy the sharded session table. With session_timeout_s, a
+ * session that sees no CCR for that long expires (see ledger_reaper_start);
+ * 0 keeps sessions until their TERMINATE.
+ */
+int  ledger_init(uint32_t session_timeout_s);
+void ledger_fini(void);
+
+/*
+ * Rating step of ledger_apply, run under the shard lock before the session
+ * changes. It gets the reservations the CCR replaces: reserved[i] for the
+ * rating group of units[i] and total for the whole session, 0 when the
+ * session or the group is unknown, and the owner they were made for (NULL
+ * after a restart or a standby takeover: nothing reserved them in this
+ * process). It settles them and sets units[i].granted. Expiry takes
+ * the same lock, so a reservation is released either here or at expiry,
+ * never both.
+ */
+#define LEDGER_RATE_UNITS_MAX  64
+
+typedef void (*ledger_rate_cb)(void *arg, void *owner, const uint64_t *reserved, uint64_t total,
+                               struct ledger_unit *units, unsigned nunits);
+
+/*
+ * Apply one CCR to the session identified by sid (hash = gy_hash(sid)).
+ * rate (when not NULL) decides the grants first, see ledger_rate_cb.
+ * For each unit, the CCR settles the outstanding reservation of the rating
+ * group with the used octets, and the granted octets (possibly 0) become
+ * its new reservation. A TERMINATE (cc_request_type 3) removes the session.
+ * The resulting session counters are copied to *out when not NULL.
+ * owner (when not NULL) is remembered and handed back if the session expires.
+ */
+int ledger_apply(const uint8_t *sid, size_t sidlen, uint64_t hash, uint32_t cc_request_type,
+                 struct ledger_unit *units, unsigned nunits, void *owner,
+                 ledger_rate_cb rate, void *rate_arg, struct ledger_totals *out);
+
+/* Number of sessions currently held in the table */
+uint64_t ledger_live_sessions(void);
+
+/* Number of shards; a session always maps to shard (hash >> (64 - LEDGER_SHARD_BITS)) */
+#define LEDGER_SHARD_BITS  8
+#define LEDGER_SHARDS      (1U << LEDGER_SHARD_BITS)
+
+/*
+ * Persistence support (see wal.c).
+ * Every change is stamped with a sequence number, remembered per session,
+ * so that replaying a log over a snapshot skips what the snapshot already has.
+ */
+struct ledger_record {
+    const uint8_t *sid;
+    size_t sidlen;
+    uint64_t seq;                /* last change applied to the session */
+    struct ledger_totals totals;
+    const struct ledger_bucket *buckets;
+    unsigned nbuckets;
+    void *owner;                 /* as given to ledger_apply, NULL after a restart or a takeover */
+};
+
+/* Call cb for every live session; each shard is copied under its lock, then reported unlocked */
+int ledger_foreach(int (*cb)(const struct ledger_record *rec, void *opaque), void *opaque);
+
+/* Insert a session read from a snapshot */
+int ledger_restore(const struct ledger_record *rec);
+
+/* Re-apply a logged change, unless the session already reflects seq */
+int ledger_replay(const uint8_t *sid, size_t sidlen, uint64_t seq, uint32_t cc_request_type,
+                  const struct ledger_unit *units, unsigned nunits);
+
+/* Remove every session, before a standby receives a full copy (see repl.c) */
+void ledger_clear(void);
+
+/*
+ * Session expiry. Each shard keeps the expiry timers of its sessions in a
+ * timer wheel with 1 s ticks, re-armed by every CCR. A reaper thread
+ * advances the wheels and removes at most batch expired sessions per shard
+ * and pass, so the shard locks are never held long. For each of them, a
+ * TERMINATE without usage is logged (the WAL forgets the session as well),
+ * then expired() is called outside of the lock with the final record.
+ */
+int  ledger_reaper_start(unsigned batch, void (*expired)(const struct ledger_record *rec));
+
+/* Number of sessions removed by the reaper */
+uint64_t ledger_expired_sessions(void);
+
+#endif /* GY_LEDGER_H */
@@ -0,0 +1,281 @@
+#include "utils.h"
+#include "histo.h"
+#include "codec.h"
+#include "metrics.h"
+
+#include <stdatomic.h>
+
+/* Result-Codes with their own series; the others are counted as "other" */
+static const uint32_t results[] = { METRICS_NO_ANSWER, 2001, 3004, 4012, 5012, 5030 };
+#define NRESULTS   (sizeof(results) / sizeof(results[0]) + 1)
+#define NTYPES     5    /* CC-Request-Type 1..4, 0 = absent or unknown */
+
+/* Upper bounds of the latency histogram buckets, in seconds */
+static const double latency_bounds[] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5 };
+
+/* Counters of one thread; single writer */
+struct metrics_thread {
+    atomic_uint_fast64_t requests[NTYPES];
+    atomic_uint_fast64_t answers[NTYPES][NRESULTS];
+    atomic_uint_fast64_t granted_octets;
+    atomic_uint_fast64_t used_octets;
+    struct histo latency[3];    /* INITIAL, UPDATE, TERMINATE */
+    struct metrics_thread *next;
+} __attribute__((aligned(64)));
+
+/* Sum over all threads */
+struct metrics_totals {
+    uint64_t requests[NTYPES];
+    uint64_t answers[NTYPES][NRESULTS];
+    uint64_t granted_octets;
+    uint64_t used_octets;
+    struct histo_snapshot latency[3];
+};
+
+static __thread struct metrics_thread *self;
+static struct metrics_thread *threads;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile int enabled;
+static char *prefix, *path, *tmp_path;
+static double interval;
+static pthread_t exporter;
+static volatile int exporter_running;
+
+/* Series of other modules, printed after ours */
+#define METRICS_EXTRAS 4
+static void (*extras[METRICS_EXTRAS])(FILE *f, const char *prefix);
+static atomic_uint nextras;
+
+static inline void inc(atomic_uint_fast64_t *c, uint64_t v)
+{
+    /* Single writer: a relaxed load + store is enough and avoids a locked op */
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static struct metrics_thread *metrics_self(void)
+{
+    struct metrics_thread *t;
+
+    if (self)
+        return self;
+    /* First count from this thread: register its block */
+    if (posix_memalign((void **)&t, 64, sizeof(*t)) != 0)
+        return NULL;
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_lock(&threads_lock);
+    t->next = threads;
+    threads = t;
+    pthread_mutex_unlock(&threads_lock);
+    return self = t;
+}
+
+static inline unsigned type_index(uint32_t cc_request_type)
+{
+    return cc_request_type < NTYPES ? cc_request_type : 0;
+}
+
+static inline unsigned result_index(uint32_t result_code)
+{
+    unsigned i;
+
+    for (i = 0; i < NRESULTS - 1; i++) {
+        if (results[i] == result_code)
+            return i;
+    }
+    return NRESULTS - 1;
+}
+
+void metrics_request(uint32_t cc_request_type, uint64_t used)
+{
+    struct metrics_thread *t;
+
+    if (!enabled || !(t = metrics_self()))
+        return;
+    inc(&t->requests[type_index(cc_request_type)], 1);
+    if (used)
+        inc(&t->used_octets, used);
+}
+
+void metrics_answer(uint32_t cc_request_type, uint32_t result_code, uint64_t granted)
+{
+    struct metrics_thread *t;
+
+    if (!enabled || !(t = metrics_self()))
+        return;
+    inc(&t->answers[type_index(cc_request_type)][result_index(result_code)], 1);
+    if (granted)
+        inc(&t->granted_octets, granted);
+}
+
+void metrics_latency(uint32_t cc_request_type, uint64_t ns)
+{
+    struct metrics_thread *t;
+
+    if (!enabled || cc_request_type < 1 || cc_request_type > 3 || !(t = metrics_self()))
+        return;
+    histo_record(&t->latency[cc_request_type - 1], ns);
+}
+
+static void metrics_collect(struct metrics_totals *m)
+{
+    struct metrics_thread *t;
+    unsigned i, j;
+
+    memset(m, 0, sizeof(*m));
+    pthread_mutex_lock(&threads_lock);
+    for (t = threads; t; t = t->next) {
+        for (i = 0; i < NTYPES; i++) {
+            m->requests[i] += atomic_load_explicit(&t->requests[i], memory_order_relaxed);
+            for (j = 0; j < NRESULTS; j++)
+                m->answers[i][j] += atomic_load_explicit(&t->answers[i][j], memory_order_relaxed);
+        }
+        m->granted_octets += atomic_load_explicit(&t->granted_octets, memory_order_relaxed);
+        m->used_octets += atomic_load_explicit(&t->used_octets, memory_order_relaxed);
+        for (i = 0; i < 3; i++)
+            histo_merge(&m->latency[i], &t->latency[i]);
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
+
+static const char *type_label(unsigned i)
+{
+    return i ? gy_request_type_name(i) : "NONE";
+}
+
+static void result_label(unsigned j, char *buf, size_t len)
+{
+    if (j == NRESULTS - 1)
+        snprintf(buf, len, "other");
+    else if (results[j] == METRICS_NO_ANSWER)
+        snprintf(buf, len, "none");
+    else
+        snprintf(buf, len, "%u", results[j]);
+}
+
+static void metrics_print(FILE *f, const struct metrics_totals *m)
+{
+    uint64_t sent = 0, answered = 0;
+    unsigned i, j, b;
+    char res[16];
+
+    fprintf(f, "# HELP %s_requests_total Credit-Control-Requests by CC-Request-Type.\n", prefix);
+    fprintf(f, "# TYPE %s_requests_total counter\n", prefix);
+    for (i = 0; i < NTYPES; i++) {
+        sent += m->requests[i];
+        if (m->requests[i] || (i >= 1 && i <= 3))
+            fprintf(f, "%s_requests_total{type=\"%s\"} %lu\n", prefix, type_label(i), (unsigned long)m->requests[i]);
+    }
+
+    fprintf(f, "# HELP %s_answers_total Credit-Control-Answers by CC-Request-Type and Result-Code.\n", prefix);
+    fprintf(f, "# TYPE %s_answers_total counter\n", prefix);
+    for (i = 0; i < NTYPES; i++) {
+        for (j = 0; j < NRESULTS; j++) {
+            answered += m->answers[i][j];
+            if (!m->answers[i][j])
+                continue;
+            result_label(j, res, sizeof(res));
+            fprintf(f, "%s_answers_total{type=\"%s\",result=\"%s\"} %lu\n", prefix, type_label(i), res,
+                    (unsigned long)m->answers[i][j]);
+        }
+    }
+
+    fprintf(f, "# HELP %s_in_flight Requests waiting for their answer.\n", prefix);
+    fprintf(f, "# TYPE %s_in_flight gauge\n", prefix);
+    fprintf(f, "%s_in_flight %lu\n", prefix, (unsigned long)(sent > answered ? sent - answered : 0));
+
+    fprintf(f, "# HELP %s_granted_octets_total Octets granted in Granted-Service-Units.\n", prefix);
+    fprintf(f, "# TYPE %s_granted_octets_total counter\n", prefix);
+    fprintf(f, "%s_granted_octets_total %lu\n", prefix, (unsigned long)m->granted_octets);
+    fprintf(f, "# HELP %s_used_octets_total Octets reported in Used-Service-Units.\n", prefix);
+    fprintf(f, "# TYPE %s_used_octets_total counter\n", prefix);
+    fprintf(f, "%s_used_octets_total %lu\n", prefix, (unsigned long)m->used_octets);
+
+    fprintf(f, "# HELP %s_latency_seconds Time from request to answer.\n", prefix);
+    fprintf(f, "# TYPE %s_latency_seconds histogram\n", prefix);
+    for (i = 0; i < 3; i++) {
+        const struct histo_snapshot *h = &m->latency[i];
+        const char *t = gy_request_type_name(i + 1);
+        for (b = 0; b < sizeof(latency_bounds) / sizeof(latency_bounds[0]); b++)
+            fprintf(f, "%s_latency_seconds_bucket{type=\"%s\",le=\"%g\"} %lu\n", prefix, t, latency_bounds[b],
+                    (unsigned long)histo_count_le(h, (uint64_t)(latency_bounds[b] * NS_PER_SEC)));
+        fprintf(f, "%s_latency_seconds_bucket{type=\"%s\",le=\"+Inf\"} %lu\n", prefix, t, (unsigned long)h->total);
+        fprintf(f, "%s_latency_seconds_sum{type=\"%s\"} %.9f\n", prefix, t, (double)histo_sum(h) / NS_PER_SEC);
+        fprintf(f, "%s_latency_seconds_count{type=\"%s\"} %lu\n", prefix, t, (unsigned long)h->total);
+    }
+}
+
+/* Rewrite the metrics file; readers see either the old or the new content */
+static void metrics_write(void)
+{
+    struct metrics_totals *m;
+    unsigned i;
+    FILE *f;
+
+    CHECK_MALLOC_DO(m = malloc(sizeof(*m)), return);
+    metrics_collect(m);
+    if ((f = fopen(tmp_path, "w")) == NULL) {
+        fd_log_error("Metrics: cannot write %s: %s\n", tmp_path, strerror(errno));
+        free(m);
+        return;
+    }
+    metrics_print(f, m);
+    free(m);
+    for (i = 0; i < atomic_load_explicit(&nextras, memory_order_acquire); i++)
+        extras[i](f, prefix);
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0)
+        fd_log_error("Metrics: cannot update %s: %s\n", path, strerror(errno));
+}
+
+static void *metrics_exporter(void *arg)
+{
+    uint64_t next = now_ns();
+
+    while (exporter_running) {
+        next += (uint64_t)(interval * NS_PER_SEC);
+        /* Sleep in short steps so that metrics_stop does not wait long */
+        while (exporter_running && now_ns() < next)
+            usleep(100000);
+        if (exporter_running)
+            metrics_write();
+    }
+    return NULL;
+}
+
+int metrics_register(void (*print)(FILE *f, const char *prefix))
+{
+    unsigned n = atomic_load(&nextras);
+
+    CHECK_PARAMS(print && n < METRICS_EXTRAS);
+    extras[n] = print;
+    atomic_store_explicit(&nextras, n + 1, memory_order_release);
+    return 0;
+}
+
+int metrics_start(const char *pfx, const char *file, double interval_s)
+{
+    if (!file || !*file)
+        return 0;
+    CHECK_PARAMS(pfx && interval_s > 0);
+    CHECK_MALLOC(prefix = strdup(pfx));
+    CHECK_MALLOC(path = strdup(file));
+    CHECK_MALLOC(tmp_path = malloc(strlen(file) + 5));
+    sprintf(tmp_path, "%s.tmp", file);
+    interval = interval_s;
+    enabled = 1;
+    exporter_running = 1;
+    CHECK_POSIX(pthread_create(&exporter, NULL, metrics_exporter, NULL));
+    fd_log_notice("Metrics: written to %s every %.1fs\n", path, interval);
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    if (!exporter_running)
+        return;
+    exporter_running = 0;
+    pthread_join(exporter, NULL);
+    metrics_write();
+    enabled = 0;
+    /* The per-thread blocks stay: threads of freeDiameter may still count */
+}
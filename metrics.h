@@ -0,0 +1,47 @@
+#ifndef GY_METRICS_H
+#define GY_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Counters of an extension, exported in the Prometheus text format.
+ *
+ * Each thread that counts gets its own cache-line aligned block of
+ * counters, registered on first use; counting is a relaxed load and store
+ * on that block, with no lock and no shared cache line. A background
+ * thread adds the blocks up every interval and rewrites the metrics file
+ * (through a temporary file and a rename, as the node_exporter textfile
+ * collector expects).
+ *
+ * Exported, with the given prefix:
+ *  - <prefix>_requests_total{type}: CCRs sent (client) or received (server),
+ *  - <prefix>_answers_total{type,result}: CCAs by Result-Code; result="none"
+ *    counts requests that got no answer (timed out, or dropped),
+ *  - <prefix>_in_flight: requests without answer yet,
+ *  - <prefix>_granted_octets_total and <prefix>_used_octets_total,
+ *  - <prefix>_latency_seconds{type}: histogram of the round trip (client)
+ *    or of the time to answer (server).
+ * Other modules may add their own series (see metrics_register).
+ */
+
+/* Result given for a request that got no answer */
+#define METRICS_NO_ANSWER 0
+
+/* Start exporting to path every interval_s seconds; without a path nothing is counted */
+int  metrics_start(const char *prefix, const char *path, double interval_s);
+
+/* print writes more series to the metrics file, from the exporter thread, at every export */
+int  metrics_register(void (*print)(FILE *f, const char *prefix));
+
+/* Write the file a last time and stop the exporter */
+void metrics_stop(void);
+
+/* A CCR was sent or received, reporting used octets */
+void metrics_request(uint32_t cc_request_type, uint64_t used);
+
+/* Its answer was received or sent, granting granted octets */
+void metrics_answer(uint32_t cc_request_type, uint32_t result_code, uint64_t granted);
+void metrics_latency(uint32_t cc_request_type, uint64_t ns);
+
+#endif /* GY_METRICS_H */
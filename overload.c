@@ -0,0 +1,111 @@
+#include "utils.h"
+#include "codec.h"
+#include "overload.h"
+
+#include <stdatomic.h>
+
+/* Weight of a new sample in the service time average: 1/16 */
+#define EWMA_SHIFT 4
+
+static struct overload_conf conf;
+static unsigned initial_limit;          /* in-progress limit for CCR-I */
+
+static atomic_uint in_progress;
+static atomic_uint_fast64_t service_ewma_ns;
+static atomic_int shedding;             /* for logging the start and end of an overload */
+static atomic_uint_fast64_t admitted[5];
+static atomic_uint_fast64_t shed[5];
+
+int overload_init(const struct overload_conf *c)
+{
+    CHECK_PARAMS(c && c->initial_share > 0 && c->initial_share <= 1);
+    conf = *c;
+    if (!conf.parallelism)
+        conf.parallelism = 1;
+    initial_limit = (unsigned)(conf.max_in_progress * conf.initial_share);
+    if (conf.max_in_progress && !initial_limit)
+        initial_limit = 1;
+    if (conf.max_in_progress || conf.max_delay_ms > 0)
+        fd_log_notice("Overload control: %u CCRs in progress (%u for CCR-I), CCR-I shed above %.1f ms estimated wait\n",
+                      conf.max_in_progress, initial_limit, conf.max_delay_ms);
+    return 0;
+}
+
+static inline unsigned type_index(uint32_t cc_request_type)
+{
+    return cc_request_type <= 4 ? cc_request_type : 0;
+}
+
+/* Estimated wait of a CCR admitted now, in ms */
+static double estimated_wait_ms(unsigned queued)
+{
+    uint64_t ewma = atomic_load_explicit(&service_ewma_ns, memory_order_relaxed);
+    return (double)queued * ewma / conf.parallelism / 1e6;
+}
+
+int overload_admit(uint32_t cc_request_type)
+{
+    unsigned idx = type_index(cc_request_type);
+    int existing = (cc_request_type == 2 || cc_request_type == 3);
+    unsigned limit = existing ? conf.max_in_progress : initial_limit;
+    unsigned queued;
+
+    /* Take the place first, so that concurrent dispatch threads cannot overshoot the limit */
+    queued = atomic_fetch_add_explicit(&in_progress, 1, memory_order_relaxed);
+    if ((limit && queued >= limit)
+        || (!existing && conf.max_delay_ms > 0 && estimated_wait_ms(queued) > conf.max_delay_ms)) {
+        atomic_fetch_sub_explicit(&in_progress, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&shed[idx], 1, memory_order_relaxed);
+        if (!atomic_exchange_explicit(&shedding, 1, memory_order_relaxed))
+            fd_log_notice("Overload: shedding %s requests, %u in progress, estimated wait %.1f ms\n",
+                          gy_request_type_name(cc_request_type), queued, estimated_wait_ms(queued));
+        return 0;
+    }
+
+    atomic_fetch_add_explicit(&admitted[idx], 1, memory_order_relaxed);
+    if (!existing && atomic_load_explicit(&shedding, memory_order_relaxed)
+        && atomic_exchange_explicit(&shedding, 0, memory_order_relaxed))
+        fd_log_notice("Overload: over, %u in progress\n", queued);
+    return 1;
+}
+
+void overload_done(uint64_t service_ns)
+{
+    uint64_t cur = atomic_load_explicit(&service_ewma_ns, memory_order_relaxed), next;
+
+    do {
+        next = cur - (cur >> EWMA_SHIFT) + (service_ns >> EWMA_SHIFT);
+    } while (!atomic_compare_exchange_weak_explicit(&service_ewma_ns, &cur, next,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    atomic_fetch_sub_explicit(&in_progress, 1, memory_order_relaxed);
+}
+
+void overload_get_stats(struct overload_stats *out)
+{
+    unsigned i;
+
+    for (i = 0; i < 5; i++) {
+        out->admitted[i] = atomic_load_explicit(&admitted[i], memory_order_relaxed);
+        out->shed[i] = atomic_load_explicit(&shed[i], memory_order_relaxed);
+    }
+    out->in_progress = atomic_load_explicit(&in_progress, memory_order_relaxed);
+    out->service_ewma_ns = atomic_load_explicit(&service_ewma_ns, memory_order_relaxed);
+}
+
+void overload_log_stats(void)
+{
+    struct overload_stats s;
+    unsigned i;
+
+    overload_get_stats(&s);
+    for (i = 1; i <= 4; i++) {
+        if (!s.admitted[i] && !s.shed[i])
+            continue;
+        fd_log_notice("Overload control: %-9s admitted %lu, shed %lu (3004)\n",
+                      gy_request_type_name(i), (unsigned long)s.admitted[i], (unsigned long)s.shed[i]);
+    }
+    if (s.admitted[0] || s.shed[0])
+        fd_log_notice("Overload control: without CC-Request-Type admitted %lu, shed %lu\n",
+                      (unsigned long)s.admitted[0], (unsigned long)s.shed[0]);
+    fd_log_notice("Overload control: average service time %.3f ms\n", s.service_ewma_ns / 1e6);
+}
@@ -0,0 +1,49 @@
+#ifndef GY_OVERLOAD_H
+#define GY_OVERLOAD_H
+
+#include <stdint.h>
+
+/*
+ * Admission control for the server.
+ *
+ * Every CCR is either admitted or shed before it is rated. The decision
+ * uses the number of CCRs admitted but not answered yet (in progress) and
+ * an exponentially weighted moving average of the time a CCR takes to rate.
+ * Together they estimate how long a new CCR would wait.
+ *
+ * Existing sessions come first. CCR-I (and EVENT) are only admitted below
+ * initial_share of the in-progress limit and while the estimated wait is
+ * under max_delay_ms. CCR-U and CCR-T may use the whole limit. During a
+ * storm of new sessions, the sessions already open keep reporting usage
+ * and getting quota. A shed CCR is answered with DIAMETER_TOO_BUSY (3004).
+ */
+
+struct overload_conf {
+    unsigned max_in_progress;     /* CCRs in progress, 0 = no limit */
+    double initial_share;         /* share of max_in_progress open to CCR-I, in (0, 1] */
+    double max_delay_ms;          /* estimated wait above which CCR-I are shed, 0 = no limit */
+    unsigned parallelism;         /* threads rating CCRs, used to estimate the wait */
+};
+
+/* Admission counters, indexed by CC-Request-Type (0 when absent or unknown) */
+struct overload_stats {
+    uint64_t admitted[5];
+    uint64_t shed[5];
+    unsigned in_progress;
+    uint64_t service_ewma_ns;
+};
+
+int  overload_init(const struct overload_conf *conf);
+
+/* Non-zero if the CCR is admitted; an admitted CCR must be followed by overload_done() */
+int  overload_admit(uint32_t cc_request_type);
+
+/* An admitted CCR was answered after service_ns of rating */
+void overload_done(uint64_t service_ns);
+
+void overload_get_stats(struct overload_stats *out);
+
+/* Log the counters per request type */
+void overload_log_stats(void);
+
+#endif /* GY_OVERLOAD_H */
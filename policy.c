@@ -0,0 +1,612 @@
+#include "utils.h"
+#include "policy.h"
+
+#include <stdatomic.h>
+#include <sched.h>
+
+#define MAX_NAMES       64          /* tiers, periods and bands, each */
+#define MAX_NAME_LEN    32
+#define MAX_GROUPS      255         /* rating groups named in the rules */
+#define MAX_RANGES      4096        /* MSISDN ranges of all tiers */
+#define MAX_RULES       4096
+#define MAX_CELLS       (1U << 20)
+#define DIRECT_GROUPS   256         /* rating groups below this are mapped by a direct table */
+#define ANY             (-1)
+
+/* MSISDNs first..last belong to tier */
+struct tier_range {
+    uint64_t first, last;
+    uint32_t tier;
+};
+
+/*
+ * A compiled policy, read-only once installed. Entry 0 of each dimension
+ * stands for what the rules do not name: subscribers in no tier range,
+ * other rating groups (and top-level service units), hours in no period,
+ * balances below the lowest band.
+ */
+struct policy {
+    unsigned ntiers, ngroups, nperiods, nbands;
+    long utc_offset;                            /* of the local time when compiled, seconds */
+    uint8_t period_of_hour[24];
+    uint16_t group_direct[DIRECT_GROUPS];       /* rating group -> index */
+    unsigned nlarge;
+    uint32_t large_groups[MAX_GROUPS];          /* rating groups >= DIRECT_GROUPS, sorted */
+    uint16_t large_index[MAX_GROUPS];
+    unsigned nranges;
+    struct tier_range *ranges;                  /* sorted, not overlapping */
+    uint64_t band_floor[MAX_NAMES + 1];         /* band b applies from band_floor[b] octets, ascending */
+    uint64_t *grant;                            /* [tier][group][period][band] */
+    unsigned nrules;
+};
+
+/* Rating threads announce when they read the current policy: odd seq = reading */
+struct policy_reader {
+    atomic_uint_fast64_t seq;
+    struct policy_reader *next;
+} __attribute__((aligned(64)));
+
+static _Atomic(struct policy *) current;
+static _Atomic(struct policy_reader *) readers;
+static __thread struct policy_reader *self;
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *rules_path;
+static void (*reloaded_cb)(void);      /* called after a successful SIGHUP reload */
+
+/*
+ * Compilation
+ */
+
+struct names {
+    unsigned n;                                 /* entries 1..n; 0 is unnamed */
+    char name[MAX_NAMES + 1][MAX_NAME_LEN];
+};
+
+/* A grant rule, with ANY or an index per dimension */
+struct rule {
+    int tier, group, period, band;
+    uint64_t octets;
+};
+
+struct compiler {
+    const char *path;
+    unsigned line;
+    struct names tiers, periods, bands;
+    unsigned ngroups;
+    uint32_t groups[MAX_GROUPS + 1];            /* rating group of each index >= 1 */
+    struct tier_range ranges[MAX_RANGES];
+    unsigned nranges;
+    int hour_period[24];
+    struct rule rules[MAX_RULES];
+    unsigned nrules;
+};
+
+static int name_find(const struct names *t, const char *name)
+{
+    unsigned i;
+
+    for (i = 1; i <= t->n; i++) {
+        if (!strcmp(t->name[i], name))
+            return i;
+    }
+    return 0;
+}
+
+static int name_add(struct compiler *c, struct names *t, const char *name)
+{
+    int i = name_find(t, name);
+
+    if (i)
+        return i;
+    if (t->n == MAX_NAMES || strlen(name) >= MAX_NAME_LEN || !strcmp(name, "*")) {
+        fd_log_error("%s:%u: invalid name '%s' or too many names\n", c->path, c->line, name);
+        return -1;
+    }
+    strcpy(t->name[++t->n], name);
+    return t->n;
+}
+
+static int parse_u64(const char *s, uint64_t *out)
+{
+    char *end;
+
+    if (*s < '0' || *s > '9')
+        return EINVAL;
+    errno = 0;
+    *out = strtoull(s, &end, 10);
+    return (errno || *end) ? EINVAL : 0;
+}
+
+/* Octets with an optional K, M, G or T (binary) suffix, or deny / unlimited */
+static int parse_octets(const char *s, uint64_t *out)
+{
+    char *end;
+    unsigned shift = 0;
+
+    if (!strcmp(s, "deny")) {
+        *out = 0;
+        return 0;
+    }
+    if (!strcmp(s, "unlimited")) {
+        *out = POLICY_NO_LIMIT;
+        return 0;
+    }
+    if (*s < '0' || *s > '9')
+        return EINVAL;
+    errno = 0;
+    *out = strtoull(s, &end, 10);
+    switch (*end) {
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+        case 'T': case 't': shift = 40; end++; break;
+    }
+    if (errno || *end || *out > (POLICY_NO_LIMIT - 1) >> shift)
+        return EINVAL;
+    *out <<= shift;
+    return 0;
+}
+
+/* period <name> <from hour> <to hour>: the hours [from, to), wrapping over midnight */
+static int compile_period(struct compiler *c, char **tok, int ntok)
+{
+    uint64_t from, to, h;
+    int p;
+
+    if (ntok != 4 || parse_u64(tok[2], &from) || parse_u64(tok[3], &to) || from > 23 || to > 24 || from == to) {
+        fd_log_error("%s:%u: expected: period <name> <from hour 0-23> <to hour 0-24>\n", c->path, c->line);
+        return EINVAL;
+    }
+    if ((p = name_add(c, &c->periods, tok[1])) < 0)
+        return EINVAL;
+    for (h = from; h != to; h = (h + 1) % 24) {
+        c->hour_period[h] = p;
+        if (to == 24 && h == 23)
+            break;
+    }
+    return 0;
+}
+
+/* tier <name> <first MSISDN> [<last MSISDN>] */
+static int compile_tier(struct compiler *c, char **tok, int ntok)
+{
+    struct tier_range *r;
+    int t;
+
+    if (ntok < 3 || ntok > 4 || c->nranges == MAX_RANGES) {
+        fd_log_error("%s:%u: expected: tier <name> <first MSISDN> [<last MSISDN>]\n", c->path, c->line);
+        return EINVAL;
+    }
+    if ((t = name_add(c, &c->tiers, tok[1])) < 0)
+        return EINVAL;
+    r = &c->ranges[c->nranges];
+    if (parse_u64(tok[2], &r->first) || parse_u64(tok[ntok - 1], &r->last) || r->last < r->first) {
+        fd_log_error("%s:%u: invalid MSISDN range\n", c->path, c->line);
+        return EINVAL;
+    }
+    r->tier = t;
+    c->nranges++;
+    return 0;
+}
+
+/* band <name> <floor octets>, in increasing floor order */
+static int compile_band(struct compiler *c, char **tok, int ntok, uint64_t *floors)
+{
+    uint64_t floor;
+    int b;
+
+    if (ntok != 3 || parse_octets(tok[2], &floor) || floor == POLICY_NO_LIMIT) {
+        fd_log_error("%s:%u: expected: band <name> <floor octets>\n", c->path, c->line);
+        return EINVAL;
+    }
+    if (name_find(&c->bands, tok[1]) || (c->bands.n && floor <= floors[c->bands.n])) {
+        fd_log_error("%s:%u: bands must be declared once each, by increasing floor\n", c->path, c->line);
+        return EINVAL;
+    }
+    if ((b = name_add(c, &c->bands, tok[1])) < 0)
+        return EINVAL;
+    floors[b] = floor;
+    return 0;
+}
+
+/* A selector of a grant rule: * or a declared name */
+static int selector(struct compiler *c, const struct names *t, const char *what, const char *s, int *out)
+{
+    if (!strcmp(s, "*")) {
+        *out = ANY;
+        return 0;
+    }
+    if (!(*out = name_find(t, s))) {
+        fd_log_error("%s:%u: unknown %s '%s' (declare it before the grant rules)\n", c->path, c->line, what, s);
+        return EINVAL;
+    }
+    return 0;
+}
+
+/* grant <tier> <rating group> <period> <band> <octets> */
+static int compile_grant(struct compiler *c, char **tok, int ntok)
+{
+    struct rule *r;
+    uint64_t rg;
+    unsigned i;
+
+    if (ntok != 6 || c->nrules == MAX_RULES) {
+        fd_log_error("%s:%u: expected: grant <tier> <rating group> <period> <band> <octets>\n", c->path, c->line);
+        return EINVAL;
+    }
+    r = &c->rules[c->nrules];
+    CHECK_FCT(selector(c, &c->tiers, "tier", tok[1], &r->tier));
+    CHECK_FCT(selector(c, &c->periods, "period", tok[3], &r->period));
+    CHECK_FCT(selector(c, &c->bands, "band", tok[4], &r->band));
+    if (parse_octets(tok[5], &r->octets)) {
+        fd_log_error("%s:%u: invalid octets '%s'\n", c->path, c->line, tok[5]);
+        return EINVAL;
+    }
+    if (!strcmp(tok[2], "*")) {
+        r->group = ANY;
+    } else {
+        if (parse_u64(tok[2], &rg) || rg >= UINT32_MAX) {
+            fd_log_error("%s:%u: invalid rating group '%s'\n", c->path, c->line, tok[2]);
+            return EINVAL;
+        }
+        for (i = 1; i <= c->ngroups && c->groups[i] != rg; i++)
+            ;
+        if (i > c->ngroups) {
+            if (c->ngroups == MAX_GROUPS) {
+                fd_log_error("%s:%u: too many rating groups\n", c->path, c->line);
+                return EINVAL;
+            }
+            c->groups[++c->ngroups] = rg;
+        }
+        r->group = i;
+    }
+    c->nrules++;
+    return 0;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+    const struct tier_range *x = a, *y = b;
+
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+/* Flatten what was parsed into a policy */
+static int compile_tables(struct compiler *c, const uint64_t *floors, struct policy **out)
+{
+    struct policy *p;
+    size_t cells, i;
+    unsigned t, g, h, b, k;
+
+    CHECK_MALLOC(p = calloc(1, sizeof(*p)));
+    p->ntiers = c->tiers.n + 1;
+    p->ngroups = c->ngroups + 1;
+    p->nperiods = c->periods.n + 1;
+    p->nbands = c->bands.n + 1;
+    p->nrules = c->nrules;
+    cells = (size_t)p->ntiers * p->ngroups * p->nperiods * p->nbands;
+    if (cells > MAX_CELLS) {
+        fd_log_error("%s: %zu grant cells, more than %u\n", c->path, cells, MAX_CELLS);
+        free(p);
+        return EINVAL;
+    }
+
+    /* Local time offset, for the period of the day */
+    {
+        time_t now = time(NULL);
+        struct tm tm;
+        localtime_r(&now, &tm);
+        p->utc_offset = tm.tm_gmtoff;
+    }
+    for (h = 0; h < 24; h++)
+        p->period_of_hour[h] = c->hour_period[h];
+    for (b = 1; b < p->nbands; b++)
+        p->band_floor[b] = floors[b];
+
+    /* Rating groups: a direct table for the small ones, a sorted array for the others */
+    for (g = 1; g < p->ngroups; g++) {
+        if (c->groups[g] < DIRECT_GROUPS) {
+            p->group_direct[c->groups[g]] = g;
+            continue;
+        }
+        for (k = p->nlarge; k > 0 && p->large_groups[k - 1] > c->groups[g]; k--) {
+            p->large_groups[k] = p->large_groups[k - 1];
+            p->large_index[k] = p->large_index[k - 1];
+        }
+        p->large_groups[k] = c->groups[g];
+        p->large_index[k] = g;
+        p->nlarge++;
+    }
+
+    /* MSISDN ranges, sorted for a binary search */
+    if (c->nranges) {
+        CHECK_MALLOC_DO(p->ranges = malloc(c->nranges * sizeof(*p->ranges)), { free(p); return ENOMEM; });
+        memcpy(p->ranges, c->ranges, c->nranges * sizeof(*p->ranges));
+        qsort(p->ranges, c->nranges, sizeof(*p->ranges), range_cmp);
+        p->nranges = c->nranges;
+        for (k = 1; k < p->nranges; k++) {
+            if (p->ranges[k].first <= p->ranges[k - 1].last) {
+                fd_log_error("%s: MSISDN ranges %llu-%llu and %llu-%llu overlap\n", c->path,
+                             (unsigned long long)p->ranges[k - 1].first, (unsigned long long)p->ranges[k - 1].last,
+                             (unsigned long long)p->ranges[k].first, (unsigned long long)p->ranges[k].last);
+                free(p->ranges);
+                free(p);
+                return EINVAL;
+            }
+        }
+    }
+
+    /* Decision array: no limit, then each rule over the cells it selects, in file order */
+    CHECK_MALLOC_DO(p->grant = malloc(cells * sizeof(*p->grant)), { free(p->ranges); free(p); return ENOMEM; });
+    for (i = 0; i < cells; i++)
+        p->grant[i] = POLICY_NO_LIMIT;
+    for (k = 0; k < c->nrules; k++) {
+        const struct rule *r = &c->rules[k];
+
+        for (t = 0; t < p->ntiers; t++) {
+            if (r->tier != ANY && r->tier != (int)t)
+                continue;
+            for (g = 0; g < p->ngroups; g++) {
+                if (r->group != ANY && r->group != (int)g)
+                    continue;
+                for (h = 0; h < p->nperiods; h++) {
+                    if (r->period != ANY && r->period != (int)h)
+                        continue;
+                    for (b = 0; b < p->nbands; b++) {
+                        if (r->band == ANY || r->band == (int)b)
+                            p->grant[((t * p->ngroups + g) * p->nperiods + h) * p->nbands + b] = r->octets;
+                    }
+                }
+            }
+        }
+    }
+
+    *out = p;
+    return 0;
+}
+
+static void policy_free(struct policy *p)
+{
+    if (!p)
+        return;
+    free(p->grant);
+    free(p->ranges);
+    free(p);
+}
+
+static int policy_compile(const char *path, struct policy **out)
+{
+    struct compiler *c;
+    uint64_t floors[MAX_NAMES + 1] = { 0 };
+    char buf[512], *tok[8], *save, *s;
+    FILE *f;
+    int ntok, ret = 0;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        fd_log_error("Unable to open policy file %s: %s\n", path, strerror(errno));
+        return errno;
+    }
+    CHECK_MALLOC_DO(c = calloc(1, sizeof(*c)), { fclose(f); return ENOMEM; });
+    c->path = path;
+
+    while (!ret && fgets(buf, sizeof(buf), f)) {
+        c->line++;
+        if ((s = strchr(buf, '#')) != NULL)
+            *s = '\0';
+        ntok = 0;
+        for (s = strtok_r(buf, " \t\r\n", &save); s && ntok < 8; s = strtok_r(NULL, " \t\r\n", &save))
+            tok[ntok++] = s;
+        if (!ntok)
+            continue;
+        if (!strcmp(tok[0], "period"))
+            ret = compile_period(c, tok, ntok);
+        else if (!strcmp(tok[0], "tier"))
+            ret = compile_tier(c, tok, ntok);
+        else if (!strcmp(tok[0], "band"))
+            ret = compile_band(c, tok, ntok, floors);
+        else if (!strcmp(tok[0], "grant"))
+            ret = compile_grant(c, tok, ntok);
+        else {
+            fd_log_error("%s:%u: unknown statement '%s'\n", path, c->line, tok[0]);
+            ret = EINVAL;
+        }
+    }
+    fclose(f);
+
+    if (!ret)
+        ret = compile_tables(c, floors, out);
+    free(c);
+    return ret;
+}
+
+/*
+ * Lookup
+ */
+
+static inline unsigned tier_of(const struct policy *p, const uint8_t *id, size_t len)
+{
+    uint64_t msisdn = 0;
+    unsigned lo = 0, hi = p->nranges;
+    size_t i;
+
+    if (!id || !len || len > 19 || !p->nranges)
+        return 0;
+    for (i = 0; i < len; i++) {
+        if (id[i] < '0' || id[i] > '9')
+            return 0;
+        msisdn = msisdn * 10 + (id[i] - '0');
+    }
+    /* Last range starting at or below msisdn */
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (p->ranges[mid].first <= msisdn)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo && msisdn <= p->ranges[lo - 1].last)
+        return p->ranges[lo - 1].tier;
+    return 0;
+}
+
+static inline unsigned group_of(const struct policy *p, uint32_t rating_group)
+{
+    unsigned lo = 0, hi = p->nlarge;
+
+    if (rating_group < DIRECT_GROUPS)
+        return p->group_direct[rating_group];
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (p->large_groups[mid] < rating_group)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < p->nlarge && p->large_groups[lo] == rating_group) ? p->large_index[lo] : 0;
+}
+
+static inline unsigned band_of(const struct policy *p, const uint64_t *balance)
+{
+    unsigned b = p->nbands - 1;
+
+    if (!balance)
+        return b;
+    while (b > 0 && *balance < p->band_floor[b])
+        b--;
+    return b;
+}
+
+static struct policy_reader *reader_self(void)
+{
+    struct policy_reader *r;
+
+    if (self)
+        return self;
+    /* First lookup from this thread: register it, so that reloads wait for it */
+    if (posix_memalign((void **)&r, 64, sizeof(*r)) != 0)
+        return NULL;
+    memset(r, 0, sizeof(*r));
+    pthread_mutex_lock(&readers_lock);
+    r->next = atomic_load_explicit(&readers, memory_order_relaxed);
+    atomic_store_explicit(&readers, r, memory_order_release);
+    pthread_mutex_unlock(&readers_lock);
+    return self = r;
+}
+
+void policy_limits(const uint8_t *id, size_t idlen, const uint64_t *balance,
+                   const struct ledger_unit *units, unsigned n, uint64_t *limit)
+{
+    struct policy_reader *r = reader_self();
+    const struct policy *p;
+    const uint64_t *row;
+    uint64_t seq;
+    unsigned i, tier, period, band;
+
+    for (i = 0; i < n; i++)
+        limit[i] = POLICY_NO_LIMIT;
+    if (!r)
+        return;
+
+    /* Enter: the store must be visible before the pointer is read, hence seq_cst */
+    seq = atomic_load_explicit(&r->seq, memory_order_relaxed);
+    atomic_store(&r->seq, seq + 1);
+    p = atomic_load(&current);
+    if (p) {
+        tier = tier_of(p, id, idlen);
+        period = p->period_of_hour[((time(NULL) + p->utc_offset) / 3600) % 24];
+        band = band_of(p, balance);
+        row = p->grant + (size_t)tier * p->ngroups * p->nperiods * p->nbands + period * p->nbands + band;
+        for (i = 0; i < n; i++)
+            limit[i] = row[(size_t)group_of(p, units[i].rating_group) * p->nperiods * p->nbands];
+    }
+    /* Leave */
+    atomic_store_explicit(&r->seq, seq + 2, memory_order_release);
+}
+
+/*
+ * Installation
+ */
+
+/* Wait until every thread that may have read the previous pointer is done with it */
+static void policy_synchronize(void)
+{
+    struct policy_reader *r;
+
+    for (r = atomic_load_explicit(&readers, memory_order_acquire); r; r = r->next) {
+        uint64_t seq = atomic_load(&r->seq);
+        if (seq & 1) {
+            while (atomic_load(&r->seq) == seq)
+                sched_yield();
+        }
+    }
+}
+
+static void policy_install(struct policy *p)
+{
+    struct policy *old = atomic_exchange(&current, p);
+
+    policy_synchronize();
+    policy_free(old);
+}
+
+static int policy_load(void)
+{
+    struct policy *p = NULL;
+    uint64_t start = now_ns();
+    int ret;
+
+    pthread_mutex_lock(&reload_lock);
+    if ((ret = policy_compile(rules_path, &p)) == 0) {
+        fd_log_notice("Policy: %u rules over %u tiers, %u rating groups, %u periods, %u bands compiled from %s in %.1f ms\n",
+                      p->nrules, p->ntiers - 1, p->ngroups - 1, p->nperiods - 1, p->nbands - 1, rules_path,
+                      (double)(now_ns() - start) / 1e6);
+        policy_install(p);
+    }
+    pthread_mutex_unlock(&reload_lock);
+    return ret;
+}
+
+int policy_reload(void)
+{
+    int ret;
+
+    if (!rules_path)
+        return 0;
+    if ((ret = policy_load()) != 0)
+        fd_log_error("Policy: %s not reloaded, the previous rules stay in force\n", rules_path);
+    return ret;
+}
+
+/* SIGHUP: compile the rules file again */
+static void policy_sighup(void)
+{
+    if (policy_reload() == 0 && reloaded_cb)
+        reloaded_cb();
+}
+
+int policy_init(const char *path, void (*reloaded)(void))
+{
+    CHECK_PARAMS(path && *path);
+    CHECK_MALLOC(rules_path = strdup(path));
+    reloaded_cb = reloaded;
+    CHECK_FCT(policy_load());
+    CHECK_FCT(fd_event_trig_regcb(SIGHUP, "gy_policy", policy_sighup));
+    return 0;
+}
+
+int policy_loaded(void)
+{
+    return atomic_load_explicit(&current, memory_order_relaxed) != NULL;
+}
+
+void policy_fini(void)
+{
+    pthread_mutex_lock(&reload_lock);
+    policy_install(NULL);
+    free(rules_path);
+    rules_path = NULL;
+    reloaded_cb = NULL;
+    pthread_mutex_unlock(&reload_lock);
+    /* The reader blocks stay: rating threads may still look up (and find no policy) */
+}
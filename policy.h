@@ -0,0 +1,44 @@
+#ifndef GY_POLICY_H
+#define GY_POLICY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ledger.h"
+
+/*
+ * Grant policy of the server.
+ *
+ * A rules file (see policy.rules) sizes the grants by subscriber tier,
+ * rating group, period of the day and remaining balance. It is compiled
+ * into flat tables: each of the four dimensions maps to a small index,
+ * and the grant is read from one array cell. No names are compared while
+ * rating.
+ *
+ * SIGHUP recompiles the file. The new tables replace the old ones with a
+ * single pointer swap, so CCRs being rated are never blocked. The old
+ * tables are freed once no rating thread can still be reading them. A
+ * file that does not compile leaves the current policy in place.
+ */
+
+/* Compile the rules file and install it; reloaded (may be NULL) is called after each successful SIGHUP */
+int  policy_init(const char *path, void (*reloaded)(void));
+void policy_fini(void);
+int  policy_loaded(void);
+
+/* Compile the file again and swap it in (SIGHUP) */
+int  policy_reload(void);
+
+/* Limit on the grant of each unit: POLICY_NO_LIMIT, or at most that many octets (0 = deny) */
+#define POLICY_NO_LIMIT  UINT64_MAX
+
+/*
+ * Grant limits of the units of one CCR, in limit[i]. id is the
+ * Subscription-Id-Data (MSISDN) of the subscriber, NULL when absent.
+ * balance is the credit the subscriber has left, or NULL when balances
+ * are not loaded; the highest balance band then applies.
+ */
+void policy_limits(const uint8_t *id, size_t idlen, const uint64_t *balance,
+                   const struct ledger_unit *units, unsigned n, uint64_t *limit);
+
+#endif /* GY_POLICY_H */
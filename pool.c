@@ -0,0 +1,98 @@
+#include "utils.h"
+#include "pool.h"
+
+struct pool_obj {
+    struct pool_obj *next;
+};
+
+struct magazine {
+    unsigned count;
+    struct pool_obj *head;
+};
+
+static __thread struct magazine magazines[POOL_MAX];
+static atomic_uint pool_count;
+
+int pool_init(struct pool *p, const char *name, size_t objsize)
+{
+    unsigned id = atomic_fetch_add(&pool_count, 1);
+
+    CHECK_PARAMS(p && id < POOL_MAX);
+    memset(p, 0, sizeof(*p));
+    p->name = name;
+    p->objsize = objsize < sizeof(struct pool_obj) ? sizeof(struct pool_obj) : objsize;
+    p->id = id;
+    CHECK_POSIX(pthread_mutex_init(&p->lock, NULL));
+    return 0;
+}
+
+void *pool_get(struct pool *p)
+{
+    struct magazine *m = &magazines[p->id];
+    struct pool_obj *o;
+
+    if (!m->head) {
+        /* Refill half a magazine from the depot */
+        pthread_mutex_lock(&p->lock);
+        while (p->depot && m->count < POOL_MAGAZINE / 2) {
+            o = p->depot;
+            p->depot = o->next;
+            p->depot_count--;
+            o->next = m->head;
+            m->head = o;
+            m->count++;
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    atomic_fetch_add_explicit(&p->gets, 1, memory_order_relaxed);
+    if ((o = m->head) != NULL) {
+        m->head = o->next;
+        m->count--;
+        return o;
+    }
+
+    atomic_fetch_add_explicit(&p->mallocs, 1, memory_order_relaxed);
+    return malloc(p->objsize);
+}
+
+void pool_put(struct pool *p, void *obj)
+{
+    struct magazine *m = &magazines[p->id];
+    struct pool_obj *o = obj;
+
+    if (!o)
+        return;
+
+    o->next = m->head;
+    m->head = o;
+    m->count++;
+
+    if (m->count > POOL_MAGAZINE) {
+        /* Give half of the magazine back to the depot in one batch */
+        struct pool_obj *first = m->head, *last = m->head;
+        unsigned n = 1;
+
+        while (n < POOL_MAGAZINE / 2) {
+            last = last->next;
+            n++;
+        }
+        m->head = last->next;
+        m->count -= n;
+
+        pthread_mutex_lock(&p->lock);
+        last->next = p->depot;
+        p->depot = first;
+        p->depot_count += n;
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+void pool_log_stats(struct pool *p)
+{
+    uint64_t gets = atomic_load(&p->gets), mallocs = atomic_load(&p->mallocs);
+
+    fd_log_notice("Pool %s: %lu objects handed out, %lu malloc'ed (%.2f%%)\n",
+                  p->name, (unsigned long)gets, (unsigned long)mallocs,
+                  gets ? 100.0 * mallocs / gets : 0.0);
+}
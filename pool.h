@@ -0,0 +1,38 @@
+#ifndef GY_POOL_H
+#define GY_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * Fixed-size object pool with per-thread magazines.
+ * Each thread keeps a small cache of free objects and only touches the
+ * shared depot (under a mutex) to exchange whole batches, so objects that
+ * are allocated on one thread and released on another (e.g. a request
+ * context freed in the answer callback) cost one lock per batch instead of
+ * one malloc/free pair per message.
+ */
+#define POOL_MAGAZINE 64    /* objects cached per thread and per pool */
+#define POOL_MAX      8     /* pools per process */
+
+struct pool {
+    const char *name;
+    size_t objsize;
+    unsigned id;                  /* index of the thread-local magazine */
+    pthread_mutex_t lock;
+    void *depot;                  /* singly linked list of free objects */
+    size_t depot_count;
+    atomic_uint_fast64_t mallocs; /* objects obtained from malloc */
+    atomic_uint_fast64_t gets;    /* objects handed out */
+};
+
+int   pool_init(struct pool *p, const char *name, size_t objsize);
+void *pool_get(struct pool *p);
+void  pool_put(struct pool *p, void *obj);
+
+/* Log how many objects were handed out and how many had to be malloc'ed */
+void  pool_log_stats(struct pool *p);
+
+#endif /* GY_POOL_H */
@@ -0,0 +1,297 @@
+#include "utils.h"
+#include "rar.h"
+#include "ledger.h"
+#include "build.h"
+#include "histo.h"
+#include "evlog.h"
+
+#include <stdatomic.h>
+
+/* Per-RAR context, handed to the answer callback */
+struct rar_ctx {
+    uint64_t sent_ns;
+    uint64_t sess_hash;
+};
+
+static struct rar_conf conf;
+static char *dest_realm_copy;
+
+/* The fan-out thread; one at a time */
+static pthread_t fanout;
+static atomic_int fanout_running;   /* 0 = none, 1 = running, 2 = finished, not joined */
+static volatile int fanout_stop;
+
+/* RARs waiting for their RAA, as in the client's in-flight window */
+static struct {
+    unsigned in_flight;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} window = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Statistics of the current fan-out, reset at its start */
+static struct rar_stats {
+    uint64_t sessions;           /* walked, written by the fan-out thread */
+    uint64_t unroutable;         /* Session-Id without a DiameterIdentity */
+    uint64_t stalls;             /* RARs that found the window full */
+    atomic_uint_fast64_t sent;
+    atomic_uint_fast64_t send_errors;
+    atomic_uint_fast64_t raa_success;    /* 2001 */
+    atomic_uint_fast64_t raa_unknown;    /* 5002 DIAMETER_UNKNOWN_SESSION_ID: ended meanwhile */
+    atomic_uint_fast64_t raa_other;
+    atomic_uint_fast64_t timeouts;
+    pthread_mutex_t histo_lock;  /* answers arrive on any freeDiameter thread */
+    struct histo latency;
+} stats = {
+    .histo_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void window_release(void)
+{
+    pthread_mutex_lock(&window.lock);
+    window.in_flight--;
+    pthread_cond_broadcast(&window.cond);
+    pthread_mutex_unlock(&window.lock);
+}
+
+/* Take a slot, waiting for one when conf.window RARs are unanswered; ECANCELED on stop */
+static int window_acquire(void)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&window.lock);
+    if (window.in_flight >= conf.window)
+        stats.stalls++;
+    while (window.in_flight >= conf.window && !fanout_stop) {
+        /* Bounded wait, so that a stop is noticed */
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&window.cond, &window.lock, &ts);
+    }
+    if (fanout_stop)
+        ret = ECANCELED;
+    else
+        window.in_flight++;
+    pthread_mutex_unlock(&window.lock);
+    return ret;
+}
+
+static void raa_cb(void *data, struct msg **msg)
+{
+    struct rar_ctx *ctx = data;
+    uint64_t rtt = now_ns() - ctx->sent_ns;
+    uint32_t result_code = 0;
+
+    (void) gy_result_code(*msg, &result_code);
+    if (result_code == 2001)
+        atomic_fetch_add_explicit(&stats.raa_success, 1, memory_order_relaxed);
+    else if (result_code == 5002)
+        atomic_fetch_add_explicit(&stats.raa_unknown, 1, memory_order_relaxed);
+    else
+        atomic_fetch_add_explicit(&stats.raa_other, 1, memory_order_relaxed);
+
+    pthread_mutex_lock(&stats.histo_lock);
+    histo_record(&stats.latency, rtt);
+    pthread_mutex_unlock(&stats.histo_lock);
+    evlog_emit(result_code == 2001 ? EVL_INFO : EVL_ERROR, EV_RAA_RECEIVED, 0, result_code, ctx->sess_hash, rtt, 0, 0);
+
+    free(ctx);
+    window_release();
+    fd_msg_free(*msg);
+    *msg = NULL;
+}
+
+static void rar_expired(void *data, DiamId_t sentto, size_t senttolen, struct msg **req)
+{
+    struct rar_ctx *ctx = data;
+
+    atomic_fetch_add_explicit(&stats.timeouts, 1, memory_order_relaxed);
+    evlog_emit(EVL_ERROR, EV_RAR_TIMEOUT, 0, 0, ctx->sess_hash, 0, 0, 0);
+    free(ctx);
+    window_release();
+    if (*req) {
+        fd_msg_free(*req);
+        *req = NULL;
+    }
+}
+
+/* Absolute (CLOCK_REALTIME) deadline of a RAR */
+static void rar_deadline(struct timespec *ts)
+{
+    uint64_t t;
+
+    clock_gettime(CLOCK_REALTIME, ts);
+    t = (uint64_t)ts->tv_sec * NS_PER_SEC + ts->tv_nsec + (uint64_t)(conf.timeout_s * NS_PER_SEC);
+    ts->tv_sec = t / NS_PER_SEC;
+    ts->tv_nsec = t % NS_PER_SEC;
+}
+
+/* Send the RAR of one session; called by ledger_foreach outside of the shard locks */
+static int rar_session(const struct ledger_record *rec, void *opaque)
+{
+    uint64_t *next = opaque;
+    const uint8_t *host = rec->sid, *semi, *dot;
+    const uint8_t *realm;
+    size_t hostlen, realmlen;
+    struct timespec ts;
+    struct rar_ctx *ctx;
+    struct msg *req;
+    int ret;
+
+    if (fanout_stop)
+        return ECANCELED;
+    stats.sessions++;
+
+    /* Session-Id = <DiameterIdentity>;...; the realm is the identity without its first label */
+    if ((semi = memchr(rec->sid, ';', rec->sidlen)) == NULL || semi == rec->sid) {
+        stats.unroutable++;
+        return 0;
+    }
+    hostlen = semi - host;
+    if (conf.dest_realm) {
+        realm = (const uint8_t *)conf.dest_realm;
+        realmlen = strlen(conf.dest_realm);
+    } else if ((dot = memchr(host, '.', hostlen)) != NULL && dot + 1 < semi) {
+        realm = dot + 1;
+        realmlen = semi - realm;
+    } else {
+        realm = (const uint8_t *)fd_g_config->cnf_diamrlm;
+        realmlen = fd_g_config->cnf_diamrlm_len;
+    }
+
+    /* Pace first, then wait for room in the window */
+    ts.tv_sec = *next / NS_PER_SEC;
+    ts.tv_nsec = *next % NS_PER_SEC;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    *next += (uint64_t)(NS_PER_SEC / conf.rate);
+    if (*next < now_ns())
+        *next = now_ns();   /* no burst to catch up after a stall */
+    CHECK_FCT(window_acquire());
+
+    CHECK_MALLOC_DO(ctx = malloc(sizeof(*ctx)), { window_release(); return ENOMEM; });
+    ctx->sess_hash = gy_hash(rec->sid, rec->sidlen);
+    if ((ret = gy_build_rar(rec->sid, rec->sidlen, host, hostlen, realm, realmlen, &req)) != 0) {
+        free(ctx);
+        window_release();
+        return ret;
+    }
+    ctx->sent_ns = now_ns();
+    rar_deadline(&ts);
+    if ((ret = fd_msg_send_timeout(&req, raa_cb, ctx, rar_expired, &ts)) != 0) {
+        atomic_fetch_add_explicit(&stats.send_errors, 1, memory_order_relaxed);
+        evlog_emit(EVL_ERROR, EV_SEND_FAILED, 0, ret, ctx->sess_hash, 0, 0, 0);
+        free(ctx);
+        window_release();
+        if (req)
+            fd_msg_free(req);
+        return 0;
+    }
+    atomic_fetch_add_explicit(&stats.sent, 1, memory_order_relaxed);
+    return 0;
+}
+
+static void rar_log_stats(double elapsed)
+{
+    struct histo_snapshot snap;
+
+    memset(&snap, 0, sizeof(snap));
+    pthread_mutex_lock(&stats.histo_lock);
+    histo_merge(&snap, &stats.latency);
+    pthread_mutex_unlock(&stats.histo_lock);
+
+    fd_log_notice("RAR fan-out: %lu sessions, %lu RARs sent in %.1fs (%.1f/s), %lu send errors, %lu unroutable, window full %lu times\n",
+                  (unsigned long)stats.sessions, (unsigned long)atomic_load(&stats.sent), elapsed,
+                  elapsed > 0 ? atomic_load(&stats.sent) / elapsed : 0.0, (unsigned long)atomic_load(&stats.send_errors),
+                  (unsigned long)stats.unroutable, (unsigned long)stats.stalls);
+    fd_log_notice("RAR fan-out: RAA 2001 %lu, 5002 %lu, other %lu, %lu timeouts; RAA latency p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                  (unsigned long)atomic_load(&stats.raa_success), (unsigned long)atomic_load(&stats.raa_unknown),
+                  (unsigned long)atomic_load(&stats.raa_other), (unsigned long)atomic_load(&stats.timeouts),
+                  histo_percentile(&snap, 50) / 1e6, histo_percentile(&snap, 99) / 1e6, snap.max / 1e6);
+}
+
+static void *rar_fanout(void *arg)
+{
+    uint64_t start = now_ns(), next = start, live = ledger_live_sessions();
+    int ret;
+
+    fd_log_notice("RAR fan-out started over %lu live sessions, %.0f RAR/s, window %u\n",
+                  (unsigned long)live, conf.rate, conf.window);
+    ret = ledger_foreach(rar_session, &next);
+    if (ret && ret != ECANCELED)
+        fd_log_error("RAR fan-out interrupted: %s\n", strerror(ret));
+
+    /* Wait for the last answers, so that the report covers every RAR */
+    pthread_mutex_lock(&window.lock);
+    while (window.in_flight) {
+        struct timespec ts;
+        rar_deadline(&ts);
+        if (pthread_cond_timedwait(&window.cond, &window.lock, &ts) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&window.lock);
+
+    rar_log_stats((double)(now_ns() - start) / NS_PER_SEC);
+    atomic_store(&fanout_running, 2);
+    return NULL;
+}
+
+int rar_fanout_start(void)
+{
+    int expected = 0;
+
+    /* The previous fan-out thread is finished: collect it */
+    if (atomic_load(&fanout_running) == 2) {
+        pthread_join(fanout, NULL);
+        atomic_store(&fanout_running, 0);
+    }
+    if (!atomic_compare_exchange_strong(&fanout_running, &expected, 1))
+        return EALREADY;
+
+    memset(&stats, 0, offsetof(struct rar_stats, histo_lock));
+    memset(&stats.latency, 0, sizeof(stats.latency));
+    fanout_stop = 0;
+    CHECK_POSIX_DO(pthread_create(&fanout, NULL, rar_fanout, NULL), { atomic_store(&fanout_running, 0); return EAGAIN; });
+    return 0;
+}
+
+/* SIGUSR1: re-authorize every live session */
+static void rar_sigusr1(void)
+{
+    int ret = rar_fanout_start();
+
+    if (ret == EALREADY)
+        fd_log_notice("RAR fan-out already running, signal ignored\n");
+    else if (ret)
+        fd_log_error("Unable to start a RAR fan-out: %s\n", strerror(ret));
+}
+
+int rar_init(const struct rar_conf *c)
+{
+    CHECK_PARAMS(c && c->rate > 0 && c->window && c->timeout_s > 0);
+    conf = *c;
+    if (c->dest_realm && c->dest_realm[0]) {
+        CHECK_MALLOC(dest_realm_copy = strdup(c->dest_realm));
+        conf.dest_realm = dest_realm_copy;
+    } else {
+        conf.dest_realm = NULL;
+    }
+    CHECK_FCT(fd_event_trig_regcb(SIGUSR1, "gy_rar", rar_sigusr1));
+    return 0;
+}
+
+void rar_fini(void)
+{
+    fanout_stop = 1;
+    if (atomic_load(&fanout_running))
+        pthread_join(fanout, NULL);
+    atomic_store(&fanout_running, 0);
+    free(dest_realm_copy);
+    dest_realm_copy = NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef GY_RAR_H
+#define GY_RAR_H
+
+#include <stdint.h>
+
+/*
+ * Server-initiated re-authorization (RFC 4006, 5.5).
+ *
+ * A fan-out walks the live sessions of the ledger and sends each one a
+ * Re-Auth-Request, so that the clients come back with a CCR-U and are
+ * rated again, for instance after a tariff change. RARs leave at most at
+ * the configured rate and with a bounded number waiting for their RAA, so
+ * a fan-out over millions of sessions is a steady background load rather
+ * than a storm. Each RAR is addressed to the DiameterIdentity the
+ * Session-Id starts with (RFC 6733, 8.8), the peer that opened it.
+ *
+ * RAA results, timeouts and the RAA latency are reported at the end of
+ * each fan-out.
+ */
+
+struct rar_conf {
+    double rate;                 /* RARs per second */
+    unsigned window;             /* RARs waiting for their RAA */
+    double timeout_s;            /* seconds before a RAR counts as unanswered */
+    const char *dest_realm;      /* Destination-Realm, NULL = from the Destination-Host */
+};
+
+/* Prepare the engine; SIGUSR1 starts a fan-out */
+int  rar_init(const struct rar_conf *conf);
+
+/* Stop a running fan-out and wait for the RARs in flight */
+void rar_fini(void);
+
+/* Start a fan-out over the sessions live now; EALREADY while one is running */
+int  rar_fanout_start(void);
+
+#endif /* GY_RAR_H */
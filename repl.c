@@ -0,0 +1,897 @@
+#include "utils.h"
+#include "ledger.h"
+#include "wal.h"
+#include "metrics.h"
+#include "repl.h"
+
+#include <stdatomic.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define REPL_MAGIC       "GYREPL01"
+#define REPL_UNACKED     4096            /* batches sent and not acknowledged; more counts as lagging */
+#define REPL_SYNC_CHUNK  (1U << 20)      /* bytes of full-copy entries per frame */
+#define REPL_FRAME_MAX   (1U << 30)
+
+#define PAD8(x) (((x) + 7) & ~(size_t)7)
+
+enum repl_frame_type {
+    REPL_HELLO = 1,     /* standby -> primary, payload REPL_MAGIC */
+    REPL_SYNC,          /* sessions of the full copy */
+    REPL_SYNC_END,      /* seq = number of sessions in the full copy */
+    REPL_BATCH,         /* changes, possibly none */
+    REPL_ACK,           /* standby -> primary, seq = last batch applied */
+};
+
+/* Both ends run the same build on the same kind of host: fields are in host order */
+struct repl_frame {
+    uint32_t len;       /* payload bytes after this header */
+    uint16_t type;
+    uint16_t reserved;
+    uint64_t seq;
+    uint64_t ts_ns;     /* BATCH: CLOCK_REALTIME of the primary when the batch was cut */
+};
+
+/* One change in a batch; nunits struct ledger_unit, then the Session-Id padded to 8 bytes, follow */
+struct repl_delta {
+    uint32_t len;
+    uint32_t cc_request_type;
+    uint64_t seq;
+    uint16_t sidlen;
+    uint16_t nunits;
+    uint32_t reserved;
+};
+
+/* One session of the full copy; nbuckets struct ledger_bucket, then the Session-Id padded to 8 bytes, follow */
+struct repl_entry {
+    uint32_t len;
+    uint32_t ccr_count;
+    uint64_t seq;
+    uint64_t granted;
+    uint64_t used;
+    uint64_t reserved;
+    uint16_t sidlen;
+    uint16_t nbuckets;
+    uint32_t pad;
+};
+
+struct repl_buf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    uint64_t records;
+};
+
+/* Changes of one ledger shard waiting for the next batch; the lock is only shared with the sender */
+struct repl_shard {
+    pthread_mutex_t lock;
+    struct repl_buf cur;
+} __attribute__((aligned(64)));
+
+static struct repl_shard rshards[LEDGER_SHARDS];
+static struct repl_buf spare[LEDGER_SHARDS];    /* sender-owned */
+
+static struct repl_conf conf;
+static char *address;
+
+static atomic_int capturing;            /* primary: a standby is attached */
+static atomic_int overflow;             /* primary: changes were lost, the standby must start over */
+static atomic_size_t backlog;           /* primary: bytes in the shard buffers */
+static atomic_int waiting;              /* standby: not taken over yet */
+static uint64_t last_heard;             /* standby: when the primary last sent a frame; thread-owned */
+
+static pthread_t thread;
+static volatile int running;
+static int listen_fd = -1;
+static int link_fd = -1;
+static pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Batches sent and not acknowledged yet, oldest first; sender-owned */
+static struct {
+    uint64_t seq;
+    uint64_t sent_ns;
+} unacked[REPL_UNACKED];
+static unsigned ua_head, ua_tail;
+static uint64_t batch_seq;
+
+/* Sent by the primary, applied by the standby; read by the metrics exporter */
+static struct {
+    atomic_uint_fast64_t batches;
+    atomic_uint_fast64_t records;
+    atomic_uint_fast64_t bytes;
+    atomic_uint_fast64_t acked;         /* primary: last batch acknowledged */
+    atomic_uint_fast64_t full_copies;
+    atomic_uint_fast64_t lag_ns;        /* primary: age of the oldest unacknowledged batch; standby: delay of the last batch */
+    atomic_int connected;
+    atomic_int synced;                  /* standby: holds a complete copy */
+} stats;
+
+/* "host:port" or "[v6]:port" */
+static int repl_resolve(const char *addr, int passive, struct addrinfo **res)
+{
+    struct addrinfo hints;
+    char host[256], *port;
+    int ret;
+
+    if (strlen(addr) >= sizeof(host))
+        return EINVAL;
+    strcpy(host, addr);
+    if ((port = strrchr(host, ':')) == NULL)
+        return EINVAL;
+    *port++ = '\0';
+    if (host[0] == '[' && port - host >= 3 && port[-2] == ']') {
+        port[-2] = '\0';
+        memmove(host, host + 1, strlen(host + 1) + 1);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    if ((ret = getaddrinfo(host[0] ? host : NULL, port, &hints, res)) != 0) {
+        fd_log_error("Replication: cannot resolve %s: %s\n", addr, gai_strerror(ret));
+        return EINVAL;
+    }
+    return 0;
+}
+
+/* Small frames both ways, and a bound on how long a stalled peer can block us */
+static void link_setup(int fd)
+{
+    struct timeval tv = { conf.max_lag_ms / 1000, (conf.max_lag_ms % 1000) * 1000 };
+    int one = 1;
+
+    (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    (void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    (void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int send_iov(int fd, struct iovec *iov, unsigned n)
+{
+    struct msghdr mh;
+    unsigned i = 0;
+
+    while (i < n) {
+        ssize_t w;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov[i];
+        mh.msg_iovlen = n - i;
+        if ((w = sendmsg(fd, &mh, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? ETIMEDOUT : errno;
+        }
+        /* Skip what was written, handling short writes */
+        while (i < n && (size_t)w >= iov[i].iov_len) {
+            w -= iov[i].iov_len;
+            i++;
+        }
+        if (i < n) {
+            iov[i].iov_base = (uint8_t *)iov[i].iov_base + w;
+            iov[i].iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+static int send_frame(int fd, uint16_t type, uint64_t seq, const void *payload, size_t len)
+{
+    struct repl_frame f;
+    struct iovec iov[2];
+
+    memset(&f, 0, sizeof(f));
+    f.len = len;
+    f.type = type;
+    f.seq = seq;
+    iov[0].iov_base = &f;
+    iov[0].iov_len = sizeof(f);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+    return send_iov(fd, iov, len ? 2 : 1);
+}
+
+static int recv_all(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    while (len) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n == 0)
+            return ECONNRESET;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? ETIMEDOUT : errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int repl_capturing(void)
+{
+    return atomic_load_explicit(&capturing, memory_order_relaxed);
+}
+
+int repl_standby(void)
+{
+    return atomic_load_explicit(&waiting, memory_order_acquire);
+}
+
+void repl_log(unsigned shard, uint64_t seq, const uint8_t *sid, size_t sidlen,
+              uint32_t cc_request_type, const struct ledger_unit *units, unsigned nunits)
+{
+    struct repl_shard *r = &rshards[shard];
+    size_t len = PAD8(sizeof(struct repl_delta) + nunits * sizeof(*units) + sidlen);
+    struct repl_delta *d;
+
+    /* Never fail the CCR: a change that cannot be queued costs the standby a new full copy */
+    if (atomic_load_explicit(&overflow, memory_order_relaxed))
+        return;
+    if (shard >= LEDGER_SHARDS || sidlen > UINT16_MAX || nunits > UINT16_MAX
+        || atomic_load_explicit(&backlog, memory_order_relaxed) + len > conf.max_backlog) {
+        atomic_store(&overflow, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    if (r->cur.len + len > r->cur.cap) {
+        size_t ncap = r->cur.cap ? r->cur.cap * 2 : 16384;
+        uint8_t *nd;
+        while (ncap < r->cur.len + len)
+            ncap *= 2;
+        if ((nd = realloc(r->cur.data, ncap)) == NULL) {
+            pthread_mutex_unlock(&r->lock);
+            atomic_store(&overflow, 1);
+            return;
+        }
+        r->cur.data = nd;
+        r->cur.cap = ncap;
+    }
+    d = (struct repl_delta *)(r->cur.data + r->cur.len);
+    memset(d, 0, len);
+    d->len = len;
+    d->cc_request_type = cc_request_type;
+    d->seq = seq;
+    d->sidlen = (uint16_t)sidlen;
+    d->nunits = (uint16_t)nunits;
+    memcpy(d + 1, units, nunits * sizeof(*units));
+    memcpy((uint8_t *)(d + 1) + nunits * sizeof(*units), sid, sidlen);
+    r->cur.len += len;
+    r->cur.records++;
+    pthread_mutex_unlock(&r->lock);
+    atomic_fetch_add_explicit(&backlog, len, memory_order_relaxed);
+}
+
+/* Forget the changes queued for a previous standby */
+static void capture_reset(void)
+{
+    unsigned i;
+
+    for (i = 0; i < LEDGER_SHARDS; i++) {
+        pthread_mutex_lock(&rshards[i].lock);
+        rshards[i].cur.len = 0;
+        rshards[i].cur.records = 0;
+        pthread_mutex_unlock(&rshards[i].lock);
+    }
+    atomic_store(&backlog, 0);
+    atomic_store(&overflow, 0);
+    ua_head = ua_tail = 0;
+    batch_seq = 0;
+}
+
+/* Full copy, built in chunks of whole sessions */
+struct sync_ctx {
+    int fd;
+    uint8_t *buf;
+    size_t len;
+    uint64_t count;
+};
+
+static int sync_flush(struct sync_ctx *sc)
+{
+    int ret = 0;
+
+    if (sc->len)
+        ret = send_frame(sc->fd, REPL_SYNC, 0, sc->buf, sc->len);
+    sc->len = 0;
+    return ret;
+}
+
+static int sync_entry(const struct ledger_record *rec, void *opaque)
+{
+    struct sync_ctx *sc = opaque;
+    size_t len = PAD8(sizeof(struct repl_entry) + rec->nbuckets * sizeof(*rec->buckets) + rec->sidlen);
+    struct repl_entry *e;
+
+    if (!running)
+        return ECANCELED;
+    if (len > REPL_SYNC_CHUNK)
+        return EMSGSIZE;
+    if (sc->len + len > REPL_SYNC_CHUNK)
+        CHECK_FCT(sync_flush(sc));
+
+    e = (struct repl_entry *)(sc->buf + sc->len);
+    memset(e, 0, len);
+    e->len = len;
+    e->ccr_count = rec->totals.ccr_count;
+    e->seq = rec->seq;
+    e->granted = rec->totals.granted;
+    e->used = rec->totals.used;
+    e->reserved = rec->totals.reserved;
+    e->sidlen = (uint16_t)rec->sidlen;
+    e->nbuckets = (uint16_t)rec->nbuckets;
+    memcpy(e + 1, rec->buckets, rec->nbuckets * sizeof(*rec->buckets));
+    memcpy((uint8_t *)(e + 1) + rec->nbuckets * sizeof(*rec->buckets), rec->sid, rec->sidlen);
+    sc->len += len;
+    sc->count++;
+    return 0;
+}
+
+/*
+ * Changes are captured before the walk starts, so a session copied before
+ * a change also gets that change in a batch; the standby skips the changes
+ * its copy already reflects, by sequence number, as WAL recovery does.
+ */
+static int sync_send(int fd)
+{
+    struct sync_ctx sc = { fd, NULL, 0, 0 };
+    uint64_t start = now_ns();
+    int ret;
+
+    CHECK_MALLOC(sc.buf = malloc(REPL_SYNC_CHUNK));
+    ret = ledger_foreach(sync_entry, &sc);
+    if (!ret)
+        ret = sync_flush(&sc);
+    if (!ret)
+        ret = send_frame(fd, REPL_SYNC_END, sc.count, NULL, 0);
+    free(sc.buf);
+    if (!ret) {
+        atomic_fetch_add(&stats.full_copies, 1);
+        fd_log_notice("Replication: full copy of %lu sessions sent in %.1f ms\n",
+                      (unsigned long)sc.count, (double)(now_ns() - start) / 1e6);
+    }
+    return ret;
+}
+
+/* Cut and send one batch with everything queued; an empty batch tells the standby we are alive */
+static int batch_send(int fd)
+{
+    struct iovec iov[LEDGER_SHARDS + 1];
+    struct repl_frame f;
+    struct timespec ts;
+    uint64_t records = 0, bytes = 0;
+    unsigned i, n = 1;
+    int ret;
+
+    if (ua_tail - ua_head >= REPL_UNACKED)
+        return ETIMEDOUT;
+
+    for (i = 0; i < LEDGER_SHARDS; i++) {
+        struct repl_shard *r = &rshards[i];
+        struct repl_buf tmp;
+
+        if (!r->cur.len)    /* racy peek, the next batch will catch up */
+            continue;
+        pthread_mutex_lock(&r->lock);
+        tmp = r->cur;
+        r->cur = spare[i];
+        pthread_mutex_unlock(&r->lock);
+        spare[i] = tmp;
+
+        iov[n].iov_base = tmp.data;
+        iov[n].iov_len = tmp.len;
+        bytes += tmp.len;
+        records += tmp.records;
+        n++;
+    }
+
+    memset(&f, 0, sizeof(f));
+    clock_gettime(CLOCK_REALTIME, &ts);
+    f.len = bytes;
+    f.type = REPL_BATCH;
+    f.seq = ++batch_seq;
+    f.ts_ns = (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+    iov[0].iov_base = &f;
+    iov[0].iov_len = sizeof(f);
+    ret = send_iov(fd, iov, n);
+
+    for (i = 0; i < LEDGER_SHARDS; i++) {
+        spare[i].len = 0;
+        spare[i].records = 0;
+    }
+    atomic_fetch_sub_explicit(&backlog, bytes, memory_order_relaxed);
+    if (ret)
+        return ret;
+
+    unacked[ua_tail % REPL_UNACKED].seq = f.seq;
+    unacked[ua_tail % REPL_UNACKED].sent_ns = now_ns();
+    ua_tail++;
+    atomic_fetch_add_explicit(&stats.batches, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats.records, records, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats.bytes, bytes + sizeof(f), memory_order_relaxed);
+    return 0;
+}
+
+/* Acknowledgements received from one standby, possibly ending with part of a frame */
+struct ack_buf {
+    uint8_t data[64 * sizeof(struct repl_frame)];
+    size_t len;
+};
+
+/* Read acknowledgements until the next batch is due */
+static int acks_read(int fd, struct ack_buf *ab, uint64_t until)
+{
+    uint64_t now;
+
+    while ((now = now_ns()) < until) {
+        struct pollfd p = { fd, POLLIN, 0 };
+        ssize_t n;
+        int r = poll(&p, 1, (int)((until - now + 999999) / 1000000));
+
+        if (r < 0 && errno != EINTR)
+            return errno;
+        if (r <= 0)
+            continue;
+        if ((n = recv(fd, ab->data + ab->len, sizeof(ab->data) - ab->len, MSG_DONTWAIT)) == 0)
+            return ECONNRESET;
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+            return errno;
+        }
+        ab->len += n;
+
+        while (ab->len >= sizeof(struct repl_frame)) {
+            struct repl_frame f;
+            memcpy(&f, ab->data, sizeof(f));
+            if (f.type != REPL_ACK || f.len)
+                return EPROTO;
+            while (ua_head != ua_tail && unacked[ua_head % REPL_UNACKED].seq <= f.seq)
+                ua_head++;
+            atomic_store_explicit(&stats.acked, f.seq, memory_order_relaxed);
+            ab->len -= sizeof(f);
+            memmove(ab->data, ab->data + sizeof(f), ab->len);
+        }
+    }
+    return 0;
+}
+
+static int lag_check(void)
+{
+    uint64_t lag = ua_head != ua_tail ? now_ns() - unacked[ua_head % REPL_UNACKED].sent_ns : 0;
+
+    atomic_store_explicit(&stats.lag_ns, lag, memory_order_relaxed);
+    if (atomic_load(&overflow))
+        return ENOBUFS;
+    if (lag > (uint64_t)conf.max_lag_ms * 1000000)
+        return ETIMEDOUT;
+    return 0;
+}
+
+static void primary_serve(int fd)
+{
+    struct repl_frame f;
+    char magic[sizeof(REPL_MAGIC) - 1];
+    struct ack_buf ab = { .len = 0 };
+    uint64_t next;
+    int ret;
+
+    if ((ret = recv_all(fd, &f, sizeof(f))) != 0 || f.type != REPL_HELLO || f.len != sizeof(magic)
+        || (ret = recv_all(fd, magic, sizeof(magic))) != 0 || memcmp(magic, REPL_MAGIC, sizeof(magic))) {
+        fd_log_error("Replication: connection without a valid hello, closed\n");
+        return;
+    }
+
+    capture_reset();
+    atomic_store(&capturing, 1);
+    atomic_store(&stats.connected, 1);
+    fd_log_notice("Replication: standby connected, sending a full copy\n");
+
+    ret = sync_send(fd);
+    for (next = now_ns(); !ret && running; ) {
+        next += (uint64_t)conf.batch_ms * 1000000;
+        if ((ret = batch_send(fd)) == 0 && (ret = acks_read(fd, &ab, next)) == 0)
+            ret = lag_check();
+    }
+
+    atomic_store(&capturing, 0);
+    atomic_store(&stats.connected, 0);
+    atomic_store(&stats.lag_ns, 0);
+    if (ret == ETIMEDOUT)
+        fd_log_error("Replication: standby more than %u ms behind, dropped; it will receive a new full copy\n", conf.max_lag_ms);
+    else if (ret == ENOBUFS)
+        fd_log_error("Replication: changes piled up beyond %lu bytes, standby dropped; it will receive a new full copy\n",
+                     (unsigned long)conf.max_backlog);
+    else if (ret)
+        fd_log_error("Replication: standby link lost: %s\n", strerror(ret));
+}
+
+static void *repl_primary(void *arg)
+{
+    while (running) {
+        struct pollfd p = { listen_fd, POLLIN, 0 };
+        int fd;
+
+        if (poll(&p, 1, 100) <= 0 || (fd = accept(listen_fd, NULL, NULL)) < 0)
+            continue;
+        link_setup(fd);
+        primary_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int apply_sync(const uint8_t *p, size_t len, uint64_t *count)
+{
+    const uint8_t *end = p + len;
+
+    while (p + sizeof(struct repl_entry) <= end) {
+        const struct repl_entry *e = (const struct repl_entry *)p;
+        struct ledger_record rec;
+
+        if (e->len < sizeof(*e) || p + e->len > end
+            || PAD8(sizeof(*e) + e->nbuckets * sizeof(struct ledger_bucket) + e->sidlen) != e->len)
+            return EPROTO;
+        memset(&rec, 0, sizeof(rec));
+        rec.buckets = (const struct ledger_bucket *)(e + 1);
+        rec.nbuckets = e->nbuckets;
+        rec.sid = (const uint8_t *)(rec.buckets + e->nbuckets);
+        rec.sidlen = e->sidlen;
+        rec.seq = e->seq;
+        rec.totals.granted = e->granted;
+        rec.totals.used = e->used;
+        rec.totals.reserved = e->reserved;
+        rec.totals.ccr_count = e->ccr_count;
+        CHECK_FCT(ledger_restore(&rec));
+        wal_seq_advance(e->seq);
+        (*count)++;
+        p += e->len;
+    }
+    return p == end ? 0 : EPROTO;
+}
+
+static int apply_batch(const uint8_t *p, size_t len, uint64_t *records)
+{
+    const uint8_t *end = p + len;
+
+    while (p + sizeof(struct repl_delta) <= end) {
+        const struct repl_delta *d = (const struct repl_delta *)p;
+        const struct ledger_unit *units = (const struct ledger_unit *)(d + 1);
+
+        if (d->len < sizeof(*d) || p + d->len > end
+            || PAD8(sizeof(*d) + d->nunits * sizeof(*units) + d->sidlen) != d->len)
+            return EPROTO;
+        CHECK_FCT(ledger_replay((const uint8_t *)(units + d->nunits), d->sidlen, d->seq, d->cc_request_type,
+                                units, d->nunits));
+        wal_seq_advance(d->seq);
+        (*records)++;
+        p += d->len;
+    }
+    return p == end ? 0 : EPROTO;
+}
+
+static int standby_serve(int fd)
+{
+    struct repl_frame f;
+    uint8_t *buf = NULL;
+    size_t cap = 0;
+    uint64_t sessions = 0, start = now_ns();
+    int ret, first = 1;
+
+    if ((ret = send_frame(fd, REPL_HELLO, 0, REPL_MAGIC, sizeof(REPL_MAGIC) - 1)) != 0)
+        return ret;
+
+    while (running) {
+        /* The primary sends a batch every batch interval: silence means it is gone */
+        if ((ret = recv_all(fd, &f, sizeof(f))) != 0)
+            break;
+        last_heard = now_ns();
+        if (f.len > REPL_FRAME_MAX) {
+            ret = EPROTO;
+            break;
+        }
+        if (f.len > cap) {
+            uint8_t *nb = realloc(buf, f.len);
+            if (!nb) {
+                ret = ENOMEM;
+                break;
+            }
+            buf = nb;
+            cap = f.len;
+        }
+        if (f.len && (ret = recv_all(fd, buf, f.len)) != 0)
+            break;
+
+        /* A new full copy replaces whatever an earlier link left */
+        if (first) {
+            ledger_clear();
+            atomic_store(&stats.synced, 0);
+            first = 0;
+        }
+
+        if (f.type == REPL_SYNC) {
+            ret = apply_sync(buf, f.len, &sessions);
+        } else if (f.type == REPL_SYNC_END) {
+            if (f.seq != sessions) {
+                ret = EPROTO;
+            } else {
+                atomic_store(&stats.synced, 1);
+                atomic_fetch_add(&stats.full_copies, 1);
+                fd_log_notice("Replication: in sync with the primary, %lu sessions copied in %.1f ms\n",
+                              (unsigned long)sessions, (double)(now_ns() - start) / 1e6);
+            }
+        } else if (f.type == REPL_BATCH && atomic_load(&stats.synced)) {
+            struct timespec ts;
+            uint64_t records = 0, now;
+
+            if ((ret = apply_batch(buf, f.len, &records)) != 0)
+                break;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            now = (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+            atomic_store_explicit(&stats.lag_ns, now > f.ts_ns ? now - f.ts_ns : 0, memory_order_relaxed);
+            atomic_fetch_add_explicit(&stats.batches, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&stats.records, records, memory_order_relaxed);
+            atomic_fetch_add_explicit(&stats.bytes, f.len + sizeof(f), memory_order_relaxed);
+            ret = send_frame(fd, REPL_ACK, f.seq, NULL, 0);
+        } else {
+            ret = EPROTO;
+        }
+        if (ret)
+            break;
+    }
+    free(buf);
+    return ret;
+}
+
+/* Connect without waiting longer than max_lag_ms for a host that does not answer */
+static int connect_within(const struct addrinfo *ai)
+{
+    struct pollfd pfd;
+    int fd, flags, err = 0;
+    socklen_t len = sizeof(err);
+
+    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+        return -1;
+    flags = fcntl(fd, F_GETFL);
+    (void) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if (errno != EINPROGRESS || poll(&pfd, 1, conf.max_lag_ms) != 1
+            || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err) {
+            close(fd);
+            return -1;
+        }
+    }
+    (void) fcntl(fd, F_SETFL, flags);
+    return fd;
+}
+
+static int standby_connect(void)
+{
+    struct addrinfo *res, *ai;
+    int fd = -1;
+
+    if (repl_resolve(address, 0, &res) != 0)
+        return -1;
+    for (ai = res; ai && fd < 0; ai = ai->ai_next)
+        fd = connect_within(ai);
+    freeaddrinfo(res);
+    return fd;
+}
+
+/* The primary is gone once it has been silent for takeover_ms; only a complete copy is worth taking over */
+static int takeover_due(int *warned)
+{
+    if (now_ns() - last_heard < (uint64_t)conf.takeover_ms * 1000000)
+        return 0;
+    if (atomic_load(&stats.synced))
+        return 1;
+    if (!(*warned)++)
+        fd_log_error("Replication: primary %s silent for %u ms, but the copy is incomplete: not taking over\n",
+                     address, conf.takeover_ms);
+    return 0;
+}
+
+/* Stop replicating and rate on the copy; the WAL only logged changes made here, so snapshot the copy first */
+static void standby_take_over(void)
+{
+    int ret;
+
+    fd_log_notice("Replication: primary silent for %u ms, standby taking over with %lu sessions (last batch %.1f ms behind the primary)\n",
+                  conf.takeover_ms, (unsigned long)ledger_live_sessions(), (double)atomic_load(&stats.lag_ns) / 1e6);
+    if ((ret = wal_snapshot()) != 0)
+        fd_log_error("Replication: the ledger taken over could not be written to the WAL (%s), it will be lost after a restart\n",
+                     strerror(ret));
+    atomic_store_explicit(&waiting, 0, memory_order_release);
+    if (conf.promoted)
+        conf.promoted();
+}
+
+static void *repl_standby_run(void *arg)
+{
+    uint64_t last_try = 0;
+    int fd, ret, logged = 0, warned = 0;
+
+    last_heard = now_ns();
+    while (running) {
+        if (takeover_due(&warned)) {
+            standby_take_over();
+            break;
+        }
+        /* Retry every second, but keep watching the silence in between */
+        if (now_ns() - last_try < NS_PER_SEC) {
+            usleep(100000);
+            continue;
+        }
+        last_try = now_ns();
+        if ((fd = standby_connect()) < 0) {
+            if (!logged++)
+                fd_log_notice("Replication: primary %s not reachable, retrying every second\n", address);
+            continue;
+        }
+        logged = 0;
+        warned = 0;
+        link_setup(fd);
+        pthread_mutex_lock(&link_lock);
+        link_fd = running ? fd : -1;
+        pthread_mutex_unlock(&link_lock);
+
+        atomic_store(&stats.connected, 1);
+        ret = running ? standby_serve(fd) : ECANCELED;
+        atomic_store(&stats.connected, 0);
+        if (running)
+            fd_log_error("Replication: link to the primary lost (%s), %s\n", ret == ETIMEDOUT ? "no batch in time" : strerror(ret),
+                         atomic_load(&stats.synced) ? "keeping the last copy" : "the copy is incomplete");
+
+        pthread_mutex_lock(&link_lock);
+        link_fd = -1;
+        pthread_mutex_unlock(&link_lock);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Stop the thread; a shutdown of the link interrupts a read in progress */
+static void thread_stop(void)
+{
+    if (!running)
+        return;
+    running = 0;
+    pthread_mutex_lock(&link_lock);
+    if (link_fd >= 0)
+        shutdown(link_fd, SHUT_RDWR);
+    pthread_mutex_unlock(&link_lock);
+    pthread_join(thread, NULL);
+}
+
+static void repl_metrics(FILE *f, const char *prefix)
+{
+    const char *what = conf.role == REPL_PRIMARY ? "sent to the standby" : "applied from the primary";
+
+    fprintf(f, "# HELP %s_repl_connected Replication link up.\n", prefix);
+    fprintf(f, "# TYPE %s_repl_connected gauge\n", prefix);
+    fprintf(f, "%s_repl_connected %d\n", prefix, atomic_load(&stats.connected));
+    fprintf(f, "# HELP %s_repl_lag_seconds %s\n", prefix, conf.role == REPL_PRIMARY
+            ? "Age of the oldest batch not acknowledged by the standby."
+            : "Delay of the last batch applied, from the primary's clock.");
+    fprintf(f, "# TYPE %s_repl_lag_seconds gauge\n", prefix);
+    fprintf(f, "%s_repl_lag_seconds %.6f\n", prefix, (double)atomic_load(&stats.lag_ns) / NS_PER_SEC);
+    fprintf(f, "# HELP %s_repl_batches_total Batches %s.\n", prefix, what);
+    fprintf(f, "# TYPE %s_repl_batches_total counter\n", prefix);
+    fprintf(f, "%s_repl_batches_total %lu\n", prefix, (unsigned long)atomic_load(&stats.batches));
+    fprintf(f, "# HELP %s_repl_records_total Ledger changes %s.\n", prefix, what);
+    fprintf(f, "# TYPE %s_repl_records_total counter\n", prefix);
+    fprintf(f, "%s_repl_records_total %lu\n", prefix, (unsigned long)atomic_load(&stats.records));
+    fprintf(f, "# HELP %s_repl_bytes_total Bytes of batches %s.\n", prefix, what);
+    fprintf(f, "# TYPE %s_repl_bytes_total counter\n", prefix);
+    fprintf(f, "%s_repl_bytes_total %lu\n", prefix, (unsigned long)atomic_load(&stats.bytes));
+    fprintf(f, "# HELP %s_repl_full_copies_total Full copies of the ledger %s.\n", prefix, what);
+    fprintf(f, "# TYPE %s_repl_full_copies_total counter\n", prefix);
+    fprintf(f, "%s_repl_full_copies_total %lu\n", prefix, (unsigned long)atomic_load(&stats.full_copies));
+    if (conf.role == REPL_PRIMARY) {
+        fprintf(f, "# HELP %s_repl_backlog_bytes Changes waiting for the next batch.\n", prefix);
+        fprintf(f, "# TYPE %s_repl_backlog_bytes gauge\n", prefix);
+        fprintf(f, "%s_repl_backlog_bytes %lu\n", prefix, (unsigned long)atomic_load(&backlog));
+        fprintf(f, "# HELP %s_repl_acked_batch Last batch acknowledged by the standby.\n", prefix);
+        fprintf(f, "# TYPE %s_repl_acked_batch gauge\n", prefix);
+        fprintf(f, "%s_repl_acked_batch %lu\n", prefix, (unsigned long)atomic_load(&stats.acked));
+    } else {
+        fprintf(f, "# HELP %s_repl_synced Standby holds a complete copy.\n", prefix);
+        fprintf(f, "# TYPE %s_repl_synced gauge\n", prefix);
+        fprintf(f, "%s_repl_synced %d\n", prefix, atomic_load(&stats.synced));
+        fprintf(f, "# HELP %s_repl_standby Standby not taken over yet.\n", prefix);
+        fprintf(f, "# TYPE %s_repl_standby gauge\n", prefix);
+        fprintf(f, "%s_repl_standby %d\n", prefix, atomic_load(&waiting));
+    }
+}
+
+static int primary_listen(void)
+{
+    struct addrinfo *res, *ai;
+    int one = 1, ret = EADDRNOTAVAIL;
+
+    CHECK_FCT(repl_resolve(address, 1, &res));
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((listen_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        (void) setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(listen_fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(listen_fd, 1) == 0) {
+            ret = 0;
+            break;
+        }
+        ret = errno;
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    freeaddrinfo(res);
+    if (ret)
+        fd_log_error("Replication: cannot listen on %s: %s\n", address, strerror(ret));
+    return ret;
+}
+
+int repl_start(const struct repl_conf *c)
+{
+    unsigned s;
+
+    if (!c || c->role == REPL_NONE)
+        return 0;
+    CHECK_PARAMS(c->address && *c->address && c->batch_ms && c->max_lag_ms > c->batch_ms
+                 && c->max_backlog && c->max_backlog < REPL_FRAME_MAX
+                 && (c->role != REPL_STANDBY || c->takeover_ms >= c->max_lag_ms));
+    conf = *c;
+    CHECK_MALLOC(address = strdup(c->address));
+    conf.address = address;
+    for (s = 0; s < LEDGER_SHARDS; s++)
+        CHECK_POSIX(pthread_mutex_init(&rshards[s].lock, NULL));
+    CHECK_FCT(metrics_register(repl_metrics));
+
+    running = 1;
+    if (conf.role == REPL_PRIMARY) {
+        CHECK_FCT(primary_listen());
+        fd_log_notice("Replication: primary, standby accepted on %s, batches every %u ms, at most %u ms of lag\n",
+                      address, conf.batch_ms, conf.max_lag_ms);
+        CHECK_POSIX(pthread_create(&thread, NULL, repl_primary, NULL));
+    } else {
+        atomic_store(&waiting, 1);
+        fd_log_notice("Replication: standby of %s, taking over after %u ms without it\n", address, conf.takeover_ms);
+        CHECK_POSIX(pthread_create(&thread, NULL, repl_standby_run, NULL));
+    }
+    return 0;
+}
+
+void repl_stop(void)
+{
+    unsigned s;
+
+    if (conf.role == REPL_NONE)
+        return;
+    thread_stop();
+    atomic_store(&capturing, 0);
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+
+    fd_log_notice("Replication: %lu batches, %lu changes, %lu bytes %s, %lu full copies\n",
+                  (unsigned long)atomic_load(&stats.batches), (unsigned long)atomic_load(&stats.records),
+                  (unsigned long)atomic_load(&stats.bytes),
+                  conf.role == REPL_PRIMARY ? "sent" : "applied", (unsigned long)atomic_load(&stats.full_copies));
+
+    for (s = 0; s < LEDGER_SHARDS; s++) {
+        free(rshards[s].cur.data);
+        free(spare[s].data);
+        memset(&rshards[s].cur, 0, sizeof(rshards[s].cur));
+        memset(&spare[s], 0, sizeof(spare[s]));
+    }
+    free(address);
+    address = NULL;
+    conf.role = REPL_NONE;
+}
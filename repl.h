@@ -0,0 +1,64 @@
+#ifndef GY_REPL_H
+#define GY_REPL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ledger.h"
+
+/*
+ * Active-standby replication of the session ledger over TCP.
+ *
+ * The standby connects to the primary. The primary sends it a full copy
+ * of the ledger, then streams every change. ledger_apply serializes each
+ * change into a per-shard buffer under the shard lock, as for the WAL. A
+ * sender thread cuts all pending changes into one numbered batch every
+ * batch interval and sends it, empty batches included, so the standby
+ * always knows the primary is alive. The standby applies each batch and
+ * acknowledges its number; the primary reads the acknowledgements between
+ * batches, so the CCA path never waits for the standby.
+ *
+ * The lag is the age of the oldest unacknowledged batch. When it exceeds
+ * max_lag_ms, or when the changes pile up faster than they can be sent,
+ * the primary drops the standby, which reconnects and receives a new full
+ * copy. A standby in sync therefore never lags more than max_lag_ms. A
+ * standby that gets no batch for max_lag_ms considers the primary gone
+ * and reconnects.
+ *
+ * The standby takes over once it has heard nothing from the primary for
+ * takeover_ms, neither on the link nor by reconnecting, and only if it
+ * holds a complete copy. It then writes the copy to its WAL, stops
+ * replicating and rates on its own copy. Until then CCRs are refused.
+ */
+
+enum repl_role {
+    REPL_NONE = 0,
+    REPL_PRIMARY,
+    REPL_STANDBY,
+};
+
+struct repl_conf {
+    enum repl_role role;
+    const char *address;         /* primary: address to listen on; standby: the primary's; "host:port" */
+    unsigned batch_ms;           /* interval between two batches */
+    unsigned max_lag_ms;         /* oldest unacknowledged batch before the standby is dropped */
+    size_t max_backlog;          /* bytes of changes waiting to be sent before the standby is dropped */
+    unsigned takeover_ms;        /* standby: silence of the primary before it takes over, at least max_lag_ms */
+    void (*promoted)(void);      /* standby: called once it has taken over */
+};
+
+/* Start listening (primary) or connecting (standby); nothing to do with REPL_NONE */
+int  repl_start(const struct repl_conf *conf);
+
+/* Stop the replication thread and close the link */
+void repl_stop(void);
+
+/* Standby that has not taken over yet */
+int  repl_standby(void);
+
+/* Used by ledger.c: a standby is attached, its changes must be handed over */
+int  repl_capturing(void);
+void repl_log(unsigned shard, uint64_t seq, const uint8_t *sid, size_t sidlen,
+              uint32_t cc_request_type, const struct ledger_unit *units, unsigned nunits);
+
+#endif /* GY_REPL_H */
@@ -0,0 +1,257 @@
+#include "utils.h"
+#include "codec.h"
+#include "replay.h"
+
+#include <stdatomic.h>
+
+/* Bucket locks; bucket b is protected by locks[b % REPLAY_LOCKS] */
+#define REPLAY_LOCKS 64
+
+/* Key and age of one cached answer; 16 bytes, REPLAY_WAYS of them per cache line */
+struct replay_slot {
+    uint64_t hash;
+    uint32_t number;
+    uint32_t expires;     /* monotonic seconds; 0 = free */
+};
+
+struct replay_bucket {
+    struct replay_slot slot[REPLAY_WAYS];
+} __attribute__((aligned(64)));
+
+/* The answer itself, kept apart so that lookups only touch the buckets */
+struct replay_answer {
+    uint32_t result_code;       /* 0 while the request is being rated */
+    uint32_t cc_request_type;
+    uint32_t has_gsu;
+    uint32_t mscc_count;
+    uint64_t gsu_octets;
+    uint32_t validity_time;
+    uint32_t pad;
+    struct msg *parked;         /* a copy received while rating, waiting for this answer */
+    struct {
+        uint32_t rating_group;
+        uint32_t result_code;
+        uint32_t validity_time;
+        uint32_t pad;
+        uint64_t gsu_octets;    /* UINT64_MAX = no Granted-Service-Unit */
+    } mscc[GY_MSCC_MAX];
+};
+
+struct replay_lock {
+    pthread_mutex_t lock;
+} __attribute__((aligned(64)));
+
+static struct replay_bucket *buckets;
+static struct replay_answer *answers;   /* answers[b * REPLAY_WAYS + way] */
+static size_t mask;                     /* number of buckets - 1 */
+static unsigned ttl;
+static struct replay_lock locks[REPLAY_LOCKS];
+
+static atomic_uint_fast64_t hits, misses, pending, evictions;
+
+int replay_init(unsigned capacity, unsigned ttl_s)
+{
+    size_t nb = 1, i;
+
+    if (!capacity)
+        return 0;
+    while (nb * REPLAY_WAYS < capacity)
+        nb <<= 1;
+    CHECK_POSIX(posix_memalign((void **)&buckets, 64, nb * sizeof(*buckets)));
+    memset(buckets, 0, nb * sizeof(*buckets));
+    CHECK_MALLOC_DO(answers = calloc(nb * REPLAY_WAYS, sizeof(*answers)), { free(buckets); buckets = NULL; return ENOMEM; });
+    for (i = 0; i < REPLAY_LOCKS; i++)
+        CHECK_POSIX(pthread_mutex_init(&locks[i].lock, NULL));
+    mask = nb - 1;
+    ttl = ttl_s ? ttl_s : 1;
+
+    fd_log_notice("Replay cache: %zu answers kept for %us (%zu KB)\n", nb * REPLAY_WAYS, ttl,
+                  nb * (sizeof(*buckets) + REPLAY_WAYS * sizeof(*answers)) / 1024);
+    return 0;
+}
+
+void replay_fini(void)
+{
+    size_t i;
+
+    if (!buckets)
+        return;
+    replay_log_stats();
+    for (i = 0; i < (mask + 1) * REPLAY_WAYS; i++) {
+        if (answers[i].parked)
+            fd_msg_free(answers[i].parked);
+    }
+    for (i = 0; i < REPLAY_LOCKS; i++)
+        pthread_mutex_destroy(&locks[i].lock);
+    free(buckets);
+    free(answers);
+    buckets = NULL;
+    answers = NULL;
+}
+
+static inline uint32_t now_s(void)
+{
+    /* Never 0, which marks a free slot */
+    return (uint32_t)(now_ns() / NS_PER_SEC) + 1;
+}
+
+/* The slot holding the key in bucket b, or NULL; called with the bucket lock held */
+static struct replay_slot *bucket_find(size_t b, uint64_t hash, uint32_t number, uint32_t now)
+{
+    struct replay_slot *s = buckets[b].slot;
+    unsigned w;
+
+    for (w = 0; w < REPLAY_WAYS; w++) {
+        if (s[w].hash == hash && s[w].number == number && s[w].expires > now)
+            return &s[w];
+    }
+    return NULL;
+}
+
+enum replay_result replay_lookup(uint64_t hash, uint32_t number, struct gy_cca_fields *f, struct gy_cca_mscc *mscc,
+                                 struct msg **msg)
+{
+    size_t b = hash & mask;
+    pthread_mutex_t *lock = &locks[b % REPLAY_LOCKS].lock;
+    uint32_t now = now_s();
+    struct replay_slot *s, *victim;
+    struct replay_answer *a;
+    struct msg *stale;
+    unsigned w;
+
+    if (!buckets)
+        return REPLAY_MISS;
+
+    pthread_mutex_lock(lock);
+    if ((s = bucket_find(b, hash, number, now)) != NULL) {
+        a = &answers[b * REPLAY_WAYS + (s - buckets[b].slot)];
+        if (!a->result_code) {
+            stale = a->parked;
+            a->parked = *msg;
+            *msg = NULL;
+            pthread_mutex_unlock(lock);
+            if (stale)
+                fd_msg_free(stale);
+            atomic_fetch_add_explicit(&pending, 1, memory_order_relaxed);
+            return REPLAY_PENDING;
+        }
+        memset(f, 0, sizeof(*f));
+        f->result_code = a->result_code;
+        f->cc_request_type = a->cc_request_type;
+        f->cc_request_number = number;
+        f->has_gsu = a->has_gsu;
+        f->gsu_octets = a->gsu_octets;
+        f->validity_time = a->validity_time;
+        f->mscc_count = a->mscc_count;
+        f->mscc = mscc;
+        for (w = 0; w < a->mscc_count; w++) {
+            mscc[w].rating_group = a->mscc[w].rating_group;
+            mscc[w].result_code = a->mscc[w].result_code;
+            mscc[w].validity_time = a->mscc[w].validity_time;
+            mscc[w].has_gsu = a->mscc[w].gsu_octets != UINT64_MAX;
+            mscc[w].gsu_octets = mscc[w].has_gsu ? a->mscc[w].gsu_octets : 0;
+        }
+        pthread_mutex_unlock(lock);
+        atomic_fetch_add_explicit(&hits, 1, memory_order_relaxed);
+        return REPLAY_HIT;
+    }
+
+    /* Reserve the key: a free or expired slot, else the one closest to expiry */
+    victim = &buckets[b].slot[0];
+    for (w = 0; w < REPLAY_WAYS; w++) {
+        s = &buckets[b].slot[w];
+        if (s->expires <= now) {
+            victim = s;
+            break;
+        }
+        if (s->expires < victim->expires)
+            victim = s;
+    }
+    if (victim->expires > now)
+        atomic_fetch_add_explicit(&evictions, 1, memory_order_relaxed);
+    victim->hash = hash;
+    victim->number = number;
+    victim->expires = now + ttl;
+    a = &answers[b * REPLAY_WAYS + (victim - buckets[b].slot)];
+    a->result_code = 0;
+    /* A copy left by a request whose reservation was lost: nobody will answer it */
+    stale = a->parked;
+    a->parked = NULL;
+    pthread_mutex_unlock(lock);
+    if (stale)
+        fd_msg_free(stale);
+    atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+    return REPLAY_MISS;
+}
+
+void replay_store(uint64_t hash, uint32_t number, const struct gy_cca_fields *f, struct msg **parked)
+{
+    size_t b = hash & mask;
+    pthread_mutex_t *lock = &locks[b % REPLAY_LOCKS].lock;
+    struct replay_answer *a;
+    struct replay_slot *s;
+    unsigned i;
+
+    *parked = NULL;
+    if (!buckets)
+        return;
+
+    pthread_mutex_lock(lock);
+    /* The reservation may have been evicted meanwhile: then the answer is not kept */
+    if ((s = bucket_find(b, hash, number, now_s())) != NULL) {
+        a = &answers[b * REPLAY_WAYS + (s - buckets[b].slot)];
+        *parked = a->parked;
+        a->parked = NULL;
+        a->result_code = f->result_code;
+        a->cc_request_type = f->cc_request_type;
+        a->has_gsu = f->has_gsu;
+        a->gsu_octets = f->gsu_octets;
+        a->validity_time = f->validity_time;
+        a->mscc_count = f->mscc_count;
+        for (i = 0; i < f->mscc_count; i++) {
+            a->mscc[i].rating_group = f->mscc[i].rating_group;
+            a->mscc[i].result_code = f->mscc[i].result_code;
+            a->mscc[i].validity_time = f->mscc[i].validity_time;
+            a->mscc[i].gsu_octets = f->mscc[i].has_gsu ? f->mscc[i].gsu_octets : UINT64_MAX;
+        }
+    }
+    pthread_mutex_unlock(lock);
+}
+
+void replay_cancel(uint64_t hash, uint32_t number, struct msg **parked)
+{
+    size_t b = hash & mask;
+    pthread_mutex_t *lock = &locks[b % REPLAY_LOCKS].lock;
+    struct replay_answer *a;
+    struct replay_slot *s;
+
+    *parked = NULL;
+    if (!buckets)
+        return;
+
+    pthread_mutex_lock(lock);
+    if ((s = bucket_find(b, hash, number, now_s())) != NULL) {
+        a = &answers[b * REPLAY_WAYS + (s - buckets[b].slot)];
+        *parked = a->parked;
+        a->parked = NULL;
+        s->expires = 0;
+    }
+    pthread_mutex_unlock(lock);
+}
+
+void replay_get_stats(struct replay_stats *out)
+{
+    out->hits = atomic_load_explicit(&hits, memory_order_relaxed);
+    out->misses = atomic_load_explicit(&misses, memory_order_relaxed);
+    out->pending = atomic_load_explicit(&pending, memory_order_relaxed);
+    out->evictions = atomic_load_explicit(&evictions, memory_order_relaxed);
+}
+
+void replay_log_stats(void)
+{
+    struct replay_stats s;
+
+    replay_get_stats(&s);
+    fd_log_notice("Replay cache: %lu hits (answered from cache), %lu kept for the answer of the first copy, %lu misses, %lu evictions\n",
+                  (unsigned long)s.hits, (unsigned long)s.pending, (unsigned long)s.misses, (unsigned long)s.evictions);
+}
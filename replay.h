@@ -0,0 +1,58 @@
+#ifndef GY_REPLAY_H
+#define GY_REPLAY_H
+
+#include <stdint.h>
+#include "build.h"
+
+/*
+ * Replay cache: the answers recently sent, keyed by Session-Id hash and
+ * CC-Request-Number. A CCR seen again within the TTL, such as one
+ * retransmitted with the T flag after a failover, is answered with the same
+ * fields as the first time. It is not rated again, so the ledger and the
+ * balances count it once.
+ *
+ * The table is set-associative: a key can only live in one 64-byte bucket
+ * of REPLAY_WAYS slots. A full bucket evicts its oldest slot, so memory is
+ * bounded and a lookup reads a single cache line.
+ */
+
+#define REPLAY_WAYS 4
+
+enum replay_result {
+    REPLAY_MISS = 0,    /* not seen: the caller rates it, then calls replay_store or replay_cancel */
+    REPLAY_HIT,         /* answered before: the answer fields were copied out */
+    REPLAY_PENDING,     /* the first copy is still being rated: this one was kept to get its answer */
+};
+
+struct replay_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t pending;     /* copies kept until the first one was answered */
+    uint64_t evictions;   /* live answers pushed out by newer ones before their TTL */
+};
+
+/* capacity answers kept for ttl_s seconds; capacity 0 disables the cache */
+int  replay_init(unsigned capacity, unsigned ttl_s);
+void replay_fini(void);
+
+/*
+ * Look a CCR up. On a hit, *f is filled and f->mscc points to mscc[], which
+ * must hold GY_MSCC_MAX entries. On a miss, the key is reserved until
+ * replay_store() or replay_cancel(). While pending, *msg is taken (set to
+ * NULL) and handed back by replay_store() or replay_cancel(). A retransmission
+ * only exists because the client gave up on the earlier copy, so only the
+ * latest copy is kept; an older one is freed.
+ */
+enum replay_result replay_lookup(uint64_t hash, uint32_t cc_request_number,
+                                 struct gy_cca_fields *f, struct gy_cca_mscc *mscc, struct msg **msg);
+
+/* Remember the answer of a reserved key; *parked gets the copy that waits for it, if any */
+void replay_store(uint64_t hash, uint32_t cc_request_number, const struct gy_cca_fields *f, struct msg **parked);
+
+/* Release a reserved key without an answer; *parked as for replay_store */
+void replay_cancel(uint64_t hash, uint32_t cc_request_number, struct msg **parked);
+
+void replay_get_stats(struct replay_stats *out);
+void replay_log_stats(void);
+
+#endif /* GY_REPLAY_H */
@@ -1,174 +1,584 @@
 #include "utils.h"
+#include "ledger.h"
+#include "codec.h"
+#include "build.h"
+#include "conf.h"
+#include "evlog.h"
+#include "wal.h"
+#include "workq.h"
+#include "accounts.h"
+#include "overload.h"
+#include "replay.h"
+#include "metrics.h"
+#include "policy.h"
+#include "trace.h"
+#include "rar.h"
+#include "repl.h"
 
 static struct disp_hdl *hdl = NULL;
 static struct dict_object *ccr_cmd = NULL;
 static struct dict_object *app_dcca = NULL;
-static struct dict_object *avp_cc_request_type = NULL;
-static struct dict_object *avp_cc_request_number = NULL;
-static struct dict_object *avp_auth_app_id = NULL;
-static struct dict_object *avp_service_context_id = NULL;
-static struct dict_object *avp_requested_service_unit = NULL;
-static struct dict_object *avp_used_service_unit = NULL;
-static struct dict_object *avp_granted_service_unit = NULL;
-static struct dict_object *avp_cc_total_octets = NULL;
-
-static uint64_t total_granted = 0;
-static uint64_t total_reported_usage = 0;
-
-/* Helper function to extract octets from Service-Unit AVP */
-static uint64_t extract_octets_from_service_unit(struct avp *su_avp)
-{
-    struct avp *child;
-    struct avp_hdr *hdr;
-    
-    if (fd_msg_browse(su_avp, MSG_BRW_FIRST_CHILD, &child, NULL) == 0) {
-        while (child != NULL) {
-            if (fd_msg_avp_hdr(child, &hdr) == 0) {
-                if (hdr->avp_code == 421) { /* CC-Total-Octets */
-                    return hdr->avp_value->u64;
-                }
-            }
-            if (fd_msg_browse(child, MSG_BRW_NEXT, &child, NULL) != 0) {
-                break;
-            }
+
+/* Server configuration, from the file given on the LoadExtension line */
+static struct {
+    enum evlog_level log_level;   /* event log verbosity */
+    char log_file[256];           /* binary event log, empty = text through fd_log */
+    char wal_dir[256];            /* ledger persistence directory, empty = not persisted */
+    uint32_t wal_commit_ms;       /* group commit interval */
+    uint32_t wal_compact_interval; /* seconds between snapshots */
+    uint32_t workers;             /* rating threads, 0 = rate in the dispatch thread */
+    uint32_t queue_size;          /* jobs waiting for a worker */
+    double report_interval;       /* worker statistics period, 0 = only at unload */
+    char accounts_file[256];      /* subscriber balances, empty = grant what is requested */
+    char policy_file[256];        /* grant rules, empty = no cap on the grants */
+    uint32_t max_in_progress;     /* CCRs admitted and not answered yet, 0 = no limit */
+    double initial_share;         /* share of max_in_progress open to CCR-I */
+    double max_delay_ms;          /* estimated wait above which CCR-I are shed, 0 = no limit */
+    uint32_t replay_cache_size;   /* answers kept for duplicate CCRs, 0 = no replay cache */
+    uint32_t replay_ttl;          /* seconds an answer is kept */
+    uint32_t validity_time;       /* Validity-Time of the grants, 0 = none */
+    uint32_t tcc;                 /* Tcc: extra seconds a session may stay silent after Validity-Time */
+    uint32_t reap_batch;          /* expired sessions removed per ledger shard and reaper pass */
+    char metrics_file[256];       /* Prometheus textfile, empty = no metrics */
+    double metrics_interval;      /* seconds between rewrites of the metrics file */
+    char trace_file[256];         /* workload trace of the CCRs rated, empty = no capture */
+    double rar_rate;              /* RARs per second of a re-authorization fan-out */
+    uint32_t rar_window;          /* RARs waiting for their RAA */
+    double rar_timeout;           /* seconds before a RAR counts as unanswered */
+    char rar_dest_realm[256];     /* Destination-Realm of the RARs, empty = from the Session-Id */
+    uint32_t rar_on_reload;       /* re-authorize every session after a policy reload */
+    enum repl_role repl_role;     /* ledger replication to or from another OCS */
+    char repl_address[256];       /* primary: where the standby connects; standby: the primary */
+    uint32_t repl_batch_ms;       /* interval between two batches of ledger changes */
+    uint32_t repl_max_lag_ms;     /* lag beyond which the primary drops the standby */
+    uint32_t repl_max_backlog;    /* bytes of changes not sent yet beyond which the standby is dropped */
+    uint32_t repl_takeover_ms;    /* silence of the primary after which the standby takes over */
+} server_conf = {
+    .log_level = EVL_INFO,
+    .initial_share = 0.75,
+    .replay_cache_size = 65536,
+    .replay_ttl = 30,
+    .reap_batch = 64,
+    .metrics_interval = 10,
+    .wal_commit_ms = 5,
+    .wal_compact_interval = 60,
+    .queue_size = 4096,
+    .rar_rate = 1000,
+    .rar_window = 256,
+    .rar_timeout = 5,
+    .repl_batch_ms = 5,
+    .repl_max_lag_ms = 1000,
+    .repl_max_backlog = 64 << 20,
+    .repl_takeover_ms = 3000,
+};
+
+static int server_conf_handler(const char *key, const char *value, void *opaque)
+{
+    if (!strcmp(key, "log_level"))
+        return evlog_parse_level(value, &server_conf.log_level);
+    if (!strcmp(key, "log_file")) {
+        if (strlen(value) >= sizeof(server_conf.log_file))
+            return EINVAL;
+        strcpy(server_conf.log_file, value);
+        return 0;
+    }
+    if (!strcmp(key, "wal_dir")) {
+        if (strlen(value) >= sizeof(server_conf.wal_dir))
+            return EINVAL;
+        strcpy(server_conf.wal_dir, value);
+        return 0;
+    }
+    if (!strcmp(key, "wal_commit_ms"))
+        return conf_get_u32(key, value, &server_conf.wal_commit_ms);
+    if (!strcmp(key, "wal_compact_interval"))
+        return conf_get_u32(key, value, &server_conf.wal_compact_interval);
+    if (!strcmp(key, "accounts_file")) {
+        if (strlen(value) >= sizeof(server_conf.accounts_file))
+            return EINVAL;
+        strcpy(server_conf.accounts_file, value);
+        return 0;
+    }
+    if (!strcmp(key, "rar_rate"))
+        return conf_get_double(key, value, &server_conf.rar_rate);
+    if (!strcmp(key, "rar_window"))
+        return conf_get_u32(key, value, &server_conf.rar_window);
+    if (!strcmp(key, "rar_timeout"))
+        return conf_get_double(key, value, &server_conf.rar_timeout);
+    if (!strcmp(key, "rar_on_reload"))
+        return conf_get_u32(key, value, &server_conf.rar_on_reload);
+    if (!strcmp(key, "rar_dest_realm")) {
+        if (strlen(value) >= sizeof(server_conf.rar_dest_realm))
+            return EINVAL;
+        strcpy(server_conf.rar_dest_realm, value);
+        return 0;
+    }
+    if (!strcmp(key, "repl_role")) {
+        if (!strcmp(value, "primary"))
+            server_conf.repl_role = REPL_PRIMARY;
+        else if (!strcmp(value, "standby"))
+            server_conf.repl_role = REPL_STANDBY;
+        else
+            return EINVAL;
+        return 0;
+    }
+    if (!strcmp(key, "repl_address")) {
+        if (strlen(value) >= sizeof(server_conf.repl_address))
+            return EINVAL;
+        strcpy(server_conf.repl_address, value);
+        return 0;
+    }
+    if (!strcmp(key, "repl_batch_ms"))
+        return conf_get_u32(key, value, &server_conf.repl_batch_ms);
+    if (!strcmp(key, "repl_max_lag_ms"))
+        return conf_get_u32(key, value, &server_conf.repl_max_lag_ms);
+    if (!strcmp(key, "repl_max_backlog"))
+        return conf_get_u32(key, value, &server_conf.repl_max_backlog);
+    if (!strcmp(key, "repl_takeover_ms"))
+        return conf_get_u32(key, value, &server_conf.repl_takeover_ms);
+    if (!strcmp(key, "trace_file")) {
+        if (strlen(value) >= sizeof(server_conf.trace_file))
+            return EINVAL;
+        strcpy(server_conf.trace_file, value);
+        return 0;
+    }
+    if (!strcmp(key, "policy_file")) {
+        if (strlen(value) >= sizeof(server_conf.policy_file))
+            return EINVAL;
+        strcpy(server_conf.policy_file, value);
+        return 0;
+    }
+    if (!strcmp(key, "workers"))
+        return conf_get_u32(key, value, &server_conf.workers);
+    if (!strcmp(key, "queue_size"))
+        return conf_get_u32(key, value, &server_conf.queue_size);
+    if (!strcmp(key, "report_interval"))
+        return conf_get_double(key, value, &server_conf.report_interval);
+    if (!strcmp(key, "max_in_progress"))
+        return conf_get_u32(key, value, &server_conf.max_in_progress);
+    if (!strcmp(key, "initial_share"))
+        return conf_get_double(key, value, &server_conf.initial_share);
+    if (!strcmp(key, "max_delay_ms"))
+        return conf_get_double(key, value, &server_conf.max_delay_ms);
+    if (!strcmp(key, "replay_cache_size"))
+        return conf_get_u32(key, value, &server_conf.replay_cache_size);
+    if (!strcmp(key, "replay_ttl"))
+        return conf_get_u32(key, value, &server_conf.replay_ttl);
+    if (!strcmp(key, "validity_time"))
+        return conf_get_u32(key, value, &server_conf.validity_time);
+    if (!strcmp(key, "tcc"))
+        return conf_get_u32(key, value, &server_conf.tcc);
+    if (!strcmp(key, "reap_batch"))
+        return conf_get_u32(key, value, &server_conf.reap_batch);
+    if (!strcmp(key, "metrics_file")) {
+        if (strlen(value) >= sizeof(server_conf.metrics_file))
+            return EINVAL;
+        strcpy(server_conf.metrics_file, value);
+        return 0;
+    }
+    if (!strcmp(key, "metrics_interval"))
+        return conf_get_double(key, value, &server_conf.metrics_interval);
+
+    fd_log_error("Unknown server configuration key '%s'\n", key);
+    return EINVAL;
+}
+
+/* The rating groups of one CCR: one per MSCC, or a single one for top-level service units */
+struct rating {
+    unsigned n;
+    struct ledger_unit units[GY_MSCC_MAX];   /* rating group, usage, and the grant decided here */
+    uint64_t requested[GY_MSCC_MAX];
+    uint32_t result[GY_MSCC_MAX];            /* Result-Code of each group */
+};
+
+static void rating_from_ccr(const struct ccr_view *ccr, struct rating *r)
+{
+    unsigned i;
+
+    if (!ccr->mscc_count) {
+        r->n = 1;
+        memset(&r->units[0], 0, sizeof(r->units[0]));
+        r->units[0].rating_group = LEDGER_NO_RATING_GROUP;
+        r->units[0].used = ccr->usu.present ? ccr->usu.total_octets : 0;
+        r->requested[0] = ccr->rsu.present ? ccr->rsu.total_octets : 0;
+        r->result[0] = 2001;
+        return;
+    }
+
+    r->n = ccr->mscc_count;
+    for (i = 0; i < r->n; i++) {
+        const struct gy_mscc *m = &ccr->mscc[i];
+        memset(&r->units[i], 0, sizeof(r->units[i]));
+        r->units[i].rating_group = m->rating_group;
+        r->units[i].used = m->usu.present ? m->usu.total_octets : 0;
+        r->requested[i] = m->rsu.present ? m->rsu.total_octets : 0;
+        r->result[i] = 2001;
+    }
+}
+
+/* Cap the requests of an INITIAL or UPDATE with the grant policy; acct is NULL without balances */
+static void rating_apply_policy(const struct ccr_view *ccr, const struct account *acct, struct rating *r)
+{
+    uint64_t limit[GY_MSCC_MAX], balance = 0;
+    unsigned i;
+
+    if (!policy_loaded() || (ccr->cc_request_type != 1 && ccr->cc_request_type != 2))
+        return;
+    if (acct)
+        balance = atomic_load_explicit(&acct->available, memory_order_relaxed);
+    policy_limits(ccr->subscription_id.data, ccr->subscription_id.len, acct ? &balance : NULL,
+                  r->units, r->n, limit);
+    for (i = 0; i < r->n; i++) {
+        if (r->requested[i] <= limit[i])
+            continue;
+        r->requested[i] = limit[i];
+        if (!limit[i])
+            r->result[i] = 4012; /* DIAMETER_CREDIT_LIMIT_REACHED: denied by the policy */
+    }
+}
+
+/* A CCR rated against its subscriber's balance, from within ledger_apply */
+struct balance_rating {
+    const struct ccr_view *ccr;
+    struct rating *r;
+    struct account *acct;
+};
+
+/*
+ * Rate a CCR against the subscriber's balance: the outstanding reservation
+ * of each rating group is settled with the usage reported for it, then the
+ * new request of the group is reserved. Runs under the session's ledger
+ * lock, with the reservations the ledger actually holds, so an expiry of
+ * the session cannot release them as well. Per-group results are left in
+ * r->result.
+ */
+static void rate_from_balance(void *arg, void *owner, const uint64_t *prev, uint64_t prev_total,
+                              struct ledger_unit *units, unsigned n)
+{
+    struct balance_rating *br = arg;
+    const struct ccr_view *ccr = br->ccr;
+    struct rating *r = br->r;
+    uint64_t listed = 0;
+    unsigned i;
+
+    /*
+     * A session recovered from the WAL or inherited from the primary has no
+     * owner: its grants were never reserved on this run's balances, so there
+     * is nothing to release, and its usage is charged from the balance.
+     */
+    for (i = 0; i < n; i++) {
+        accounts_settle(br->acct, owner ? prev[i] : 0, units[i].used);
+        listed += prev[i];
+    }
+    /* A TERMINATE also releases the groups it does not report on */
+    if (owner && ccr->cc_request_type == 3 && prev_total > listed)
+        accounts_settle(br->acct, prev_total - listed, 0);
+
+    /* The policy sees the balance left once the usage is settled */
+    rating_apply_policy(ccr, br->acct, r);
+    if (ccr->cc_request_type == 1 || ccr->cc_request_type == 2) {
+        for (i = 0; i < n; i++) {
+            if (!r->requested[i])
+                continue;
+            units[i].granted = accounts_reserve(br->acct, r->requested[i]);
+            if (!units[i].granted)
+                r->result[i] = 4012; /* DIAMETER_CREDIT_LIMIT_REACHED */
         }
     }
+}
+
+/* Answer a CCR that was not rated with a bare Result-Code */
+static int ccr_refuse(struct msg **msg, uint32_t result_code, uint32_t cc_request_type, uint32_t cc_request_number)
+{
+    struct gy_cca_fields cca;
+    int ret;
+
+    memset(&cca, 0, sizeof(cca));
+    cca.result_code = result_code;
+    cca.cc_request_type = cc_request_type;
+    cca.cc_request_number = cc_request_number;
+    CHECK_FCT(gy_build_cca(msg, &cca));
+    if ((ret = fd_msg_send(msg, NULL, NULL)) != 0) {
+        evlog_emit(EVL_ERROR, EV_SEND_FAILED, cc_request_type, ret, 0, 0, 0, 0);
+        metrics_answer(cc_request_type, METRICS_NO_ANSWER, 0);
+        return ret;
+    }
+    metrics_answer(cc_request_type, result_code, 0);
     return 0;
 }
 
-/* Helper function to add Granted-Service-Unit with octets */
-static int add_granted_service_unit(struct msg *ans, uint64_t octets)
-{
-    struct avp *avp_gsu, *avp_octets;
-    union avp_value val;
-
-    /* Create Granted-Service-Unit AVP (grouped) */
-    CHECK_FCT(fd_msg_avp_new(avp_granted_service_unit, 0, &avp_gsu));
-    
-    /* Add CC-Total-Octets inside Granted-Service-Unit */
-    CHECK_FCT(fd_msg_avp_new(avp_cc_total_octets, 0, &avp_octets));
-    val.u64 = octets;
-    CHECK_FCT(fd_msg_avp_setvalue(avp_octets, &val));
-    CHECK_FCT(fd_msg_avp_add(avp_gsu, MSG_BRW_LAST_CHILD, avp_octets));
-    
-    /* Add Granted-Service-Unit to answer */
-    CHECK_FCT(fd_msg_avp_add(ans, MSG_BRW_LAST_CHILD, avp_gsu));
-    
+/* Answer a duplicate CCR with the fields of its first answer */
+static int ccr_replay(struct msg **msg, const struct gy_cca_fields *cca, uint64_t sess_hash)
+{
+    int ret;
+
+    CHECK_FCT(gy_build_cca(msg, cca));
+    if ((ret = fd_msg_send(msg, NULL, NULL)) != 0) {
+        evlog_emit(EVL_ERROR, EV_SEND_FAILED, cca->cc_request_type, ret, sess_hash, 0, 0, 0);
+        metrics_answer(cca->cc_request_type, METRICS_NO_ANSWER, 0);
+        return ret;
+    }
+    /* The octets were counted with the first answer */
+    metrics_answer(cca->cc_request_type, cca->result_code, 0);
+    evlog_emit(EVL_INFO, EV_CCR_DUPLICATE, cca->cc_request_type, cca->cc_request_number, sess_hash, 1, 0, 0);
     return 0;
 }
 
-/* Callback when a CCR is received */
-static int ccr_cb(struct msg **msg, struct avp *avp, struct session *sess, void *opaque, enum disp_action *act)
+/* Rate a CCR and send its CCA; on success *msg is consumed */
+static int ccr_handle(struct msg **msg)
 {
-    struct msg *ans;
-    struct msg_hdr *hdr;
-    struct avp *avp_val;
-    struct avp_hdr *avp_hdr;
-    union avp_value val;
+    struct ccr_view ccr;
+    struct gy_cca_fields cca;
+    struct gy_cca_mscc mscc[GY_MSCC_MAX];
+    struct rating r;
     uint32_t cc_request_type = 0;
     uint32_t cc_request_number = 0;
     uint64_t requested_quota = 0;
     uint64_t reported_usage = 0;
+    uint64_t quota_to_grant = 0;
+    uint64_t sess_hash = 0;
+    uint64_t start = now_ns();
+    uint32_t result_code = 2001; /* DIAMETER_SUCCESS */
+    struct ledger_totals totals;
+    struct account *acct = NULL;
+    struct balance_rating br = { &ccr, &r, NULL };
+    ledger_rate_cb rate = NULL;
+    struct msg *parked = NULL;
+    unsigned i;
+    int ret, rejected = 0;
 
     if (!msg || !*msg)
         return EINVAL;
 
-    fd_log_notice("\n=== Gy server: received CCR ===\n");
-
-    /* Parse message header */
-    CHECK_FCT(fd_msg_hdr(*msg, &hdr));
-
-    /* Extract CC-Request-Type */
-    CHECK_FCT(fd_msg_search_avp(*msg, avp_cc_request_type, &avp_val));
-    if (avp_val) {
-        CHECK_FCT(fd_msg_avp_hdr(avp_val, &avp_hdr));
-        cc_request_type = avp_hdr->avp_value->u32;
+    /* Decode all the AVPs we need in one pass */
+    CHECK_FCT(gy_decode_ccr(*msg, &ccr));
+    cc_request_type = ccr.cc_request_type;
+    cc_request_number = ccr.cc_request_number;
+    if (ccr.session_id_len)
+        sess_hash = gy_hash(ccr.session_id, ccr.session_id_len);
+
+    /* Requested-Service-Unit / Used-Service-Unit, per rating group */
+    rating_from_ccr(&ccr, &r);
+    for (i = 0; i < r.n; i++) {
+        requested_quota += r.requested[i];
+        reported_usage += r.units[i].used;
     }
 
-    /* Extract CC-Request-Number */
-    CHECK_FCT(fd_msg_search_avp(*msg, avp_cc_request_number, &avp_val));
-    if (avp_val) {
-        CHECK_FCT(fd_msg_avp_hdr(avp_val, &avp_hdr));
-        cc_request_number = avp_hdr->avp_value->u32;
+    evlog_emit(EVL_INFO, EV_CCR_RECEIVED, cc_request_type, cc_request_number, sess_hash, requested_quota, reported_usage, r.n);
+    metrics_request(cc_request_type, reported_usage);
+
+    /* A retransmission of a CCR already rated gets the same answer again */
+    if (ccr.session_id_len) {
+        switch (replay_lookup(sess_hash, cc_request_number, &cca, mscc, msg)) {
+            case REPLAY_HIT:
+                return ccr_replay(msg, &cca, sess_hash);
+            case REPLAY_PENDING:
+                /* Kept: it gets the answer of the first copy when that one is rated */
+                evlog_emit(EVL_INFO, EV_CCR_DUPLICATE, cc_request_type, cc_request_number, sess_hash, 0, 0, 0);
+                return 0;
+            case REPLAY_MISS:
+                break;
+        }
     }
 
-    const char *request_name;
-    if (cc_request_type == 1) {
-        request_name = "INITIAL";
-    } else if (cc_request_type == 2) {
-        request_name = "UPDATE";
-    } else if (cc_request_type == 3) {
-        request_name = "TERMINATE";
-    } else {
-        request_name = "UNKNOWN";
+    /* Retransmissions are not captured: a replay would rate them as new requests */
+    trace_capture(sess_hash, ccr.subscription_id.data, ccr.subscription_id.len, cc_request_type, cc_request_number,
+                  ccr.mscc_count, requested_quota, reported_usage);
+
+    /* Grant quota for INITIAL and UPDATE requests, within the balance when accounts are loaded */
+    if (ccr.mscc_truncated) {
+        result_code = 5012; /* DIAMETER_UNABLE_TO_COMPLY: more rating groups than we handle */
+        r.n = 0;
+        rejected = 1;
+    } else if (accounts_loaded()) {
+        /* Rated by ledger_apply, against the reservations the session holds */
+        br.acct = acct = accounts_find(ccr.subscription_id.data, ccr.subscription_id.len);
+        if (!acct) {
+            result_code = 5030; /* DIAMETER_USER_UNKNOWN */
+            rejected = 1;
+        } else {
+            rate = rate_from_balance;
+        }
+    } else if (cc_request_type == 1 || cc_request_type == 2) {
+        rating_apply_policy(&ccr, NULL, &r);
+        for (i = 0; i < r.n; i++)
+            r.units[i].granted = r.requested[i];
     }
 
-    fd_log_notice("CCR Type: %u (%s), Number: %u\n", cc_request_type, request_name, cc_request_number);
+    /*
+     * Account the CCR against the session ledger; if the session expires, its reservation goes back to acct.
+     * A rejected CCR leaves the ledger alone: even a TERMINATE keeps its session, and the reservations
+     * the session holds, until they are settled by a later CCR or released by its expiry.
+     */
+    memset(&totals, 0, sizeof(totals));
+    if (rejected) {
+        /* Nothing to account */
+    } else if (ccr.session_id_len) {
+        if ((ret = ledger_apply(ccr.session_id, ccr.session_id_len, sess_hash, cc_request_type, r.units, r.n, acct,
+                                rate, &br, &totals)) != 0) {
+            fd_log_error("CCR not rated, the ledger failed: %s\n", strerror(ret));
+            replay_cancel(sess_hash, cc_request_number, &parked);
+            if (parked) {
+                /* Not rated: the copy that waited is told to try again */
+                memset(&cca, 0, sizeof(cca));
+                cca.result_code = 3004; /* DIAMETER_TOO_BUSY */
+                cca.cc_request_type = cc_request_type;
+                cca.cc_request_number = cc_request_number;
+                (void) ccr_replay(&parked, &cca, sess_hash);
+            }
+            /* And so is this one */
+            return ccr_refuse(msg, 3004, cc_request_type, cc_request_number);
+        }
+    } else {
+        uint64_t none[GY_MSCC_MAX] = { 0 };
 
-    /* Extract Requested-Service-Unit if present */
-    if (fd_msg_search_avp(*msg, avp_requested_service_unit, &avp_val) == 0 && avp_val) {
-        requested_quota = extract_octets_from_service_unit(avp_val);
-        fd_log_notice("Requested quota: %.1f GB\n", (double)requested_quota / (1024*1024*1024));
+        fd_log_error("CCR without a usable Session-Id, not accounted\n");
+        if (rate)
+            rate(&br, acct, none, 0, r.units, r.n);
     }
+    for (i = 0; i < r.n; i++)
+        quota_to_grant += r.units[i].granted;
+
+    /* Build the answer: only the variable fields are set here */
+    memset(&cca, 0, sizeof(cca));
+    cca.cc_request_type = cc_request_type;
+    cca.cc_request_number = cc_request_number;
+    if (result_code == 2001 && !ccr.mscc_count) {
+        /* Top-level service units: the group's result is the answer's */
+        result_code = r.result[0];
+        if ((cc_request_type == 1 || cc_request_type == 2) && result_code == 2001) {
+            cca.has_gsu = 1;
+            cca.gsu_octets = r.units[0].granted;
+            cca.validity_time = server_conf.validity_time;
+        }
+    } else if (result_code == 2001) {
+        /* One MSCC per rating group of the request */
+        for (i = 0; i < r.n; i++) {
+            memset(&mscc[i], 0, sizeof(mscc[i]));
+            mscc[i].rating_group = r.units[i].rating_group;
+            mscc[i].result_code = r.result[i];
+            if ((cc_request_type == 1 || cc_request_type == 2) && r.result[i] == 2001) {
+                mscc[i].has_gsu = 1;
+                mscc[i].gsu_octets = r.units[i].granted;
+                mscc[i].validity_time = server_conf.validity_time;
+            }
+        }
+        cca.mscc_count = r.n;
+        cca.mscc = mscc;
+    }
+    cca.result_code = result_code;
+    /* The ledger has counted this CCR: from now on a duplicate must get this answer */
+    if (ccr.session_id_len) {
+        replay_store(sess_hash, cc_request_number, &cca, &parked);
+        if (parked)
+            (void) ccr_replay(&parked, &cca, sess_hash);
+    }
+    CHECK_FCT(gy_build_cca(msg, &cca));
 
-    /* Extract Used-Service-Unit if present */
-    if (fd_msg_search_avp(*msg, avp_used_service_unit, &avp_val) == 0 && avp_val) {
-        reported_usage = extract_octets_from_service_unit(avp_val);
-        total_reported_usage += reported_usage;
-        fd_log_notice("Reported usage: %.1f GB (total: %.1f GB)\n", (double)reported_usage / (1024*1024*1024), (double)total_reported_usage / (1024*1024*1024));
+    if ((ret = fd_msg_send(msg, NULL, NULL)) != 0) {
+        evlog_emit(EVL_ERROR, EV_SEND_FAILED, cc_request_type, ret, sess_hash, 0, 0, 0);
+        metrics_answer(cc_request_type, METRICS_NO_ANSWER, 0);
+        return ret;
     }
+    metrics_answer(cc_request_type, cca.result_code, quota_to_grant);
+    metrics_latency(cc_request_type, now_ns() - start);
+
+    evlog_emit(EVL_INFO, EV_CCA_SENT, cc_request_type, cca.result_code, sess_hash, quota_to_grant, totals.granted, totals.used);
+    if (cc_request_type == 3 && !rejected)
+        evlog_emit(EVL_INFO, EV_SESSION_CLOSED, 0, 0, sess_hash, totals.granted, totals.used, ledger_live_sessions());
 
-    /* Create answer from request */
-    CHECK_FCT(fd_msg_new_answer_from_req(fd_g_config->cnf_dict, msg, 0));
-    ans = *msg;
+    return 0;
+}
 
-    /* Add Result-Code = DIAMETER_SUCCESS */
-    CHECK_FCT(fd_msg_rescode_set(ans, "DIAMETER_SUCCESS", NULL, NULL, 1));
+/* A session went silent past Validity-Time + Tcc: give its reservation back */
+static void session_expired(const struct ledger_record *rec)
+{
+    if (rec->owner && rec->totals.reserved)
+        accounts_settle(rec->owner, rec->totals.reserved, 0);
+    evlog_emit(EVL_INFO, EV_SESSION_EXPIRED, rec->totals.ccr_count, 0, gy_hash(rec->sid, rec->sidlen),
+               rec->totals.granted, rec->totals.used, rec->totals.reserved);
+}
 
-    /* Add Auth-Application-Id */
-    CHECK_FCT(fd_msg_avp_new(avp_auth_app_id, 0, &avp_val));
-    val.u32 = 4;
-    CHECK_FCT(fd_msg_avp_setvalue(avp_val, &val));
-    CHECK_FCT(fd_msg_avp_add(ans, MSG_BRW_LAST_CHILD, avp_val));
+/* Answer a CCR that overload control did not admit, or that reached a standby, with DIAMETER_TOO_BUSY */
+static int ccr_shed(struct msg **msg, uint32_t cc_request_type, uint32_t cc_request_number)
+{
+    evlog_emit(EVL_ERROR, EV_CCR_SHED, cc_request_type, cc_request_number, 0, 0, 0, 0);
+    metrics_request(cc_request_type, 0);
+    return ccr_refuse(msg, 3004, cc_request_type, cc_request_number);
+}
 
-    /* Add CC-Request-Type */
-    CHECK_FCT(fd_msg_avp_new(avp_cc_request_type, 0, &avp_val));
-    val.u32 = cc_request_type;
-    CHECK_FCT(fd_msg_avp_setvalue(avp_val, &val));
-    CHECK_FCT(fd_msg_avp_add(ans, MSG_BRW_LAST_CHILD, avp_val));
+/* Rate an admitted CCR, then release its place in overload control */
+static int ccr_rate(struct msg **msg)
+{
+    uint64_t start = now_ns();
+    int ret = ccr_handle(msg);
 
-    /* Add CC-Request-Number */
-    CHECK_FCT(fd_msg_avp_new(avp_cc_request_number, 0, &avp_val));
-    val.u32 = cc_request_number;
-    CHECK_FCT(fd_msg_avp_setvalue(avp_val, &val));
-    CHECK_FCT(fd_msg_avp_add(ans, MSG_BRW_LAST_CHILD, avp_val));
+    overload_done(now_ns() - start);
+    return ret;
+}
 
-    /* Grant quota for INITIAL and UPDATE requests */
-    if (cc_request_type == 1 || cc_request_type == 2) {
-        uint64_t quota_to_grant = requested_quota; /* Grant 1GB */
-        total_granted += quota_to_grant;
-        
-        add_granted_service_unit(ans, quota_to_grant);
-        fd_log_notice("Granted quota: %.1f GB (total granted: %.1f GB)\n", (double)quota_to_grant / (1024*1024*1024), (double)total_granted / (1024*1024*1024));
+/* Worker side of the asynchronous mode */
+static void ccr_job(void *job)
+{
+    struct msg *msg = job;
+    struct msg_hdr *hdr;
+    uint32_t cc_request_type = 0, cc_request_number = 0;
+    int ret;
+
+    if ((ret = ccr_rate(&msg)) == 0)
+        return;
+    fd_log_error("CCR failed in a worker: %s\n", strerror(ret));
+
+    /* Inline, freeDiameter would answer it; here the client would only see a timeout */
+    if (msg && fd_msg_hdr(msg, &hdr) == 0 && (hdr->msg_flags & CMD_FLAG_REQUEST)) {
+        (void) gy_peek_ccr(msg, &cc_request_type, &cc_request_number);
+        if (ccr_refuse(&msg, 5012, cc_request_type, cc_request_number) == 0) /* DIAMETER_UNABLE_TO_COMPLY */
+            return;
     }
+    if (msg)
+        fd_msg_free(msg);
+}
+
+/* Callback when a CCR is received */
+static int ccr_cb(struct msg **msg, struct avp *avp, struct session *sess, void *opaque, enum disp_action *act)
+{
+    uint32_t cc_request_type, cc_request_number;
 
-    CHECK_FCT(fd_msg_send(msg, NULL, NULL));
+    if (!msg || !*msg)
+        return EINVAL;
 
-    if (cc_request_type == 1) {
-        fd_log_notice("CCA: \"OK, here's %.1f GB quota\"\n", (double)requested_quota / (1024*1024*1024));
-    } else if (cc_request_type == 2) {
-        fd_log_notice("CCA: \"OK, here's another %.1f GB quota\"\n", (double)requested_quota / (1024*1024*1024));
-    } else if (cc_request_type == 3) {
-        fd_log_notice("CCA: \"OK, session closed\"\n");
-        fd_log_notice("Session summary - Granted: %.1f GB, Used: %.1f GB\n", (double)total_granted / (1024*1024*1024), (double)total_reported_usage / (1024*1024*1024));
-        
-        /* Reset counters for next session */
-        total_granted = 0;
-        total_reported_usage = 0;
+    /* Admission: only the request type is read here, the worker decodes the rest */
+    CHECK_FCT(gy_peek_ccr(*msg, &cc_request_type, &cc_request_number));
+    /* A standby does not rate until it has taken over from the primary */
+    if (repl_standby() || !overload_admit(cc_request_type))
+        return ccr_shed(msg, cc_request_type, cc_request_number);
+
+    /* Hand the request to a worker; freeDiameter is done with it once *msg is NULL */
+    if (server_conf.workers) {
+        if (workq_push(*msg) == 0) {
+            *msg = NULL;
+            return 0;
+        }
+        /* Queue full: rate it here, which slows the dispatch threads down */
     }
+    return ccr_rate(msg);
+}
 
-    fd_log_notice("CCA sent successfully for %s request\n", request_name);
-    return 0;
+/* New grant rules: every open session is rated again */
+static void policy_reloaded(void)
+{
+    int ret = rar_fanout_start();
+
+    if (ret)
+        fd_log_error("Policy reloaded, but no RAR fan-out started: %s\n", strerror(ret));
+}
+
+/* The standby took over: its sessions expire from now on */
+static void repl_promoted(void)
+{
+    int ret = ledger_reaper_start(server_conf.reap_batch, session_expired);
+
+    if (ret)
+        fd_log_error("Standby took over, but its sessions will not expire: %s\n", strerror(ret));
 }
 
 /* Called when extension is loaded */
@@ -176,6 +586,78 @@ static int server_entry(char *conffile)
 {
     struct disp_when data;
 
+    /* Optional configuration file */
+    if (conffile) {
+        CHECK_FCT(conf_parse(conffile, server_conf_handler, NULL));
+    }
+    CHECK_FCT(evlog_init(server_conf.log_file[0] ? server_conf.log_file : NULL, server_conf.log_level));
+    CHECK_FCT(metrics_start("gy_server", server_conf.metrics_file, server_conf.metrics_interval));
+    if (server_conf.trace_file[0]) {
+        CHECK_FCT(trace_capture_start(server_conf.trace_file));
+    }
+
+    /* Per-session quota ledger; a session silent for Validity-Time + Tcc expires */
+    CHECK_FCT(ledger_init(server_conf.validity_time + server_conf.tcc));
+    if (server_conf.wal_dir[0]) {
+        struct wal_conf wc = {
+            .dir = server_conf.wal_dir,
+            .commit_ms = server_conf.wal_commit_ms,
+            .compact_interval_s = server_conf.wal_compact_interval,
+        };
+        /* Recovers the ledger left by the previous run before any CCR is accepted */
+        CHECK_FCT(wal_open(&wc));
+    }
+
+    /* Subscriber balances */
+    if (server_conf.accounts_file[0]) {
+        CHECK_FCT(accounts_load(server_conf.accounts_file));
+    }
+    /* Grant rules, recompiled on SIGHUP */
+    if (server_conf.policy_file[0]) {
+        CHECK_FCT(policy_init(server_conf.policy_file, server_conf.rar_on_reload ? policy_reloaded : NULL));
+    }
+
+    /* A standby keeps its sessions as the primary sends them, until it takes over */
+    if (server_conf.repl_role != REPL_STANDBY) {
+        CHECK_FCT(ledger_reaper_start(server_conf.reap_batch, session_expired));
+    }
+    if (server_conf.repl_role != REPL_NONE) {
+        struct repl_conf rc = {
+            .role = server_conf.repl_role,
+            .address = server_conf.repl_address,
+            .batch_ms = server_conf.repl_batch_ms,
+            .max_lag_ms = server_conf.repl_max_lag_ms,
+            .max_backlog = server_conf.repl_max_backlog,
+            .takeover_ms = server_conf.repl_takeover_ms,
+            .promoted = repl_promoted,
+        };
+        CHECK_FCT(repl_start(&rc));
+    }
+
+    /* Answers of recent CCRs, for retransmissions */
+    CHECK_FCT(replay_init(server_conf.replay_cache_size, server_conf.replay_ttl));
+
+    /* Admission control, in front of the rating threads */
+    {
+        struct overload_conf oc = {
+            .max_in_progress = server_conf.max_in_progress,
+            .initial_share = server_conf.initial_share,
+            .max_delay_ms = server_conf.max_delay_ms,
+            .parallelism = server_conf.workers,
+        };
+        CHECK_FCT(overload_init(&oc));
+    }
+
+    /* Asynchronous rating */
+    if (server_conf.workers) {
+        struct workq_conf wq = {
+            .workers = server_conf.workers,
+            .capacity = server_conf.queue_size,
+            .report_interval_s = server_conf.report_interval,
+        };
+        CHECK_FCT(workq_start(&wq, ccr_job));
+    }
+
     /* Look up the DCCA application */
     application_id_t dcca_id = 4;
     CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_APPLICATION, APPLICATION_BY_ID, &dcca_id, &app_dcca, ENOENT));
@@ -185,14 +667,18 @@ static int server_entry(char *conffile)
 
     /* Look up dictionary objects */
     CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Credit-Control-Request", &ccr_cmd, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "CC-Request-Type", &avp_cc_request_type, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "CC-Request-Number", &avp_cc_request_number, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Auth-Application-Id", &avp_auth_app_id, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Service-Context-Id", &avp_service_context_id, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Requested-Service-Unit", &avp_requested_service_unit, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Used-Service-Unit", &avp_used_service_unit, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Granted-Service-Unit", &avp_granted_service_unit, ENOENT));
-    CHECK_FCT(fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "CC-Total-Octets", &avp_cc_total_octets, ENOENT));
+    CHECK_FCT(gy_build_init(NULL));
+
+    /* Re-authorization fan-outs, started by SIGUSR1 */
+    {
+        struct rar_conf rc = {
+            .rate = server_conf.rar_rate,
+            .window = server_conf.rar_window,
+            .timeout_s = server_conf.rar_timeout,
+            .dest_realm = server_conf.rar_dest_realm,
+        };
+        CHECK_FCT(rar_init(&rc));
+    }
 
     /* Set up dispatch rule */
     memset(&data, 0, sizeof(data));
@@ -212,6 +698,21 @@ void fd_ext_fini(void)
     if (hdl) {
         (void) fd_disp_unregister(&hdl, NULL);
     }
+    /* Answer what is still queued, and stop walking the sessions, before the ledger goes away */
+    workq_stop();
+    rar_fini();
+    repl_stop();
+    wal_close();
+    fd_log_notice("Sessions expired: %lu\n", (unsigned long)ledger_expired_sessions());
+    ledger_fini();
+    overload_log_stats();
+    replay_fini();
+    accounts_log_stats();
+    accounts_unload();
+    policy_fini();
+    metrics_stop();
+    trace_capture_stop();
+    evlog_fini();
     fd_log_notice("Gy server extension unloaded\n");
 }
 
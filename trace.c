@@ -0,0 +1,239 @@
+#include "utils.h"
+#include "trace.h"
+
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TRACE_RING_SIZE  16384  /* records per thread, power of two */
+#define TRACE_IDLE_US    1000   /* writer sleep when all rings are empty */
+
+/* Single producer (the rating thread), single consumer (the writer thread) */
+struct trace_ring {
+    atomic_uint head __attribute__((aligned(64)));   /* next slot to write */
+    atomic_uint tail __attribute__((aligned(64)));   /* next slot to read */
+    atomic_uint_fast64_t dropped __attribute__((aligned(64)));
+    struct trace_ring *next;
+    struct trace_record rec[TRACE_RING_SIZE];
+};
+
+static __thread struct trace_ring *self;
+static struct trace_ring *_Atomic rings;   /* lock-free push-only list */
+static atomic_int capturing;
+
+static pthread_t writer;
+static volatile int writer_running;
+static FILE *out;
+static uint64_t written;
+
+static struct trace_ring *ring_register(void)
+{
+    struct trace_ring *r;
+
+    if ((r = calloc(1, sizeof(*r))) == NULL)
+        return NULL;
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+        ;
+    return r;
+}
+
+/* E.164 digits as a number; 0 for anything else */
+static uint64_t msisdn_value(const uint8_t *s, size_t len)
+{
+    uint64_t v = 0;
+    size_t i;
+
+    if (!s || !len || len > 19)
+        return 0;
+    for (i = 0; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9')
+            return 0;
+        v = v * 10 + (s[i] - '0');
+    }
+    return v;
+}
+
+void trace_capture(uint64_t session, const uint8_t *msisdn, size_t msisdn_len,
+                   uint32_t request_type, uint32_t request_number, unsigned rating_groups,
+                   uint64_t requested, uint64_t used)
+{
+    struct trace_ring *r = self;
+    struct trace_record *rec;
+    struct timespec ts;
+    unsigned h;
+
+    if (!atomic_load_explicit(&capturing, memory_order_relaxed))
+        return;
+
+    if (!r && (r = self = ring_register()) == NULL)
+        return;
+
+    h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (h - atomic_load_explicit(&r->tail, memory_order_acquire) >= TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    rec = &r->rec[h & (TRACE_RING_SIZE - 1)];
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->ts_ns = (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+    rec->session = session;
+    rec->msisdn = msisdn_value(msisdn, msisdn_len);
+    rec->requested = requested;
+    rec->used = used;
+    rec->request_number = request_number;
+    rec->request_type = request_type;
+    rec->rating_groups = rating_groups;
+    rec->reserved = 0;
+
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+static uint64_t trace_dropped(void)
+{
+    struct trace_ring *r;
+    uint64_t total = 0;
+
+    for (r = atomic_load(&rings); r; r = r->next)
+        total += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    return total;
+}
+
+/* Move everything currently queued to the file; returns the number of records */
+static unsigned write_once(void)
+{
+    struct trace_ring *r;
+    unsigned n = 0;
+
+    for (r = atomic_load(&rings); r; r = r->next) {
+        unsigned t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        unsigned h = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        /* The pending records are at most two contiguous runs of the ring */
+        while (t != h) {
+            unsigned i = t & (TRACE_RING_SIZE - 1);
+            unsigned run = h - t;
+            if (run > TRACE_RING_SIZE - i)
+                run = TRACE_RING_SIZE - i;
+            fwrite(&r->rec[i], sizeof(struct trace_record), run, out);
+            t += run;
+            n += run;
+        }
+        atomic_store_explicit(&r->tail, t, memory_order_release);
+    }
+    written += n;
+    return n;
+}
+
+static void *trace_writer(void *arg)
+{
+    uint64_t reported_drops = 0, last_check = now_ns();
+
+    while (writer_running) {
+        if (!write_once()) {
+            /* Idle: push the buffered records out so that the file follows the traffic */
+            fflush(out);
+            usleep(TRACE_IDLE_US);
+        }
+
+        /* Warn about lost records at most every 10 seconds */
+        if (now_ns() - last_check > 10 * NS_PER_SEC) {
+            uint64_t d = trace_dropped();
+            if (d != reported_drops) {
+                fd_log_error("Trace capture: %lu records dropped so far (rings full)\n", (unsigned long)d);
+                reported_drops = d;
+            }
+            last_check = now_ns();
+        }
+    }
+    write_once();
+    return NULL;
+}
+
+int trace_capture_start(const char *path)
+{
+    struct trace_file_header hdr;
+
+    /* A new trace per run: replaying two runs as one would merge their timelines */
+    if ((out = fopen(path, "wb")) == NULL) {
+        fd_log_error("Unable to create trace file %s: %s\n", path, strerror(errno));
+        return errno;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(struct trace_record);
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    writer_running = 1;
+    CHECK_POSIX(pthread_create(&writer, NULL, trace_writer, NULL));
+    atomic_store(&capturing, 1);
+    fd_log_notice("Capturing a workload trace in %s\n", path);
+    return 0;
+}
+
+void trace_capture_stop(void)
+{
+    if (!writer_running)
+        return;
+    atomic_store(&capturing, 0);
+    writer_running = 0;
+    pthread_join(writer, NULL);
+    fd_log_notice("Trace capture: %lu records written, %lu dropped\n",
+                  (unsigned long)written, (unsigned long)trace_dropped());
+    if (fclose(out) != 0)
+        fd_log_error("Trace capture: error closing the file: %s\n", strerror(errno));
+    out = NULL;
+}
+
+int trace_open(const char *path, struct trace_map *map)
+{
+    const struct trace_file_header *hdr;
+    struct stat st;
+    void *p;
+    int fd, ret;
+
+    memset(map, 0, sizeof(*map));
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        ret = errno;
+        fd_log_error("Unable to open trace file %s: %s\n", path, strerror(ret));
+        return ret;
+    }
+    if (fstat(fd, &st) < 0) {
+        ret = errno;
+        close(fd);
+        return ret;
+    }
+    if ((size_t)st.st_size < sizeof(*hdr)) {
+        close(fd);
+        fd_log_error("%s is not a Gy trace\n", path);
+        return EINVAL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return errno;
+
+    hdr = p;
+    if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) || hdr->version != TRACE_VERSION
+        || hdr->record_size != sizeof(struct trace_record)) {
+        fd_log_error("%s is not a Gy trace of version %d\n", path, TRACE_VERSION);
+        munmap(p, st.st_size);
+        return EINVAL;
+    }
+    map->base = p;
+    map->len = st.st_size;
+    map->rec = (const struct trace_record *)((const uint8_t *)p + sizeof(*hdr));
+    map->count = (map->len - sizeof(*hdr)) / sizeof(struct trace_record);
+    return 0;
+}
+
+void trace_close(struct trace_map *map)
+{
+    if (map->base)
+        munmap(map->base, map->len);
+    memset(map, 0, sizeof(*map));
+}
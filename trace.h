@@ -0,0 +1,63 @@
+#ifndef GY_TRACE_H
+#define GY_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Workload traces: the server records one compact record per CCR it rates,
+ * and the client replays such a file to reproduce the traffic shape.
+ *
+ * Capture works like the event log: the rating threads copy the record
+ * into a per-thread ring, and a background thread streams the rings to the
+ * file through a large stdio buffer. A full ring drops the record and
+ * counts it, so capturing never blocks rating.
+ *
+ * Records are in time order within one capturing thread only; readers sort
+ * them by timestamp.
+ */
+
+/* On-disk record, 48 bytes */
+struct trace_record {
+    uint64_t ts_ns;           /* CLOCK_REALTIME when the CCR was rated */
+    uint64_t session;         /* hash of the Session-Id */
+    uint64_t msisdn;          /* Subscription-Id-Data as a number, 0 when absent or not numeric */
+    uint64_t requested;       /* Requested-Service-Unit octets, all rating groups */
+    uint64_t used;            /* Used-Service-Unit octets, all rating groups */
+    uint32_t request_number;  /* CC-Request-Number */
+    uint8_t  request_type;    /* CC-Request-Type */
+    uint8_t  rating_groups;   /* MSCC in the CCR, 0 = top-level service units */
+    uint16_t reserved;
+};
+
+/* File layout: header followed by records */
+#define TRACE_MAGIC    "GYTRACE1"
+#define TRACE_VERSION  1
+
+struct trace_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+/* Capture (server): create the file and start the writer thread */
+int  trace_capture_start(const char *path);
+void trace_capture_stop(void);
+
+/* Queue the record of one CCR; no-op when no capture is running */
+void trace_capture(uint64_t session, const uint8_t *msisdn, size_t msisdn_len,
+                   uint32_t request_type, uint32_t request_number, unsigned rating_groups,
+                   uint64_t requested, uint64_t used);
+
+/* Replay (client): a trace file mapped read-only */
+struct trace_map {
+    void *base;
+    size_t len;
+    const struct trace_record *rec;
+    size_t count;             /* whole records; a torn last record is ignored */
+};
+
+int  trace_open(const char *path, struct trace_map *map);
+void trace_close(struct trace_map *map);
+
+#endif /* GY_TRACE_H */
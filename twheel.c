@@ -0,0 +1,132 @@
+#include "twheel.h"
+
+#include <limits.h>
+
+#define TW_MASK (TW_SLOTS - 1)
+
+static inline void list_init(struct tw_timer *head)
+{
+    head->next = head->prev = head;
+}
+
+static inline void list_insert(struct tw_timer *head, struct tw_timer *t)
+{
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static inline void list_unlink(struct tw_timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+void tw_init(struct timer_wheel *w, uint64_t tick_ns, uint64_t now_ns)
+{
+    unsigned l, s;
+
+    w->tick_ns = tick_ns;
+    w->origin_ns = now_ns;
+    w->now = 0;
+    w->count = 0;
+    for (l = 0; l < TW_LEVELS; l++)
+        for (s = 0; s < TW_SLOTS; s++)
+            list_init(&w->slots[l][s]);
+}
+
+/* Put t in the slot matching its distance from the current tick */
+static void tw_place(struct timer_wheel *w, struct tw_timer *t)
+{
+    uint64_t expires = t->expires, delta;
+    unsigned level;
+
+    if (expires < w->now)
+        expires = t->expires = w->now;
+    delta = expires - w->now;
+
+    for (level = 0; level < TW_LEVELS - 1; level++) {
+        if (delta < (1ULL << (TW_BITS * (level + 1))))
+            break;
+    }
+    if (level == TW_LEVELS - 1 && delta >= (1ULL << (TW_BITS * TW_LEVELS))) {
+        /* Beyond the range: park it in the farthest slot, it is re-placed when reached */
+        expires = w->now + (1ULL << (TW_BITS * TW_LEVELS)) - 1;
+    }
+    list_insert(&w->slots[level][(expires >> (TW_BITS * level)) & TW_MASK], t);
+}
+
+void tw_add(struct timer_wheel *w, struct tw_timer *t, uint64_t when_ns)
+{
+    if (t->prev)
+        list_unlink(t);
+    else
+        w->count++;
+    t->expires = when_ns > w->origin_ns ? (when_ns - w->origin_ns + w->tick_ns - 1) / w->tick_ns : 0;
+    tw_place(w, t);
+}
+
+void tw_del(struct timer_wheel *w, struct tw_timer *t)
+{
+    if (!t->prev)
+        return;
+    list_unlink(t);
+    w->count--;
+}
+
+/* Move the timers of one slot of a coarse level down to the finer ones */
+static void tw_cascade(struct timer_wheel *w, unsigned level, unsigned idx)
+{
+    struct tw_timer head, *t;
+
+    /* Detach the whole slot first: re-placing may target the same slot */
+    list_init(&head);
+    if (w->slots[level][idx].next != &w->slots[level][idx]) {
+        head.next = w->slots[level][idx].next;
+        head.prev = w->slots[level][idx].prev;
+        head.next->prev = &head;
+        head.prev->next = &head;
+        list_init(&w->slots[level][idx]);
+    }
+    while ((t = head.next) != &head) {
+        list_unlink(t);
+        tw_place(w, t);
+    }
+}
+
+unsigned tw_advance(struct timer_wheel *w, uint64_t now_ns,
+                    void (*fire)(struct tw_timer *t, void *opaque), void *opaque)
+{
+    return tw_advance_max(w, now_ns, fire, opaque, UINT_MAX);
+}
+
+unsigned tw_advance_max(struct timer_wheel *w, uint64_t now_ns,
+                        void (*fire)(struct tw_timer *t, void *opaque), void *opaque, unsigned max)
+{
+    uint64_t target = now_ns > w->origin_ns ? (now_ns - w->origin_ns) / w->tick_ns : 0;
+    unsigned fired = 0;
+
+    while (w->now <= target) {
+        unsigned idx = w->now & TW_MASK, level;
+        struct tw_timer *head, *t;
+
+        /* At the start of each turn of a level, bring the next slot of the level above down
+         * (again when resuming a tick cut short by max: re-placing is idempotent) */
+        for (level = 1; level < TW_LEVELS && !(w->now & ((1ULL << (TW_BITS * level)) - 1)); level++)
+            tw_cascade(w, level, (w->now >> (TW_BITS * level)) & TW_MASK);
+
+        head = &w->slots[0][idx];
+        while ((t = head->next) != head) {
+            if (fired == max)
+                return fired;
+            list_unlink(t);
+            w->count--;
+            fired++;
+            fire(t, opaque);
+        }
+        w->now++;
+    }
+    return fired;
+}
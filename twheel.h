@@ -0,0 +1,62 @@
+#ifndef GY_TWHEEL_H
+#define GY_TWHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Hierarchical timer wheel: TW_LEVELS wheels of TW_SLOTS slots, each level
+ * TW_SLOTS times coarser than the one below. Adding and removing a timer is
+ * O(1); a timer far in the future is moved down one level each time the
+ * wheel below completes a turn, so the total work per timer is bounded by
+ * the number of levels. With 1 ms ticks the wheel covers ~49 days.
+ *
+ * A wheel is not thread safe: it belongs to the thread that advances it.
+ */
+#define TW_BITS    8
+#define TW_SLOTS   (1U << TW_BITS)
+#define TW_LEVELS  4
+
+struct tw_timer {
+    struct tw_timer *next;
+    struct tw_timer *prev;        /* NULL when not armed */
+    uint64_t expires;             /* in ticks */
+};
+
+struct timer_wheel {
+    uint64_t tick_ns;
+    uint64_t origin_ns;           /* time of tick 0 */
+    uint64_t now;                 /* next tick to process */
+    size_t count;                 /* armed timers */
+    struct tw_timer slots[TW_LEVELS][TW_SLOTS];   /* circular list heads */
+};
+
+void tw_init(struct timer_wheel *w, uint64_t tick_ns, uint64_t now_ns);
+
+/* (Re)arm t to fire at time when_ns (in the past = at the next advance) */
+void tw_add(struct timer_wheel *w, struct tw_timer *t, uint64_t when_ns);
+
+/* Disarm t if armed */
+void tw_del(struct timer_wheel *w, struct tw_timer *t);
+
+static inline int tw_armed(const struct tw_timer *t)
+{
+    return t->prev != NULL;
+}
+
+/*
+ * Process all ticks up to now_ns, calling fire for every expired timer (in
+ * tick order, disarmed before the call so that fire may re-arm it).
+ * Returns the number of timers fired.
+ */
+unsigned tw_advance(struct timer_wheel *w, uint64_t now_ns,
+                    void (*fire)(struct tw_timer *t, void *opaque), void *opaque);
+
+/*
+ * Same, but stop after max timers; the next call resumes where this one
+ * stopped. Bounds the time spent when many timers expire together.
+ */
+unsigned tw_advance_max(struct timer_wheel *w, uint64_t now_ns,
+                        void (*fire)(struct tw_timer *t, void *opaque), void *opaque, unsigned max);
+
+#endif /* GY_TWHEEL_H */
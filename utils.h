@@ -1,4 +1,21 @@
+#ifndef GY_UTILS_H
+#define GY_UTILS_H
+
 #include <freeDiameter/extension.h>
 #include <unistd.h>
 #include <signal.h>
-#include <time.h>
\ No newline at end of file
+#include <time.h>
+
+#include "hash.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+/* Monotonic clock in nanoseconds, for pacing and latency measurements */
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+#endif /* GY_UTILS_H */
@@ -0,0 +1,782 @@
+#include "utils.h"
+#include "ledger.h"
+#include "wal.h"
+
+#include <stdatomic.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define WAL_MAGIC    "GYWAL002"
+#define SNAP_MAGIC   "GYSNAP01"
+#define SNAP_VERSION 2
+
+#define PAD8(x) (((x) + 7) & ~(size_t)7)
+
+/* Segment file: header, then records */
+struct wal_seg_hdr {
+    char magic[8];
+    uint64_t gen;
+};
+
+/* One logged CCR; nunits struct ledger_unit, then the Session-Id padded to 8 bytes, follow */
+struct wal_rec {
+    uint32_t len;               /* whole record, including header and padding */
+    uint32_t crc;               /* CRC-32 of the bytes after this field */
+    uint64_t seq;
+    uint32_t cc_request_type;
+    uint16_t sidlen;
+    uint16_t nunits;
+};
+
+static inline size_t rec_len(size_t nunits, size_t sidlen)
+{
+    return PAD8(sizeof(struct wal_rec) + nunits * sizeof(struct ledger_unit) + sidlen);
+}
+
+struct snap_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t gen;               /* first log segment not covered by the snapshot */
+    uint64_t count;             /* number of entries */
+    uint64_t next_seq;          /* sequence counter when the snapshot was taken */
+};
+
+/* One session in the snapshot; nbuckets struct ledger_bucket, then the Session-Id padded to 8 bytes, follow */
+struct snap_entry {
+    uint64_t seq;
+    uint64_t granted;
+    uint64_t used;
+    uint64_t reserved;
+    uint32_t ccr_count;
+    uint16_t sidlen;
+    uint16_t nbuckets;
+};
+
+static inline size_t snap_entry_len(size_t nbuckets, size_t sidlen)
+{
+    return PAD8(sizeof(struct snap_entry) + nbuckets * sizeof(struct ledger_bucket) + sidlen);
+}
+
+struct wal_buf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+};
+
+/* Pending records of one ledger shard; the lock is only shared with the writer */
+struct wal_shard {
+    pthread_mutex_t lock;
+    struct wal_buf cur;
+} __attribute__((aligned(64)));
+
+static struct wal_shard wshards[LEDGER_SHARDS];
+static struct wal_buf spare[LEDGER_SHARDS];    /* under writer_lock; records of a failed commit until written */
+
+static struct wal_conf conf;
+static char *dir;
+static int enabled;
+static atomic_uint_fast64_t next_seq = 1;
+
+static int seg_fd = -1;
+static uint64_t seg_gen;
+static off_t seg_off;               /* end of the last commit written to seg_fd */
+static int seg_torn;                /* a failed commit may have left part of its records after seg_off */
+
+static pthread_t writer;
+static volatile int writer_running;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;  /* commits and snapshots, the segment */
+
+static struct {
+    uint64_t commits;
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t max_batch;
+    uint64_t snapshots;
+    uint64_t failed;            /* commits */
+    uint64_t failing;           /* failed commits since the last one written */
+} stats;
+
+static uint32_t crc_table[256];
+
+static void crc32_init(void)
+{
+    uint32_t i, j, c;
+
+    for (i = 0; i < 256; i++) {
+        for (c = i, j = 0; j < 8; j++)
+            c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const uint8_t *p, size_t len)
+{
+    uint32_t c = 0xFFFFFFFFU;
+
+    while (len--)
+        c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFU;
+}
+
+static inline uint32_t rec_crc(const struct wal_rec *r)
+{
+    return crc32((const uint8_t *)r + 8, r->len - 8);
+}
+
+int wal_enabled(void)
+{
+    return enabled;
+}
+
+uint64_t wal_next_seq(void)
+{
+    return atomic_fetch_add_explicit(&next_seq, 1, memory_order_relaxed);
+}
+
+void wal_seq_advance(uint64_t seq)
+{
+    uint_fast64_t cur = atomic_load_explicit(&next_seq, memory_order_relaxed);
+
+    while (cur <= seq && !atomic_compare_exchange_weak(&next_seq, &cur, seq + 1))
+        ;
+}
+
+int wal_log(unsigned shard, uint64_t seq, const uint8_t *sid, size_t sidlen,
+            uint32_t cc_request_type, const struct ledger_unit *units, unsigned nunits)
+{
+    struct wal_shard *w = &wshards[shard];
+    size_t len = rec_len(nunits, sidlen);
+    struct wal_rec *r;
+
+    CHECK_PARAMS(shard < LEDGER_SHARDS && sidlen <= UINT16_MAX && nunits <= UINT16_MAX);
+
+    pthread_mutex_lock(&w->lock);
+    if (w->cur.len + len > w->cur.cap) {
+        size_t ncap = w->cur.cap ? w->cur.cap * 2 : 16384;
+        uint8_t *nd;
+        while (ncap < w->cur.len + len)
+            ncap *= 2;
+        if ((nd = realloc(w->cur.data, ncap)) == NULL) {
+            pthread_mutex_unlock(&w->lock);
+            return ENOMEM;
+        }
+        w->cur.data = nd;
+        w->cur.cap = ncap;
+    }
+
+    /* The CRC is computed by the writer thread, off the CCA path */
+    r = (struct wal_rec *)(w->cur.data + w->cur.len);
+    memset(r, 0, len);
+    r->len = len;
+    r->seq = seq;
+    r->cc_request_type = cc_request_type;
+    r->sidlen = (uint16_t)sidlen;
+    r->nunits = (uint16_t)nunits;
+    memcpy(r + 1, units, nunits * sizeof(*units));
+    memcpy((uint8_t *)(r + 1) + nunits * sizeof(*units), sid, sidlen);
+    w->cur.len += len;
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+static char *path_of(const char *name, uint64_t gen, int with_gen)
+{
+    size_t len = strlen(dir) + strlen(name) + 32;
+    char *p = malloc(len);
+
+    if (p) {
+        if (with_gen)
+            snprintf(p, len, "%s/%s.%llu", dir, name, (unsigned long long)gen);
+        else
+            snprintf(p, len, "%s/%s", dir, name);
+    }
+    return p;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void sync_dir(void)
+{
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+
+    if (fd >= 0) {
+        (void) fsync(fd);
+        close(fd);
+    }
+}
+
+/* Start log segment gen; called by wal_open and with writer_lock held */
+static int segment_open(uint64_t gen)
+{
+    struct wal_seg_hdr hdr;
+    char *path;
+    int fd, ret;
+
+    CHECK_MALLOC(path = path_of("ledger.wal", gen, 1));
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        ret = errno;
+        fd_log_error("WAL: unable to create %s: %s\n", path, strerror(ret));
+        free(path);
+        return ret;
+    }
+    free(path);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, WAL_MAGIC, sizeof(hdr.magic));
+    hdr.gen = gen;
+    if ((ret = write_all(fd, &hdr, sizeof(hdr))) != 0) {
+        close(fd);
+        return ret;
+    }
+    sync_dir();
+
+    if (seg_fd >= 0)
+        close(seg_fd);
+    seg_fd = fd;
+    seg_gen = gen;
+    seg_off = sizeof(hdr);
+    seg_torn = 0;
+    return 0;
+}
+
+/* Cut off what a failed commit left in the segment, or go on in a new one */
+static int segment_repair(void)
+{
+    if (ftruncate(seg_fd, seg_off) == 0) {
+        seg_torn = 0;
+        return 0;
+    }
+    fd_log_error("WAL: unable to truncate segment %llu: %s, starting a new one\n",
+                 (unsigned long long)seg_gen, strerror(errno));
+    return segment_open(seg_gen + 1);
+}
+
+/* Move the shard's pending records into out, behind those of a failed commit */
+static void take_pending(struct wal_shard *w, struct wal_buf *out)
+{
+    pthread_mutex_lock(&w->lock);
+    if (!out->len) {
+        struct wal_buf tmp = w->cur;
+        w->cur = *out;
+        *out = tmp;
+    } else {
+        if (out->len + w->cur.len > out->cap) {
+            uint8_t *nd = realloc(out->data, out->len + w->cur.len);
+            if (!nd) {      /* they stay in the shard for the next commit */
+                pthread_mutex_unlock(&w->lock);
+                return;
+            }
+            out->data = nd;
+            out->cap = out->len + w->cur.len;
+        }
+        memcpy(out->data + out->len, w->cur.data, w->cur.len);
+        out->len += w->cur.len;
+        w->cur.len = 0;
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Group commit: write every pending record with one writev and one fdatasync.
+ * A failed commit keeps its records in spare[] and the next one cuts the
+ * segment back to seg_off before writing them again: replay stops at the
+ * first torn record, so nothing may be appended after one.
+ */
+static int wal_commit(void)
+{
+    struct iovec iov[LEDGER_SHARDS];
+    unsigned i, n = 0;
+    uint64_t records = 0, bytes = 0;
+    int ret = 0;
+
+    if (seg_torn && (ret = segment_repair()) != 0)
+        return ret;
+
+    for (i = 0; i < LEDGER_SHARDS; i++) {
+        struct wal_shard *w = &wshards[i];
+        struct wal_buf tmp;
+
+        if (w->cur.len)     /* racy peek, the next commit will catch up */
+            take_pending(w, &spare[i]);
+        if (!spare[i].len)
+            continue;
+        tmp = spare[i];
+
+        /* Seal the records; sealing again those of a failed commit changes nothing */
+        {
+            size_t off;
+            for (off = 0; off < tmp.len; ) {
+                struct wal_rec *r = (struct wal_rec *)(tmp.data + off);
+                r->crc = rec_crc(r);
+                off += r->len;
+                records++;
+            }
+        }
+        iov[n].iov_base = tmp.data;
+        iov[n].iov_len = tmp.len;
+        bytes += tmp.len;
+        n++;
+    }
+
+    if (!n)
+        return 0;
+
+    for (i = 0; i < n && !ret; ) {
+        ssize_t w = writev(seg_fd, &iov[i], n - i);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = errno;
+            break;
+        }
+        /* Skip what was written, handling short writes */
+        while (i < n && (size_t)w >= iov[i].iov_len) {
+            w -= iov[i].iov_len;
+            i++;
+        }
+        if (i < n) {
+            iov[i].iov_base = (uint8_t *)iov[i].iov_base + w;
+            iov[i].iov_len -= w;
+        }
+    }
+    if (!ret && fdatasync(seg_fd) < 0)
+        ret = errno;
+
+    if (ret) {
+        if (!stats.failing++)
+            fd_log_error("WAL: write to segment %llu failed: %s, the records are kept and written again at each commit\n",
+                         (unsigned long long)seg_gen, strerror(ret));
+        stats.failed++;
+        seg_torn = 1;
+        return ret;
+    }
+    if (stats.failing) {
+        fd_log_notice("WAL: segment %llu written again after %llu failed commits\n",
+                      (unsigned long long)seg_gen, (unsigned long long)stats.failing);
+        stats.failing = 0;
+    }
+
+    seg_off += bytes;
+    for (i = 0; i < LEDGER_SHARDS; i++)
+        spare[i].len = 0;
+
+    stats.commits++;
+    stats.records += records;
+    stats.bytes += bytes;
+    if (records > stats.max_batch)
+        stats.max_batch = records;
+    return 0;
+}
+
+struct snap_writer {
+    FILE *f;
+    uint64_t count;
+};
+
+static int snap_write_entry(const struct ledger_record *rec, void *opaque)
+{
+    struct snap_writer *sw = opaque;
+    struct snap_entry e;
+    static const uint8_t zeros[8];
+    size_t pad = snap_entry_len(rec->nbuckets, rec->sidlen) - sizeof(e) - rec->nbuckets * sizeof(*rec->buckets) - rec->sidlen;
+
+    memset(&e, 0, sizeof(e));
+    e.seq = rec->seq;
+    e.granted = rec->totals.granted;
+    e.used = rec->totals.used;
+    e.reserved = rec->totals.reserved;
+    e.ccr_count = rec->totals.ccr_count;
+    e.sidlen = (uint16_t)rec->sidlen;
+    e.nbuckets = (uint16_t)rec->nbuckets;
+
+    if (fwrite(&e, sizeof(e), 1, sw->f) != 1
+        || fwrite(rec->buckets, sizeof(*rec->buckets), rec->nbuckets, sw->f) != rec->nbuckets
+        || fwrite(rec->sid, 1, rec->sidlen, sw->f) != rec->sidlen
+        || fwrite(zeros, 1, pad, sw->f) != pad)
+        return EIO;
+    sw->count++;
+    return 0;
+}
+
+/*
+ * Snapshot the ledger as of log generation gen: every change logged in a
+ * segment older than gen is already applied to the ledger.
+ */
+static int snapshot_write(uint64_t gen)
+{
+    struct snap_hdr hdr;
+    struct snap_writer sw = { NULL, 0 };
+    char *tmp = NULL, *final = NULL;
+    int ret = 0;
+
+    CHECK_MALLOC_DO(tmp = path_of("ledger.snap.tmp", 0, 0), { ret = ENOMEM; goto out; });
+    CHECK_MALLOC_DO(final = path_of("ledger.snap", 0, 0), { ret = ENOMEM; goto out; });
+    if ((sw.f = fopen(tmp, "wb")) == NULL) {
+        ret = errno;
+        goto out;
+    }
+    setvbuf(sw.f, NULL, _IOFBF, 1 << 20);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAP_VERSION;
+    hdr.gen = gen;
+    hdr.next_seq = atomic_load(&next_seq);
+    if (fwrite(&hdr, sizeof(hdr), 1, sw.f) != 1) {
+        ret = EIO;
+        goto out;
+    }
+
+    if ((ret = ledger_foreach(snap_write_entry, &sw)) != 0)
+        goto out;
+
+    /* Now that the count is known, rewrite the header */
+    hdr.count = sw.count;
+    if (fseek(sw.f, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, sw.f) != 1
+        || fflush(sw.f) != 0 || fsync(fileno(sw.f)) != 0) {
+        ret = errno ? errno : EIO;
+        goto out;
+    }
+    fclose(sw.f);
+    sw.f = NULL;
+
+    if (rename(tmp, final) != 0) {
+        ret = errno;
+        goto out;
+    }
+    sync_dir();
+    stats.snapshots++;
+
+out:
+    if (sw.f) {
+        fclose(sw.f);
+        unlink(tmp);
+    }
+    if (ret)
+        fd_log_error("WAL: snapshot failed: %s\n", strerror(ret));
+    free(tmp);
+    free(final);
+    return ret;
+}
+
+/* Log segments of generation >= min_gen, sorted */
+static int segments_list(uint64_t min_gen, uint64_t **gens, size_t *count)
+{
+    DIR *d;
+    struct dirent *de;
+    uint64_t *list = NULL;
+    size_t n = 0, cap = 0, i, j;
+
+    if ((d = opendir(dir)) == NULL)
+        return errno;
+    while ((de = readdir(d)) != NULL) {
+        unsigned long long g;
+        char c;
+        if (sscanf(de->d_name, "ledger.wal.%llu%c", &g, &c) != 1 || g < min_gen)
+            continue;
+        if (n == cap) {
+            uint64_t *nl = realloc(list, (cap = cap ? cap * 2 : 16) * sizeof(*list));
+            if (!nl) {
+                free(list);
+                closedir(d);
+                return ENOMEM;
+            }
+            list = nl;
+        }
+        list[n++] = g;
+    }
+    closedir(d);
+
+    for (i = 1; i < n; i++) {
+        uint64_t g = list[i];
+        for (j = i; j > 0 && list[j - 1] > g; j--)
+            list[j] = list[j - 1];
+        list[j] = g;
+    }
+    *gens = list;
+    *count = n;
+    return 0;
+}
+
+static void segments_remove_before(uint64_t gen)
+{
+    uint64_t *gens = NULL;
+    size_t n = 0, i;
+
+    if (segments_list(0, &gens, &n) != 0)
+        return;
+    for (i = 0; i < n && gens[i] < gen; i++) {
+        char *p = path_of("ledger.wal", gens[i], 1);
+        if (p) {
+            unlink(p);
+            free(p);
+        }
+    }
+    free(gens);
+}
+
+/* Map a whole file read-only; *len == 0 and NULL for an empty or missing file */
+static int map_file(const char *path, const uint8_t **data, size_t *len)
+{
+    struct stat st;
+    int fd;
+    void *p;
+
+    *data = NULL;
+    *len = 0;
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return errno == ENOENT ? 0 : errno;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return errno;
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    *data = p;
+    *len = st.st_size;
+    return 0;
+}
+
+static int snapshot_load(uint64_t *gen, uint64_t *count)
+{
+    const uint8_t *data, *p, *end;
+    const struct snap_hdr *hdr;
+    size_t len;
+    uint64_t i;
+    char *path;
+    int ret;
+
+    *gen = 0;
+    *count = 0;
+    CHECK_MALLOC(path = path_of("ledger.snap", 0, 0));
+    ret = map_file(path, &data, &len);
+    free(path);
+    if (ret || !data)
+        return ret;
+
+    hdr = (const struct snap_hdr *)data;
+    if (len < sizeof(*hdr) || memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) || hdr->version != SNAP_VERSION) {
+        fd_log_error("WAL: ledger.snap is not a valid snapshot\n");
+        munmap((void *)data, len);
+        return EINVAL;
+    }
+
+    p = data + sizeof(*hdr);
+    end = data + len;
+    for (i = 0; i < hdr->count; i++) {
+        const struct snap_entry *e = (const struct snap_entry *)p;
+        struct ledger_record rec;
+
+        if (p + sizeof(*e) > end || p + snap_entry_len(e->nbuckets, e->sidlen) > end) {
+            fd_log_error("WAL: ledger.snap is truncated\n");
+            ret = EINVAL;
+            break;
+        }
+        rec.buckets = (const struct ledger_bucket *)(e + 1);
+        rec.nbuckets = e->nbuckets;
+        rec.sid = (const uint8_t *)(rec.buckets + e->nbuckets);
+        rec.sidlen = e->sidlen;
+        rec.seq = e->seq;
+        rec.totals.granted = e->granted;
+        rec.totals.used = e->used;
+        rec.totals.reserved = e->reserved;
+        rec.totals.ccr_count = e->ccr_count;
+        if ((ret = ledger_restore(&rec)) != 0)
+            break;
+        p += snap_entry_len(e->nbuckets, e->sidlen);
+    }
+
+    if (!ret) {
+        *gen = hdr->gen;
+        *count = hdr->count;
+        if (hdr->next_seq > atomic_load(&next_seq))
+            atomic_store(&next_seq, hdr->next_seq);
+    }
+    munmap((void *)data, len);
+    return ret;
+}
+
+static int segment_replay(uint64_t gen, uint64_t *records)
+{
+    const uint8_t *data, *p, *end;
+    size_t len;
+    char *path;
+    int ret;
+
+    CHECK_MALLOC(path = path_of("ledger.wal", gen, 1));
+    ret = map_file(path, &data, &len);
+    free(path);
+    if (ret || !data)
+        return ret;
+
+    if (len < sizeof(struct wal_seg_hdr) || memcmp(data, WAL_MAGIC, 8)) {
+        fd_log_error("WAL: segment %llu has no valid header, skipped\n", (unsigned long long)gen);
+        munmap((void *)data, len);
+        return 0;
+    }
+
+    p = data + sizeof(struct wal_seg_hdr);
+    end = data + len;
+    while (p + sizeof(struct wal_rec) <= end) {
+        const struct wal_rec *r = (const struct wal_rec *)p;
+
+        /* A torn or partial record ends the segment (crash during a commit) */
+        if (r->len < sizeof(*r) || p + r->len > end || rec_len(r->nunits, r->sidlen) != r->len || rec_crc(r) != r->crc) {
+            fd_log_notice("WAL: segment %llu ends with an incomplete record, ignored\n", (unsigned long long)gen);
+            break;
+        }
+        const struct ledger_unit *units = (const struct ledger_unit *)(r + 1);
+        if ((ret = ledger_replay((const uint8_t *)(units + r->nunits), r->sidlen, r->seq, r->cc_request_type, units, r->nunits)) != 0)
+            break;
+        if (r->seq >= atomic_load(&next_seq))
+            atomic_store(&next_seq, r->seq + 1);
+        (*records)++;
+        p += r->len;
+    }
+
+    munmap((void *)data, len);
+    return ret;
+}
+
+/* New changes go to a new segment; the snapshot covers everything before it. Called with writer_lock held */
+static int compact(void)
+{
+    int ret;
+
+    if ((ret = segment_open(seg_gen + 1)) == 0 && (ret = snapshot_write(seg_gen)) == 0)
+        segments_remove_before(seg_gen);
+    return ret;
+}
+
+static void *wal_writer(void *arg)
+{
+    uint64_t last_snapshot = now_ns();
+    struct timespec ts = { conf.commit_ms / 1000, (conf.commit_ms % 1000) * 1000000L };
+
+    while (writer_running) {
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&writer_lock);
+        (void) wal_commit();
+
+        if (conf.compact_interval_s && now_ns() - last_snapshot >= conf.compact_interval_s * NS_PER_SEC) {
+            (void) compact();
+            last_snapshot = now_ns();
+        }
+        pthread_mutex_unlock(&writer_lock);
+    }
+    return NULL;
+}
+
+int wal_snapshot(void)
+{
+    int ret;
+
+    if (!enabled)
+        return 0;
+    pthread_mutex_lock(&writer_lock);
+    if ((ret = wal_commit()) == 0)
+        ret = compact();
+    pthread_mutex_unlock(&writer_lock);
+    return ret;
+}
+
+int wal_open(const struct wal_conf *c)
+{
+    uint64_t snap_gen, snap_count, records = 0, *gens = NULL, last_gen;
+    size_t ngens = 0, i;
+    uint64_t start = now_ns();
+    unsigned s;
+
+    CHECK_PARAMS(c && c->dir && *c->dir);
+    conf = *c;
+    if (!conf.commit_ms)
+        conf.commit_ms = 1;
+    CHECK_MALLOC(dir = strdup(c->dir));
+    conf.dir = dir;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fd_log_error("WAL: unable to create directory %s: %s\n", dir, strerror(errno));
+        return errno;
+    }
+    crc32_init();
+    for (s = 0; s < LEDGER_SHARDS; s++)
+        CHECK_POSIX(pthread_mutex_init(&wshards[s].lock, NULL));
+
+    /* Recovery: snapshot, then the newer segments in order */
+    CHECK_FCT(snapshot_load(&snap_gen, &snap_count));
+    CHECK_FCT(segments_list(snap_gen, &gens, &ngens));
+    last_gen = snap_gen;
+    for (i = 0; i < ngens; i++) {
+        CHECK_FCT_DO(segment_replay(gens[i], &records), { free(gens); return EINVAL; });
+        last_gen = gens[i];
+    }
+    free(gens);
+
+    fd_log_notice("WAL: recovered %llu sessions from snapshot and %llu logged changes in %.1f ms, %llu live sessions\n",
+                  (unsigned long long)snap_count, (unsigned long long)records,
+                  (double)(now_ns() - start) / 1e6, (unsigned long long)ledger_live_sessions());
+
+    /* Never append to a segment that may end with a torn record */
+    CHECK_FCT(segment_open(last_gen + 1));
+    enabled = 1;
+
+    writer_running = 1;
+    CHECK_POSIX(pthread_create(&writer, NULL, wal_writer, NULL));
+    return 0;
+}
+
+void wal_close(void)
+{
+    unsigned s;
+
+    if (!enabled)
+        return;
+
+    writer_running = 0;
+    pthread_join(writer, NULL);
+    enabled = 0;
+
+    /* Final commit, then a snapshot so that the next start has nothing to replay */
+    (void) wal_commit();
+    (void) compact();
+
+    fd_log_notice("WAL: %llu commits, %llu records (%.1f per commit, max %llu), %llu bytes, %llu snapshots, %llu failed commits\n",
+                  (unsigned long long)stats.commits, (unsigned long long)stats.records,
+                  stats.commits ? (double)stats.records / stats.commits : 0.0,
+                  (unsigned long long)stats.max_batch, (unsigned long long)stats.bytes,
+                  (unsigned long long)stats.snapshots, (unsigned long long)stats.failed);
+
+    close(seg_fd);
+    seg_fd = -1;
+    for (s = 0; s < LEDGER_SHARDS; s++) {
+        free(wshards[s].cur.data);
+        free(spare[s].data);
+        memset(&wshards[s].cur, 0, sizeof(wshards[s].cur));
+        memset(&spare[s], 0, sizeof(spare[s]));
+    }
+    free(dir);
+    dir = NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef GY_WAL_H
+#define GY_WAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ledger.h"
+
+/*
+ * Write-ahead log of the session ledger.
+ *
+ * ledger_apply serializes each change into a per-shard buffer while it
+ * already holds the shard lock; a writer thread swaps the buffers out every
+ * commit interval and writes them with a single fdatasync (group commit),
+ * so the CCA path never waits for the disk. Periodically the writer starts
+ * a new log segment and compacts the ledger into a snapshot file; older
+ * segments are then removed. At startup the snapshot is memory-mapped and
+ * the remaining segments replayed over it.
+ *
+ * Files in the WAL directory:
+ *   ledger.snap        latest snapshot (written as ledger.snap.tmp, then renamed)
+ *   ledger.wal.<gen>   log segments, replayed in generation order
+ */
+
+struct wal_conf {
+    const char *dir;              /* NULL or empty: persistence disabled */
+    unsigned commit_ms;           /* group commit interval */
+    unsigned compact_interval_s;  /* seconds between snapshots, 0 = only at shutdown */
+};
+
+/* Recover the ledger from dir, then start logging; ledger_init must have been called */
+int  wal_open(const struct wal_conf *conf);
+
+/* Flush everything, write a final snapshot and stop the writer */
+void wal_close(void);
+
+/* Commit and write a snapshot now, e.g. once a standby has taken over a ledger the log never saw */
+int  wal_snapshot(void);
+
+/* Used by ledger.c */
+int      wal_enabled(void);
+uint64_t wal_next_seq(void);
+void     wal_seq_advance(uint64_t seq);   /* later changes are numbered after seq */
+int      wal_log(unsigned shard, uint64_t seq, const uint8_t *sid, size_t sidlen,
+                 uint32_t cc_request_type, const struct ledger_unit *units, unsigned nunits);
+
+#endif /* GY_WAL_H */
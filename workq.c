@@ -0,0 +1,278 @@
+#include "utils.h"
+#include "histo.h"
+#include "workq.h"
+
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <sched.h>
+
+/*
+ * The queue is a ring of cells, each with a sequence number telling whether
+ * it is free for the producer at position pos (seq == pos) or holds the job
+ * for the consumer at pos (seq == pos + 1). Producers and consumers claim
+ * positions with a CAS on their own counter and never share a lock.
+ * A semaphore counts the published jobs so that idle workers sleep.
+ */
+struct workq_cell {
+    atomic_size_t seq;
+    void *job;
+    uint64_t push_ns;
+};
+
+/* Statistics of one worker; single writer */
+struct workq_worker {
+    pthread_t thr;
+    struct histo wait;
+    struct histo service;
+    atomic_uint_fast64_t busy_ns;
+} __attribute__((aligned(64)));
+
+static struct workq_cell *cells;
+static size_t mask;
+static _Alignas(64) atomic_size_t push_pos;
+static _Alignas(64) atomic_size_t pop_pos;
+static _Alignas(64) atomic_size_t max_depth;   /* since the previous report */
+static size_t max_depth_all;                     /* reporter-owned */
+static atomic_uint_fast64_t refused;
+
+static sem_t ready;
+static workq_fn_t job_fn;
+static struct workq_worker *workers;
+static unsigned nworkers;
+static volatile int stopping;
+
+static pthread_t reporter;
+static volatile int reporter_running;
+static double report_interval;
+static uint64_t start_ns;
+
+int workq_push(void *job)
+{
+    struct workq_cell *c;
+    size_t pos = atomic_load_explicit(&push_pos, memory_order_relaxed), depth;
+
+    for (;;) {
+        intptr_t dif;
+        c = &cells[pos & mask];
+        dif = (intptr_t)atomic_load_explicit(&c->seq, memory_order_acquire) - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&push_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            atomic_fetch_add_explicit(&refused, 1, memory_order_relaxed);
+            return EAGAIN;
+        } else {
+            pos = atomic_load_explicit(&push_pos, memory_order_relaxed);
+        }
+    }
+
+    c->job = job;
+    c->push_ns = now_ns();
+    atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+    sem_post(&ready);
+
+    /* Approximate high-water mark; only written when it grows */
+    depth = pos + 1 - atomic_load_explicit(&pop_pos, memory_order_relaxed);
+    if (depth <= mask + 1 && depth > atomic_load_explicit(&max_depth, memory_order_relaxed))
+        atomic_store_explicit(&max_depth, depth, memory_order_relaxed);
+    return 0;
+}
+
+/* 0 and the oldest job, or EAGAIN when nothing is published yet */
+static int workq_pop(void **job, uint64_t *push_ns)
+{
+    struct workq_cell *c;
+    size_t pos = atomic_load_explicit(&pop_pos, memory_order_relaxed);
+
+    for (;;) {
+        intptr_t dif;
+        c = &cells[pos & mask];
+        dif = (intptr_t)atomic_load_explicit(&c->seq, memory_order_acquire) - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pop_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            return EAGAIN;
+        } else {
+            pos = atomic_load_explicit(&pop_pos, memory_order_relaxed);
+        }
+    }
+
+    *job = c->job;
+    *push_ns = c->push_ns;
+    atomic_store_explicit(&c->seq, pos + mask + 1, memory_order_release);
+    return 0;
+}
+
+static void workq_run(struct workq_worker *w, void *job, uint64_t push_ns)
+{
+    uint64_t start = now_ns(), end;
+
+    job_fn(job);
+    end = now_ns();
+    histo_record(&w->wait, start - push_ns);
+    histo_record(&w->service, end - start);
+    atomic_store_explicit(&w->busy_ns, atomic_load_explicit(&w->busy_ns, memory_order_relaxed) + (end - start),
+                          memory_order_relaxed);
+}
+
+static void *workq_worker(void *arg)
+{
+    struct workq_worker *w = arg;
+    void *job;
+    uint64_t push_ns;
+
+    for (;;) {
+        while (sem_wait(&ready) != 0 && errno == EINTR)
+            ;
+        if (stopping)
+            break;
+        /* A job is counted once published, but an older cell may still be in flight */
+        while (workq_pop(&job, &push_ns) != 0)
+            sched_yield();
+        workq_run(w, job, push_ns);
+    }
+
+    /* Drain what is left before exiting */
+    while (workq_pop(&job, &push_ns) == 0)
+        workq_run(w, job, push_ns);
+    return NULL;
+}
+
+struct workq_totals {
+    struct histo_snapshot wait;
+    struct histo_snapshot service;
+    uint64_t busy_ns;
+};
+
+static void workq_collect(struct workq_totals *t)
+{
+    unsigned i;
+
+    memset(t, 0, sizeof(*t));
+    for (i = 0; i < nworkers; i++) {
+        histo_merge(&t->wait, &workers[i].wait);
+        histo_merge(&t->service, &workers[i].service);
+        t->busy_ns += atomic_load_explicit(&workers[i].busy_ns, memory_order_relaxed);
+    }
+}
+
+static void workq_print(const char *label, const struct workq_totals *t, double seconds, size_t maxd)
+{
+    size_t pop = atomic_load_explicit(&pop_pos, memory_order_relaxed);
+    size_t push = atomic_load_explicit(&push_pos, memory_order_relaxed);
+    size_t depth = push > pop ? push - pop : 0;
+
+    fd_log_notice("Gy workers [%s] jobs=%lu rate=%.1f/s util=%.1f%% of %u workers, depth=%zu max=%zu/%zu, refused=%lu\n",
+                  label, (unsigned long)t->service.total, seconds > 0 ? t->service.total / seconds : 0.0,
+                  seconds > 0 ? 100.0 * t->busy_ns / (seconds * NS_PER_SEC * nworkers) : 0.0, nworkers,
+                  depth, maxd, mask + 1, (unsigned long)atomic_load_explicit(&refused, memory_order_relaxed));
+    if (!t->service.total)
+        return;
+    fd_log_notice("Gy workers [%s] wait p50=%.3fms p99=%.3fms max=%.3fms, service p50=%.3fms p99=%.3fms max=%.3fms\n",
+                  label, histo_percentile(&t->wait, 50) / 1e6, histo_percentile(&t->wait, 99) / 1e6, t->wait.max / 1e6,
+                  histo_percentile(&t->service, 50) / 1e6, histo_percentile(&t->service, 99) / 1e6, t->service.max / 1e6);
+}
+
+static void *workq_reporter(void *arg)
+{
+    struct workq_totals *cur, *prev, *diff;
+    uint64_t last = start_ns;
+
+    CHECK_MALLOC_DO(cur = calloc(3, sizeof(*cur)), return NULL);
+    prev = cur + 1;
+    diff = cur + 2;
+
+    while (reporter_running) {
+        uint64_t deadline = last + (uint64_t)(report_interval * NS_PER_SEC), now;
+        size_t maxd;
+
+        while (reporter_running && (now = now_ns()) < deadline)
+            usleep(100000);
+        if (!reporter_running)
+            break;
+
+        workq_collect(cur);
+        histo_diff(&diff->wait, &cur->wait, &prev->wait);
+        histo_diff(&diff->service, &cur->service, &prev->service);
+        diff->busy_ns = cur->busy_ns - prev->busy_ns;
+        maxd = atomic_exchange_explicit(&max_depth, 0, memory_order_relaxed);
+        if (maxd > max_depth_all)
+            max_depth_all = maxd;
+        workq_print("interval", diff, (double)(now - last) / NS_PER_SEC, maxd);
+        memcpy(prev, cur, sizeof(*cur));
+        last = now;
+    }
+
+    free(cur);
+    return NULL;
+}
+
+int workq_start(const struct workq_conf *conf, workq_fn_t fn)
+{
+    size_t cap = 2, i;
+
+    CHECK_PARAMS(conf && conf->workers && conf->capacity && fn);
+
+    while (cap < conf->capacity)
+        cap <<= 1;
+    CHECK_MALLOC(cells = calloc(cap, sizeof(*cells)));
+    for (i = 0; i < cap; i++)
+        atomic_init(&cells[i].seq, i);
+    mask = cap - 1;
+    atomic_store(&push_pos, 0);
+    atomic_store(&pop_pos, 0);
+    CHECK_POSIX(sem_init(&ready, 0, 0));
+
+    job_fn = fn;
+    stopping = 0;
+    start_ns = now_ns();
+    nworkers = conf->workers;
+    CHECK_POSIX(posix_memalign((void **)&workers, 64, nworkers * sizeof(*workers)));
+    memset(workers, 0, nworkers * sizeof(*workers));
+    for (i = 0; i < nworkers; i++)
+        CHECK_POSIX(pthread_create(&workers[i].thr, NULL, workq_worker, &workers[i]));
+
+    if (conf->report_interval_s > 0) {
+        report_interval = conf->report_interval_s;
+        reporter_running = 1;
+        CHECK_POSIX(pthread_create(&reporter, NULL, workq_reporter, NULL));
+    }
+
+    fd_log_notice("Gy workers: %u threads, queue of %zu jobs\n", nworkers, cap);
+    return 0;
+}
+
+void workq_stop(void)
+{
+    struct workq_totals *t;
+    unsigned i;
+
+    if (!workers)
+        return;
+
+    if (reporter_running) {
+        reporter_running = 0;
+        pthread_join(reporter, NULL);
+    }
+
+    stopping = 1;
+    for (i = 0; i < nworkers; i++)
+        sem_post(&ready);
+    for (i = 0; i < nworkers; i++)
+        pthread_join(workers[i].thr, NULL);
+
+    if ((t = malloc(sizeof(*t))) != NULL) {
+        size_t maxd = atomic_load_explicit(&max_depth, memory_order_relaxed);
+        workq_collect(t);
+        workq_print("final", t, (double)(now_ns() - start_ns) / NS_PER_SEC,
+                    maxd > max_depth_all ? maxd : max_depth_all);
+        free(t);
+    }
+
+    free(workers);
+    workers = NULL;
+    free(cells);
+    cells = NULL;
+    sem_destroy(&ready);
+}
@@ -0,0 +1,37 @@
+#ifndef GY_WORKQ_H
+#define GY_WORKQ_H
+
+#include <stdint.h>
+
+/*
+ * Worker pool fed by a bounded lock-free MPMC queue.
+ *
+ * Dispatch threads push a job (an opaque pointer) and return at once; the
+ * workers pop jobs in FIFO order and run the job function on them. A full
+ * queue is reported to the caller instead of blocking it.
+ *
+ * Statistics, printed every report interval and at stop:
+ *  - queue depth (current and highest since the previous report),
+ *  - wait time (push to start of the job) and service time percentiles,
+ *  - worker utilization, the share of time the workers spent in jobs,
+ *  - jobs refused because the queue was full.
+ */
+
+typedef void (*workq_fn_t)(void *job);
+
+struct workq_conf {
+    unsigned workers;             /* number of worker threads */
+    unsigned capacity;            /* queue slots, rounded up to a power of two */
+    double report_interval_s;     /* 0 = only report at stop */
+};
+
+/* Start the workers; fn is called for each job */
+int  workq_start(const struct workq_conf *conf, workq_fn_t fn);
+
+/* Queue a job; EAGAIN when the queue is full */
+int  workq_push(void *job);
+
+/* Run the jobs still queued, stop the workers and print the cumulative statistics */
+void workq_stop(void);
+
+#endif /* GY_WORKQ_H */